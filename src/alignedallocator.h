@@ -136,3 +136,49 @@ class aligned_allocator {
     private:
     aligned_allocator &operator=(const aligned_allocator &);
 };
+
+// Allocates _Padding_ bytes more than asked for, so that the last element can be read with a
+// wider load than its size
+template <typename T, std::size_t Padding>
+class padded_allocator {
+    public:
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind {
+        typedef padded_allocator<U, Padding> other;
+    };
+
+    padded_allocator() {
+    }
+
+    template <typename U>
+    padded_allocator(const padded_allocator<U, Padding> &) {
+    }
+
+    T *allocate(const std::size_t n) const {
+        if (n == 0) {
+            return NULL;
+        }
+        if (n > (static_cast<std::size_t>(0) - static_cast<std::size_t>(1) - Padding) / sizeof(T)) {
+            throw std::length_error("padded_allocator<T>::allocate() - Integer overflow.");
+        }
+        void *const pv = AllocAligned(n * sizeof(T) + Padding, 16);
+        if (pv == NULL) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(pv);
+    }
+
+    void deallocate(T *const p, const std::size_t n) const {
+        FreeAligned(p);
+    }
+
+    bool operator==(const padded_allocator &other) const {
+        return true;
+    }
+
+    bool operator!=(const padded_allocator &other) const {
+        return false;
+    }
+};
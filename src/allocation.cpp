@@ -0,0 +1,79 @@
+#include "allocation.h"
+
+#ifdef DPT_COUNT_ALLOCATIONS
+
+#include <cerrno>
+#include <cstddef>
+
+// glibc keeps its allocator reachable under these names when malloc is replaced
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+}
+
+// Trivially initialized, so that reading it inside malloc does not allocate
+static thread_local uint64_t t_AllocationCount = 0;
+
+extern "C" {
+
+void *malloc(size_t size) {
+    t_AllocationCount++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    t_AllocationCount++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    t_AllocationCount++;
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    t_AllocationCount++;
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    t_AllocationCount++;
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    t_AllocationCount++;
+    void *ret = __libc_memalign(alignment, size);
+    if (ret == nullptr) {
+        return ENOMEM;
+    }
+    *ptr = ret;
+    return 0;
+}
+
+}
+
+bool CountingAllocations() {
+    return true;
+}
+
+uint64_t ThreadAllocationCount() {
+    return t_AllocationCount;
+}
+
+#else
+
+bool CountingAllocations() {
+    return false;
+}
+
+uint64_t ThreadAllocationCount() {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstdint>
+
+// Counts the heap allocations of every thread when the renderer is built with
+// DPT_COUNT_ALLOCATIONS, by interposing the C allocation functions that operator new, Eigen
+// and the aligned allocator all end up in. Without it nothing is counted.
+bool CountingAllocations();
+// The number of allocations the calling thread made so far
+uint64_t ThreadAllocationCount();
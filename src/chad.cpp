@@ -1,5 +1,11 @@
 #include "chad.h"
+#include <algorithm>
 #include <thread>
+#include <filesystem>
+#include <cstdio>
+#include <mutex>
+#include <utility>
+#include <unistd.h>
 
 namespace chad {
 
@@ -71,6 +77,369 @@ void Forward(const ExpressionCPtrVec &exprs,
     }
 }
 
+static SimplifyStats g_SimplifyStats;
+static bool g_SimplifyExprs = true;
+
+void SetSimplifyExprs(const bool enable) {
+    g_SimplifyExprs = enable;
+}
+
+bool SimplifyExprs() {
+    return g_SimplifyExprs;
+}
+
+SimplifyStats GetSimplifyStats() {
+    return g_SimplifyStats;
+}
+
+static HessianStats g_HessianStats;
+
+HessianStats GetHessianStats() {
+    return g_HessianStats;
+}
+
+static bool IsConstantVal(const ExpressionCPtr &expr, const float value) {
+    return expr->IsConstant() && expr->GetConstantVal() == value;
+}
+
+// Value of an operation whose operands are all constants, mirroring the emitted statements
+static float FoldConstant(const ExpressionType type, const std::vector<float> &x) {
+    switch (type) {
+        case ExpressionType::Negate: return -x[0];
+        case ExpressionType::Square: return x[0] * x[0];
+        case ExpressionType::Inverse: return 1.f / x[0];
+        case ExpressionType::Sin: return std::sin(x[0]);
+        case ExpressionType::Cos: return std::cos(x[0]);
+        case ExpressionType::Tan: return std::tan(x[0]);
+        case ExpressionType::Sqrt: return std::sqrt(x[0]);
+        case ExpressionType::ASin: return std::asin(x[0]);
+        case ExpressionType::ACos: return std::acos(x[0]);
+        case ExpressionType::Exp: return std::exp(x[0]);
+        case ExpressionType::Log: return std::log(x[0]);
+        case ExpressionType::Pow: return std::pow(x[0], x[1]);
+        case ExpressionType::ATan2: return std::atan2(x[0], x[1]);
+        case ExpressionType::Add: return x[0] + x[1];
+        case ExpressionType::Minus: return x[0] - x[1];
+        case ExpressionType::Multiply: return x[0] * x[1];
+        case ExpressionType::Divide: return x[0] / x[1];
+        case ExpressionType::Length2D: return std::sqrt(x[0] * x[0] + x[1] * x[1]);
+        case ExpressionType::Length3D: return std::sqrt(x[0] * x[0] + x[1] * x[1] + x[2] * x[2]);
+        case ExpressionType::Length4D:
+            return std::sqrt(x[0] * x[0] + x[1] * x[1] + x[2] * x[2] + x[3] * x[3]);
+        case ExpressionType::Dot3D: return x[0] * x[3] + x[1] * x[4] + x[2] * x[5];
+        default: throw std::runtime_error("[FoldConstant] unknown expression");
+    }
+}
+
+// A node of _type_ over _children_, constructed without adding it to a block
+static ExpressionCPtr MakeNode(const ExpressionType type, const ExpressionCPtrVec &c) {
+    switch (type) {
+        case ExpressionType::Negate: return std::make_shared<Negate>(c[0]);
+        case ExpressionType::Square: return std::make_shared<Square>(c[0]);
+        case ExpressionType::Inverse: return std::make_shared<Inverse>(c[0]);
+        case ExpressionType::Sin: return std::make_shared<Sin>(c[0]);
+        case ExpressionType::Cos: return std::make_shared<Cos>(c[0]);
+        case ExpressionType::Tan: return std::make_shared<Tan>(c[0]);
+        case ExpressionType::Sqrt: return std::make_shared<Sqrt>(c[0]);
+        case ExpressionType::ASin: return std::make_shared<ASin>(c[0]);
+        case ExpressionType::ACos: return std::make_shared<ACos>(c[0]);
+        case ExpressionType::Exp: return std::make_shared<Exp>(c[0]);
+        case ExpressionType::Log: return std::make_shared<Log>(c[0]);
+        case ExpressionType::Pow: return std::make_shared<Pow>(c[0], c[1]);
+        case ExpressionType::ATan2: return std::make_shared<ATan2>(c[0], c[1]);
+        case ExpressionType::Add: return std::make_shared<Add>(c[0], c[1]);
+        case ExpressionType::Minus: return std::make_shared<Minus>(c[0], c[1]);
+        case ExpressionType::Multiply: return std::make_shared<Multiply>(c[0], c[1]);
+        case ExpressionType::Divide: return std::make_shared<Divide>(c[0], c[1]);
+        case ExpressionType::Length2D: return std::make_shared<Length2D>(c[0], c[1]);
+        case ExpressionType::Length3D: return std::make_shared<Length3D>(c[0], c[1], c[2]);
+        case ExpressionType::Length4D: return std::make_shared<Length4D>(c[0], c[1], c[2], c[3]);
+        case ExpressionType::Dot3D:
+            return std::make_shared<Dot3D>(std::array<ExpressionCPtr, 3>{{c[0], c[1], c[2]}},
+                                           std::array<ExpressionCPtr, 3>{{c[3], c[4], c[5]}});
+        default: throw std::runtime_error("[MakeNode] unknown expression");
+    }
+}
+
+// Hash-consing and algebraic simplification of a function's expression DAG. The emitters only
+// share nodes by pointer, so the structurally identical subtrees that Forward and Dervs()
+// rebuild for every use are emitted again and again. This pass maps every node to a canonical
+// node with the same operation over canonical children, and folds constant operands and
+// identities like x * 1 and x + 0 on the way.
+//
+// The generated code computes a node where it is first emitted, so a canonical node is only
+// reused where it has been computed: in the scope of the branch it was defined in and the
+// branches nested in it. The reverse pass enters the branches of the forward pass again and
+// reuses their nodes.
+class ExprSimplifier {
+    public:
+    ~ExprSimplifier() {
+        // Every node the pass visits would have been emitted once without it
+        g_SimplifyStats.nodesBefore += m_NumVisited;
+        g_SimplifyStats.nodesAfter += m_NumInterned;
+    }
+
+    // Rewrites the blocks of _func_ in place and remaps the values of _fwdExprs_
+    void Simplify(const std::shared_ptr<Function> &func,
+                  std::unordered_map<ExpressionCPtr, ExpressionCPtr> &fwdExprs) {
+        m_Scopes = {-1};
+        m_ScopeStack = {0};
+        SimplifyBlock(func->firstBlock);
+        for (auto &it : fwdExprs) {
+            it.second = Remap(it.second);
+        }
+        for (auto &output : func->outputs) {
+            for (auto &expr : output.second) {
+                expr = Remap(expr);
+            }
+        }
+    }
+
+    ExpressionCPtr Remap(const ExpressionCPtr &expr) const {
+        auto it = m_Replace.find(expr);
+        return it != m_Replace.end() ? it->second : expr;
+    }
+
+    // Canonical form of a partial derivative of the reverse pass. The new nodes are emitted
+    // by EmitAll where the derivative is used.
+    ExpressionCPtr Canonicalize(const ExpressionCPtr &expr) {
+        auto ret = Visit(expr);
+        m_Pending.clear();
+        return ret;
+    }
+
+    void EnterBranch(const CFGSplit *split, const int childId) {
+        auto key = std::make_pair(split, childId);
+        auto it = m_BranchScopes.find(key);
+        int scope;
+        if (it == m_BranchScopes.end()) {
+            scope = (int)m_Scopes.size();
+            m_Scopes.push_back(m_ScopeStack.back());
+            m_BranchScopes[key] = scope;
+        } else {
+            scope = it->second;
+        }
+        m_ScopeStack.push_back(scope);
+    }
+
+    void LeaveBranch() {
+        m_ScopeStack.pop_back();
+    }
+
+    private:
+    struct PairHash {
+        size_t operator()(const std::pair<const CFGSplit *, int> &key) const {
+            return std::hash<const void *>()(key.first) ^ std::hash<int>()(key.second);
+        }
+    };
+
+    void SimplifyBlock(const std::shared_ptr<CFGBlock> &block) {
+        std::vector<ExpressionCPtr> exprs;
+        for (auto &expr : block->exprs) {
+            if (expr->Type() == ExpressionType::Variable ||
+                expr->Type() == ExpressionType::NamedAssignment) {
+                exprs.push_back(expr);
+                continue;
+            }
+            Visit(expr);
+            Place(exprs);
+        }
+        if (block->next.get() == nullptr) {
+            block->exprs = exprs;
+            return;
+        }
+        auto split = block->next;
+        for (auto &cond : split->conditions) {
+            if (cond.get() != nullptr) {
+                cond = VisitCondition(cond);
+            }
+        }
+        Place(exprs);
+        block->exprs = exprs;
+        for (int childId = 0; childId < (int)split->children.size(); childId++) {
+            EnterBranch(split.get(), childId);
+            SimplifyBlock(split->children[childId]);
+            for (auto &output : split->outputs) {
+                output->SetPossibleExpr(childId, Visit(output->GetPossibleExpr(childId)));
+            }
+            LeaveBranch();
+        }
+        for (auto &output : split->outputs) {
+            // An output that every branch sets to the same value is that value
+            auto value = output->GetPossibleExpr(0);
+            bool folded = value->IsConstant() || value->Type() == ExpressionType::Variable ||
+                          Available(value);
+            for (int childId = 1; folded && childId < (int)split->children.size(); childId++) {
+                folded = output->GetPossibleExpr(childId) == value;
+            }
+            m_Replace[output] = folded && split->children.size() > 1 ? value : output;
+        }
+        if (split->next.get() != nullptr) {
+            SimplifyBlock(split->next);
+        }
+    }
+
+    // Appends the nodes interned since the last call, in dependency order
+    void Place(std::vector<ExpressionCPtr> &exprs) {
+        exprs.insert(exprs.end(), m_Pending.begin(), m_Pending.end());
+        m_Pending.clear();
+    }
+
+    bool Available(const ExpressionCPtr &expr) const {
+        auto it = m_DefScopes.find(expr);
+        if (it == m_DefScopes.end()) {
+            return false;
+        }
+        for (int scope = m_ScopeStack.back(); scope >= 0; scope = m_Scopes[scope]) {
+            if (scope == it->second) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    BooleanCPtr VisitCondition(const BooleanCPtr &cond) {
+        auto children = cond->Children();
+        if (dynamic_cast<const BooleanAnd *>(cond.get()) != nullptr) {
+            auto c0 = std::static_pointer_cast<const Boolean>(children[0]);
+            auto c1 = std::static_pointer_cast<const Boolean>(children[1]);
+            auto s0 = VisitCondition(c0), s1 = VisitCondition(c1);
+            return s0 == c0 && s1 == c1 ? cond : std::make_shared<BooleanAnd>(s0, s1);
+        }
+        auto s0 = Visit(children[0]), s1 = Visit(children[1]);
+        return s0 == children[0] && s1 == children[1]
+                   ? cond
+                   : std::make_shared<Boolean>(cond->GetOp(), s0, s1);
+    }
+
+    ExpressionCPtr Visit(const ExpressionCPtr &expr) {
+        auto it = m_Replace.find(expr);
+        if (it != m_Replace.end()) {
+            return it->second;
+        }
+        const ExpressionType type = expr->Type();
+        if (type == ExpressionType::Variable || type == ExpressionType::Constant ||
+            type == ExpressionType::NamedAssignment || type == ExpressionType::CondExpr ||
+            type == ExpressionType::Boolean) {
+            return expr;
+        }
+        m_NumVisited++;
+        auto children = expr->Children();
+        ExpressionCPtrVec canonical;
+        for (auto &child : children) {
+            canonical.push_back(Visit(child));
+        }
+        auto ret = Intern(type, canonical, canonical == children ? expr : nullptr);
+        m_Replace[expr] = ret;
+        return ret;
+    }
+
+    ExpressionCPtr Intern(const ExpressionType type,
+                          const ExpressionCPtrVec &c,
+                          const ExpressionCPtr &original) {
+        bool allConstant = true;
+        std::vector<float> values;
+        for (auto &child : c) {
+            allConstant = allConstant && child->IsConstant();
+            values.push_back(child->GetConstantVal());
+        }
+        if (allConstant) {
+            return Constant::Create(FoldConstant(type, values));
+        }
+        switch (type) {
+            case ExpressionType::Negate:
+                if (c[0]->Type() == ExpressionType::Negate) {
+                    return c[0]->Children()[0];
+                }
+                break;
+            case ExpressionType::Add:
+                if (IsConstantVal(c[0], 0.f)) {
+                    return c[1];
+                }
+                if (IsConstantVal(c[1], 0.f)) {
+                    return c[0];
+                }
+                break;
+            case ExpressionType::Minus:
+                if (IsConstantVal(c[1], 0.f)) {
+                    return c[0];
+                }
+                if (IsConstantVal(c[0], 0.f)) {
+                    return Intern(ExpressionType::Negate, {c[1]}, nullptr);
+                }
+                break;
+            case ExpressionType::Multiply:
+                // x * 0 is not folded, it is NaN where x is Inf or NaN. Both operands
+                // constant were folded above.
+                for (int i = 0; i < 2; i++) {
+                    if (IsConstantVal(c[i], 1.f)) {
+                        return c[1 - i];
+                    }
+                    if (IsConstantVal(c[i], -1.f)) {
+                        return Intern(ExpressionType::Negate, {c[1 - i]}, nullptr);
+                    }
+                }
+                break;
+            case ExpressionType::Divide:
+                // 0 / x is kept for the same reason, it is NaN where x is 0 or NaN
+                if (IsConstantVal(c[1], 1.f)) {
+                    return c[0];
+                }
+                break;
+            case ExpressionType::Pow:
+                if (IsConstantVal(c[1], 1.f)) {
+                    return c[0];
+                }
+                break;
+            default:
+                break;
+        }
+
+        std::vector<std::string> operands;
+        for (auto &child : c) {
+            std::string operand;
+            if (child->IsConstant()) {
+                // Constants are not shared between nodes, compare them by value
+                const float value = child->GetConstantVal();
+                operand = "c" + std::string((const char *)&value, sizeof(value));
+            } else {
+                const Expression *ptr = child.get();
+                operand = "n" + std::string((const char *)&ptr, sizeof(ptr));
+            }
+            operands.push_back(operand);
+        }
+        if (type == ExpressionType::Add || type == ExpressionType::Multiply) {
+            std::sort(operands.begin(), operands.end());
+        }
+        std::string key = std::to_string(int(type));
+        for (auto &operand : operands) {
+            key += operand;
+        }
+        auto it = m_Table.find(key);
+        if (it != m_Table.end() && Available(it->second)) {
+            return it->second;
+        }
+        auto node = original.get() != nullptr ? original : MakeNode(type, c);
+        m_Table[key] = node;
+        m_DefScopes[node] = m_ScopeStack.back();
+        m_Replace[node] = node;
+        m_Pending.push_back(node);
+        m_NumInterned++;
+        return node;
+    }
+
+    std::unordered_map<ExpressionCPtr, ExpressionCPtr> m_Replace;
+    std::unordered_map<std::string, ExpressionCPtr> m_Table;
+    std::unordered_map<ExpressionCPtr, int> m_DefScopes;
+    std::unordered_map<std::pair<const CFGSplit *, int>, int, PairHash> m_BranchScopes;
+    // Parent of every scope, scope 0 is the function body
+    std::vector<int> m_Scopes = {-1};
+    std::vector<int> m_ScopeStack = {0};
+    std::vector<ExpressionCPtr> m_Pending;
+    int64_t m_NumVisited = 0;
+    int64_t m_NumInterned = 0;
+};
+
 void Emit(EmitHelper &helper, const ExpressionCPtrVec &exprs, std::ostream &os) {
     for (auto &expr : exprs) {
         expr->Register(helper);
@@ -257,12 +626,13 @@ void EmitReverse(EmitHelper &helper,
                  const std::shared_ptr<CFGBlock> &block,
                  std::unordered_set<ExpressionCPtr> &nonZeroAccId,
                  std::ostream &os,
-                 const bool ispcMode = false) 
+                 const bool ispcMode = false,
+                 ExprSimplifier *simplifier = nullptr) 
 {
     if (block->next.get() != nullptr) {
         auto split = block->next;
         if (split->next.get() != nullptr) {
-            EmitReverse(helper, split->next, nonZeroAccId, os, ispcMode);
+            EmitReverse(helper, split->next, nonZeroAccId, os, ispcMode, simplifier);
         }
         int childId = 0;
         for (auto child : split->children) {
@@ -312,7 +682,13 @@ void EmitReverse(EmitHelper &helper,
                    << "_acc" << helper.GetExprId(output) << ";" << std::endl;
                 nonZeroAccId.insert(expr);
             }
-            EmitReverse(helper, child, nonZeroAccId, os, ispcMode);
+            if (simplifier != nullptr) {
+                simplifier->EnterBranch(split.get(), childId);
+            }
+            EmitReverse(helper, child, nonZeroAccId, os, ispcMode, simplifier);
+            if (simplifier != nullptr) {
+                simplifier->LeaveBranch();
+            }
             helper.DecTab();
             helper.PrintTab(os);
             os << "}" << std::endl;
@@ -332,7 +708,8 @@ void EmitReverse(EmitHelper &helper,
             if (!helper.ExprRegistered(child)) {
                 continue;
             }
-            auto derv = dervs[childId];
+            auto derv = simplifier != nullptr ? simplifier->Canonicalize(dervs[childId])
+                                              : dervs[childId];
             if (derv->IsConstant() && derv->GetConstantVal() == 1.0) {
                 helper.PrintTab(os);
                 os << "_acc" << helper.GetExprId(child) << " += "
@@ -356,17 +733,12 @@ void EmitReverse(EmitHelper &helper,
     }
 }
 
-void EmitGradHessian(const std::shared_ptr<Function> &func,
-                     const ExpressionCPtrVec &wrt,
-                     const ExpressionCPtr &dep,
-                     std::ostream &os,
-                     const bool emitIspc) 
-{
-    EmitHelper helper;
-    if (!emitIspc) {
-        os << "#include <math.h>" << std::endl;
-    }
-    os << "static void " << GetDervName(func->name) << "_kernel(";
+// Declares the inputs of _func_ as kernel parameters, uniform under ISPC. A kernel emitted
+// with lanes also takes the batch size and the lane it evaluates.
+static void EmitKernelInputs(const std::shared_ptr<Function> &func,
+                             const bool emitIspc,
+                             const bool lanes,
+                             std::ostream &os) {
     bool first = true;
     for (auto &input : func->inputs) {
         if (!first) {
@@ -378,19 +750,217 @@ void EmitGradHessian(const std::shared_ptr<Function> &func,
         os << "const " << input.GetDeclaration();
         first = false;
     }
+    if (lanes) {
+        const std::string uniform = emitIspc ? "uniform " : "";
+        os << (first ? "" : ", ") << uniform << "const int count, " << uniform
+           << "const int lane";
+    }
+}
 
-    if (wrt.size() > 0) {
-        if (!first) {
-            os << ", ";
+static bool IsSharedInput(const BatchSignature &batch, const Argument &input) {
+    return std::find(batch.sharedInputs.begin(), batch.sharedInputs.end(), input.GetName()) !=
+           batch.sharedInputs.end();
+}
+
+// The arrays that are strided by the batch, see EmitHelper::SetLaneArrays. Scalar inputs are
+// loaded from their lane by the batched entry.
+static std::unordered_set<std::string> GetLaneArrays(const std::shared_ptr<Function> &func,
+                                                     const BatchSignature &batch) {
+    std::unordered_set<std::string> laneArrays = {"grad", "hess"};
+    for (auto &input : func->inputs) {
+        if (input.Size() > 1 && !IsSharedInput(batch, input)) {
+            laneArrays.insert(input.GetName());
         }
-        os << "const " << c_FloatTypeDecl << "d[" << wrt.size() << "]";
-        os << ", ";
-        os << c_FloatTypeDecl << "grad[" << 1 << "]";
-        os << ", ";
-        os << c_FloatTypeDecl << "hess[" << wrt.size() << "]";
     }
+    return laneArrays;
+}
 
+// Emits the batched entry of a derivative kernel as C. The statements of the kernel, emitted
+// with lanes, are pasted into a loop over the paths that the compiler vectorizes; every
+// temporary starts at zero so that none of them is carried from one path to the next, and the
+// shared arrays are copied to the stack, the vectorizer can't read them from a pointer under a
+// branch. With _hessian_ the loop runs once per direction like the wrapper of
+// EmitGradHessian.
+static void EmitBatchEntry(const std::shared_ptr<Function> &func,
+                           const BatchSignature &batch,
+                           const int dim,
+                           const bool hessian,
+                           const std::string &declarations,
+                           const std::string &statements,
+                           const bool emitIspc,
+                           std::ostream &os) {
+    os << "#include <math.h>" << std::endl;
+    if (emitIspc) {
+        // The statements were emitted for the ISPC kernel
+        os << "#define cif if" << std::endl;
+    }
+    os << "void " << GetBatchName(func->name) << "(const int count";
+    for (auto &input : func->inputs) {
+        if (IsSharedInput(batch, input) && input.Size() > 1) {
+            os << ", const " << c_FloatTypeDecl << input.GetName() << "_shared[" << input.Size()
+               << "]";
+        } else if (IsSharedInput(batch, input)) {
+            os << ", const " << input.GetDeclaration();
+        } else if (input.Size() > 1) {
+            os << ", const " << c_FloatTypeDecl << "*restrict " << input.GetName();
+        } else {
+            os << ", const " << c_FloatTypeDecl << "*restrict " << input.GetName() << "_lanes";
+        }
+    }
+    os << ", " << c_FloatTypeDecl << "*restrict batchGrad";
+    if (hessian) {
+        os << ", " << c_FloatTypeDecl << "*restrict batchHess";
+    }
     os << ") {" << std::endl;
+    for (auto &input : func->inputs) {
+        if (input.Size() > 1 && IsSharedInput(batch, input)) {
+            os << "\t" << input.GetDeclaration() << ";" << std::endl;
+            os << "\tfor (int i = 0; i < " << input.Size() << "; i++) {" << std::endl;
+            os << "\t\t" << input.GetName() << "[i] = " << input.GetName() << "_shared[i];"
+               << std::endl;
+            os << "\t}" << std::endl;
+        }
+    }
+    std::string tab = "\t";
+    if (hessian) {
+        os << "\tfor (int index = 0; index < " << dim << "; index++) {" << std::endl;
+        os << "\t\t" << c_FloatTypeDecl << "d[" << dim << "] = {0};" << std::endl;
+        os << "\t\t" << "d[index] = 1;" << std::endl;
+        os << "\t\t" << c_FloatTypeDecl << "*restrict grad = batchGrad + index * count;"
+           << std::endl;
+        os << "\t\t" << c_FloatTypeDecl << "*restrict hess = batchHess + index * " << dim
+           << " * count;" << std::endl;
+        tab = "\t\t";
+    } else {
+        os << "\t" << c_FloatTypeDecl << "*restrict grad = batchGrad;" << std::endl;
+    }
+    os << "#pragma omp simd" << std::endl;
+    os << tab << "for (int lane = 0; lane < count; lane++) {" << std::endl;
+    for (auto &input : func->inputs) {
+        if (input.Size() == 1 && !IsSharedInput(batch, input)) {
+            os << tab << "\tconst " << c_FloatTypeDecl << input.GetName() << " = "
+               << input.GetName() << "_lanes[lane];" << std::endl;
+        }
+    }
+    os << declarations;
+    os << statements;
+    os << tab << "}" << std::endl;
+    if (hessian) {
+        os << "\t}" << std::endl;
+    }
+    os << "}" << std::endl;
+}
+
+// Declares _names_ for the batched entry, all starting at zero
+static std::string GetBatchDeclarations(const EmitHelper &helper,
+                                        const std::vector<std::string> &names) {
+    if (names.empty()) {
+        return "";
+    }
+    std::stringstream ss;
+    helper.PrintTab(ss);
+    ss << c_FloatTypeDecl;
+    for (size_t i = 0; i < names.size(); i++) {
+        ss << (i > 0 ? ", " : "") << names[i] << " = 0";
+    }
+    ss << ";" << std::endl;
+    return ss.str();
+}
+
+// Variables of _wrt_ that an expression depends on, one bit per variable
+using DepSet = std::vector<uint64_t>;
+
+static void Union(DepSet &set, const DepSet &other) {
+    for (size_t w = 0; w < set.size(); w++) {
+        set[w] |= other[w];
+    }
+}
+
+// Marks every pair of a variable of _rows_ and a variable of _cols_, both ways
+static void Couple(const DepSet &rows, const DepSet &cols, std::vector<DepSet> &pattern) {
+    const int dim = int(pattern.size());
+    for (int i = 0; i < dim; i++) {
+        if (rows[i / 64] & (uint64_t(1) << (i % 64))) {
+            Union(pattern[i], cols);
+        }
+        if (cols[i / 64] & (uint64_t(1) << (i % 64))) {
+            Union(pattern[i], rows);
+        }
+    }
+}
+
+static const DepSet &Dependencies(const ExpressionCPtr &expr,
+                                  const std::unordered_map<ExpressionCPtr, int> &wrtIds,
+                                  std::unordered_map<ExpressionCPtr, DepSet> &deps,
+                                  std::vector<DepSet> &pattern) {
+    auto it = deps.find(expr);
+    if (it != deps.end()) {
+        return it->second;
+    }
+    DepSet set((pattern.size() + 63) / 64, 0);
+    const ExpressionType type = expr->Type();
+    if (type == ExpressionType::Variable) {
+        auto wrtIt = wrtIds.find(expr);
+        if (wrtIt != wrtIds.end()) {
+            set[wrtIt->second / 64] |= uint64_t(1) << (wrtIt->second % 64);
+        }
+    } else if (type != ExpressionType::Constant && type != ExpressionType::Boolean) {
+        // Branch conditions only select between the outputs of a split
+        std::vector<DepSet> children;
+        for (auto &child : expr->Children()) {
+            children.push_back(Dependencies(child, wrtIds, deps, pattern));
+            Union(set, children.back());
+        }
+        switch (type) {
+            case ExpressionType::NamedAssignment:
+            case ExpressionType::Negate:
+            case ExpressionType::Add:
+            case ExpressionType::Minus:
+            case ExpressionType::CondExpr: break;
+            case ExpressionType::Multiply: Couple(children[0], children[1], pattern); break;
+            case ExpressionType::Divide:
+                Couple(children[0], children[1], pattern);
+                Couple(children[1], children[1], pattern);
+                break;
+            default: Couple(set, set, pattern);
+        }
+    }
+    return deps[expr] = set;
+}
+
+std::vector<std::vector<bool>> HessianPattern(const ExpressionCPtrVec &wrt,
+                                              const ExpressionCPtr &dep) {
+    std::unordered_map<ExpressionCPtr, int> wrtIds;
+    for (int i = 0; i < (int)wrt.size(); i++) {
+        wrtIds[wrt[i]] = i;
+    }
+    std::unordered_map<ExpressionCPtr, DepSet> deps;
+    std::vector<DepSet> pattern(wrt.size(), DepSet((wrt.size() + 63) / 64, 0));
+    Dependencies(dep, wrtIds, deps, pattern);
+    std::vector<std::vector<bool>> ret(wrt.size(), std::vector<bool>(wrt.size(), false));
+    for (int i = 0; i < (int)wrt.size(); i++) {
+        for (int j = 0; j < (int)wrt.size(); j++) {
+            ret[i][j] = (pattern[i][j / 64] >> (j % 64)) & 1;
+        }
+    }
+    return ret;
+}
+
+void EmitGradHessian(const std::shared_ptr<Function> &func,
+                     const ExpressionCPtrVec &wrt,
+                     const ExpressionCPtr &dep,
+                     std::ostream &os,
+                     const bool emitIspc,
+                     const BatchSignature *batch,
+                     std::ostream *batchOs)
+{
+    EmitHelper helper;
+    if (batch != nullptr) {
+        helper.SetLaneArrays(GetLaneArrays(func, *batch));
+    }
+    if (!emitIspc) {
+        os << "#include <math.h>" << std::endl;
+    }
 
     std::stringstream forwardStream;
     helper.IncTab();
@@ -404,6 +974,11 @@ void EmitGradHessian(const std::shared_ptr<Function> &func,
 
     std::unordered_map<ExpressionCPtr, ExpressionCPtr> fwdExprs;
     Forward(func, wrt, fwdExprs);
+    std::unique_ptr<ExprSimplifier> simplifier;
+    if (SimplifyExprs()) {
+        simplifier.reset(new ExprSimplifier());
+        simplifier->Simplify(func, fwdExprs);
+    }
 
     for (auto &expr : wrt) {
         helper.Register(fwdExprs[expr]);
@@ -415,9 +990,19 @@ void EmitGradHessian(const std::shared_ptr<Function> &func,
     assert(fDep.get() != nullptr);
     std::unordered_set<ExpressionCPtr> nonZeroAccId;
     std::stringstream backwardStream;
-    if (helper.ExprRegistered(fDep)) {
+    if (!helper.ExprRegistered(fDep) && fDep->IsConstant()) {
+        // The tangent folded to a constant, it has no second derivatives
         helper.PrintTab(forwardStream);
-        forwardStream << "grad[0] = " << fDep->GetEmitName(helper) << ";" << std::endl;
+        forwardStream << helper.GetElementName("grad", 0) << " = " << fDep->GetEmitName(helper)
+                      << ";" << std::endl;
+        for (int id = 0; id < (int)wrt.size(); id++) {
+            helper.PrintTab(forwardStream);
+            forwardStream << helper.GetElementName("hess", id) << " = 0;" << std::endl;
+        }
+    } else if (helper.ExprRegistered(fDep)) {
+        helper.PrintTab(forwardStream);
+        forwardStream << helper.GetElementName("grad", 0) << " = " << fDep->GetEmitName(helper)
+                      << ";" << std::endl;
 
         helper.PrintTab(backwardStream);
         backwardStream << "/* Reverse accumulation */" << std::endl;
@@ -425,24 +1010,28 @@ void EmitGradHessian(const std::shared_ptr<Function> &func,
         helper.PrintTab(backwardStream);
         backwardStream << "_acc" << helper.GetExprId(fDep) << " = 1.0;" << std::endl;
         nonZeroAccId.insert(fDep);
-        EmitReverse(helper, func->firstBlock, nonZeroAccId, backwardStream, emitIspc);
+        EmitReverse(helper,
+                    func->firstBlock,
+                    nonZeroAccId,
+                    backwardStream,
+                    emitIspc,
+                    simplifier.get());
         int id = 0;
         for (auto &expr : wrt) {
             helper.PrintTab(backwardStream);
-            backwardStream << "hess[" << id << "] = _acc" << helper.GetExprId(expr) << ";"
-                           << std::endl;
+            backwardStream << helper.GetElementName("hess", id) << " = _acc"
+                           << helper.GetExprId(expr) << ";" << std::endl;
             id++;
         }
     }
 
+    // The temporaries that do not depend on the direction are uniform in the single kernel
+    std::stringstream uniformDeclStream, varyingDeclStream;
     std::stringstream backwardDeclStream;
+    std::vector<std::string> batchDecls;
     auto emitted = helper.GetEmitted();
     if (emitted.size() > 0) {
-        helper.PrintTab(os);
-        if (emitIspc) {
-            os << "uniform ";
-        }
-        os << c_FloatTypeDecl;
+        uniformDeclStream << c_FloatTypeDecl;
         bool first = true;
         for (auto expr : emitted) {
             if (expr->Type() == ExpressionType::Boolean ||
@@ -450,17 +1039,18 @@ void EmitGradHessian(const std::shared_ptr<Function> &func,
                 expr->Type() == ExpressionType::Variable) {
                 continue;
             }
+            batchDecls.push_back(expr->GetEmitName(helper));
             if (fwdExprs.find(expr) != fwdExprs.end()) {
                 if (!first) {
-                    os << ", ";
+                    uniformDeclStream << ", ";
                 }
-                os << expr->GetEmitName(helper);
+                uniformDeclStream << expr->GetEmitName(helper);
                 first = false;
             }
         }
-        os << ";" << std::endl;
-        helper.PrintTab(os);
-        os << c_FloatTypeDecl;
+        uniformDeclStream << ";" << std::endl;
+        helper.PrintTab(varyingDeclStream);
+        varyingDeclStream << c_FloatTypeDecl;
         first = true;
         for (auto expr : emitted) {
             if (expr->Type() == ExpressionType::Boolean ||
@@ -470,13 +1060,13 @@ void EmitGradHessian(const std::shared_ptr<Function> &func,
             }
             if (fwdExprs.find(expr) == fwdExprs.end()) {
                 if (!first) {
-                    os << ", ";
+                    varyingDeclStream << ", ";
                 }
-                os << expr->GetEmitName(helper);
+                varyingDeclStream << expr->GetEmitName(helper);
                 first = false;
             }
         }
-        os << ";" << std::endl;
+        varyingDeclStream << ";" << std::endl;
         helper.PrintTab(backwardDeclStream);
         backwardDeclStream << c_FloatTypeDecl;
         first = true;
@@ -500,17 +1090,38 @@ void EmitGradHessian(const std::shared_ptr<Function> &func,
         backwardDeclStream << ";" << std::endl;
     }
 
+    os << "static void " << GetDervName(func->name) << "_kernel(";
+    EmitKernelInputs(func, emitIspc, helper.HasLanes(), os);
+    if (wrt.size() > 0) {
+        if (!func->inputs.empty() || helper.HasLanes()) {
+            os << ", ";
+        }
+        os << "const " << c_FloatTypeDecl << "d[" << wrt.size() << "]";
+        os << ", ";
+        os << c_FloatTypeDecl << "grad[" << 1 << "]";
+        os << ", ";
+        os << c_FloatTypeDecl << "hess[" << wrt.size() << "]";
+    }
+    os << ") {" << std::endl;
+    if (emitted.size() > 0) {
+        helper.PrintTab(os);
+        if (emitIspc) {
+            os << "uniform ";
+        }
+        os << uniformDeclStream.str();
+    }
+    os << varyingDeclStream.str();
     os << forwardStream.str();
     os << backwardDeclStream.str();
     os << backwardStream.str();
-    helper.DecTab();
     os << "}" << std::endl;
+    helper.DecTab();
 
     if (emitIspc) {
         os << "export ";
     }
     os << "void " << GetDervName(func->name) << "(";
-    first = true;
+    bool first = true;
     for (auto &input : func->inputs) {
         if (!first) {
             os << ", ";
@@ -532,7 +1143,14 @@ void EmitGradHessian(const std::shared_ptr<Function> &func,
     }
     os << c_FloatTypeDecl << "hess[]";
     os << ") {" << std::endl;
-    int dim = (int)wrt.size();
+    std::string args;
+    for (auto &input : func->inputs) {
+        args += (args.empty() ? "" : ", ") + input.GetName();
+    }
+    if (helper.HasLanes()) {
+        args += args.empty() ? "1, 0" : ", 1, 0";
+    }
+    const int dim = (int)wrt.size();
     if (emitIspc) {
         os << "\tforeach (index = 0 ... " << dim << ") {" << std::endl;
     } else {
@@ -543,16 +1161,7 @@ void EmitGradHessian(const std::shared_ptr<Function> &func,
     os << "\t\t" << c_FloatTypeDecl << "h[" << dim << "];" << std::endl;
     os << "\t\t"
        << "d[index] = 1;" << std::endl;
-    os << "\t\t" << GetDervName(func->name) << "_kernel(";
-    first = true;
-    for (auto &input : func->inputs) {
-        if (!first) {
-            os << ", ";
-        }
-        os << input.GetName();
-        first = false;
-    }
-    os << ", d, &g, h);" << std::endl;
+    os << "\t\t" << GetDervName(func->name) << "_kernel(" << args << ", d, &g, h);" << std::endl;
     os << "\t\t"
        << "grad[index] = g;" << std::endl;
     if (emitIspc) {
@@ -567,6 +1176,17 @@ void EmitGradHessian(const std::shared_ptr<Function> &func,
     os << "\t\t}" << std::endl;
     os << "\t}" << std::endl;
     os << "}" << std::endl;
+
+    if (batch != nullptr) {
+        EmitBatchEntry(func,
+                       *batch,
+                       dim,
+                       true,
+                       GetBatchDeclarations(helper, batchDecls),
+                       forwardStream.str() + backwardDeclStream.str() + backwardStream.str(),
+                       emitIspc,
+                       *batchOs);
+    }
 }
 
 // Forward mode autodiff
@@ -726,33 +1346,19 @@ void EmitGrad(const std::shared_ptr<Function> &func,
 // Reverse mode autodiff 
 void EmitGrad2(const std::shared_ptr<Function> &func, 
                const ExpressionCPtrVec &wrt, 
-               const ExpressionCPtr &dep, 
+               const ExpressionCPtr &originalDep, 
                std::ostream &os, 
-               const bool emitIspc)
+               const bool emitIspc,
+               const BatchSignature *batch = nullptr,
+               std::ostream *batchOs = nullptr)
 {
     EmitHelper helper;
+    if (batch != nullptr) {
+        helper.SetLaneArrays(GetLaneArrays(func, *batch));
+    }
     if (!emitIspc) {
         os << "#include <math.h>" << std::endl;
     }
-    os << "static void " << GetDervName(func->name) << "_kernel(";
-    bool first = true;
-    for (auto &input : func->inputs) {
-        if (!first) {
-            os << ", ";
-        }
-        if (emitIspc) {
-            os << "uniform ";
-        }
-        os << "const " << input.GetDeclaration();
-        first = false; 
-    }
-    if (wrt.size() > 0) {
-         if (!first) {
-            os << ", ";
-        }
-        os << c_FloatTypeDecl << "grad[" << wrt.size() << "]";
-    }
-    os << ") {" << std::endl;
 
     std::stringstream forwardStream;
     helper.IncTab();
@@ -770,6 +1376,14 @@ void EmitGrad2(const std::shared_ptr<Function> &func,
     // for (auto &expr : wrt) {
     //     helper.Register(fwdExprs[expr]);
     // }
+    std::unique_ptr<ExprSimplifier> simplifier;
+    ExpressionCPtr dep = originalDep;
+    if (SimplifyExprs()) {
+        std::unordered_map<ExpressionCPtr, ExpressionCPtr> fwdExprs;
+        simplifier.reset(new ExprSimplifier());
+        simplifier->Simplify(func, fwdExprs);
+        dep = simplifier->Remap(dep);
+    }
     Emit(helper, func->firstBlock, forwardStream, emitIspc);
 
     assert(dep.get() != nullptr);
@@ -782,24 +1396,27 @@ void EmitGrad2(const std::shared_ptr<Function> &func,
         helper.PrintTab(backwardStream);
         backwardStream << "_acc" << helper.GetExprId(dep) << " = 1.0;" << std::endl;
         nonZeroAccId.insert(dep);
-        EmitReverse(helper, func->firstBlock, nonZeroAccId, backwardStream, emitIspc);
+        EmitReverse(helper,
+                    func->firstBlock,
+                    nonZeroAccId,
+                    backwardStream,
+                    emitIspc,
+                    simplifier.get());
         int id = 0;
         for (auto &expr : wrt) {
             helper.PrintTab(backwardStream);
-            backwardStream << "grad[" << id << "] = _acc" << helper.GetExprId(expr) << ";"
-                        << std::endl;
+            backwardStream << helper.GetElementName("grad", id) << " = _acc"
+                           << helper.GetExprId(expr) << ";" << std::endl;
             id++;
         }
     }
 
+    std::stringstream uniformDeclStream, varyingDeclStream;
     std::stringstream backwardDeclStream;
+    std::vector<std::string> batchDecls;
     auto emitted = helper.GetEmitted();
     if (emitted.size() > 0) {
-        helper.PrintTab(os);
-        if (emitIspc) {
-            os << "uniform ";
-        }
-        os << c_FloatTypeDecl;
+        uniformDeclStream << c_FloatTypeDecl;
         bool first = true;
         for (auto expr : emitted) {
             if (expr->Type() == ExpressionType::Boolean ||
@@ -807,17 +1424,18 @@ void EmitGrad2(const std::shared_ptr<Function> &func,
                 expr->Type() == ExpressionType::Variable) {
                 continue;
             }
+            batchDecls.push_back(expr->GetEmitName(helper));
             if (nonZeroAccId.find(expr) != nonZeroAccId.end()) {
                 if (!first) {
-                    os << ", ";
+                    uniformDeclStream << ", ";
                 }
-                os << expr->GetEmitName(helper);
+                uniformDeclStream << expr->GetEmitName(helper);
                 first = false;
             }
         }
-        os << ";" << std::endl;
-        helper.PrintTab(os);
-        os << c_FloatTypeDecl;
+        uniformDeclStream << ";" << std::endl;
+        helper.PrintTab(varyingDeclStream);
+        varyingDeclStream << c_FloatTypeDecl;
         first = true;
         for (auto expr : emitted) {
             if (expr->Type() == ExpressionType::Boolean ||
@@ -827,13 +1445,13 @@ void EmitGrad2(const std::shared_ptr<Function> &func,
             }
             if (nonZeroAccId.find(expr) == nonZeroAccId.end()) {
                 if (!first) {
-                    os << ", ";
+                    varyingDeclStream << ", ";
                 }
-                os << expr->GetEmitName(helper);
+                varyingDeclStream << expr->GetEmitName(helper);
                 first = false;
             }
         }
-        os << ";" << std::endl;
+        varyingDeclStream << ";" << std::endl;
 
         helper.PrintTab(backwardDeclStream);
         backwardDeclStream << c_FloatTypeDecl;
@@ -857,18 +1475,35 @@ void EmitGrad2(const std::shared_ptr<Function> &func,
         }
         backwardDeclStream << ";" << std::endl;
     }
-    os << forwardStream.str();
-    os << backwardDeclStream.str();
-    os << backwardStream.str();
-    helper.DecTab();
-    os << "}" << std::endl;
-
+    os << "static void " << GetDervName(func->name) << "_kernel(";
+    EmitKernelInputs(func, emitIspc, helper.HasLanes(), os);
+    if (wrt.size() > 0) {
+        if (!func->inputs.empty() || helper.HasLanes()) {
+            os << ", ";
+        }
+        os << c_FloatTypeDecl << "grad[" << wrt.size() << "]";
+    }
+    os << ") {" << std::endl;
+    if (emitted.size() > 0) {
+        helper.PrintTab(os);
+        if (emitIspc) {
+            os << "uniform ";
+        }
+        os << uniformDeclStream.str();
+    }
+    os << varyingDeclStream.str();
+    os << forwardStream.str();
+    os << backwardDeclStream.str();
+    os << backwardStream.str();
+    os << "}" << std::endl;
+    helper.DecTab();
+
 
     if (emitIspc) {
         os << "export ";
     }
     os << "void " << GetDervName(func->name) << "(";
-    first = true;
+    bool first = true;
     for (auto &input : func->inputs) {
         if (!first) {
             os << ", ";
@@ -896,6 +1531,9 @@ void EmitGrad2(const std::shared_ptr<Function> &func,
         os << input.GetName();
         first = false;
     }
+    if (helper.HasLanes()) {
+        os << (first ? "1, 0" : ", 1, 0");
+    }
     os << ", g);" << std::endl;
     if (emitIspc) {
         os << "\tforeach (index = 0 ... " << dim << ") {" << std::endl;
@@ -905,13 +1543,787 @@ void EmitGrad2(const std::shared_ptr<Function> &func,
     os << "\t\t" << "grad[index] = g[index];" << std::endl;
     os << "\t}" << std::endl;
     os << "}" << std::endl;
+
+    if (batch != nullptr) {
+        EmitBatchEntry(func,
+                       *batch,
+                       dim,
+                       false,
+                       GetBatchDeclarations(helper, batchDecls),
+                       forwardStream.str() + backwardDeclStream.str() + backwardStream.str(),
+                       emitIspc,
+                       *batchOs);
+    }
+}
+
+// Tape instructions, every one is the opcode, the destination register and the operand registers
+enum TapeOp : int32_t {
+    TAPE_COPY,
+    TAPE_NEG,
+    TAPE_SQUARE,
+    TAPE_INVERSE,
+    TAPE_SIN,
+    TAPE_COS,
+    TAPE_TAN,
+    TAPE_SQRT,
+    TAPE_ASIN,
+    TAPE_ACOS,
+    TAPE_EXP,
+    TAPE_LOG,
+    TAPE_POW,
+    TAPE_ATAN2,
+    TAPE_ADD,
+    TAPE_SUB,
+    TAPE_MUL,
+    TAPE_DIV,
+    TAPE_LENGTH2,
+    TAPE_LENGTH3,
+    TAPE_LENGTH4,
+    TAPE_DOT3,
+    TAPE_GT,
+    TAPE_GE,
+    TAPE_EQ,
+    TAPE_NE,
+    TAPE_LE,
+    TAPE_LT,
+    TAPE_AND,
+    TAPE_ACC_ADD,     // dst += a
+    TAPE_ACC_SUB,     // dst -= a
+    TAPE_ACC_MUL_ADD, // dst += a * b
+    TAPE_JUMP_IF_ZERO,  // condition, target
+    TAPE_JUMP           // target
+};
+
+// Walks the control flow graph exactly like the emitters, so that the tape evaluates the same
+// statements in the same order as the generated code
+class TapeRecorder {
+    public:
+    TapeRecorder(Tape &tape, EmitHelper &helper, ExprSimplifier *simplifier = nullptr)
+        : m_Tape(tape), m_Helper(helper), m_Simplifier(simplifier) {
+    }
+
+    void AddArgument(const Argument &arg) {
+        std::vector<std::string> names;
+        for (auto &expr : arg.GetExprVec()) {
+            names.push_back(expr->GetEmitName(m_Helper));
+        }
+        m_ArgNames.push_back(names);
+    }
+
+    int Slot(const ExpressionCPtr &expr) {
+        switch (expr->Type()) {
+            case ExpressionType::Variable:
+            case ExpressionType::NamedAssignment:
+                return NamedSlot(expr->GetEmitName(m_Helper));
+            case ExpressionType::Constant: {
+                const float value = expr->GetConstantVal();
+                auto it = m_ConstSlots.find(value);
+                if (it != m_ConstSlots.end()) {
+                    return it->second;
+                }
+                const int slot = NewSlot();
+                m_ConstSlots[value] = slot;
+                m_Tape.m_Constants.push_back({slot, value});
+                return slot;
+            }
+            default:
+                return IdSlot(m_ExprSlots, m_Helper.GetExprId(expr));
+        }
+    }
+
+    int AccSlot(const ExpressionCPtr &expr) {
+        const int id = m_Helper.GetExprId(expr);
+        const bool isNew = id >= (int)m_AccSlots.size() || m_AccSlots[id] < 0;
+        const int slot = IdSlot(m_AccSlots, id);
+        if (isNew) {
+            m_Tape.m_AccSlots.push_back(slot);
+        }
+        return slot;
+    }
+
+    // Mirrors Expression::EmitAll
+    void RecordAll(const ExpressionCPtr &expr) {
+        if (m_Helper.IsEmitted(expr)) {
+            return;
+        }
+        for (auto child : expr->Children()) {
+            RecordAll(child);
+        }
+        Record(expr);
+        m_Helper.SetEmitted(expr);
+    }
+
+    // Mirrors Emit(helper, block, os)
+    void RecordBlock(const std::shared_ptr<CFGBlock> &block) {
+        for (auto &expr : block->exprs) {
+            expr->Register(m_Helper);
+        }
+        for (auto &expr : block->exprs) {
+            if (!m_Helper.IsEmitted(expr)) {
+                Record(expr);
+                m_Helper.SetEmitted(expr);
+            }
+        }
+        if (block->next.get() == nullptr) {
+            return;
+        }
+        auto split = block->next;
+        for (auto output : split->outputs) {
+            m_Helper.Register(output);
+        }
+        for (auto cond : split->conditions) {
+            if (cond.get() != nullptr) {
+                cond->Register(m_Helper);
+            }
+        }
+        std::vector<size_t> endJumps;
+        for (int childId = 0; childId < (int)split->children.size(); childId++) {
+            const size_t skipJump = BeginBranch(split, childId);
+            RecordBlock(split->children[childId]);
+            for (auto output : split->outputs) {
+                Emit(TAPE_COPY, Slot(output), {Slot(output->GetPossibleExpr(childId))});
+            }
+            EndBranch(skipJump, endJumps);
+        }
+        PatchJumps(endJumps);
+        for (auto output : split->outputs) {
+            m_Helper.SetEmitted(output);
+        }
+        if (split->next.get() != nullptr) {
+            RecordBlock(split->next);
+        }
+    }
+
+    // Mirrors EmitReverse
+    void RecordReverse(const std::shared_ptr<CFGBlock> &block,
+                       std::unordered_set<ExpressionCPtr> &nonZeroAccId) {
+        if (block->next.get() != nullptr) {
+            auto split = block->next;
+            if (split->next.get() != nullptr) {
+                RecordReverse(split->next, nonZeroAccId);
+            }
+            bool hasNonZeroAcc = false;
+            for (auto output : split->outputs) {
+                if (nonZeroAccId.find(output) != nonZeroAccId.end()) {
+                    hasNonZeroAcc = true;
+                    break;
+                }
+            }
+            std::vector<size_t> endJumps;
+            for (int childId = 0; hasNonZeroAcc && childId < (int)split->children.size();
+                 childId++) {
+                const size_t skipJump = BeginBranch(split, childId);
+                for (auto output : split->outputs) {
+                    if (nonZeroAccId.find(output) == nonZeroAccId.end()) {
+                        continue;
+                    }
+                    auto expr = output->GetPossibleExpr(childId);
+                    if (!m_Helper.ExprRegistered(expr)) {
+                        continue;
+                    }
+                    Emit(TAPE_COPY, AccSlot(expr), {AccSlot(output)});
+                    nonZeroAccId.insert(expr);
+                }
+                if (m_Simplifier != nullptr) {
+                    m_Simplifier->EnterBranch(split.get(), childId);
+                }
+                RecordReverse(split->children[childId], nonZeroAccId);
+                if (m_Simplifier != nullptr) {
+                    m_Simplifier->LeaveBranch();
+                }
+                EndBranch(skipJump, endJumps);
+            }
+            PatchJumps(endJumps);
+        }
+
+        for (auto it = block->exprs.rbegin(); it != block->exprs.rend(); it++) {
+            auto expr = *it;
+            if (nonZeroAccId.find(expr) == nonZeroAccId.end()) {
+                continue;
+            }
+            auto children = expr->Children();
+            auto dervs = expr->Dervs();
+            for (int childId = 0; childId < (int)children.size(); childId++) {
+                auto child = children[childId];
+                if (!m_Helper.ExprRegistered(child)) {
+                    continue;
+                }
+                auto derv = m_Simplifier != nullptr ? m_Simplifier->Canonicalize(dervs[childId])
+                                                    : dervs[childId];
+                if (derv->IsConstant() && derv->GetConstantVal() == 1.0) {
+                    Emit(TAPE_ACC_ADD, AccSlot(child), {AccSlot(expr)});
+                    nonZeroAccId.insert(child);
+                } else if (derv->IsConstant() && derv->GetConstantVal() == -1.0) {
+                    Emit(TAPE_ACC_SUB, AccSlot(child), {AccSlot(expr)});
+                    nonZeroAccId.insert(child);
+                } else if (!derv->IsConstant() || derv->GetConstantVal() != 0.0) {
+                    derv->Register(m_Helper);
+                    RecordAll(derv);
+                    Emit(TAPE_ACC_MUL_ADD, AccSlot(child), {AccSlot(expr), Slot(derv)});
+                    nonZeroAccId.insert(child);
+                }
+            }
+        }
+    }
+
+    void Finish() {
+        // Only the argument elements that the function reads are loaded
+        for (auto &names : m_ArgNames) {
+            std::vector<int> slots;
+            for (auto &name : names) {
+                auto it = m_NamedSlots.find(name);
+                slots.push_back(it != m_NamedSlots.end() ? it->second : -1);
+            }
+            m_Tape.m_ArgSlots.push_back(slots);
+        }
+        m_Tape.m_NumSlots = m_NumSlots;
+    }
+
+    private:
+    int NewSlot() {
+        return m_NumSlots++;
+    }
+
+    int NamedSlot(const std::string &name) {
+        auto it = m_NamedSlots.find(name);
+        if (it != m_NamedSlots.end()) {
+            return it->second;
+        }
+        const int slot = NewSlot();
+        m_NamedSlots[name] = slot;
+        return slot;
+    }
+
+    int IdSlot(std::vector<int> &slots, const int id) {
+        if (id >= (int)slots.size()) {
+            slots.resize(id + 1, -1);
+        }
+        if (slots[id] < 0) {
+            slots[id] = NewSlot();
+        }
+        return slots[id];
+    }
+
+    void Emit(const TapeOp op, const int dst, const std::vector<int> &operands) {
+        m_Tape.m_Code.push_back(op);
+        m_Tape.m_Code.push_back(dst);
+        m_Tape.m_Code.insert(m_Tape.m_Code.end(), operands.begin(), operands.end());
+        m_Tape.m_NumInstructions++;
+    }
+
+    // Mirrors Expression::Emit, one instruction per emitted statement
+    void Record(const ExpressionCPtr &expr) {
+        const ExpressionType type = expr->Type();
+        if (type == ExpressionType::Variable || type == ExpressionType::Constant ||
+            type == ExpressionType::Boolean || type == ExpressionType::CondExpr) {
+            return;
+        }
+        std::vector<int> operands;
+        for (auto child : expr->Children()) {
+            operands.push_back(Slot(child));
+        }
+        const int dst = Slot(expr);
+        switch (type) {
+            case ExpressionType::NamedAssignment: Emit(TAPE_COPY, dst, operands); break;
+            case ExpressionType::Negate: Emit(TAPE_NEG, dst, operands); break;
+            case ExpressionType::Square: Emit(TAPE_SQUARE, dst, operands); break;
+            case ExpressionType::Inverse: Emit(TAPE_INVERSE, dst, operands); break;
+            case ExpressionType::Sin: Emit(TAPE_SIN, dst, operands); break;
+            case ExpressionType::Cos: Emit(TAPE_COS, dst, operands); break;
+            case ExpressionType::Tan: Emit(TAPE_TAN, dst, operands); break;
+            case ExpressionType::Sqrt: Emit(TAPE_SQRT, dst, operands); break;
+            case ExpressionType::ASin: Emit(TAPE_ASIN, dst, operands); break;
+            case ExpressionType::ACos: Emit(TAPE_ACOS, dst, operands); break;
+            case ExpressionType::Exp: Emit(TAPE_EXP, dst, operands); break;
+            case ExpressionType::Log: Emit(TAPE_LOG, dst, operands); break;
+            case ExpressionType::Pow: Emit(TAPE_POW, dst, operands); break;
+            case ExpressionType::ATan2: Emit(TAPE_ATAN2, dst, operands); break;
+            case ExpressionType::Add: Emit(TAPE_ADD, dst, operands); break;
+            case ExpressionType::Minus: Emit(TAPE_SUB, dst, operands); break;
+            case ExpressionType::Multiply: Emit(TAPE_MUL, dst, operands); break;
+            case ExpressionType::Divide: Emit(TAPE_DIV, dst, operands); break;
+            case ExpressionType::Length2D: Emit(TAPE_LENGTH2, dst, operands); break;
+            case ExpressionType::Length3D: Emit(TAPE_LENGTH3, dst, operands); break;
+            case ExpressionType::Length4D: Emit(TAPE_LENGTH4, dst, operands); break;
+            case ExpressionType::Dot3D: Emit(TAPE_DOT3, dst, operands); break;
+            default: throw std::runtime_error("[TapeRecorder:Record] unknown expression");
+        }
+    }
+
+    // Evaluates a condition into a new register
+    int RecordCondition(const BooleanCPtr &cond) {
+        auto children = cond->Children();
+        const int dst = NewSlot();
+        if (dynamic_cast<const BooleanAnd *>(cond.get()) != nullptr) {
+            const int slot0 = RecordCondition(std::static_pointer_cast<const Boolean>(children[0]));
+            const int slot1 = RecordCondition(std::static_pointer_cast<const Boolean>(children[1]));
+            Emit(TAPE_AND, dst, {slot0, slot1});
+            return dst;
+        }
+        static const TapeOp ops[] = {TAPE_GT, TAPE_GE, TAPE_EQ, TAPE_NE, TAPE_LE, TAPE_LT};
+        Emit(ops[cond->GetOp()], dst, {Slot(children[0]), Slot(children[1])});
+        return dst;
+    }
+
+    // Records the test of branch _childId_ of an if/else-if/else chain, returns the position
+    // of the jump to the next branch or 0 for the final else
+    size_t BeginBranch(const std::shared_ptr<CFGSplit> &split, const int childId) {
+        if (childId != 0 && childId == int(split->children.size()) - 1) {
+            return 0;
+        }
+        auto cond = split->conditions[childId];
+        RecordAll(cond);
+        const int condSlot = RecordCondition(cond);
+        Emit(TAPE_JUMP_IF_ZERO, condSlot, {-1});
+        return m_Tape.m_Code.size() - 1;
+    }
+
+    void EndBranch(const size_t skipJump, std::vector<size_t> &endJumps) {
+        Emit(TAPE_JUMP, 0, {-1});
+        endJumps.push_back(m_Tape.m_Code.size() - 1);
+        if (skipJump != 0) {
+            m_Tape.m_Code[skipJump] = (int32_t)m_Tape.m_Code.size();
+        }
+    }
+
+    void PatchJumps(const std::vector<size_t> &jumps) {
+        for (auto jump : jumps) {
+            m_Tape.m_Code[jump] = (int32_t)m_Tape.m_Code.size();
+        }
+    }
+
+    Tape &m_Tape;
+    EmitHelper &m_Helper;
+    ExprSimplifier *m_Simplifier;
+    int m_NumSlots = 0;
+    std::vector<std::vector<std::string>> m_ArgNames;
+    std::unordered_map<std::string, int> m_NamedSlots;
+    std::unordered_map<float, int> m_ConstSlots;
+    std::vector<int> m_ExprSlots;
+    std::vector<int> m_AccSlots;
+};
+
+std::shared_ptr<Tape> Tape::Record(const std::shared_ptr<Function> &func) {
+    auto tape = std::make_shared<Tape>();
+    EmitHelper helper;
+    TapeRecorder recorder(*tape, helper);
+    for (auto &input : func->inputs) {
+        recorder.AddArgument(input);
+    }
+    recorder.RecordBlock(func->firstBlock);
+    for (auto &output : func->outputs) {
+        std::vector<int> slots;
+        for (auto &subOutput : output.second) {
+            slots.push_back(recorder.Slot(subOutput));
+        }
+        tape->m_OutSlots.push_back(slots);
+    }
+    recorder.Finish();
+    return tape;
+}
+
+std::shared_ptr<Tape> Tape::RecordGradHessian(const std::shared_ptr<Function> &func,
+                                              const ExpressionCPtrVec &wrt,
+                                              const ExpressionCPtr &dep) {
+    auto tape = std::make_shared<Tape>();
+    tape->m_Kind = Kind::GradHessian;
+    tape->m_Width = std::max((int)wrt.size(), 1);
+    EmitHelper helper;
+    std::unique_ptr<ExprSimplifier> simplifier;
+    if (SimplifyExprs()) {
+        simplifier.reset(new ExprSimplifier());
+    }
+    TapeRecorder recorder(*tape, helper, simplifier.get());
+    for (auto &input : func->inputs) {
+        recorder.AddArgument(input);
+    }
+    for (auto &expr : wrt) {
+        helper.Register(expr);
+    }
+    std::unordered_map<ExpressionCPtr, ExpressionCPtr> fwdExprs;
+    Forward(func, wrt, fwdExprs);
+    if (simplifier) {
+        simplifier->Simplify(func, fwdExprs);
+    }
+    for (auto &expr : wrt) {
+        helper.Register(fwdExprs[expr]);
+    }
+    // Forward() prepended the direction variables to the first block
+    for (int i = 0; i < (int)wrt.size(); i++) {
+        tape->m_DirSlots.push_back(recorder.Slot(func->firstBlock->exprs[i]));
+    }
+    recorder.RecordBlock(func->firstBlock);
+
+    auto fDep = fwdExprs[dep];
+    std::vector<int> gradSlots = {-1}, hessSlots(wrt.size(), -1);
+    if (!helper.ExprRegistered(fDep) && fDep->IsConstant()) {
+        gradSlots[0] = recorder.Slot(fDep);
+    } else if (helper.ExprRegistered(fDep)) {
+        gradSlots[0] = recorder.Slot(fDep);
+        std::unordered_set<ExpressionCPtr> nonZeroAccId;
+        for (auto &expr : wrt) {
+            recorder.AccSlot(expr);
+        }
+        const int one = recorder.Slot(Constant::Create(1.0));
+        tape->m_Code.insert(tape->m_Code.end(), {TAPE_COPY, recorder.AccSlot(fDep), one});
+        tape->m_NumInstructions++;
+        nonZeroAccId.insert(fDep);
+        recorder.RecordReverse(func->firstBlock, nonZeroAccId);
+        for (int i = 0; i < (int)wrt.size(); i++) {
+            hessSlots[i] = recorder.AccSlot(wrt[i]);
+        }
+    }
+    tape->m_OutSlots = {gradSlots, hessSlots};
+    recorder.Finish();
+    return tape;
+}
+
+std::shared_ptr<Tape> Tape::RecordGrad(const std::shared_ptr<Function> &func,
+                                       const ExpressionCPtrVec &wrt,
+                                       const ExpressionCPtr &originalDep) {
+    auto tape = std::make_shared<Tape>();
+    tape->m_Kind = Kind::Grad;
+    EmitHelper helper;
+    std::unique_ptr<ExprSimplifier> simplifier;
+    ExpressionCPtr dep = originalDep;
+    if (SimplifyExprs()) {
+        std::unordered_map<ExpressionCPtr, ExpressionCPtr> fwdExprs;
+        simplifier.reset(new ExprSimplifier());
+        simplifier->Simplify(func, fwdExprs);
+        dep = simplifier->Remap(dep);
+    }
+    TapeRecorder recorder(*tape, helper, simplifier.get());
+    for (auto &input : func->inputs) {
+        recorder.AddArgument(input);
+    }
+    for (auto &expr : wrt) {
+        helper.Register(expr);
+    }
+    recorder.RecordBlock(func->firstBlock);
+
+    std::vector<int> gradSlots(wrt.size(), -1);
+    if (helper.ExprRegistered(dep)) {
+        std::unordered_set<ExpressionCPtr> nonZeroAccId;
+        for (auto &expr : wrt) {
+            recorder.AccSlot(expr);
+        }
+        const int one = recorder.Slot(Constant::Create(1.0));
+        tape->m_Code.insert(tape->m_Code.end(), {TAPE_COPY, recorder.AccSlot(dep), one});
+        tape->m_NumInstructions++;
+        nonZeroAccId.insert(dep);
+        recorder.RecordReverse(func->firstBlock, nonZeroAccId);
+        for (int i = 0; i < (int)wrt.size(); i++) {
+            gradSlots[i] = recorder.AccSlot(wrt[i]);
+        }
+    }
+    tape->m_OutSlots = {gradSlots};
+    recorder.Finish();
+    return tape;
+}
+
+void Tape::Init(float *regs, const int width, const int firstLane, float *const *args) const {
+    for (auto &constant : m_Constants) {
+        std::fill(regs + constant.first * width, regs + (constant.first + 1) * width,
+                  constant.second);
+    }
+    for (int argId = 0; argId < (int)m_ArgSlots.size(); argId++) {
+        const std::vector<int> &slots = m_ArgSlots[argId];
+        for (int i = 0; i < (int)slots.size(); i++) {
+            if (slots[i] >= 0) {
+                std::fill(regs + slots[i] * width, regs + (slots[i] + 1) * width, args[argId][i]);
+            }
+        }
+    }
+    for (int dirId = 0; dirId < (int)m_DirSlots.size(); dirId++) {
+        float *reg = regs + m_DirSlots[dirId] * width;
+        for (int lane = 0; lane < width; lane++) {
+            reg[lane] = firstLane + lane == dirId ? 1.f : 0.f;
+        }
+    }
+    for (auto slot : m_AccSlots) {
+        std::fill(regs + slot * width, regs + (slot + 1) * width, 0.f);
+    }
+}
+
+#define TAPE_LANES(expr)                        \
+    for (int lane = 0; lane < width; lane++) { \
+        dst[lane] = expr;                       \
+    }
+
+// A compile-time _Width_ lets the compiler drop the lane loops of the scalar case
+template <int Width>
+static inline int Lanes(const int width) {
+    return Width > 0 ? Width : width;
+}
+
+template <int Width>
+bool Tape::Execute(float *regs, const int runtimeWidth) const {
+    const int width = Lanes<Width>(runtimeWidth);
+    const int32_t *code = m_Code.data();
+    const size_t size = m_Code.size();
+    size_t pc = 0;
+    while (pc < size) {
+        const int32_t op = code[pc];
+        if (op == TAPE_JUMP) {
+            pc = code[pc + 2];
+            continue;
+        }
+        float *dst = regs + code[pc + 1] * width;
+        if (op == TAPE_JUMP_IF_ZERO) {
+            // The condition register is the destination operand
+            bool any = false, all = true;
+            for (int lane = 0; lane < width; lane++) {
+                any = any || dst[lane] != 0.f;
+                all = all && dst[lane] != 0.f;
+            }
+            if (any != all) {
+                return false;
+            }
+            pc = any ? pc + 3 : code[pc + 2];
+            continue;
+        }
+        const float *a = regs + code[pc + 2] * width;
+        switch (op) {
+            case TAPE_COPY: TAPE_LANES(a[lane]); pc += 3; break;
+            case TAPE_NEG: TAPE_LANES(-a[lane]); pc += 3; break;
+            case TAPE_SQUARE: TAPE_LANES(a[lane] * a[lane]); pc += 3; break;
+            case TAPE_INVERSE: TAPE_LANES(1.f / a[lane]); pc += 3; break;
+            case TAPE_SIN: TAPE_LANES(std::sin(a[lane])); pc += 3; break;
+            case TAPE_COS: TAPE_LANES(std::cos(a[lane])); pc += 3; break;
+            case TAPE_TAN: TAPE_LANES(std::tan(a[lane])); pc += 3; break;
+            case TAPE_SQRT: TAPE_LANES(std::sqrt(a[lane])); pc += 3; break;
+            case TAPE_ASIN: TAPE_LANES(std::asin(a[lane])); pc += 3; break;
+            case TAPE_ACOS: TAPE_LANES(std::acos(a[lane])); pc += 3; break;
+            case TAPE_EXP: TAPE_LANES(std::exp(a[lane])); pc += 3; break;
+            case TAPE_LOG: TAPE_LANES(std::log(a[lane])); pc += 3; break;
+            case TAPE_ACC_ADD: TAPE_LANES(dst[lane] + a[lane]); pc += 3; break;
+            case TAPE_ACC_SUB: TAPE_LANES(dst[lane] - a[lane]); pc += 3; break;
+            default: {
+                const float *b = regs + code[pc + 3] * width;
+                switch (op) {
+                    case TAPE_POW: TAPE_LANES(std::pow(a[lane], b[lane])); break;
+                    case TAPE_ATAN2: TAPE_LANES(std::atan2(a[lane], b[lane])); break;
+                    case TAPE_ADD: TAPE_LANES(a[lane] + b[lane]); break;
+                    case TAPE_SUB: TAPE_LANES(a[lane] - b[lane]); break;
+                    case TAPE_MUL: TAPE_LANES(a[lane] * b[lane]); break;
+                    case TAPE_DIV: TAPE_LANES(a[lane] / b[lane]); break;
+                    case TAPE_LENGTH2:
+                        TAPE_LANES(std::sqrt(a[lane] * a[lane] + b[lane] * b[lane]));
+                        break;
+                    case TAPE_GT: TAPE_LANES(float(a[lane] > b[lane])); break;
+                    case TAPE_GE: TAPE_LANES(float(a[lane] >= b[lane])); break;
+                    case TAPE_EQ: TAPE_LANES(float(a[lane] == b[lane])); break;
+                    case TAPE_NE: TAPE_LANES(float(a[lane] != b[lane])); break;
+                    case TAPE_LE: TAPE_LANES(float(a[lane] <= b[lane])); break;
+                    case TAPE_LT: TAPE_LANES(float(a[lane] < b[lane])); break;
+                    case TAPE_AND: TAPE_LANES(float(a[lane] != 0.f && b[lane] != 0.f)); break;
+                    case TAPE_ACC_MUL_ADD: TAPE_LANES(dst[lane] + a[lane] * b[lane]); break;
+                    case TAPE_LENGTH3: {
+                        const float *c = regs + code[pc + 4] * width;
+                        TAPE_LANES(
+                            std::sqrt(a[lane] * a[lane] + b[lane] * b[lane] + c[lane] * c[lane]));
+                        pc++;
+                        break;
+                    }
+                    case TAPE_LENGTH4: {
+                        const float *c = regs + code[pc + 4] * width;
+                        const float *e = regs + code[pc + 5] * width;
+                        TAPE_LANES(std::sqrt(a[lane] * a[lane] + b[lane] * b[lane] +
+                                             c[lane] * c[lane] + e[lane] * e[lane]));
+                        pc += 2;
+                        break;
+                    }
+                    case TAPE_DOT3: {
+                        const float *c = regs + code[pc + 4] * width;
+                        const float *x1 = regs + code[pc + 5] * width;
+                        const float *y1 = regs + code[pc + 6] * width;
+                        const float *z1 = regs + code[pc + 7] * width;
+                        TAPE_LANES(a[lane] * x1[lane] + b[lane] * y1[lane] + c[lane] * z1[lane]);
+                        pc += 4;
+                        break;
+                    }
+                }
+                pc += 4;
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+#undef TAPE_LANES
+
+void Tape::Run(float *const *args) const {
+    thread_local std::vector<float> regs;
+    float *const *outputs = args + m_ArgSlots.size();
+    auto readOutput = [&](const int width, const int lane, const int slot) {
+        return slot >= 0 ? regs[slot * width + lane] : 0.f;
+    };
+    if (m_Kind != Kind::GradHessian) {
+        regs.resize(m_NumSlots);
+        Init(regs.data(), 1, 0, args);
+        Execute<1>(regs.data(), 1);
+        for (int outId = 0; outId < (int)m_OutSlots.size(); outId++) {
+            for (int i = 0; i < (int)m_OutSlots[outId].size(); i++) {
+                outputs[outId][i] = readOutput(1, 0, m_OutSlots[outId][i]);
+            }
+        }
+        return;
+    }
+
+    const int dim = (int)m_OutSlots[1].size();
+    auto scatter = [&](const int width, const int firstLane) {
+        for (int lane = 0; lane < width && firstLane + lane < dim; lane++) {
+            const int index = firstLane + lane;
+            outputs[0][index] = readOutput(width, lane, m_OutSlots[0][0]);
+            for (int i = 0; i < dim; i++) {
+                outputs[1][index * dim + i] = readOutput(width, lane, m_OutSlots[1][i]);
+            }
+        }
+    };
+    regs.resize(m_NumSlots * m_Width);
+    Init(regs.data(), m_Width, 0, args);
+    if (Execute<0>(regs.data(), m_Width)) {
+        scatter(m_Width, 0);
+        return;
+    }
+    // The directions took different branches
+    for (int index = 0; index < dim; index++) {
+        Init(regs.data(), 1, index, args);
+        Execute<1>(regs.data(), 1);
+        scatter(1, index);
+    }
+}
+
+// Callers expect plain C function pointers with the signature of the emitted function, so the
+// interpreted backend hands out one of a fixed set of entry points, each bound to a slot of
+// this table. Every number of arguments has its own slots: the entry points are generated at
+// compile time for all of them anyway, and functions and their derivatives do not compete.
+static constexpr int c_MaxTapes = 256;
+static constexpr int c_MaxTapeArgs = 8;
+static const Tape *g_Tapes[c_MaxTapeArgs + 1][c_MaxTapes];
+static std::mutex g_TapesMutex;
+
+template <size_t, typename T>
+using TapeArg = T;
+
+template <int Slot, size_t... ArgIds>
+static void TapeTrampoline(TapeArg<ArgIds, float *>... args) {
+    float *argv[] = {args...};
+    g_Tapes[sizeof...(ArgIds)][Slot]->Run(argv);
+}
+
+template <size_t... ArgIds, size_t... Slots>
+static std::array<void *, c_MaxTapes> TapeTrampolines(std::index_sequence<ArgIds...>,
+                                                      std::index_sequence<Slots...>) {
+    return {{(void *)&TapeTrampoline<int(Slots), ArgIds...>...}};
+}
+
+template <int NumArgs>
+static void *TapeEntry(const int slot) {
+    static const std::array<void *, c_MaxTapes> entries = TapeTrampolines(
+        std::make_index_sequence<NumArgs>(), std::make_index_sequence<c_MaxTapes>());
+    return entries[slot];
+}
+
+static void *TapeEntry(const int numArgs, const int slot) {
+    switch (numArgs) {
+        case 1: return TapeEntry<1>(slot);
+        case 2: return TapeEntry<2>(slot);
+        case 3: return TapeEntry<3>(slot);
+        case 4: return TapeEntry<4>(slot);
+        case 5: return TapeEntry<5>(slot);
+        case 6: return TapeEntry<6>(slot);
+        case 7: return TapeEntry<7>(slot);
+        case 8: return TapeEntry<8>(slot);
+    }
+    return nullptr;
+}
+
+// Flags of the cached per-function objects, they are part of the object hash together with
+// the toolchain
+static const std::string c_FuncCFlags = "-O3";
+static const std::string c_DervCFlags = "-Ofast -std=c11 -march=native";
+// The batched entries vectorize their loop over the paths, with the vector math of libmvec
+static const std::string c_DervBatchCFlags = "-Ofast -std=c11 -march=native -fopenmp-simd";
+static const std::string c_DervIspcFlags = "-O3 --math-lib=default --opt=fast-math --woff --pic";
+
+// 64-bit FNV-1a
+static uint64_t HashBytes(const char *data, const size_t size, uint64_t hash) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= uint64_t((unsigned char)data[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint64_t HashString(const std::string &str, const uint64_t hash = 14695981039346656037ull) {
+    return HashBytes(str.data(), str.size(), hash);
+}
+
+static std::string ToHex(const uint64_t value) {
+    std::stringstream ss;
+    ss << std::hex << value;
+    return ss.str();
+}
+
+// Identifies the compiler of the cached objects and the cpu they run on. -march=native and
+// ispc without --target both pick the instructions of this host, and the cache directory may
+// be shared with other hosts, so the resolved target options and the compiler versions go
+// into the object hash.
+static const std::string &ToolchainId(const bool ispc) {
+    static const std::string hostId = []() {
+        try {
+            return exec("gcc --version 2>&1") + exec("gcc -march=native -Q --help=target 2>&1");
+        } catch (const std::exception &) {
+            return std::string();
+        }
+    }();
+    static const std::string ispcId = [&]() {
+        try {
+            return hostId + exec("ispc --version 2>&1");
+        } catch (const std::exception &) {
+            return hostId;
+        }
+    }();
+    return ispc ? ispcId : hostId;
+}
+
+// Identifies the code generator, i.e. this executable. Cached objects are found through it
+// without generating their source again, a rebuilt executable regenerates the sources and
+// reuses every object whose source did not change.
+static const std::string &GeneratorId() {
+    static const std::string id = []() {
+        std::ifstream exe("/proc/self/exe", std::ios::binary);
+        if (!exe.good()) {
+            return std::string();
+        }
+        uint64_t hash = 14695981039346656037ull;
+        std::vector<char> buffer(1 << 20);
+        while (exe.read(buffer.data(), buffer.size()) || exe.gcount() > 0) {
+            hash = HashBytes(buffer.data(), size_t(exe.gcount()), hash);
+        }
+        return ToHex(hash);
+    }();
+    return id;
 }
 
-Library::Library(const std::string &path, const std::string &name)
-    : m_Path(path), m_Name(name), m_Linked(false) {
+Library::Library(const std::string &path, const std::string &name, const Backend backend)
+    : m_Path(path), m_Name(name), m_Linked(false), m_Backend(backend) {
     if (path.size() > 0 && path.back() != '/') {
         m_Path += "/";
     }
+    if (m_Backend == Backend::Interpreted) {
+        return;
+    }
+    if (m_Backend == Backend::Cached) {
+        std::error_code ec;
+        std::filesystem::create_directories(m_Path + "index", ec);
+        if (ec) {
+            std::cerr << "[Warning] can't create cache directory " << m_Path << std::endl;
+        }
+        return;
+    }
     std::string libFilepath = m_Path + m_Name + ".so";
     std::ifstream f(libFilepath.c_str());
     if (f.good()) {  // file existed
@@ -921,12 +2333,202 @@ Library::Library(const std::string &path, const std::string &name)
 }
 
 Library::~Library() {
-    if (m_Linked) {
+    if (m_Linked && m_Backend == Backend::Linked) {
         dlclose(m_Handle);
     }
+    for (auto &it : m_FuncHandles) {
+        dlclose(it.second);
+    }
+    for (const PendingObject &pending : m_PendingObjects) {
+        std::remove(pending.sourceFilepath.c_str());
+    }
+    std::lock_guard<std::mutex> lock(g_TapesMutex);
+    for (auto slot : m_TapeSlots) {
+        delete g_Tapes[slot.first][slot.second];
+        g_Tapes[slot.first][slot.second] = nullptr;
+    }
+}
+
+std::string Library::IndexPath(const std::string &name) const {
+    // The index skips generating the source, so everything that changes the object besides the
+    // generator goes into its name: the toolchain and target of this host and the
+    // simplification. The ISPC toolchain id covers gcc as well.
+    return m_Path + "index/" + m_Name + "-" + name + "-" + GeneratorId() + "-" +
+           ToHex(HashString(ToolchainId(true))) + (SimplifyExprs() ? "" : "-nosimplify");
+}
+
+bool Library::LoadCached(const std::string &name) {
+    if (m_Backend != Backend::Cached || GeneratorId().empty()) {
+        return false;
+    }
+    std::ifstream index(IndexPath(name).c_str());
+    std::string objFilename;
+    if (!(index >> objFilename)) {
+        return false;
+    }
+    lib_t handle = dlopen((m_Path + objFilename).c_str(), RTLD_LAZY);
+    if (handle == nullptr) {
+        return false;
+    }
+    auto it = m_FuncHandles.find(name);
+    if (it != m_FuncHandles.end()) {
+        dlclose(it->second);
+    }
+    m_FuncHandles[name] = handle;
+    return true;
+}
+
+void Library::CompileCached(const std::string &name,
+                            const std::string &source,
+                            const bool ispc,
+                            const std::string &flags) {
+    m_Funcs.push_back(name);
+    const std::string compiler = ispc ? "ispc " : "gcc ";
+    const std::string hash =
+        ToHex(HashString(source, HashString(compiler + flags + ToolchainId(ispc))));
+    const std::string objFilename = name + "-" + hash + ".so";
+    const std::string objFilepath = m_Path + objFilename;
+    if (std::ifstream(objFilepath.c_str()).good()) {
+        LoadObject(name, objFilename);
+        return;
+    }
+    // Missing objects are built together on Link(). Other processes may share the cache, so
+    // build under a private name and move the finished object in place.
+    const std::string tmpBase = objFilepath + ".tmp" + std::to_string(getpid());
+    const std::string sourceFilepath = tmpBase + (ispc ? ".ispc" : ".c");
+    for (const PendingObject &pending : m_PendingObjects) {
+        if (pending.objFilename == objFilename) {
+            m_PendingObjects.push_back(PendingObject{name, objFilename, tmpBase, "", ""});
+            return;
+        }
+    }
+    {
+        std::fstream fs(sourceFilepath.c_str(), std::fstream::out);
+        fs << source;
+    }
+    std::string cmd;
+    if (ispc) {
+        cmd = compiler + flags + " " + sourceFilepath + " -o " + tmpBase + ".o && gcc -shared -o " +
+              tmpBase + ".so " + tmpBase + ".o";
+    } else {
+        cmd = compiler + flags + " -shared -fPIC -o " + tmpBase + ".so " + sourceFilepath + " -lm";
+    }
+    m_PendingObjects.push_back(PendingObject{name, objFilename, tmpBase, sourceFilepath, cmd});
+}
+
+void Library::CompilePending() {
+    if (m_PendingObjects.empty()) {
+        return;
+    }
+    // One make job per object, -k keeps building the others when one fails
+    const std::string makefilePath = m_Path + m_Name + ".tmp" + std::to_string(getpid()) + ".mk";
+    {
+        std::fstream fs(makefilePath.c_str(), std::fstream::out);
+        fs << "all:";
+        for (const PendingObject &pending : m_PendingObjects) {
+            if (!pending.cmd.empty()) {
+                fs << " " << pending.tmpBase << ".so";
+            }
+        }
+        fs << "\n";
+        for (const PendingObject &pending : m_PendingObjects) {
+            if (!pending.cmd.empty()) {
+                fs << pending.tmpBase << ".so: " << pending.sourceFilepath << "\n\t" << pending.cmd
+                   << "\n";
+            }
+        }
+    }
+    std::cout << "Compiling " << m_PendingObjects.size() << " functions of " << m_Name
+              << std::endl;
+    const std::string cmd = "make -k -s -j" + std::to_string(NumSystemCores()) + " -f " +
+                            makefilePath + " all";
+    if (std::system(cmd.c_str()) != 0) {
+        std::cerr << "[Warning] compile failed" << std::endl;
+    }
+    std::remove(makefilePath.c_str());
+
+    for (const PendingObject &pending : m_PendingObjects) {
+        if (!pending.cmd.empty()) {
+            std::rename((pending.tmpBase + ".so").c_str(),
+                        (m_Path + pending.objFilename).c_str());
+            std::remove(pending.sourceFilepath.c_str());
+            std::remove((pending.tmpBase + ".o").c_str());
+            std::remove((pending.tmpBase + ".so").c_str());
+        }
+    }
+    for (const PendingObject &pending : m_PendingObjects) {
+        if (std::ifstream((m_Path + pending.objFilename).c_str()).good()) {
+            LoadObject(pending.name, pending.objFilename);
+        }
+    }
+    m_PendingObjects.clear();
+}
+
+void Library::LoadObject(const std::string &name, const std::string &objFilename) {
+    const std::string objFilepath = m_Path + objFilename;
+    lib_t handle = dlopen(objFilepath.c_str(), RTLD_LAZY);
+    if (handle == nullptr) {
+        std::cerr << "[Warning] can't load " << objFilepath << std::endl;
+        return;
+    }
+    auto it = m_FuncHandles.find(name);
+    if (it != m_FuncHandles.end()) {
+        dlclose(it->second);
+    }
+    m_FuncHandles[name] = handle;
+
+    if (!GeneratorId().empty()) {
+        const std::string indexPath = IndexPath(name);
+        const std::string tmpIndexPath = indexPath + ".tmp" + std::to_string(getpid());
+        {
+            std::fstream fs(tmpIndexPath.c_str(), std::fstream::out);
+            fs << objFilename << std::endl;
+        }
+        std::rename(tmpIndexPath.c_str(), indexPath.c_str());
+    }
+}
+
+int Library::FreeTapeSlots(const int numArgs) {
+    if (numArgs < 1 || numArgs > c_MaxTapeArgs) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(g_TapesMutex);
+    return int(std::count(g_Tapes[numArgs], g_Tapes[numArgs] + c_MaxTapes, nullptr));
+}
+
+void Library::RegisterTape(const std::string &name, const std::shared_ptr<Tape> &tape) {
+    const int numArgs = tape->NumArgs();
+    if (numArgs < 1 || numArgs > c_MaxTapeArgs) {
+        throw std::runtime_error("[Library::RegisterTape] can't interpret " + name + " with " +
+                                 std::to_string(numArgs) + " arguments");
+    }
+    std::lock_guard<std::mutex> lock(g_TapesMutex);
+    int slot = 0;
+    while (slot < c_MaxTapes && g_Tapes[numArgs][slot] != nullptr) {
+        slot++;
+    }
+    // A function left out would only show up as a missing entry much later
+    if (slot == c_MaxTapes) {
+        throw std::runtime_error("[Library::RegisterTape] can't interpret " + name + ", all " +
+                                 std::to_string(c_MaxTapes) + " entry points with " +
+                                 std::to_string(numArgs) + " arguments are in use");
+    }
+    g_Tapes[numArgs][slot] = new Tape(std::move(*tape));
+    m_TapeSlots.push_back(std::make_pair(numArgs, slot));
+    m_TapeEntries[name] = TapeEntry(numArgs, slot);
 }
 
 void Library::RegisterFunc(const std::shared_ptr<Function> func) {
+    if (m_Backend == Backend::Interpreted) {
+        RegisterTape(func->name, Tape::Record(func));
+        return;
+    }
+    if (m_Backend == Backend::Cached) {
+        std::stringstream ss;
+        Emit(func, ss);
+        CompileCached(func->name, ss.str(), false, c_FuncCFlags);
+        return;
+    }
     m_Funcs.push_back(func->name);
 
     std::string cSourceFilename = m_Path + func->name + ".c";
@@ -942,6 +2544,10 @@ void Library::RegisterFunc(const std::shared_ptr<Function> func) {
 }
 
 void Library::RegisterFunc2(const std::shared_ptr<Function> func) {
+    if (m_Backend != Backend::Linked) {
+        RegisterFunc(func);
+        return;
+    }
     m_Funcs.push_back(func->name);
 
     std::string cSourceFilename = m_Path + func->name + ".c";
@@ -963,14 +2569,37 @@ void Library::RegisterFunc2(const std::shared_ptr<Function> func) {
 void Library::RegisterFuncDerv(const std::shared_ptr<Function> func,
                                const ExpressionCPtrVec &wrt,
                                const ExpressionCPtr &dep,
-                               const bool emitIspc) {
+                               const bool emitIspc,
+                               const BatchSignature *batch) {
     std::string dervName = GetDervName(func->name);
+    for (const auto &row : HessianPattern(wrt, dep)) {
+        g_HessianStats.entries += int64_t(row.size());
+        g_HessianStats.nonZeros += int64_t(std::count(row.begin(), row.end(), true));
+    }
+    if (m_Backend == Backend::Interpreted) {
+        RegisterTape(dervName, Tape::RecordGradHessian(func, wrt, dep));
+        return;
+    }
+    std::stringstream batchSs;
+    if (m_Backend == Backend::Cached) {
+        std::stringstream ss;
+        EmitGradHessian(func, wrt, dep, ss, emitIspc, batch, &batchSs);
+        CompileCached(dervName, ss.str(), emitIspc, emitIspc ? c_DervIspcFlags : c_DervCFlags);
+        if (batch != nullptr) {
+            CompileCached(GetBatchName(func->name), batchSs.str(), false, c_DervBatchCFlags);
+        }
+        return;
+    }
     m_Funcs.push_back(dervName);
 
     std::string ext = emitIspc ? std::string(".ispc") : std::string(".c");
     std::string sourceFilepath = m_Path + dervName + ext;
     std::fstream dfs(sourceFilepath.c_str(), std::fstream::out);
-    EmitGradHessian(func, wrt, dep, dfs, emitIspc);
+    EmitGradHessian(func, wrt, dep, dfs, emitIspc, batch, &batchSs);
+    dfs.close();
+    if (batch != nullptr) {
+        CompileBatchEntry(func->name, batchSs.str(), false);
+    }
 
     std::string objFilepath = m_Path + dervName + ".o";
     std::string cmd;
@@ -990,16 +2619,35 @@ void Library::RegisterFuncDerv(const std::shared_ptr<Function> func,
 void Library::RegisterFuncDerv2(const std::shared_ptr<Function> func,
                                 const ExpressionCPtrVec &wrt,
                                 const ExpressionCPtr &dep,
-                                const bool emitIspc) 
+                                const bool emitIspc,
+                                const BatchSignature *batch) 
 {
     std::string dervName = GetDervName(func->name);
+    if (m_Backend == Backend::Interpreted) {
+        RegisterTape(dervName, Tape::RecordGrad(func, wrt, dep));
+        return;
+    }
+    std::stringstream batchSs;
+    if (m_Backend == Backend::Cached) {
+        std::stringstream ss;
+        EmitGrad2(func, wrt, dep, ss, emitIspc, batch, &batchSs);   // Reverse mode
+        CompileCached(dervName, ss.str(), emitIspc, emitIspc ? c_DervIspcFlags : c_DervCFlags);
+        if (batch != nullptr) {
+            CompileCached(GetBatchName(func->name), batchSs.str(), false, c_DervBatchCFlags);
+        }
+        return;
+    }
     m_Funcs.push_back(dervName);
 
     std::string ext = emitIspc ? std::string(".ispc") : std::string(".c");
     std::string sourceFilepath = m_Path + dervName + ext;
     std::fstream dfs(sourceFilepath.c_str(), std::fstream::out);
     // EmitGrad(func, wrt, dep, dfs, emitIspc);    // Forward mode 
-    EmitGrad2(func, wrt, dep, dfs, emitIspc);   // Reverse mode 
+    EmitGrad2(func, wrt, dep, dfs, emitIspc, batch, &batchSs);   // Reverse mode 
+    dfs.close();
+    if (batch != nullptr) {
+        CompileBatchEntry(func->name, batchSs.str(), true);
+    }
 
     std::string objFilepath = m_Path + dervName + ".o";
     std::string cmd;
@@ -1018,8 +2666,34 @@ void Library::RegisterFuncDerv2(const std::shared_ptr<Function> func,
     m_MakeLines.emplace_back(makeLine);
 }
 
+void Library::CompileBatchEntry(const std::string &name,
+                                const std::string &source,
+                                const bool deferred) {
+    const std::string batchName = GetBatchName(name);
+    m_Funcs.push_back(batchName);
+    const std::string sourceFilepath = m_Path + batchName + ".c";
+    {
+        std::fstream fs(sourceFilepath.c_str(), std::fstream::out);
+        fs << source;
+    }
+    const std::string objFilepath = m_Path + batchName + ".o";
+    const std::string cmd =
+        "gcc " + c_DervBatchCFlags + " -c -fPIC -o " + objFilepath + " " + sourceFilepath;
+    if (deferred) {
+        m_MakeLines.emplace_back(objFilepath + ": " + sourceFilepath + "\n\t" + cmd + "\n");
+    } else if (std::system(cmd.c_str()) != 0) {
+        std::cerr << "[Warning] compile failed" << std::endl;
+    }
+}
 
 void Library::Link() {
+    if (m_Backend != Backend::Linked) {
+        // Recorded functions and cached objects are ready on registration, only the objects
+        // missing from the cache are left to compile
+        CompilePending();
+        m_Linked = true;
+        return;
+    }
     // std::string libFilepath = m_Path + m_Name + ".so";
     // std::string gccCmd =
     //     std::string("gcc ") + "-march=native -Ofast -shared -fPIC -o " + libFilepath;
@@ -1045,6 +2719,7 @@ void Library::Link() {
         files += " " + (m_Path + funcName) + ".o";
         gccCmd += " " + (m_Path + funcName) + ".o";
     }
+    gccCmd += " -lm";
 
     // Generate the make file
     std::fstream fs("Makefile.lib", std::fstream::out);
@@ -1073,12 +2748,34 @@ void Library::Link() {
 }
 
 void *Library::GetFunc(const std::string &name) const {
+    if (m_Backend == Backend::Interpreted) {
+        auto it = m_TapeEntries.find(name);
+        return it != m_TapeEntries.end() ? it->second : nullptr;
+    }
+    if (m_Backend == Backend::Cached) {
+        auto it = m_FuncHandles.find(name);
+        return it != m_FuncHandles.end() ? dlsym(it->second, name.c_str()) : nullptr;
+    }
     return dlsym(m_Handle, name.c_str());
 }
 
 void *Library::GetFuncDerv(const std::string &name) const {
     std::string dervName = GetDervName(name);
+    if (m_Backend != Backend::Linked) {
+        return GetFunc(dervName);
+    }
     return dlsym(m_Handle, dervName.c_str());
 }
 
+void *Library::GetFuncDervBatch(const std::string &name) const {
+    std::string batchName = GetBatchName(name);
+    if (m_Backend == Backend::Interpreted) {
+        return nullptr;
+    }
+    if (m_Backend == Backend::Cached) {
+        return GetFunc(batchName);
+    }
+    return dlsym(m_Handle, batchName.c_str());
+}
+
 }  // chad
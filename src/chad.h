@@ -165,9 +165,29 @@ class EmitHelper {
         return m_Emitted;
     }
 
+    // Element _index_ of the arrays _laneArrays_ is emitted as name[index * count + lane], so
+    // the same statements evaluate path _lane_ of a batch of _count_ paths stored as structures
+    // of arrays. A single path is lane 0 of a batch of one.
+    void SetLaneArrays(const std::unordered_set<std::string> &laneArrays) {
+        m_LaneArrays = laneArrays;
+    }
+    bool HasLanes() const {
+        return !m_LaneArrays.empty();
+    }
+    std::string GetElementName(const std::string &name, const int index) const {
+        if (index < 0) {
+            return name;
+        }
+        if (m_LaneArrays.find(name) != m_LaneArrays.end()) {
+            return name + "[" + std::to_string(index) + " * count + lane]";
+        }
+        return name + "[" + std::to_string(index) + "]";
+    }
+
     private:
     std::unordered_map<ExpressionCPtr, int> m_ExprMap;
     std::unordered_set<ExpressionCPtr> m_Emitted;
+    std::unordered_set<std::string> m_LaneArrays;
     int numTab;
 };
 
@@ -248,11 +268,7 @@ class Variable : public Expression {
     void Emit(const EmitHelper &helper, std::ostream &os) const {
     }
     std::string GetEmitName(const EmitHelper &helper) const {
-        if (m_Index >= 0) {
-            return m_Name + std::string("[") + std::to_string(m_Index) + std::string("]");
-        } else {
-            return m_Name;
-        }
+        return helper.GetElementName(m_Name, m_Index);
     }
     ExpressionCPtrVec Children() const {
         return {};
@@ -975,6 +991,9 @@ class Boolean : public Expression {
     ExpressionCPtrVec Dervs() const {
         return {Constant::Create(0.0), Constant::Create(0.0)};
     }
+    Op GetOp() const {
+        return m_Op;
+    }
 
     private:
     std::string OpToString() const {
@@ -1076,6 +1095,9 @@ class CondExpr : public Expression {
     ExpressionCPtr GetPossibleExpr(const int index) const {
         return m_PossibleExprs[index];
     }
+    void SetPossibleExpr(const int index, const ExpressionCPtr expr) const {
+        m_PossibleExprs[index] = expr;
+    }
 
     private:
     // ugly!
@@ -1427,6 +1449,9 @@ class Argument {
     std::string GetName() const {
         return m_Name;
     }
+    int Size() const {
+        return int(m_Exprs.size());
+    }
     ExpressionCPtr GetExpr(int index = 0) const {
         return m_Exprs[index];
     }
@@ -1532,48 +1557,200 @@ inline void PushExprToBlock(const ExpressionCPtr &expr) {
     }
 }
 
+// Node counts of the simplification pass that runs before derivatives are emitted, summed
+// over every function emitted so far
+struct SimplifyStats {
+    int64_t nodesBefore = 0;
+    int64_t nodesAfter = 0;
+};
+
+// Enables common-subexpression elimination and constant folding of the functions whose
+// derivatives are emitted, on by default
+void SetSimplifyExprs(const bool enable);
+bool SimplifyExprs();
+SimplifyStats GetSimplifyStats();
+
+// Structurally nonzero entries of the Hessian of _dep_ with respect to _wrt_, by row. An entry
+// is false only if the two variables never meet in a nonlinear expression, so that the second
+// derivative is zero for every input.
+std::vector<std::vector<bool>> HessianPattern(const ExpressionCPtrVec &wrt,
+                                              const ExpressionCPtr &dep);
+
+// Hessian entries of the derivative kernels registered with Library::RegisterFuncDerv and how
+// many of them HessianPattern finds nonzero, summed over every kernel registered so far
+struct HessianStats {
+    int64_t entries = 0;
+    int64_t nonZeros = 0;
+};
+
+HessianStats GetHessianStats();
+
 void Emit(const std::shared_ptr<Function> &func, std::ostream &os);
 
+// Asks for a batched entry <name>_derv_batch next to the derivative kernel of a function. It
+// takes the number of paths _count_ first and evaluates all of them in one call, vectorized
+// over the paths. Every input but _sharedInputs_ and every output is a structure of arrays:
+// element i of input x of path p is x[i * count + p], gradient element i is
+// grad[i * count + p] and Hessian element (j, i) is hess[(j * dim + i) * count + p]. The
+// batched entry is C even when the kernel is ISPC.
+struct BatchSignature {
+    std::vector<std::string> sharedInputs;
+};
+
+// Emits the gradient and the dense dim * dim Hessian of _dep_ with respect to _wrt_. The
+// Hessians of the path functions are structurally dense, GetHessianStats finds every entry
+// nonzero, so there is no band or sparsity to exploit.
+// With _batch_, the C source of the batched entry described by BatchSignature is written to
+// _batchOs_.
 void EmitGradHessian(const std::shared_ptr<Function> &func,
                      const ExpressionCPtrVec &wrt,
                      const ExpressionCPtr &dep,
                      std::ostream &os,
-                     const bool emitIspc);
+                     const bool emitIspc,
+                     const BatchSignature *batch = nullptr,
+                     std::ostream *batchOs = nullptr);
 
 inline std::string GetDervName(const std::string &name) {
     return name + "_derv";
 }
 
+inline std::string GetBatchName(const std::string &name) {
+    return GetDervName(name) + "_batch";
+}
+
 typedef void *lib_t;
 
+// A function or derivative kernel recorded as a flat instruction stream over a register file,
+// evaluated in-process instead of by compiled code. Every register holds one lane per
+// derivative direction, so the Hessian kernel evaluates all directions of the wrapper loop of
+// EmitGradHessian in one pass; if a branch condition differs between lanes the lanes are
+// evaluated one by one.
+class Tape {
+    public:
+    // Mirror Emit, EmitGradHessian and EmitGrad2. Like the emitters, the derivative recorders
+    // modify _func_, so a function can only be recorded or emitted once.
+    static std::shared_ptr<Tape> Record(const std::shared_ptr<Function> &func);
+    static std::shared_ptr<Tape> RecordGradHessian(const std::shared_ptr<Function> &func,
+                                                   const ExpressionCPtrVec &wrt,
+                                                   const ExpressionCPtr &dep);
+    static std::shared_ptr<Tape> RecordGrad(const std::shared_ptr<Function> &func,
+                                            const ExpressionCPtrVec &wrt,
+                                            const ExpressionCPtr &dep);
+
+    // _args_ are the pointer arguments of the emitted C function, inputs first
+    void Run(float *const *args) const;
+    int NumArgs() const {
+        return int(m_ArgSlots.size() + m_OutSlots.size());
+    }
+    int NumInstructions() const {
+        return m_NumInstructions;
+    }
+
+    private:
+    friend class TapeRecorder;
+    enum class Kind { Function, GradHessian, Grad };
+
+    void Init(float *regs, const int width, const int firstLane, float *const *args) const;
+    // Returns false if the lanes diverge at a branch
+    template <int Width>
+    bool Execute(float *regs, const int runtimeWidth) const;
+
+    Kind m_Kind = Kind::Function;
+    int m_Width = 1;
+    int m_NumSlots = 0;
+    int m_NumInstructions = 0;
+    std::vector<int32_t> m_Code;
+    std::vector<std::pair<int, float>> m_Constants;
+    // Register of every element of every input argument, -1 if the element is never read
+    std::vector<std::vector<int>> m_ArgSlots;
+    // Registers of the derivative direction _d_ of the Hessian kernel
+    std::vector<int> m_DirSlots;
+    // Adjoint registers, they start at zero
+    std::vector<int> m_AccSlots;
+    // Register of every element of every output argument, -1 for a zero output. The Hessian
+    // kernel has the tangent as its only gradient element and the adjoints of _wrt_ as the
+    // Hessian row, which are scattered to grad[lane] and hess[lane * dim + i].
+    std::vector<std::vector<int>> m_OutSlots;
+};
+
+// A library either links all registered functions into _path/name.so_, or, with the Cached
+// backend, compiles every function into its own shared object under the cache directory
+// _path_. Cached objects are named after a hash of the generated source and the compiler
+// flags, so a function is only compiled once no matter which run or configuration asks for it.
+// The Interpreted backend needs no compiler at all, it records every function into a Tape and
+// hands out entry points that evaluate it.
 class Library {
     public:
-    Library(const std::string &path, const std::string &name);
+    enum class Backend { Linked, Cached, Interpreted };
+
+    Library(const std::string &path,
+            const std::string &name,
+            const Backend backend = Backend::Linked);
     virtual ~Library();
+    // Loads the cached object that this build compiled for the function _name_ on this host
+    // with the current code generation settings, without generating the function again.
+    // Returns false if there is none.
+    bool LoadCached(const std::string &name);
     void RegisterFunc(const std::shared_ptr<Function> func);
+    // The Interpreted backend ignores _batch_, it has no batched entries
     void RegisterFuncDerv(const std::shared_ptr<Function> func,
                           const ExpressionCPtrVec &wrt,
                           const ExpressionCPtr &dep,
-                          const bool emitIspc = true);
+                          const bool emitIspc = true,
+                          const BatchSignature *batch = nullptr);
     void RegisterFunc2(const std::shared_ptr<Function> func);
     void RegisterFuncDerv2(const std::shared_ptr<Function> func,
                            const ExpressionCPtrVec &wrt,
                            const ExpressionCPtr &dep,
-                           const bool emitIspc = true);
+                           const bool emitIspc = true,
+                           const BatchSignature *batch = nullptr);
     inline bool IsLinked() const {
         return m_Linked;
     }
     void Link();
     void *GetFunc(const std::string &name) const;
     void *GetFuncDerv(const std::string &name) const;
+    // The batched derivative entry of _name_, nullptr if it was registered without one
+    void *GetFuncDervBatch(const std::string &name) const;
+    // The Interpreted backend has a fixed number of entry points for every number of
+    // arguments, shared by all libraries. Returns how many are left for _numArgs_.
+    static int FreeTapeSlots(const int numArgs);
 
     private:
+    // An object of the cache that is built on the next Link()
+    struct PendingObject {
+        std::string name;
+        std::string objFilename;
+        std::string tmpBase;
+        std::string sourceFilepath;
+        std::string cmd;
+    };
+
+    void CompileCached(const std::string &name,
+                       const std::string &source,
+                       const bool ispc,
+                       const std::string &flags);
+    void CompilePending();
+    // Builds the batched entry of _name_ into the linked library, on Link() if _deferred_
+    void CompileBatchEntry(const std::string &name,
+                           const std::string &source,
+                           const bool deferred);
+    void LoadObject(const std::string &name, const std::string &objFilename);
+    std::string IndexPath(const std::string &name) const;
+    void RegisterTape(const std::string &name, const std::shared_ptr<Tape> &tape);
+
     std::string m_Path;
     std::string m_Name;
     std::vector<std::string> m_Funcs;
     std::vector<std::string> m_MakeLines;
     lib_t m_Handle;
     bool m_Linked;
+    Backend m_Backend;
+    std::unordered_map<std::string, lib_t> m_FuncHandles;
+    std::vector<PendingObject> m_PendingObjects;
+    std::unordered_map<std::string, void *> m_TapeEntries;
+    // Number of arguments and slot of every tape of the Interpreted backend
+    std::vector<std::pair<int, int>> m_TapeSlots;
 };
 
 }  // namespace chad
@@ -0,0 +1,192 @@
+#include "checkpoint.h"
+#include "scene.h"
+
+#include <cstdio>
+#include <fstream>
+
+static const char c_Magic[8] = {'D', 'P', 'T', 'C', 'K', 'P', 'T', '7'};
+
+CheckpointWriter::CheckpointWriter(const Scene *scene) {
+    for (int i = 0; i < int(scene->objects.size()); i++) {
+        shapeIds[scene->objects[i].get()] = i;
+    }
+    for (int i = 0; i < int(scene->lights.size()); i++) {
+        lightIds[scene->lights[i].get()] = i;
+    }
+}
+
+void CheckpointWriter::Write(const Vector &value) {
+    Write(uint64_t(value.size()));
+    WriteBytes(value.data(), sizeof(Float) * value.size());
+}
+
+void CheckpointWriter::Write(const SubpathContrib &spContrib) {
+    Write(spContrib.camDepth);
+    Write(spContrib.lightDepth);
+    Write(spContrib.screenPos);
+    Write(spContrib.contrib);
+    Write(spContrib.lsScore);
+    Write(spContrib.ssScore);
+    Write(spContrib.lensScore);
+    Write(spContrib.misWeight);
+}
+
+void CheckpointWriter::Write(const ShapeInst &shapeInst) {
+    Write(shapeInst.obj != nullptr ? shapeIds.at(shapeInst.obj) : -1);
+    Write(shapeInst.primID);
+    Write(shapeInst.st);
+}
+
+void CheckpointWriter::Write(const LightInst &lightInst) {
+    Write(lightInst.light != nullptr ? lightIds.at(lightInst.light) : -1);
+    Write(lightInst.lPrimID);
+}
+
+void CheckpointWriter::Write(const SurfaceVertex &vertex) {
+    Write(vertex.shapeInst);
+    Write(vertex.bsdfRndParam);
+    Write(vertex.bsdfDiscrete);
+    Write(vertex.useAbsoluteParam);
+    Write(vertex.directLightInst);
+    Write(vertex.directLightRndParam);
+    Write(vertex.rrWeight);
+}
+
+void CheckpointWriter::Write(const Path &path) {
+    Write(path.time);
+    Write(path.camVertex.screenPos);
+    Write(path.camSurfaceVertex);
+    Write(path.lgtVertex.rndParamPos);
+    Write(path.lgtVertex.rndParamDir);
+    Write(path.lgtVertex.lightInst);
+    Write(path.lgtSurfaceVertex);
+    Write(path.envLightInst);
+    Write(path.lensVertexPos);
+    Write(path.isSubpath);
+    Write(path.camDepth);
+    Write(path.lgtDepth);
+}
+
+void CheckpointWriter::Write(const Gaussian &gaussian) {
+    Write(gaussian.dim);
+    Write(gaussian.covL);
+    Write(gaussian.invCov);
+    Write(gaussian.mean);
+    Write(gaussian.logDet);
+    Write(gaussian.isDiagonal);
+    Write(gaussian.covL_d);
+    Write(gaussian.invCov_d);
+}
+
+CheckpointReader::CheckpointReader(const Scene *scene, const char *bytes, const size_t size)
+    : scene(scene), pos(bytes), end(bytes + size) {
+}
+
+void CheckpointReader::Read(Vector &value) {
+    uint64_t size;
+    Read(size);
+    if (size > uint64_t(end - pos) / sizeof(Float)) {
+        Error("Checkpoint is truncated");
+    }
+    value.resize(size);
+    ReadBytes(value.data(), sizeof(Float) * size);
+}
+
+void CheckpointReader::Read(SubpathContrib &spContrib) {
+    Read(spContrib.camDepth);
+    Read(spContrib.lightDepth);
+    Read(spContrib.screenPos);
+    Read(spContrib.contrib);
+    Read(spContrib.lsScore);
+    Read(spContrib.ssScore);
+    Read(spContrib.lensScore);
+    Read(spContrib.misWeight);
+}
+
+void CheckpointReader::Read(ShapeInst &shapeInst) {
+    int id;
+    Read(id);
+    if (id >= int(scene->objects.size())) {
+        Error("Checkpoint does not match the scene");
+    }
+    shapeInst.obj = id >= 0 ? scene->objects[id].get() : nullptr;
+    Read(shapeInst.primID);
+    Read(shapeInst.st);
+}
+
+void CheckpointReader::Read(LightInst &lightInst) {
+    int id;
+    Read(id);
+    if (id >= int(scene->lights.size())) {
+        Error("Checkpoint does not match the scene");
+    }
+    lightInst.light = id >= 0 ? scene->lights[id].get() : nullptr;
+    Read(lightInst.lPrimID);
+}
+
+void CheckpointReader::Read(SurfaceVertex &vertex) {
+    Read(vertex.shapeInst);
+    Read(vertex.bsdfRndParam);
+    Read(vertex.bsdfDiscrete);
+    Read(vertex.useAbsoluteParam);
+    Read(vertex.directLightInst);
+    Read(vertex.directLightRndParam);
+    Read(vertex.rrWeight);
+}
+
+void CheckpointReader::Read(Path &path) {
+    Read(path.time);
+    Read(path.camVertex.screenPos);
+    Read(path.camSurfaceVertex);
+    Read(path.lgtVertex.rndParamPos);
+    Read(path.lgtVertex.rndParamDir);
+    Read(path.lgtVertex.lightInst);
+    Read(path.lgtSurfaceVertex);
+    Read(path.envLightInst);
+    Read(path.lensVertexPos);
+    Read(path.isSubpath);
+    Read(path.camDepth);
+    Read(path.lgtDepth);
+}
+
+void CheckpointReader::Read(Gaussian &gaussian) {
+    Read(gaussian.dim);
+    Read(gaussian.covL);
+    Read(gaussian.invCov);
+    Read(gaussian.mean);
+    Read(gaussian.logDet);
+    Read(gaussian.isDiagonal);
+    Read(gaussian.covL_d);
+    Read(gaussian.invCov_d);
+}
+
+void WriteCheckpointFile(const std::string &filename, const std::vector<char> &data) {
+    const std::string tmpFilename = filename + ".tmp";
+    {
+        std::ofstream ofs(tmpFilename, std::ios::binary);
+        ofs.write(c_Magic, sizeof(c_Magic));
+        ofs.write(data.data(), data.size());
+        if (!ofs) {
+            Error("Failed to write " + tmpFilename);
+        }
+    }
+    if (std::rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+        Error("Failed to replace " + filename);
+    }
+}
+
+std::vector<char> ReadCheckpointFile(const std::string &filename) {
+    std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+    if (!ifs) {
+        Error("Cannot open checkpoint " + filename);
+    }
+    std::vector<char> data(size_t(ifs.tellg()));
+    ifs.seekg(0);
+    ifs.read(data.data(), data.size());
+    if (!ifs || data.size() < sizeof(c_Magic) ||
+        std::memcmp(data.data(), c_Magic, sizeof(c_Magic)) != 0) {
+        Error(filename + " is not a checkpoint");
+    }
+    data.erase(data.begin(), data.begin() + sizeof(c_Magic));
+    return data;
+}
@@ -0,0 +1,200 @@
+#pragma once
+
+#include "commondef.h"
+#include "path.h"
+#include "gaussian.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Binary checkpoints of a render. Values are written as their bytes, so a checkpoint is only
+// read back by the same build on the same machine, and the scene pointers of the paths are
+// written as indices into the scene that is loaded again on resume.
+class CheckpointWriter {
+    public:
+    explicit CheckpointWriter(const Scene *scene);
+
+    template <typename T>
+    void Write(const T &value) {
+        static_assert(std::is_trivially_copyable<T>::value, "written as bytes");
+        WriteBytes(&value, sizeof(T));
+    }
+    template <typename T, int R, int C, int O, int MR, int MC>
+    void Write(const Eigen::Matrix<T, R, C, O, MR, MC> &value) {
+        static_assert(R != Eigen::Dynamic && C != Eigen::Dynamic, "fixed size only");
+        WriteBytes(value.data(), sizeof(T) * R * C);
+    }
+    template <typename T, typename Alloc>
+    void Write(const std::vector<T, Alloc> &values) {
+        Write(uint64_t(values.size()));
+        if constexpr (std::is_trivially_copyable<T>::value) {
+            WriteBytes(values.data(), sizeof(T) * values.size());
+        } else {
+            for (const T &value : values) {
+                Write(value);
+            }
+        }
+    }
+    void Write(const Vector &value);
+    void Write(const SubpathContrib &spContrib);
+    void Write(const ShapeInst &shapeInst);
+    void Write(const LightInst &lightInst);
+    void Write(const SurfaceVertex &vertex);
+    void Write(const Path &path);
+    void Write(const Gaussian &gaussian);
+
+    // The values written between BeginBlock and EndBlock are read back as one
+    // std::vector<char>, which can be handed to a reader of its own later
+    size_t BeginBlock() {
+        Write(uint64_t(0));
+        return data.size();
+    }
+    void EndBlock(const size_t begin) {
+        const uint64_t size = data.size() - begin;
+        std::memcpy(&data[begin - sizeof(uint64_t)], &size, sizeof(uint64_t));
+    }
+
+    const std::vector<char> &GetData() const {
+        return data;
+    }
+
+    private:
+    void WriteBytes(const void *bytes, const size_t size) {
+        const char *begin = reinterpret_cast<const char *>(bytes);
+        data.insert(data.end(), begin, begin + size);
+    }
+
+    std::unordered_map<const Shape *, int> shapeIds;
+    std::unordered_map<const Light *, int> lightIds;
+    std::vector<char> data;
+};
+
+class CheckpointReader {
+    public:
+    // Reads _size_ bytes at _bytes_, which have to stay alive while the reader is used
+    CheckpointReader(const Scene *scene, const char *bytes, const size_t size);
+
+    template <typename T>
+    void Read(T &value) {
+        static_assert(std::is_trivially_copyable<T>::value, "read as bytes");
+        ReadBytes(&value, sizeof(T));
+    }
+    template <typename T, int R, int C, int O, int MR, int MC>
+    void Read(Eigen::Matrix<T, R, C, O, MR, MC> &value) {
+        static_assert(R != Eigen::Dynamic && C != Eigen::Dynamic, "fixed size only");
+        ReadBytes(value.data(), sizeof(T) * R * C);
+    }
+    template <typename T, typename Alloc>
+    void Read(std::vector<T, Alloc> &values) {
+        uint64_t size;
+        Read(size);
+        if (size > uint64_t(end - pos)) {
+            Error("Checkpoint is truncated");
+        }
+        values.resize(size);
+        if constexpr (std::is_trivially_copyable<T>::value) {
+            ReadBytes(values.data(), sizeof(T) * values.size());
+        } else {
+            for (T &value : values) {
+                Read(value);
+            }
+        }
+    }
+    void Read(Vector &value);
+    void Read(SubpathContrib &spContrib);
+    void Read(ShapeInst &shapeInst);
+    void Read(LightInst &lightInst);
+    void Read(SurfaceVertex &vertex);
+    void Read(Path &path);
+    void Read(Gaussian &gaussian);
+
+    bool AtEnd() const {
+        return pos == end;
+    }
+
+    private:
+    void ReadBytes(void *bytes, const size_t size) {
+        if (size > size_t(end - pos)) {
+            Error("Checkpoint is truncated");
+        }
+        std::memcpy(bytes, pos, size);
+        pos += size;
+    }
+
+    const Scene *scene;
+    const char *pos;
+    const char *end;
+};
+
+// Writes to a temporary file that replaces _filename_ once it is complete, so that a run
+// killed while writing still leaves the previous checkpoint
+void WriteCheckpointFile(const std::string &filename, const std::vector<char> &data);
+std::vector<char> ReadCheckpointFile(const std::string &filename);
+
+// Stops the threads of a ParallelFor where their work items are consistent, so that a
+// checkpoint can copy them. A thread brackets every work item with Enter and Leave, and
+// between the steps of an item calls Park once Requested is set. Capture waits until every
+// thread inside an item is parked, runs the capture and lets them go on.
+class CheckpointBarrier {
+    public:
+    void Enter() {
+        std::lock_guard<std::mutex> lock(mutex);
+        active++;
+    }
+    void Leave() {
+        std::lock_guard<std::mutex> lock(mutex);
+        active--;
+        parkedCondition.notify_one();
+    }
+    bool Requested() const {
+        return requested.load(std::memory_order_relaxed);
+    }
+    void Park() {
+        std::unique_lock<std::mutex> lock(mutex);
+        // The capture may have run without this thread, if it had not entered yet
+        if (!requested.load(std::memory_order_relaxed)) {
+            return;
+        }
+        const uint64_t parkedGeneration = generation;
+        parked++;
+        parkedCondition.notify_one();
+        resumeCondition.wait(lock, [&]() { return generation != parkedGeneration; });
+        parked--;
+        parkedCondition.notify_one();
+    }
+    template <typename Func>
+    void Capture(Func &&capture) {
+        std::unique_lock<std::mutex> lock(mutex);
+        // The threads of the last capture have to be gone first, they still count as parked
+        parkedCondition.wait(lock, [&]() { return parked == 0; });
+        requested.store(true, std::memory_order_relaxed);
+        parkedCondition.wait(lock, [&]() { return parked == active; });
+        auto resume = [&]() {
+            requested.store(false, std::memory_order_relaxed);
+            generation++;
+            resumeCondition.notify_all();
+        };
+        try {
+            capture();
+        } catch (...) {
+            resume();
+            throw;
+        }
+        resume();
+    }
+
+    private:
+    std::mutex mutex;
+    std::condition_variable parkedCondition;
+    std::condition_variable resumeCondition;
+    std::atomic<bool> requested{false};
+    int active = 0;
+    int parked = 0;
+    uint64_t generation = 0;
+};
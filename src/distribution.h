@@ -8,9 +8,12 @@
 struct PiecewiseConstant1D {
     PiecewiseConstant1D(const Float *f, int n) {
         count = n;
-        func = new Float[n];
+        Float *func = new Float[n];
         memcpy(func, f, n * sizeof(Float));
-        cdf = new Float[n + 1];
+        Float *cdf = new Float[n + 1];
+        this->func = func;
+        this->cdf = cdf;
+        owned = true;
         cdf[0] = 0.;
         for (int i = 1; i < count + 1; ++i)
             cdf[i] = cdf[i - 1] + func[i - 1] / n;
@@ -24,12 +27,18 @@ struct PiecewiseConstant1D {
                 cdf[i] /= funcInt;
         }
     }
+    // Uses the _func_ and _cdf_ of a distribution built before, which outlive it
+    PiecewiseConstant1D(const Float *func, const Float *cdf, Float funcInt, int n)
+        : func(func), cdf(cdf), funcInt(funcInt), count(n), owned(false) {
+    }
     ~PiecewiseConstant1D() {
-        delete[] func;
-        delete[] cdf;
+        if (owned) {
+            delete[] func;
+            delete[] cdf;
+        }
     }
     Float SampleContinuous(const Float u, Float *pdf, int *off = nullptr) const {
-        Float *ptr = std::upper_bound(cdf, cdf + count + 1, u);
+        const Float *ptr = std::upper_bound(cdf, cdf + count + 1, u);
         int offset = Clamp(int(ptr - cdf - 1), 0, count - 1);
         if (off)
             *off = offset;
@@ -42,7 +51,7 @@ struct PiecewiseConstant1D {
         return (offset + du) / count;
     }
     int SampleDiscrete(const Float u, Float *pdf) const {
-        Float *ptr = std::upper_bound(cdf, cdf + count + 1, u);
+        const Float *ptr = std::upper_bound(cdf, cdf + count + 1, u);
         int offset = Clamp(int(ptr - cdf - 1), 0, count - 1);
         if (pdf != nullptr)
             *pdf = func[offset] / (funcInt * count);
@@ -57,7 +66,8 @@ struct PiecewiseConstant1D {
         return funcInt * count;
     }
 
-    Float *func, *cdf;
+    const Float *func, *cdf;
     Float funcInt;
     int count;
+    bool owned;
 };
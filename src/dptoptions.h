@@ -4,6 +4,7 @@
 #include <filesystem>
 
 #include <string>
+#include <cstdlib>
 
 namespace fs = std::filesystem;
 
@@ -12,6 +13,8 @@ struct DptOptions {
     bool bidirectional = true;
     int spp = 256;
     int numInitSamples = 300000;
+    int initPathBatch = 0;                           // Bidirectional bootstrap paths whose scene queries are batched, 0 for one by one
+    int chainBatch = 1;                              // Chains whose small step derivatives are evaluated together, 1 for one by one
     int minDepth = -1;
     int maxDepth = 8;
     int directSpp = 256;
@@ -25,11 +28,20 @@ struct DptOptions {
     Float malaGN = Float(100.0);                     // MALA truncated gradient magnitude
     Float malaStepsize = Float(0.005);               // MALA stepsize
     Float malaStdDev = Float(0.005);                 // MALA shrink prior to prevent noisy gradient issue
+    bool malaDifferentiateUncached = false;          // MALA differentiates where a ready cache has no record nearby, instead of an isotropic step
     bool sampleFromGlobalCache = false;              // Sampling from the cache for global jumps
+    std::string cacheIndex = "kdtree";               // Neighbour search of the cache lookups: kdtree, or rpforest (approximate, experimental)
+    int cacheIndexTrees = 2;                         // Trees of the rpforest, more find more neighbours but take longer
 
     int numChains = 128;
     int seedOffset = 0;
     int reportIntervalSpp = 0;
+    bool threadLocalSplat = true;                    // MLT splats into per-thread tiles
+    bool incrementalPerturb = false;                 // Small steps reuse the scene queries of rays that did not change
+    Float checkpointInterval = Float(0.0);           // Seconds between the MLT checkpoints, 0 for none
+    bool resume = false;                             // MLT continues from its checkpoint (--resume)
+    int64_t checkpointStep = 0;                      // MLT writes its checkpoint and stops before this step of the chains (--checkpoint-at), 0 to run through
+    bool requireNoAllocations = false;               // MLT fails if its chains allocate after warm-up, needs DPT_COUNT_ALLOCATIONS (--require-no-allocations)
     Float discreteStdDev = Float(0.01);
     Float uniformMixingProbability = Float(0.1);      
     bool useLightCoordinateSampling = false;         // turned off by default 
@@ -48,3 +60,22 @@ inline std::string GetLibPath() {
     // return std::string(getenv("DPT_LIBPATH"));
     return fs::current_path();
 }
+
+// Shared cache of the compiled path functions: $DPT_CACHE_DIR, otherwise the user cache
+// directory. Resolved once, since dpt changes into the directory of every scene it renders.
+inline std::string GetPathFuncCacheDir() {
+    static const std::string dir = []() {
+        fs::path path;
+        if (const char *env = getenv("DPT_CACHE_DIR")) {
+            path = env;
+        } else if (const char *env = getenv("XDG_CACHE_HOME")) {
+            path = fs::path(env) / "dpt";
+        } else if (const char *env = getenv("HOME")) {
+            path = fs::path(env) / ".cache" / "dpt";
+        } else {
+            path = fs::current_path() / ".dptcache";
+        }
+        return fs::absolute(path).string();
+    }();
+    return dir;
+}
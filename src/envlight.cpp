@@ -4,6 +4,7 @@
 #include "distribution.h"
 #include "transform.h"
 #include "sampling.h"
+#include "scenecache.h"
 
 int GetEnvLightSerializedSize() {
     return 1 +      // type
@@ -21,7 +22,7 @@ int GetEnvLightSerializedSize() {
            1;       // normalization
 }
 
-std::unique_ptr<const EnvmapSampleInfo> CreateEnvmapSampleInfo(const Image3 *image) {
+std::shared_ptr<const EnvmapSampleInfo> CreateEnvmapSampleInfo(const Image3 *image) {
     int height = image->pixelHeight;
     int width = image->pixelWidth;
     size_t nEntries = (size_t)(width + 1) * (size_t)height;
@@ -66,18 +67,40 @@ std::unique_ptr<const EnvmapSampleInfo> CreateEnvmapSampleInfo(const Image3 *ima
 
     Vector2 pixelSize = Vector2(c_TWOPI / width, M_PI / height);
 
-    return std::unique_ptr<const EnvmapSampleInfo>(
-        new EnvmapSampleInfo{cdfRows, cdfCols, rowWeights, normalization, pixelSize});
+    std::shared_ptr<EnvmapSampleInfo> sampleInfo = std::make_shared<EnvmapSampleInfo>();
+    sampleInfo->cdfRows.assign(cdfRows.data(), cdfRows.data() + cdfRows.size());
+    sampleInfo->cdfCols.assign(cdfCols.data(), cdfCols.data() + cdfCols.size());
+    sampleInfo->rowWeights.assign(rowWeights.data(), rowWeights.data() + rowWeights.size());
+    sampleInfo->normalization = normalization;
+    sampleInfo->pixelSize = pixelSize;
+    return sampleInfo;
+}
+
+static std::shared_ptr<const EnvmapSampleInfo> LoadEnvmapSampleInfo(const Image3 *image,
+                                                                    const std::string &filename,
+                                                                    SceneCache *cache) {
+    if (cache == nullptr) {
+        return CreateEnvmapSampleInfo(image);
+    }
+    std::shared_ptr<const EnvmapSampleInfo> sampleInfo = cache->GetEnvmap(
+        EnvmapCacheKey(filename), [&]() { return CreateEnvmapSampleInfo(image); });
+    if (sampleInfo->cdfRows.size() != size_t(image->pixelHeight) + 1 ||
+        sampleInfo->cdfCols.size() != size_t(image->pixelWidth + 1) * size_t(image->pixelHeight) ||
+        sampleInfo->rowWeights.size() != size_t(image->pixelHeight)) {
+        Error("Scene cache does not match the envmap " + filename + ", delete it to load the scene");
+    }
+    return sampleInfo;
 }
 
 EnvLight::EnvLight(const Float &samplingWeight,
                    const AnimatedTransform &toWorld,
-                   const std::string &filename)
+                   const std::string &filename,
+                   SceneCache *cache)
     : Light(samplingWeight),
       toWorld(toWorld),
       toLight(Invert(toWorld)),
       image(new Image3(filename)),
-      sampleInfo(CreateEnvmapSampleInfo(image.get())) {
+      sampleInfo(LoadEnvmapSampleInfo(image.get(), filename, cache)) {
 }
 
 void EnvLight::Serialize(const LightPrimID &lPrimID, const Vector2 &rndDir, Float *buffer) const {
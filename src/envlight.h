@@ -2,24 +2,30 @@
 
 #include "light.h"
 #include "animatedtransform.h"
+#include "mappedarray.h"
 
 struct Image3;
 struct PiecewiseConstant2D;
+class SceneCache;
 
 int GetEnvLightSerializedSize();
 
 struct EnvmapSampleInfo {
-    std::vector<Float> cdfRows;
-    std::vector<Float> cdfCols;
-    std::vector<Float> rowWeights;
+    MappedArray<Float> cdfRows;
+    MappedArray<Float> cdfCols;
+    MappedArray<Float> rowWeights;
     Float normalization;
     Vector2 pixelSize;
+    // Keeps the memory of the arrays that are views alive
+    std::shared_ptr<const void> storage;
 };
 
 struct EnvLight : public Light {
+    // The sampling distribution of the envmap is taken from _cache_ when it has one
     EnvLight(const Float &samplingWeight,
              const AnimatedTransform &toWorld,
-             const std::string &filename);
+             const std::string &filename,
+             SceneCache *cache = nullptr);
 
     LightType GetType() const override {
         return LightType::EnvLight;
@@ -65,7 +71,7 @@ struct EnvLight : public Light {
     const AnimatedTransform toWorld;
     const AnimatedTransform toLight;
     const std::unique_ptr<const Image3> image;
-    const std::unique_ptr<const EnvmapSampleInfo> sampleInfo;
+    const std::shared_ptr<const EnvmapSampleInfo> sampleInfo;
 };
 
 void SampleDirectEnvLight(const ADFloat *buffer,
@@ -2,55 +2,72 @@
 #include "fastmath.h"
 
 void IsotropicGaussian(const int dim, const Float sigma, Gaussian &gaussian) {
-    auto vsigma = Vector::Constant(dim, sigma);
-    auto invSigmaSq = vsigma.cwiseProduct(vsigma).cwiseInverse();
+    const Float invSigmaSq = Float(1.0) / (sigma * sigma);
     gaussian.isDiagonal = false; 
-    if (gaussian.mean.size() != dim) {
-        gaussian.mean = Vector::Zero(dim);
-        gaussian.covL_d = Vector::Constant(dim, sigma);
-        gaussian.invCov_d = Vector::Constant(dim, Float(1.0) / (sigma * sigma));
-    } else {
-        for (int i = 0; i < dim; i++) {
-            gaussian.mean[i] = Float(0.0);
-            gaussian.covL_d[i] = sigma;
-            gaussian.invCov_d[i] = Float(1.0) / (sigma * sigma);
-        }   
-    } 
-    gaussian.covL = vsigma.asDiagonal();
-    gaussian.invCov = invSigmaSq.asDiagonal();
-    gaussian.logDet = dim * fastlog(invSigmaSq[0]);
+    Resize(gaussian, dim);
+    std::fill(gaussian.mean.begin(), gaussian.mean.end(), Float(0.0));
+    std::fill(gaussian.covL_d.begin(), gaussian.covL_d.end(), sigma);
+    std::fill(gaussian.invCov_d.begin(), gaussian.invCov_d.end(), invSigmaSq);
+    std::fill(gaussian.covL.begin(), gaussian.covL.end(), Float(0.0));
+    std::fill(gaussian.invCov.begin(), gaussian.invCov.end(), Float(0.0));
+    for (int i = 0; i < dim; i++) {
+        gaussian.covL[i * dim + i] = sigma;
+        gaussian.invCov[i * dim + i] = invSigmaSq;
+    }
+    gaussian.logDet = dim * fastlog(invSigmaSq);
 }
 
-Float GaussianLogPdf(const Vector &offset, const Gaussian &gaussian) {
-    assert(gaussian.mean.size() == offset.size());
-    auto d = offset - gaussian.mean;
-    Float logPdf = gaussian.mean.size() * (-Float(0.9189385332046727)); // = (-Float(0.5) * log(Float(2.0 * M_PI)));
-    logPdf += Float(0.5) * gaussian.logDet;
-    if (!gaussian.isDiagonal) {
-        logPdf -= Float(0.5) * (d.transpose() * (gaussian.invCov * d))[0];
-    } else {
-        assert(gaussian.invCov_d.size() == offset.size());
-        logPdf -= Float(0.5) * d.dot(gaussian.invCov_d.cwiseProduct(d));
+template <int dim>
+struct LogPdfKernel {
+    static Float Run(const int n, const Vector &offset, const Gaussian &gaussian) {
+        using FixedVector = Eigen::Matrix<Float, dim, 1>;
+        using FixedMatrix = Eigen::Matrix<Float, dim, dim>;
+        const FixedVector d = Eigen::Map<const FixedVector>(offset.data(), n) -
+                              Eigen::Map<const FixedVector>(gaussian.mean.data(), n);
+        Float logPdf = n * (-Float(0.9189385332046727)); // = (-Float(0.5) * log(Float(2.0 * M_PI)));
+        logPdf += Float(0.5) * gaussian.logDet;
+        if (!gaussian.isDiagonal) {
+            logPdf -= Float(0.5) *
+                      d.dot(Eigen::Map<const FixedMatrix>(gaussian.invCov.data(), n, n) * d);
+        } else {
+            logPdf -= Float(0.5) *
+                      d.dot(Eigen::Map<const FixedVector>(gaussian.invCov_d.data(), n).cwiseProduct(d));
+        }
+        return logPdf;
     }
-    return logPdf;
+};
+
+Float GaussianLogPdf(const int dim, const Vector &offset, const Gaussian &gaussian) {
+    assert(GetDimension(gaussian) == dim);
+    assert(offset.size() >= dim);
+    return DimDispatch<LogPdfKernel>::Get(dim)(dim, offset, gaussian);
 }
 
-void GenerateSample(Gaussian &gaussian, Vector &x, RNG &rng) {
-    if (gaussian.mean.size() != x.size()) {
-        std::cerr << "gaussian.mean.size():" << gaussian.mean.size() << std::endl;
-        std::cerr << "x.size():" << x.size() << std::endl;
-    }
-    assert(gaussian.mean.size() == x.size());
-    std::normal_distribution<Float> normDist(Float(0.0), Float(1.0));
-    for (int i = 0; i < x.size(); i++) {
-        x[i] = normDist(rng);
-    }
+template <int dim>
+struct SampleKernel {
+    static void Run(const int n, Gaussian &gaussian, Vector &x, RNG &rng) {
+        using FixedVector = Eigen::Matrix<Float, dim, 1>;
+        using FixedMatrix = Eigen::Matrix<Float, dim, dim>;
+        std::normal_distribution<Float> normDist(Float(0.0), Float(1.0));
+        FixedVector z;
+        z.resize(n);
+        for (int i = 0; i < n; i++) {
+            z[i] = normDist(rng);
+        }
 
-    if (!gaussian.isDiagonal) {
-        x = gaussian.covL * x + gaussian.mean;
-    } else {
-        assert(gaussian.covL_d.size() == x.size());
-        x = gaussian.covL_d.cwiseProduct(x) + gaussian.mean;
+        Eigen::Map<FixedVector> ret(x.data(), n);
+        const Eigen::Map<const FixedVector> mean(gaussian.mean.data(), n);
+        if (!gaussian.isDiagonal) {
+            ret.noalias() = Eigen::Map<const FixedMatrix>(gaussian.covL.data(), n, n) * z;
+            ret += mean;
+        } else {
+            ret = Eigen::Map<const FixedVector>(gaussian.covL_d.data(), n).cwiseProduct(z) + mean;
+        }
     }
-}
+};
 
+void GenerateSample(const int dim, Gaussian &gaussian, Vector &x, RNG &rng) {
+    assert(GetDimension(gaussian) == dim);
+    assert(x.size() >= dim);
+    DimDispatch<SampleKernel>::Get(dim)(dim, gaussian, x, rng);
+}
@@ -2,27 +2,75 @@
 
 #include "commondef.h"
 #include <algorithm>
+#include <array>
+#include <utility>
 #include <vector>
 
 struct Chain; 
 
+// The matrices are stored column-major at the current dimension. The buffers only grow, so a
+// state that moves between path lengths stops allocating once it has seen the longest one.
 struct Gaussian {
-    Matrix covL;
-    Matrix invCov;
-    Vector mean;
+    int dim = 0;
+    AlignedStdVector covL;
+    AlignedStdVector invCov;
+    AlignedStdVector mean;
     Float logDet;
 
     // For MALA with diagonal preconditioning  
     bool isDiagonal = false; 
-    Vector covL_d;
-    Vector invCov_d;
+    AlignedStdVector covL_d;
+    AlignedStdVector invCov_d;
 };
 
 
 inline int GetDimension(const Gaussian &gaussian) {
-    return gaussian.mean.size();
+    return gaussian.dim;
 }
 
+// Sets the dimension of _gaussian_, the entries are left undefined
+inline void Resize(Gaussian &gaussian, const int dim) {
+    gaussian.dim = dim;
+    gaussian.covL.resize(dim * dim);
+    gaussian.invCov.resize(dim * dim);
+    gaussian.mean.resize(dim);
+    gaussian.covL_d.resize(dim);
+    gaussian.invCov_d.resize(dim);
+}
+
+inline void Reserve(Gaussian &gaussian, const int maxDim) {
+    gaussian.covL.reserve(maxDim * maxDim);
+    gaussian.invCov.reserve(maxDim * maxDim);
+    gaussian.mean.reserve(maxDim);
+    gaussian.covL_d.reserve(maxDim);
+    gaussian.invCov_d.reserve(maxDim);
+}
+
+// Dimensions up to c_MaxFixedDim, twice the vertices of a path of depth 12, get kernels with
+// fixed-size Eigen types that are unrolled and never allocate
+constexpr int c_MaxFixedDim = 24;
+
+// Kernel<dim>::Run of a dimension known at runtime, Kernel<Eigen::Dynamic>::Run for the
+// dimensions above _maxDim_
+template <template <int> class Kernel, int maxDim = c_MaxFixedDim>
+struct DimDispatch {
+    using Func = decltype(&Kernel<Eigen::Dynamic>::Run);
+
+    static Func Get(const int dim) {
+        static const std::array<Func, maxDim + 1> table =
+            MakeTable(std::make_integer_sequence<int, maxDim + 1>());
+        return dim >= 0 && dim <= maxDim ? table[dim] : &Kernel<Eigen::Dynamic>::Run;
+    }
+
+    private:
+    template <int... dims>
+    static std::array<Func, sizeof...(dims)> MakeTable(std::integer_sequence<int, dims...>) {
+        return {{&Kernel<dims >= 1 ? dims : Eigen::Dynamic>::Run...}};
+    }
+};
+
 void IsotropicGaussian(const int dim, const Float sigma, Gaussian &gaussian);
-Float GaussianLogPdf(const Vector &offset, const Gaussian &gaussian);
-void GenerateSample(Gaussian &gaussian, Vector &x, RNG &rng);
\ No newline at end of file
+// _dim_ has to be the dimension of _gaussian_. Only the first _dim_ entries of _offset_ and _x_
+// are used, so that the callers can keep one buffer for all path lengths
+Float GaussianLogPdf(const int dim, const Vector &offset, const Gaussian &gaussian);
+void GenerateSample(const int dim, Gaussian &gaussian, Vector &x, RNG &rng);
\ No newline at end of file
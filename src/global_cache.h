@@ -4,10 +4,27 @@
 #include "mala.h"
 #include "fastmath.h"
 #include <nanoflann.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <utility>
 
 #define PSS_MIN_LENGTH 2
 #define PSS_MAX_LENGTH 12
+#define PSS_CACHE_MAX_DIM 16 // the largest dimension that has a cache
 #define PSS_MAX_SIZE   3000 // 10000
+#define PSS_CHUNK_SIZE 64   // the records a thread gathers before it publishes them
+#define PSS_REBUILD_SIZE 750 // the new records that make a ready cache rebuild
+#define PSS_SAMPLER_BUILDS 4 // the snapshots that the large steps sample from, the last one stays
+#define PSS_REBUILD_INTERVAL 10 // milliseconds between the updates of the rebuild thread
 #define PSS_QUERY_DIST Float(0.01)
 #define PSS_REUSE_DIST Float(0.10)
 #define CACHE_SIG  Float(0.15)   
@@ -15,12 +32,58 @@
 
 using namespace nanoflann;
 
+// The subpath lengths of a cached path, all that the density of the cache looks at
+struct path_tag_t {
+    int camDepth;
+    int lightDepth;
+};
+
+// The blocks of the records of one tag in a cache, in [begin, end)
+struct tag_group_t {
+    path_tag_t tag;
+    int begin, end;
+};
+
+// A path of a snapshot without its surface vertices, which are kept in one array for every
+// path: first those of the camera subpath, then those of the light subpath
+struct cached_path_t {
+    Float time;
+    CameraVertex camVertex;
+    LightVertex lgtVertex;
+    LightInst envLightInst;
+    Vector3 lensVertexPos;
+    bool isSubpath;
+    int camDepth;
+    int lgtDepth;
+    int firstVertex, numCamVertices, numLgtVertices;
+};
+
+// Copies the state of _src_ into _dst_. The vertex caches of _dst_ are kept: they are not part
+// of the state of a path, and stay valid whatever path they are used with.
+inline void CopyPathState(const Path &src, Path &dst) {
+    dst.time = src.time;
+    dst.camVertex = src.camVertex;
+    dst.camSurfaceVertex.assign(src.camSurfaceVertex.begin(), src.camSurfaceVertex.end());
+    dst.lgtVertex = src.lgtVertex;
+    dst.lgtSurfaceVertex.assign(src.lgtSurfaceVertex.begin(), src.lgtSurfaceVertex.end());
+    dst.envLightInst = src.envLightInst;
+    dst.lensVertexPos = src.lensVertexPos;
+    dst.isSubpath = src.isSubpath;
+    dst.camDepth = src.camDepth;
+    dst.lgtDepth = src.lgtDepth;
+}
+
+// The records of one dimension. Points and their vectors are contiguous rows of _dim_ floats,
+// so that the kd-tree streams through them. The paths are only read when sampleCache picks
+// a record, they carry the discrete vertex data that the PSS does not.
 template <int dim>
 struct point_cloud_t {
-    std::vector<std::vector<Float>> data_pss, data_v1, data_v2;
-    std::vector<Path> data_path; 
+    using row_t = std::array<Float, dim>;
+    std::vector<row_t> data_pss, data_v1, data_v2;
+    std::vector<path_tag_t> data_tag;
     std::vector<Float> data_pathWeight;
-    std::vector<SubpathContrib> data_spContrib;
+    std::vector<cached_path_t> data_path;
+    std::vector<SurfaceVertex> data_vertices;
     inline size_t kdtree_get_point_count() const {
         return data_pss.size();
     }
@@ -31,88 +94,317 @@ struct point_cloud_t {
 	bool kdtree_get_bbox(BBOX &bb) const { return false; }
 };
 
+// The neighbour searches that the preconditioner lookups can go through
+enum class CacheIndex { KDTree, RPForest };
+
+// The random projection forest is experimental and off unless a scene sets cacheindex to
+// rpforest: it is only measured on the synthetic records of tests/bench_global_cache, not on
+// the acceptance rate of a scene. Two trees are the fewest that keep the recall above 0.9
+// there from dimension 4 up, while still looking up faster than the kd-tree.
+struct cache_index_config_t {
+    CacheIndex type = CacheIndex::KDTree;
+    int numTrees = 2;   // trees of the random projection forest
+};
+
+// What the caches of every dimension are set up with
+struct cache_setup_t {
+    int numThreads;
+    int maxDepth;   // the paths of the records are reserved for it, unbounded if negative
+    cache_index_config_t index;
+};
+
+// Finds up to _knn_ records closer than the squared distance _radius_ to a point
 template <int dim>
-struct global_cache_t {
+struct neighbour_index_t {
+    virtual ~neighbour_index_t() {}
+    virtual size_t radiusSearch(const Float *q,
+                                const Float radius,
+                                const int knn,
+                                std::vector<std::pair<size_t, Float>> &matches) const = 0;
+};
+
+// The exact search
+template <int dim>
+struct kdtree_index_t : public neighbour_index_t<dim> {
     typedef KDTreeSingleIndexAdaptor<
         L2_Simple_Adaptor<Float, point_cloud_t<dim>>, 
         point_cloud_t<dim>, 
         dim
     > KDTree;
+
+    explicit kdtree_index_t(const point_cloud_t<dim> &pts)
+        : tree(dim, pts, KDTreeSingleIndexAdaptorParams(10 /* max leaf */)) {
+        tree.buildIndex();
+    }
+
+    size_t radiusSearch(const Float *q,
+                        const Float radius,
+                        const int knn,
+                        std::vector<std::pair<size_t, Float>> &matches) const override {
+        SearchParams params; 
+        return tree.radiusSearch(q, radius, matches, params, knn);
+    }
+
+    KDTree tree;
+};
+
+// An approximate search over a forest of random projection trees. Every tree splits its
+// records at the median of their projections on random directions, a query only visits
+// the leaf it falls into in each tree, so more trees find more of the neighbours.
+template <int dim>
+struct rp_forest_index_t : public neighbour_index_t<dim> {
+    using row_t = typename point_cloud_t<dim>::row_t;
+
+    rp_forest_index_t(const point_cloud_t<dim> &pts, const int numTrees) : pts(pts) {
+        RNG rng(dim);
+        const int n = int(pts.data_pss.size());
+        std::vector<int> order(n);
+        for (int tree = 0; tree < numTrees; tree++) {
+            for (int i = 0; i < n; i++)    order[i] = i;
+            roots.push_back(buildNode(order, 0, n, rng));
+        }
+    }
+
+    size_t radiusSearch(const Float *q,
+                        const Float radius,
+                        const int knn,
+                        std::vector<std::pair<size_t, Float>> &matches) const override {
+        matches.clear();
+        for (const int root : roots) {
+            const node_t *node = &nodes[root];
+            while (node->child[0] >= 0) {
+                Float proj = 0;
+                for (int j = 0; j < dim; j++)    proj += node->dir[j] * q[j];
+                node = &nodes[node->child[proj < node->split ? 0 : 1]];
+            }
+            for (int i = node->begin; i < node->end; i++) {
+                const row_t &pss = rows[i];
+                Float distSqr = 0;
+                for (int j = 0; j < dim; j++) {
+                    const Float d = q[j] - pss[j];
+                    distSqr += d * d;
+                }
+                if (distSqr >= radius)    continue;
+                // A record in the leaves of several trees is only matched once
+                const size_t index = size_t(items[i]);
+                if (std::none_of(matches.begin(), matches.end(),
+                        [&](const std::pair<size_t, Float> &m) { return m.first == index; })) {
+                    matches.emplace_back(index, distSqr);
+                }
+            }
+        }
+        if (int(matches.size()) > knn) {
+            std::nth_element(matches.begin(), matches.begin() + knn, matches.end(),
+                [](const std::pair<size_t, Float> &a, const std::pair<size_t, Float> &b) {
+                    return a.second < b.second;
+                });
+            matches.resize(knn);
+        }
+        return matches.size();
+    }
+
+    private:
+    static const int c_LeafSize = 12;
+
+    // A leaf has no children and holds the records items[begin, end), whose points are
+    // copied to rows[begin, end) so that the leaf is read in one stream
+    struct node_t {
+        row_t dir;
+        Float split;
+        int child[2];
+        int begin, end;
+    };
+
+    int buildNode(std::vector<int> &order, const int begin, const int end, RNG &rng) {
+        const int id = int(nodes.size());
+        nodes.emplace_back();
+        if (end - begin > c_LeafSize) {
+            std::normal_distribution<Float> normDist(Float(0.0), Float(1.0));
+            row_t dir;
+            for (int j = 0; j < dim; j++)    dir[j] = normDist(rng);
+            auto project = [&](const int index) {
+                Float proj = 0;
+                for (int j = 0; j < dim; j++)    proj += dir[j] * pts.data_pss[index][j];
+                return proj;
+            };
+            const int mid = (begin + end) / 2;
+            std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                [&](const int a, const int b) { return project(a) < project(b); });
+            const Float split = project(order[mid]);
+            // Records that project onto the split all go right, a split that leaves one side
+            // empty makes a leaf instead
+            const int left = int(std::partition(order.begin() + begin, order.begin() + end,
+                [&](const int index) { return project(index) < split; }) - order.begin());
+            if (left > begin && left < end) {
+                const int child0 = buildNode(order, begin, left, rng);
+                const int child1 = buildNode(order, left, end, rng);
+                node_t &node = nodes[id];
+                node.dir = dir;
+                node.split = split;
+                node.child[0] = child0;
+                node.child[1] = child1;
+                return id;
+            }
+        }
+        node_t &node = nodes[id];
+        node.child[0] = node.child[1] = -1;
+        node.begin = int(items.size());
+        for (int i = begin; i < end; i++) {
+            items.push_back(order[i]);
+            rows.push_back(pts.data_pss[order[i]]);
+        }
+        node.end = int(items.size());
+        return id;
+    }
+
+    const point_cloud_t<dim> &pts;
+    std::vector<node_t> nodes;
+    std::vector<int> items;
+    std::vector<row_t> rows;
+    std::vector<int> roots;
+};
+
+// One record of a chain: the point of a path, the moments of its gradient and the path
+// without its vertex caches
+template <int dim>
+struct cache_record_t {
+    std::array<Float, dim> pss, v1, v2;
+    path_tag_t tag;
+    Float pathWeight;
+    Path path;
+};
+
+// The records a thread gathers before it publishes them to the rebuild thread. A chunk always
+// holds PSS_CHUNK_SIZE records of which the first _size_ are in use, so that the paths of a
+// recycled chunk keep their capacity.
+template <int dim>
+struct cache_chunk_t {
+    std::vector<cache_record_t<dim>> records;
+    size_t size = 0;
+    cache_chunk_t *next = nullptr;
+};
+
+// An immutable set of PSS_MAX_SIZE records with its kd-tree, the chains read it concurrently
+template <int dim>
+struct cache_snapshot_t {
+    using row_t = typename point_cloud_t<dim>::row_t;
     
-    int64_t data_idx;
-    bool is_ready;
-    std::mutex mutex;
     double score_sum;
-    KDTree *data_tree;
+    std::unique_ptr<neighbour_index_t<dim>> data_index;
     point_cloud_t<dim> data_pts;
     std::shared_ptr<PiecewiseConstant1D> data_distrib;
     Float inv_sigma_sq, factor;
+    // The points and weights grouped by tag for evalPdfCache
+    std::vector<tag_group_t> data_groups;
+    AlignedStdVector data_blocks;
 
-    global_cache_t() : score_sum(0), data_idx(0), is_ready(false) {
-        data_pts.data_pss.resize(PSS_MAX_SIZE);
-        data_pts.data_v1.resize(PSS_MAX_SIZE);
-        data_pts.data_v2.resize(PSS_MAX_SIZE);
-        data_pts.data_path.resize(PSS_MAX_SIZE);
-        data_pts.data_spContrib.resize(PSS_MAX_SIZE);
-        data_pts.data_pathWeight.resize(PSS_MAX_SIZE);
+    cache_snapshot_t() : score_sum(0) {
         inv_sigma_sq = inverse(CACHE_SIG * CACHE_SIG);
         factor = std::exp(dim * (Float(0.5) * std::log(inv_sigma_sq) - Float(0.9189385332046727)));
+        data_pts.data_pss.reserve(PSS_MAX_SIZE);
+        data_pts.data_v1.reserve(PSS_MAX_SIZE);
+        data_pts.data_v2.reserve(PSS_MAX_SIZE);
+        data_pts.data_tag.reserve(PSS_MAX_SIZE);
+        data_pts.data_pathWeight.reserve(PSS_MAX_SIZE);
+        data_pts.data_path.reserve(PSS_MAX_SIZE);
+        // A subpath of _dim_ has dim / 2 - 1 surface vertices
+        data_pts.data_vertices.reserve(PSS_MAX_SIZE * (dim / 2));
     }  
 
-    inline std::mutex &getMutex() {
-        return mutex; 
-    }
-
-    inline bool isReady() const {
-        return is_ready; 
-    }
-
-    inline bool push(const std::vector<Float> &pss, 
-                     const std::vector<Float> &v1, 
-                     const std::vector<Float> &v2,
-                     const Path &path, 
-                     const SubpathContrib &spContrib,
-                     const Float pathWeight) {
-        if (is_ready)    return false; 
-        data_pts.data_pss[data_idx] = pss;
-        data_pts.data_v1[data_idx] = v1; 
-        data_pts.data_v2[data_idx] = v2; 
-        data_pts.data_path[data_idx] = path; 
-        data_pts.data_spContrib[data_idx] = spContrib;
-        data_pts.data_pathWeight[data_idx] = pathWeight; 
-        score_sum += pathWeight; 
-        data_idx += 1;
-        if (data_idx >= PSS_MAX_SIZE) {
-            data_tree = new KDTree(dim, data_pts, KDTreeSingleIndexAdaptorParams(10 /* max leaf */));
-            data_tree->buildIndex();
+    inline void add(const cache_record_t<dim> &record) {
+        data_pts.data_pss.push_back(record.pss);
+        data_pts.data_v1.push_back(record.v1); 
+        data_pts.data_v2.push_back(record.v2); 
+        data_pts.data_tag.push_back(record.tag);
+        data_pts.data_pathWeight.push_back(record.pathWeight); 
+        const Path &path = record.path;
+        data_pts.data_path.push_back(cached_path_t{path.time, path.camVertex, path.lgtVertex,
+                                                   path.envLightInst, path.lensVertexPos,
+                                                   path.isSubpath, path.camDepth, path.lgtDepth,
+                                                   int(data_pts.data_vertices.size()),
+                                                   int(path.camSurfaceVertex.size()),
+                                                   int(path.lgtSurfaceVertex.size())});
+        data_pts.data_vertices.insert(data_pts.data_vertices.end(),
+                                      path.camSurfaceVertex.begin(), path.camSurfaceVertex.end());
+        data_pts.data_vertices.insert(data_pts.data_vertices.end(),
+                                      path.lgtSurfaceVertex.begin(), path.lgtSurfaceVertex.end());
+        score_sum += record.pathWeight; 
+    }
+
+    // Writes the path of record _idx_ into _path_, the vertex caches of _path_ are kept
+    void getPath(const size_t idx, Path &path) const {
+        const cached_path_t &p = data_pts.data_path[idx];
+        const auto first = data_pts.data_vertices.begin() + p.firstVertex;
+        path.time = p.time;
+        path.camVertex = p.camVertex;
+        path.camSurfaceVertex.assign(first, first + p.numCamVertices);
+        path.lgtVertex = p.lgtVertex;
+        path.lgtSurfaceVertex.assign(first + p.numCamVertices,
+                                     first + p.numCamVertices + p.numLgtVertices);
+        path.envLightInst = p.envLightInst;
+        path.lensVertexPos = p.lensVertexPos;
+        path.isSubpath = p.isSubpath;
+        path.camDepth = p.camDepth;
+        path.lgtDepth = p.lgtDepth;
+    }
+
+    // The bytes that the paths of the snapshot take up
+    size_t pathBytes() const {
+        return data_pts.data_path.capacity() * sizeof(cached_path_t) +
+               data_pts.data_vertices.capacity() * sizeof(SurfaceVertex);
+    }
+
+    // Builds the neighbour search once every record is added, and the sampling distribution
+    // and the blocks of evalPdfCache if the snapshot is sampled from
+    void build(const cache_index_config_t &config, const bool sampling = true) {
+        if (config.type == CacheIndex::RPForest) {
+            data_index.reset(new rp_forest_index_t<dim>(data_pts, config.numTrees));
+        } else {
+            data_index.reset(new kdtree_index_t<dim>(data_pts));
+        }
+        if (sampling) {
             data_distrib = std::make_shared<PiecewiseConstant1D>(
                 &data_pts.data_pathWeight[0], data_pts.data_pathWeight.size());
-            is_ready = true; 
-            // std::cout << " Cache[" << dim << "] built." << std::endl;
+            buildBlocks();
         }
-        return true; 
+    }
+
+    // The records the snapshot was built from
+    std::vector<cache_record_t<dim>> records() const {
+        std::vector<cache_record_t<dim>> ret(data_pts.data_pss.size());
+        for (size_t i = 0; i < ret.size(); i++) {
+            ret[i].pss = data_pts.data_pss[i];
+            ret[i].v1 = data_pts.data_v1[i];
+            ret[i].v2 = data_pts.data_v2[i];
+            ret[i].tag = data_pts.data_tag[i];
+            ret[i].pathWeight = data_pts.data_pathWeight[i];
+            getPath(i, ret[i].path);
+        }
+        return ret;
     }
     
     inline bool query(const std::vector<Float> &pss,
                       std::vector<Float> &v1,
-                      std::vector<Float> &v2) {
-        if (!is_ready)    return false; 
+                      std::vector<Float> &v2) const {
         const int knn = 5; 
         const Float radius = dim * (PSS_QUERY_DIST * PSS_QUERY_DIST); // nanoflann uses squared L2 distance
-        std::vector<std::pair<size_t, Float>> ret_matches;
-        SearchParams params; 
-        const size_t nMatches = data_tree->radiusSearch(&pss[0], radius, ret_matches, params, knn);
+        // The chains query concurrently, each thread keeps its matches
+        static thread_local std::vector<std::pair<size_t, Float>> ret_matches;
+        ret_matches.clear();
+        const size_t nMatches = data_index->radiusSearch(&pss[0], radius, knn, ret_matches);
         if (!nMatches)    return false;
         double sum_w = 0;
         std::fill(v1.begin(), v1.end(), Float(0.0));
         std::fill(v2.begin(), v2.end(), Float(0.0));
-        for (int k = 0; k < nMatches; k++) {
-            int index = static_cast<int>(ret_matches[k].first);
+        for (size_t k = 0; k < nMatches; k++) {
+            const size_t index = ret_matches[k].first;
             Float dist = ret_matches[k].second; 
             Float w = inverse(dist * dist + Float(1e-6));
+            const row_t &r1 = data_pts.data_v1[index];
+            const row_t &r2 = data_pts.data_v2[index];
             for (int i = 0; i < dim; i++) {
-                v1[i] += data_pts.data_v1[index][i] * w; 
-                v2[i] += data_pts.data_v2[index][i] * w;
+                v1[i] += r1[i] * w; 
+                v2[i] += r2[i] * w;
             }
             sum_w += w; 
         }
@@ -124,173 +416,466 @@ struct global_cache_t {
     }
      
     void sampleCache(Path &path, std::vector<Float> &pss, 
-        SubpathContrib &spContrib, Float &pathWeight, RNG &rng) {
-        assert(is_ready);
+        path_tag_t &tag, Float &pathWeight, RNG &rng) const {
+        assert(data_distrib);
         std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
         int idx = data_distrib->SampleDiscrete(uniDist(rng), nullptr);
         assert(idx >= 0 && idx < PSS_MAX_SIZE);
-        path = data_pts.data_path[idx];
-        pss = data_pts.data_pss[idx];
-        spContrib = data_pts.data_spContrib[idx];
+        getPath(idx, path);
+        pss.assign(data_pts.data_pss[idx].begin(), data_pts.data_pss[idx].end());
+        tag = data_pts.data_tag[idx];
         pathWeight = data_pts.data_pathWeight[idx];
         return ;
     }
 
-    Float evalPdfCache(const std::vector<Float> &pss_query, const Path &path) {
-        assert(is_ready);
+    Float evalPdfCache(const std::vector<Float> &pss_query, const Path &path) const {
         assert(pss_query.size() == dim); 
-#if 1
+        row_t q;
+        std::copy_n(pss_query.begin(), dim, q.begin());
+        return evalPdfCache(q, path_tag_t{path.camDepth, path.lgtDepth});
+    }
+
+    // Sums the kernels of every record of the tag, four at a time, with the exponentials
+    // through vfastexp. The kernels are not truncated: with CACHE_SIG at 0.15 the torus is
+    // only a few sigmas across, and a radius of sqrt(dim) + 3 sigmas still needs the distance
+    // of every record, which costs more than its exponential. See tests/bench_global_cache.cpp
+    // for the records such a radius would leave out.
+    Float evalPdfCache(const row_t &q, const path_tag_t &tag) const {
+        assert(data_index);
+        const Float expoScale = -Float(0.5) * inv_sigma_sq;
+        const auto group = std::find_if(data_groups.begin(), data_groups.end(),
+            [&](const tag_group_t &g) {
+                return g.tag.camDepth == tag.camDepth && g.tag.lightDepth == tag.lightDepth;
+            });
+        if (group == data_groups.end())    return Float(0.0);
+#if defined(__SSE2__) && defined(SINGLE_PRECISION)
+        v4sf qv[dim];
+        for (int j = 0; j < dim; j++) {
+            qv[j] = _mm_set1_ps(q[j]);
+        }
+        const v4sf one = _mm_set1_ps(1.f);
+        v4sf acc = _mm_setzero_ps();
+        for (int block = group->begin; block < group->end; block++) {
+            const Float *rows = &data_blocks[block * block_size];
+            v4sf distSqr = _mm_setzero_ps();
+            for (int j = 0; j < dim; j++) {
+                const v4sf d1 = v4sf_fabs(qv[j] - _mm_load_ps(rows + 4 * j));
+                const v4sf d = _mm_min_ps(d1, one - d1);
+                distSqr += d * d;
+            }
+            acc += vfastexp(distSqr * _mm_set1_ps(expoScale)) * _mm_load_ps(rows + 4 * dim);
+        }
+        alignas(16) float lanes[4];
+        _mm_store_ps(lanes, acc);
+        const Float ret = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#else
+        Float ret(0.0);
+        for (int block = group->begin; block < group->end; block++) {
+            const Float *rows = &data_blocks[block * block_size];
+            for (int lane = 0; lane < 4; lane++) {
+                Float distSqr = 0;
+                for (int j = 0; j < dim; j++) {
+                    Float d1 = fabs(q[j] - rows[4 * j + lane]);
+                    Float d = std::min(d1, Float(1.0) - d1);
+                    distSqr += d * d;
+                }
+                ret += fastexp(distSqr * expoScale) * rows[4 * dim + lane];
+            }
+        }
+#endif
+        return ret * factor * Float(1.0 / score_sum);
+    }
+
+    // The sum over every record, the reference for the blocked evaluation
+    Float evalPdfCacheBruteForce(const row_t &q, const path_tag_t &tag) const {
+        assert(data_index);
+        const Float inv_score_sum = Float(1.0 / score_sum);
         Float ret(0.0);
-        for (int i = 0; i < PSS_MAX_SIZE; i++) {
-            const std::vector<Float> &pss = data_pts.data_pss[i];
-            const SubpathContrib &spContrib = data_pts.data_spContrib[i];
-            if (spContrib.camDepth != path.camDepth || spContrib.lightDepth != path.lgtDepth)
+        for (size_t i = 0; i < data_pts.data_pss.size(); i++) {
+            const path_tag_t &t = data_pts.data_tag[i];
+            if (t.camDepth != tag.camDepth || t.lightDepth != tag.lightDepth)
                 continue;    
+            const row_t &pss = data_pts.data_pss[i];
             Float sumDistSqr = 0;
             for (int j = 0; j < dim; j++) {
-                Float c = pss[j], q = pss_query[j];
-                Float d1 = fabs(q - c);
+                Float d1 = fabs(q[j] - pss[j]);
                 Float d2 = Float(1.0) - d1;
                 Float d = std::min(d1, d2);
                 sumDistSqr += d * d;
             }
             Float expo = -Float(0.5) * sumDistSqr * inv_sigma_sq;
-            Float scale = factor * data_pts.data_pathWeight[i] / score_sum;
+            Float scale = factor * data_pts.data_pathWeight[i] * inv_score_sum;
             ret += std::exp(expo) * scale; 
         }
-#endif 
         return ret;
     }
+
+    private:
+    // A block holds four records, one row of four floats per dimension and a row of weights
+    static constexpr int block_size = 4 * (dim + 1);
+
+    // Regroups the records by tag into blocks, the records of a tag that do not fill
+    // a block are padded with zero weights
+    void buildBlocks() {
+        const size_t n = data_pts.data_pss.size();
+        std::vector<int> order(n);
+        for (size_t i = 0; i < n; i++)    order[i] = int(i);
+        auto tagLess = [](const path_tag_t &a, const path_tag_t &b) {
+            return a.camDepth != b.camDepth ? a.camDepth < b.camDepth : a.lightDepth < b.lightDepth;
+        };
+        std::stable_sort(order.begin(), order.end(), [&](const int a, const int b) {
+            return tagLess(data_pts.data_tag[a], data_pts.data_tag[b]);
+        });
+        data_groups.clear();
+        data_blocks.clear();
+        for (size_t i = 0; i < n;) {
+            const path_tag_t tag = data_pts.data_tag[order[i]];
+            size_t end = i;
+            while (end < n && !tagLess(tag, data_pts.data_tag[order[end]]))    end++;
+            const int firstBlock = int(data_blocks.size()) / block_size;
+            for (size_t k = i; k < end; k += 4) {
+                const size_t offset = data_blocks.size();
+                data_blocks.resize(offset + block_size, Float(0.0));
+                for (int lane = 0; lane < 4 && k + lane < end; lane++) {
+                    const int index = order[k + lane];
+                    for (int j = 0; j < dim; j++) {
+                        data_blocks[offset + 4 * j + lane] = data_pts.data_pss[index][j];
+                    }
+                    data_blocks[offset + 4 * dim + lane] = data_pts.data_pathWeight[index];
+                }
+            }
+            data_groups.push_back(tag_group_t{tag, firstBlock, int(data_blocks.size()) / block_size});
+            i = end;
+        }
+    }
 };
 
-struct GlobalCache {
-    global_cache_t<2> global_cache_2;
-    global_cache_t<3> global_cache_3;
-    global_cache_t<4> global_cache_4;
-    global_cache_t<5> global_cache_5;
-    global_cache_t<6> global_cache_6;
-    global_cache_t<7> global_cache_7;
-    global_cache_t<8> global_cache_8;
-    global_cache_t<9> global_cache_9;
-    global_cache_t<10> global_cache_10;
-    global_cache_t<11> global_cache_11;
-    global_cache_t<12> global_cache_12;
-    global_cache_t<13> global_cache_13;
-    global_cache_t<14> global_cache_14;
-    global_cache_t<15> global_cache_15;
-    global_cache_t<16> global_cache_16;
+// The records of one dimension as the chains keep adding them. Each thread fills a chunk of
+// its own and pushes it onto a lock-free list once it is full. The rebuild thread takes the
+// chunks from the list, keeps the newest PSS_MAX_SIZE records and publishes a new snapshot
+// of them through an atomic pointer. The chunks it drops go back to the threads, so once the
+// window is full a push copies into records that were already allocated. The readers of a
+// thread look at the snapshot they picked up at their last refresh, a replaced snapshot is
+// deleted by GlobalCache once every thread has refreshed since.
+// The MALA lookups always read the newest snapshot. The large steps sample from the first
+// PSS_SAMPLER_BUILDS snapshots and then keep the last of them: an independence proposal that
+// kept adapting to the history of the chains would not leave their target invariant.
+template <int dim>
+struct global_cache_t {
+    using snapshot_t = cache_snapshot_t<dim>;
+    using chunk_t = cache_chunk_t<dim>;
+    using records_t = std::vector<cache_record_t<dim>>;
 
-    bool isReady(const int dim) const {
-        switch(dim) {
-            case 2: {
-                return global_cache_2.isReady();
-            }
-            case 3: {
-                return global_cache_3.isReady();
-            }
-            case 4: {
-                return global_cache_4.isReady();
-            }
-            case 5: {
-                return global_cache_5.isReady();
-            }
-            case 6: {
-                return global_cache_6.isReady();
-            }
-            case 7: {
-                return global_cache_7.isReady();
-            }
-            case 8: {
-                return global_cache_8.isReady();
-            }
-            case 9: {
-                return global_cache_9.isReady();
-            }
-            case 10: {
-                return global_cache_10.isReady();
-            }
-            case 11: {
-                return global_cache_11.isReady();
-            }
-            case 12: {
-                return global_cache_12.isReady();
-            }
-            case 13: {
-                return global_cache_13.isReady();
-            }
-            case 14: {
-                return global_cache_14.isReady();
-            }
-            case 15: {
-                return global_cache_15.isReady();
-            }
-            case 16: {
-                return global_cache_16.isReady();
-            }
-            default: {
-                std::cerr << "isReady() dim: " << dim << " is not supported for global caching!" << std::endl;
-            }
+    explicit global_cache_t(const cache_setup_t &setup)
+        : threads(setup.numThreads), maxDepth(setup.maxDepth), config(setup.index) {}
+
+    ~global_cache_t() {
+        chunk_t *chunk = published.exchange(nullptr);
+        while (chunk != nullptr) {
+            chunk_t *next = chunk->next;
+            delete chunk;
+            chunk = next;
+        }
+        const snapshot_t *last = current.load();
+        if (sampler.load() != last) {
+            delete sampler.load();
+        }
+        delete last;
+        for (const auto &r : retired) {
+            delete r.second;
+        }
+        for (chunk_t *c : recycled) {
+            delete c;
         }
-        return false;
     }
 
-    std::mutex &getMutex(const int dim) {
-        switch(dim) {
-            case 2: {
-                return global_cache_2.getMutex();
-            }
-            case 3: {
-                return global_cache_3.getMutex();
-            }
-            case 4: {
-                return global_cache_4.getMutex();
-            }
-            case 5: {
-                return global_cache_5.getMutex();
-            }
-            case 6: {
-                return global_cache_6.getMutex();
-            }
-            case 7: {
-                return global_cache_7.getMutex();
-            }
-            case 8: {
-                return global_cache_8.getMutex();
-            }
-            case 9: {
-                return global_cache_9.getMutex();
-            }
-            case 10: {
-                return global_cache_10.getMutex();
-            }
-            case 11: {
-                return global_cache_11.getMutex();
-            }
-            case 12: {
-                return global_cache_12.getMutex();
-            }
-            case 13: {
-                return global_cache_13.getMutex();
+    inline bool isReady(const int threadId) const {
+        return threads[threadId].view != nullptr; 
+    }
+
+    inline const snapshot_t &view(const int threadId) const {
+        assert(isReady(threadId));
+        return *threads[threadId].view;
+    }
+
+    // The snapshot that the large steps sample from
+    inline const snapshot_t &samplerView(const int threadId) const {
+        assert(isReady(threadId));
+        return *threads[threadId].samplerView;
+    }
+
+    void push(const int threadId,
+              const std::vector<Float> &pss, 
+              const std::vector<Float> &v1, 
+              const std::vector<Float> &v2,
+              const Path &path, 
+              const SubpathContrib &spContrib,
+              const Float pathWeight) {
+        std::unique_ptr<chunk_t> &chunk = threads[threadId].filling;
+        if (!chunk) {
+            chunk.reset(takeChunk());
+        }
+        cache_record_t<dim> &record = chunk->records[chunk->size++];
+        std::copy_n(pss.begin(), dim, record.pss.begin());
+        std::copy_n(v1.begin(), dim, record.v1.begin());
+        std::copy_n(v2.begin(), dim, record.v2.begin());
+        record.tag = path_tag_t{spContrib.camDepth, spContrib.lightDepth};
+        record.pathWeight = pathWeight;
+        CopyPathState(path, record.path);
+        if (chunk->size >= PSS_CHUNK_SIZE) {
+            chunk_t *full = chunk.release();
+            full->next = published.load(std::memory_order_relaxed);
+            while (!published.compare_exchange_weak(full->next, full,
+                                                    std::memory_order_release,
+                                                    std::memory_order_relaxed)) {
             }
-            case 14: {
-                return global_cache_14.getMutex();
+        }
+    }
+
+    // Picks up the current snapshot for the readers of _threadId_
+    inline void refresh(const int threadId) {
+        // The sampler is published first, a thread that sees a snapshot sees its sampler
+        threads[threadId].view = current.load();
+        threads[threadId].samplerView = sampler.load();
+    }
+
+    inline void release(const int threadId) {
+        threads[threadId].view = nullptr;
+        threads[threadId].samplerView = nullptr;
+    }
+
+    // Called by the rebuild thread: takes the published chunks and swaps in a new snapshot
+    // when the first PSS_MAX_SIZE records are there, or when PSS_REBUILD_SIZE records came in
+    // since the last one. Returns the snapshot that was replaced and is no longer read, if any.
+    const snapshot_t *update() {
+        chunk_t *chunk = published.exchange(nullptr, std::memory_order_acquire);
+        // The list is newest first
+        std::vector<std::unique_ptr<chunk_t>> incoming;
+        while (chunk != nullptr) {
+            incoming.emplace_back(chunk);
+            chunk = chunk->next;
+        }
+        for (auto it = incoming.rbegin(); it != incoming.rend(); it++) {
+            window_size += (*it)->size;
+            fresh += (*it)->size;
+            window.push_back(std::move(*it));
+        }
+        while (!window.empty() && window_size - window.front()->size >= PSS_MAX_SIZE) {
+            window_size -= window.front()->size;
+            recycle(window.front().release());
+            window.pop_front();
+        }
+        const bool ready = current.load(std::memory_order_relaxed) != nullptr;
+        if (window_size < PSS_MAX_SIZE || (ready && fresh < PSS_REBUILD_SIZE)) {
+            return nullptr;
+        }
+        snapshot_t *snapshot = new snapshot_t;
+        size_t skip = window_size - PSS_MAX_SIZE;
+        for (const auto &c : window) {
+            for (size_t i = 0; i < c->size; i++) {
+                if (skip > 0) {
+                    skip--;
+                    continue;
+                }
+                snapshot->add(c->records[i]);
             }
-            case 15: {
-                return global_cache_15.getMutex();
+        }
+        const bool sampling = samplerBuilds < PSS_SAMPLER_BUILDS;
+        snapshot->build(config, sampling);
+        fresh = 0;
+        if (sampling) {
+            // Until then every snapshot is sampled from, the one it replaces was the sampler
+            sampler.store(snapshot);
+            samplerBuilds++;
+            return current.exchange(snapshot);
+        }
+        const snapshot_t *replaced = current.exchange(snapshot);
+        return replaced != sampler.load(std::memory_order_relaxed) ? replaced : nullptr;
+    }
+
+    // The records that were not dropped yet, oldest first: the window, the published chunks
+    // and the chunks the threads are filling. Only called while no thread pushes and the
+    // rebuild thread does not update.
+    std::vector<const cache_record_t<dim> *> records() const {
+        std::vector<const cache_record_t<dim> *> ret;
+        auto add = [&](const chunk_t &chunk) {
+            for (size_t i = 0; i < chunk.size; i++) {
+                ret.push_back(&chunk.records[i]);
+            }
+        };
+        for (const auto &c : window) {
+            add(*c);
+        }
+        std::vector<const chunk_t *> pending;
+        for (const chunk_t *c = published.load(); c != nullptr; c = c->next) {
+            pending.push_back(c);
+        }
+        for (auto it = pending.rbegin(); it != pending.rend(); it++) {
+            add(**it);
+        }
+        for (const auto &slot : threads) {
+            if (slot.filling) {
+                add(*slot.filling);
             }
-            case 16: {
-                return global_cache_16.getMutex();
+        }
+        return ret;
+    }
+
+    // The records of the sampler once it stopped changing, none before
+    records_t samplerRecords() const {
+        if (samplerBuilds < PSS_SAMPLER_BUILDS) {
+            return records_t();
+        }
+        return sampler.load()->records();
+    }
+
+    // The snapshots that were built while they were still sampled from, see update
+    int numSamplerBuilds() const {
+        return samplerBuilds;
+    }
+
+    // Takes the records of a checkpoint, oldest first, and builds a snapshot right away if
+    // there are enough of them, and the sampler that stopped changing from _samplerRecords_.
+    // _builds_ is numSamplerBuilds at the checkpoint, so that a sampler that was still
+    // changing stops after as many builds as without the checkpoint. Called before the
+    // chains start.
+    void restore(const records_t &records, const records_t &samplerRecords, const int builds) {
+        if (!samplerRecords.empty()) {
+            snapshot_t *snapshot = new snapshot_t;
+            for (const auto &record : samplerRecords) {
+                snapshot->add(record);
+            }
+            snapshot->build(config);
+            sampler.store(snapshot);
+            current.store(snapshot);
+            samplerBuilds = PSS_SAMPLER_BUILDS;
+        }
+        if (!records.empty()) {
+            for (size_t i = 0; i < records.size();) {
+                std::unique_ptr<chunk_t> chunk(takeChunk());
+                while (chunk->size < PSS_CHUNK_SIZE && i < records.size()) {
+                    chunk->records[chunk->size++] = records[i++];
+                }
+                window_size += chunk->size;
+                fresh += chunk->size;
+                window.push_back(std::move(chunk));
+            }
+            delete update();
+        }
+        // The snapshot built here stands for the one the checkpoint was taken with
+        samplerBuilds = std::max(samplerBuilds, builds);
+    }
+
+    inline void retire(const uint64_t epoch, const snapshot_t *snapshot) {
+        retired.emplace_back(epoch, snapshot);
+    }
+
+    // Deletes the snapshots retired at or before _epoch_
+    void reclaim(const uint64_t epoch) {
+        auto end = std::remove_if(retired.begin(), retired.end(), 
+            [&](const std::pair<uint64_t, const snapshot_t *> &r) {
+                if (r.first > epoch)    return false;
+                delete r.second;
+                return true;
+            });
+        retired.erase(end, retired.end());
+    }
+
+    private:
+    // An empty chunk, one that the window dropped if there is any. A new chunk reserves the
+    // paths of its records for maxDepth, copying a path into them then does not allocate.
+    chunk_t *takeChunk() {
+        {
+            std::lock_guard<std::mutex> lock(recycleMutex);
+            if (!recycled.empty()) {
+                chunk_t *chunk = recycled.back();
+                recycled.pop_back();
+                return chunk;
             }
-            default: {
-                std::cerr << "getMutex() dim: " << dim << " is not supported for global caching!" << std::endl;
+        }
+        chunk_t *chunk = new chunk_t;
+        chunk->records.resize(PSS_CHUNK_SIZE);
+        if (maxDepth >= 0) {
+            for (auto &record : chunk->records) {
+                record.path.camSurfaceVertex.reserve(maxDepth + 1);
+                record.path.lgtSurfaceVertex.reserve(maxDepth + 1);
             }
         }
-        // should not reach here
-        assert(false);
-        return global_cache_2.getMutex();
+        return chunk;
     }
-    
-    bool push(
+
+    // Called by the rebuild thread with a chunk it dropped from the window
+    void recycle(chunk_t *chunk) {
+        chunk->size = 0;
+        chunk->next = nullptr;
+        std::lock_guard<std::mutex> lock(recycleMutex);
+        recycled.push_back(chunk);
+    }
+
+    // Only touched by its thread
+    struct alignas(64) thread_slot_t {
+        std::unique_ptr<chunk_t> filling;
+        const snapshot_t *view = nullptr;
+        const snapshot_t *samplerView = nullptr;
+    };
+    std::vector<thread_slot_t> threads;
+    const int maxDepth;
+    cache_index_config_t config;
+    std::atomic<chunk_t *> published{nullptr};
+    std::atomic<const snapshot_t *> current{nullptr};
+    std::atomic<const snapshot_t *> sampler{nullptr};
+    // Only touched by the rebuild thread
+    std::deque<std::unique_ptr<chunk_t>> window;
+    size_t window_size = 0, fresh = 0;
+    int samplerBuilds = 0;
+    std::vector<std::pair<uint64_t, const snapshot_t *>> retired;
+    // The chunks the window dropped, taken by the threads when they start a new one
+    std::mutex recycleMutex;
+    std::vector<chunk_t *> recycled;
+};
+
+// One cache per dimension from PSS_MIN_LENGTH to PSS_CACHE_MAX_DIM, a dimension known at
+// runtime picks its cache through a fold over the index sequence of the tuple. A background
+// thread rebuilds the caches while the chains run. The readers use the snapshots that the
+// calling thread picked up at its last refresh(), so that every step of a chain sees one
+// snapshot, and a thread that stops reading calls release() so that it does not hold them.
+struct GlobalCache {
+    GlobalCache(const int numThreads, const int maxDepth, const cache_index_config_t &config)
+        : caches(makeCaches(numThreads, maxDepth, config, indices_t())),
+          readers(new reader_t[numThreads]),
+          numReaders(numThreads) {
+        rebuildThread = std::thread([this]() { rebuildLoop(); });
+    }
+
+    ~GlobalCache() {
+        {
+            std::lock_guard<std::mutex> lock(rebuildMutex);
+            stop = true;
+        }
+        rebuildCondition.notify_one();
+        rebuildThread.join();
+    }
+
+    void refresh(const int threadId) {
+        readers[threadId].epoch.store(epoch.load());
+        visitAll([&](auto &cache) { cache.refresh(threadId); });
+    }
+
+    void release(const int threadId) {
+        visitAll([&](auto &cache) { cache.release(threadId); });
+        readers[threadId].epoch.store(c_Offline);
+    }
+
+    bool isReady(const int dim) const {
+        bool ready = false;
+        if (!visit(caches, dim, [&](const auto &cache) { ready = cache.isReady(threadIndex); })) {
+            std::cerr << "isReady() dim: " << dim << " is not supported for global caching!" << std::endl;
+        }
+        return ready;
+    }
+
+    void push(
+        const int threadId,
         const int dim, 
         const std::vector<Float> &pss, 
         const std::vector<Float> &v1, 
@@ -299,74 +884,11 @@ struct GlobalCache {
         const SubpathContrib &spContrib,
         const Float pathWeight
     ) {
-        // const size_t dim = pss.size();
-        bool ret = false; 
-        switch(dim) {
-            case 2: {
-                ret = global_cache_2.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            case 3: {
-                ret = global_cache_3.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            case 4: {
-                ret = global_cache_4.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            case 5: {
-                ret = global_cache_5.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            case 6: {
-                ret = global_cache_6.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            case 7: {
-                ret = global_cache_7.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            case 8: {
-                ret = global_cache_8.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            case 9: {
-                ret = global_cache_9.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            case 10: {
-                ret = global_cache_10.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            case 11: {
-                ret = global_cache_11.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            case 12: {
-                ret = global_cache_12.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            case 13: {
-                ret = global_cache_13.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            case 14: {
-                ret = global_cache_14.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            case 15: {
-                ret = global_cache_15.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            case 16: {
-                ret = global_cache_16.push(pss, v1, v2, path, spContrib, pathWeight);
-                break;  
-            }
-            default: {
-                std::cerr << "push() dim: " << dim << " not supported!" << std::endl;
-            }
+        if (!visit(caches, dim, [&](auto &cache) {
+                cache.push(threadId, pss, v1, v2, path, spContrib, pathWeight);
+            })) {
+            std::cerr << "push() dim: " << dim << " not supported!" << std::endl;
         }
-        return ret; 
     }
 
     bool query(
@@ -374,186 +896,135 @@ struct GlobalCache {
         const std::vector<Float> &pss, 
               std::vector<Float> &v1,
               std::vector<Float> &v2
-    ) {
-        // const size_t dim = pss.size(); 
+    ) const {
         bool ret = false;
-        switch(dim) {
-            case 2: {
-                ret = global_cache_2.query(pss, v1, v2);
-                break;  
-            }
-            case 3: {
-                ret = global_cache_3.query(pss, v1, v2);
-                break;  
-            }
-            case 4: {
-                ret = global_cache_4.query(pss, v1, v2);
-                break;  
-            }
-            case 5: {
-                ret = global_cache_5.query(pss, v1, v2);
-                break;  
-            }
-            case 6: {
-                ret = global_cache_6.query(pss, v1, v2);
-                break;  
-            }
-            case 7: {
-                ret = global_cache_7.query(pss, v1, v2);
-                break;  
-            }
-            case 8: {
-                ret = global_cache_8.query(pss, v1, v2);
-                break;  
-            }
-            case 9: {
-                ret = global_cache_9.query(pss, v1, v2);
-                break;  
-            }
-            case 10: {
-                ret = global_cache_10.query(pss, v1, v2);
-                break;  
-            }
-            case 11: {
-                ret = global_cache_11.query(pss, v1, v2);
-                break;  
-            }
-            case 12: {
-                ret = global_cache_12.query(pss, v1, v2);
-                break;  
-            }
-            case 13: {
-                ret = global_cache_13.query(pss, v1, v2);
-                break;  
-            }
-            case 14: {
-                ret = global_cache_14.query(pss, v1, v2);
-                break;  
-            }
-            case 15: {
-                ret = global_cache_15.query(pss, v1, v2);
-                break;  
-            }
-            case 16: {
-                ret = global_cache_16.query(pss, v1, v2);
-                break;  
-            }
-            default: {
-                std::cerr << "query() dim: " << dim << " not supported!" << std::endl;
-            }
+        if (!visit(caches, dim, [&](const auto &cache) {
+                ret = cache.isReady(threadIndex) && cache.view(threadIndex).query(pss, v1, v2);
+            })) {
+            std::cerr << "query() dim: " << dim << " not supported!" << std::endl;
         }
         return ret; 
     }
 
     void sampleCache(const int dim, Path &path, std::vector<Float> &pss, 
-                     SubpathContrib &spContrib, Float &pathWeight, RNG &rng) {
-        switch (dim) {
-            case 2: 
-                global_cache_2.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            case 3: 
-                global_cache_3.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            case 4: 
-                global_cache_4.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            case 5: 
-                global_cache_5.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            case 6: 
-                global_cache_6.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            case 7: 
-                global_cache_7.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            case 8: 
-                global_cache_8.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            case 9: 
-                global_cache_9.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            case 10: 
-                global_cache_10.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            case 11: 
-                global_cache_11.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            case 12: 
-                global_cache_12.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            case 13: 
-                global_cache_13.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            case 14: 
-                global_cache_14.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            case 15: 
-                global_cache_15.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            case 16: 
-                global_cache_16.sampleCache(path, pss, spContrib, pathWeight, rng);
-                break; 
-            default: 
-                std::cerr << "sampleCache() dim: " << dim << " not supported!" << std::endl;
-        }  
-        return ;   
+                     path_tag_t &tag, Float &pathWeight, RNG &rng) const {
+        if (!visit(caches, dim, [&](const auto &cache) {
+                cache.samplerView(threadIndex).sampleCache(path, pss, tag, pathWeight, rng);
+            })) {
+            std::cerr << "sampleCache() dim: " << dim << " not supported!" << std::endl;
+        }
     }
  
-    Float evalPdfCache(const int dim, const std::vector<Float> pss, 
-                       const Path &path) {
-        assert(dim == pss.size());
+    Float evalPdfCache(const int dim, const std::vector<Float> &pss, 
+                       const Path &path) const {
+        assert(dim == int(pss.size()));
         Float ret = Float(0.0);
-        switch (dim) {
-            case 2: 
-                ret = global_cache_2.evalPdfCache(pss, path);
-                break;
-            case 3: 
-                ret = global_cache_3.evalPdfCache(pss, path);
-                break; 
-            case 4: 
-                ret = global_cache_4.evalPdfCache(pss, path);
-                break; 
-            case 5: 
-                ret = global_cache_5.evalPdfCache(pss, path);
-                break; 
-            case 6: 
-                ret = global_cache_6.evalPdfCache(pss, path);
-                break; 
-            case 7: 
-                ret = global_cache_7.evalPdfCache(pss, path);
-                break; 
-            case 8: 
-                ret = global_cache_8.evalPdfCache(pss, path);
-                break; 
-            case 9: 
-                ret = global_cache_9.evalPdfCache(pss, path);
-                break; 
-            case 10: 
-                ret = global_cache_10.evalPdfCache(pss, path);
-                break; 
-            case 11: 
-                ret = global_cache_11.evalPdfCache(pss, path);
-                break; 
-            case 12: 
-                ret = global_cache_12.evalPdfCache(pss, path);
-                break; 
-            case 13: 
-                ret = global_cache_13.evalPdfCache(pss, path);
-                break; 
-            case 14: 
-                ret = global_cache_14.evalPdfCache(pss, path);
-                break; 
-            case 15: 
-                ret = global_cache_15.evalPdfCache(pss, path);
-                break; 
-            case 16: 
-                ret = global_cache_16.evalPdfCache(pss, path);
-                break; 
-            default: 
-                std::cerr << "evalPdfCache() dim: " << dim << " not supported!" << std::endl;
-                break;             
+        if (!visit(caches, dim, [&](const auto &cache) {
+                ret = cache.samplerView(threadIndex).evalPdfCache(pss, path);
+            })) {
+            std::cerr << "evalPdfCache() dim: " << dim << " not supported!" << std::endl;
         }
         return ret;
     }
-    
-};
\ No newline at end of file
+
+    // Hands _write_ the records of every cache, see global_cache_t::records, then the
+    // records of its sampler if it stopped changing, and _writeBuilds_ the number of sampler
+    // builds, from the smallest dimension up. Only called while no thread pushes.
+    template <typename Func, typename BuildsFunc>
+    void save(Func &&write, BuildsFunc &&writeBuilds) {
+        std::lock_guard<std::mutex> lock(rebuildMutex);
+        visitAll([&](auto &cache) {
+            write(cache.records());
+            const auto samplerRecords = cache.samplerRecords();
+            std::vector<const typename std::decay_t<decltype(samplerRecords)>::value_type *> ptrs;
+            for (const auto &record : samplerRecords) {
+                ptrs.push_back(&record);
+            }
+            write(ptrs);
+            writeBuilds(cache.numSamplerBuilds());
+        });
+    }
+
+    // Fills every cache and its sampler with the records that _read_ puts into the vector it
+    // is handed and the number of builds that _readBuilds_ returns, in the order of save.
+    // Called before the chains start.
+    template <typename Func, typename BuildsFunc>
+    void load(Func &&read, BuildsFunc &&readBuilds) {
+        std::lock_guard<std::mutex> lock(rebuildMutex);
+        visitAll([&](auto &cache) {
+            typename std::decay_t<decltype(cache)>::records_t records, samplerRecords;
+            read(records);
+            read(samplerRecords);
+            const int builds = readBuilds();
+            cache.restore(records, samplerRecords, builds);
+        });
+    }
+
+    private:
+    static constexpr size_t num_caches = PSS_CACHE_MAX_DIM - PSS_MIN_LENGTH + 1;
+    using indices_t = std::make_index_sequence<num_caches>;
+
+    template <typename Indices>
+    struct caches_of;
+    template <size_t... I>
+    struct caches_of<std::index_sequence<I...>> {
+        using type = std::tuple<global_cache_t<int(I) + PSS_MIN_LENGTH>...>;
+    };
+    using caches_t = typename caches_of<indices_t>::type;
+
+    template <size_t... I>
+    static caches_t makeCaches(const int numThreads,
+                               const int maxDepth,
+                               const cache_index_config_t &config,
+                               std::index_sequence<I...>) {
+        return caches_t(((void)I, cache_setup_t{numThreads, maxDepth, config})...);
+    }
+
+    // Calls _func_ with the cache of _dim_, returns false if there is none
+    template <typename Caches, typename Func>
+    static bool visit(Caches &caches, const int dim, Func &&func) {
+        return visit(caches, dim, func, indices_t());
+    }
+    template <typename Caches, typename Func, size_t... I>
+    static bool visit(Caches &caches, const int dim, Func &func, std::index_sequence<I...>) {
+        return ((dim == int(I) + PSS_MIN_LENGTH && (func(std::get<I>(caches)), true)) || ...);
+    }
+
+    template <typename Func>
+    void visitAll(Func &&func) {
+        std::apply([&](auto &...cache) { (func(cache), ...); }, caches);
+    }
+
+    // Wakes up every PSS_REBUILD_INTERVAL milliseconds to update the caches. A snapshot that
+    // is replaced at epoch e is deleted once no thread announced an epoch before e.
+    void rebuildLoop() {
+        std::unique_lock<std::mutex> lock(rebuildMutex);
+        while (!rebuildCondition.wait_for(lock, std::chrono::milliseconds(PSS_REBUILD_INTERVAL),
+                                          [&]() { return stop; })) {
+            visitAll([&](auto &cache) {
+                if (const auto *replaced = cache.update()) {
+                    cache.retire(epoch.fetch_add(1) + 1, replaced);
+                }
+            });
+            uint64_t oldest = epoch.load();
+            for (int i = 0; i < numReaders; i++) {
+                oldest = std::min(oldest, readers[i].epoch.load());
+            }
+            visitAll([&](auto &cache) { cache.reclaim(oldest); });
+        }
+    }
+
+    static constexpr uint64_t c_Offline = std::numeric_limits<uint64_t>::max();
+    struct alignas(64) reader_t {
+        std::atomic<uint64_t> epoch{c_Offline};
+    };
+
+    caches_t caches;
+    std::atomic<uint64_t> epoch{1};
+    std::unique_ptr<reader_t[]> readers;
+    int numReaders;
+    std::thread rebuildThread;
+    std::mutex rebuildMutex;
+    std::condition_variable rebuildCondition;
+    bool stop = false;
+};
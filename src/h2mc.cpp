@@ -54,19 +54,41 @@ void ComputeGaussian(const H2MCParam &param,
 
     postInvCovEigenvalues = eigenBuff.array() + invSigmaSq.array();
     
-    gaussian.invCov.noalias() =
-        hEigenvector * postInvCovEigenvalues.asDiagonal() * hEigenvector.transpose();
-    gaussian.mean.noalias() =
+    Resize(gaussian, dimension);
+    Eigen::Map<Eigen::Matrix<Float, dim, dim>>(gaussian.invCov.data(), dimension, dimension)
+        .noalias() = hEigenvector * postInvCovEigenvalues.asDiagonal() * hEigenvector.transpose();
+    Eigen::Map<Eigen::Matrix<Float, dim, 1>>(gaussian.mean.data(), dimension).noalias() =
         hEigenvector * (eigenBuff.cwiseQuotient(postInvCovEigenvalues).asDiagonal() * offsetBuff);
-    gaussian.covL.noalias() =
-        hEigenvector * postInvCovEigenvalues.cwiseInverse().cwiseSqrt().asDiagonal();
+    Eigen::Map<Eigen::Matrix<Float, dim, dim>>(gaussian.covL.data(), dimension, dimension)
+        .noalias() = hEigenvector * postInvCovEigenvalues.cwiseInverse().cwiseSqrt().asDiagonal();
 
-    gaussian.logDet = Float(0.0);
-    for (int i = 0; i < dim; i++) {
-        gaussian.logDet += log(postInvCovEigenvalues[i]);
-    }
+    // Summed over the eigenvalues the solver found, _dim_ is -1 above c_MaxFixedEigenDim
+    gaussian.logDet = postInvCovEigenvalues.array().log().sum();
 }
 
+// The unrolled eigensolvers of larger dimensions take too long to compile
+constexpr int c_MaxFixedEigenDim = 12;
+
+template <int dim>
+struct GaussianKernel {
+    // _grad_ and _hess_ are dense and of dimension _n_
+    static void Run(const H2MCParam &param,
+                    const int n,
+                    const Float *grad,
+                    const Float *hess,
+                    Gaussian &gaussian) {
+        using FixedVector = Eigen::Matrix<Float, dim, 1>;
+        using FixedMatrix = Eigen::Matrix<Float, dim, dim>;
+        const FixedVector invSigmaSq =
+            FixedVector::Constant(n, Float(1.0) / (param.sigma * param.sigma));
+        ComputeGaussian<dim>(param,
+                             Eigen::Map<const FixedVector>(grad, n),
+                             Eigen::Map<const FixedMatrix>(hess, n, n),
+                             invSigmaSq,
+                             gaussian);
+    }
+};
+
 void ComputeGaussian(const H2MCParam &param,
                      const Float sc,
                      const AlignedStdVector &vGrad,
@@ -78,65 +100,23 @@ void ComputeGaussian(const H2MCParam &param,
 
     gaussian.isDiagonal = false; 
     
-    Vector sigma = Vector::Constant(dim, param.sigma);
-    Float sigmaMax = sigma.maxCoeff();
-    auto sigmaSq = sigma.cwiseProduct(sigma);
-    Vector invSigmaSq = sigmaSq.cwiseInverse();
-    if (sc <= Float(1e-15) || hess.norm() < Float(0.5) / (sigmaMax * sigmaMax)) {
-        gaussian.mean = Vector::Zero(dim);
-        gaussian.covL = sigma.asDiagonal();
-        gaussian.invCov = invSigmaSq.asDiagonal();
+    const Float sigma = param.sigma;
+    const Float invSigmaSq = Float(1.0) / (sigma * sigma);
+    if (sc <= Float(1e-15) || hess.norm() < Float(0.5) / (sigma * sigma)) {
+        Resize(gaussian, dim);
+        std::fill(gaussian.mean.begin(), gaussian.mean.end(), Float(0.0));
+        std::fill(gaussian.covL.begin(), gaussian.covL.end(), Float(0.0));
+        std::fill(gaussian.invCov.begin(), gaussian.invCov.end(), Float(0.0));
+        for (int i = 0; i < dim; i++) {
+            gaussian.covL[i * dim + i] = sigma;
+            gaussian.invCov[i * dim + i] = invSigmaSq;
+        }
         gaussian.logDet = Float(0.0);
         for (int i = 0; i < dim; i++) {
-            gaussian.logDet += log(invSigmaSq[i]);
+            gaussian.logDet += log(invSigmaSq);
         }
     } else {
-        switch (dim) {
-            case 2: {
-                ComputeGaussian<2>(param, grad, hess, invSigmaSq, gaussian);
-                break;
-            }
-            case 3: {
-                ComputeGaussian<3>(param, grad, hess, invSigmaSq, gaussian);
-                break;
-            }
-            case 4: {
-                ComputeGaussian<4>(param, grad, hess, invSigmaSq, gaussian);
-                break;
-            }
-            case 5: {
-                ComputeGaussian<5>(param, grad, hess, invSigmaSq, gaussian);
-                break;
-            }
-            case 6: {
-                ComputeGaussian<6>(param, grad, hess, invSigmaSq, gaussian);
-                break;
-            }
-            case 7: {
-                ComputeGaussian<7>(param, grad, hess, invSigmaSq, gaussian);
-                break;
-            }
-            case 8: {
-                ComputeGaussian<8>(param, grad, hess, invSigmaSq, gaussian);
-                break;
-            }
-            case 9: {
-                ComputeGaussian<9>(param, grad, hess, invSigmaSq, gaussian);
-                break;
-            }
-            case 10: {
-                ComputeGaussian<10>(param, grad, hess, invSigmaSq, gaussian);
-                break;
-            }
-            case 11: {
-                ComputeGaussian<11>(param, grad, hess, invSigmaSq, gaussian);
-                break;
-            }
-            case 12: {
-                ComputeGaussian<12>(param, grad, hess, invSigmaSq, gaussian);
-                break;
-            }
-            default: { ComputeGaussian<-1>(param, grad, hess, invSigmaSq, gaussian); }
-        }
-   }
+        DimDispatch<GaussianKernel, c_MaxFixedEigenDim>::Get(dim)(
+            param, dim, &vGrad[0], &vHess[0], gaussian);
+    }
 }
@@ -1,4 +1,5 @@
 #include "image.h"
+#include "timer.h"
 
 #include <OpenImageIO/imageio.h>
 namespace OpenImageIO = OIIO;
@@ -58,4 +59,111 @@ void WriteImage(const std::string &filename, const Image3 *image) {
                      &image->data[0]);
     out->close();
     // OpenImageIO::ImageOutput::destroy(out.get());
-}
\ No newline at end of file
+}
+
+Float *NewTile(SplatBuffer::ThreadTiles &threadTiles) {
+    if (threadTiles.freeTiles == 0) {
+        if (threadTiles.spareBlock == nullptr) {
+            threadTiles.spareBlock.reset(
+                new Float[SplatBuffer::blockTiles * SplatBuffer::tileFloats]);
+        }
+        threadTiles.blocks.push_back(std::move(threadTiles.spareBlock));
+        threadTiles.nextTile = threadTiles.blocks.back().get();
+        threadTiles.freeTiles = SplatBuffer::blockTiles;
+    }
+    Float *tile = threadTiles.nextTile;
+    threadTiles.nextTile += SplatBuffer::tileFloats;
+    threadTiles.freeTiles--;
+    std::fill(tile, tile + SplatBuffer::tileFloats, Float(0.0));
+    return tile;
+}
+
+void FlushSplats(SplatBuffer &buffer, const int tIndex) {
+    Timer timer;
+    Tick(timer);
+    SampleBuffer &target = buffer.target;
+    SplatBuffer::ThreadTiles &threadTiles = buffer.threadTiles[tIndex];
+    for (const int tileId : threadTiles.residentTiles) {
+        if (!threadTiles.dirty[tileId]) {
+            continue;
+        }
+        Float *tile = threadTiles.tiles[tileId];
+        const int x0 = (tileId % buffer.nXTiles) * SplatBuffer::tileSize;
+        const int y0 = (tileId / buffer.nXTiles) * SplatBuffer::tileSize;
+        const int x1 = std::min(x0 + SplatBuffer::tileSize, target.pixelWidth);
+        const int y1 = std::min(y0 + SplatBuffer::tileSize, target.pixelHeight);
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                Float *value = &tile[3 * ((y - y0) * SplatBuffer::tileSize + (x - x0))];
+                Pixel &pixel = target.pixels[y * target.pixelWidth + x];
+                for (int i = 0; i < 3; i++) {
+                    if (value[i] != Float(0.0)) {
+                        pixel[i].Add(value[i]);
+                        value[i] = Float(0.0);
+                    }
+                }
+            }
+        }
+        threadTiles.dirty[tileId] = 0;
+    }
+    // Allocated here rather than while splatting, unless all tiles already have their storage
+    const size_t numTiles = threadTiles.tiles.size();
+    if (threadTiles.spareBlock == nullptr &&
+        threadTiles.residentTiles.size() + size_t(threadTiles.freeTiles) < numTiles) {
+        threadTiles.spareBlock.reset(new Float[SplatBuffer::blockTiles * SplatBuffer::tileFloats]);
+    }
+    threadTiles.flushTime += Tick(timer);
+}
+
+Float FlushAllSplats(SplatBuffer &buffer) {
+    const int numThreads = int(buffer.threadTiles.size());
+    Float flushTime = Float(0.0);
+    for (int i = 0; i < numThreads; i++) {
+        FlushSplats(buffer, i);
+        flushTime += buffer.threadTiles[i].flushTime;
+    }
+    return flushTime;
+}
+
+void TakeSplats(SplatBuffer &buffer, const int tIndex, std::vector<PendingSplat> &splats) {
+    const SampleBuffer &target = buffer.target;
+    SplatBuffer::ThreadTiles &threadTiles = buffer.threadTiles[tIndex];
+    for (const int tileId : threadTiles.residentTiles) {
+        if (!threadTiles.dirty[tileId]) {
+            continue;
+        }
+        Float *tile = threadTiles.tiles[tileId];
+        const int x0 = (tileId % buffer.nXTiles) * SplatBuffer::tileSize;
+        const int y0 = (tileId / buffer.nXTiles) * SplatBuffer::tileSize;
+        const int x1 = std::min(x0 + SplatBuffer::tileSize, target.pixelWidth);
+        const int y1 = std::min(y0 + SplatBuffer::tileSize, target.pixelHeight);
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                Float *value = &tile[3 * ((y - y0) * SplatBuffer::tileSize + (x - x0))];
+                if (value[0] != Float(0.0) || value[1] != Float(0.0) || value[2] != Float(0.0)) {
+                    splats.push_back(
+                        PendingSplat{y * target.pixelWidth + x, {value[0], value[1], value[2]}});
+                    value[0] = value[1] = value[2] = Float(0.0);
+                }
+            }
+        }
+        threadTiles.dirty[tileId] = 0;
+    }
+}
+
+void RestoreSplats(SplatBuffer &buffer, const int tIndex, const std::vector<PendingSplat> &splats) {
+    const SampleBuffer &target = buffer.target;
+    SplatBuffer::ThreadTiles &threadTiles = buffer.threadTiles[tIndex];
+    for (const PendingSplat &splat : splats) {
+        const int ix = splat.pixel % target.pixelWidth;
+        const int iy = splat.pixel / target.pixelWidth;
+        const int tileId =
+            (iy / SplatBuffer::tileSize) * buffer.nXTiles + ix / SplatBuffer::tileSize;
+        Float *tile = UseTile(threadTiles, tileId);
+        const int offset = 3 * ((iy % SplatBuffer::tileSize) * SplatBuffer::tileSize +
+                                ix % SplatBuffer::tileSize);
+        for (int i = 0; i < 3; i++) {
+            tile[offset + i] += splat.value[i];
+        }
+    }
+}
@@ -49,25 +49,39 @@ struct Image3 {
 
 void WriteImage(const std::string &filename, const Image3 *image);
 
-using Pixel = std::array<AtomicFloat, 3>;
+// Accumulated in double precision: with single precision Float, small contributions are lost
+// against the running sums over long MCMC runs.  The splats themselves are buffered in Float
+// per thread (see SplatBuffer), so the wider type only costs on the flush.
+using Pixel = std::array<AtomicDouble, 3>;
 
-struct SampleBuffer {
-    SampleBuffer(const int pixelWidth, const int pixelHeight)
+template <typename PixelType>
+struct BasicSampleBuffer {
+    BasicSampleBuffer(const int pixelWidth, const int pixelHeight)
         : pixelWidth(pixelWidth), pixelHeight(pixelHeight) {
-        pixels = std::unique_ptr<Pixel[]>(new Pixel[pixelWidth * pixelHeight]);
+        pixels = std::unique_ptr<PixelType[]>(new PixelType[pixelWidth * pixelHeight]);
     }
 
-    std::unique_ptr<Pixel[]> pixels;
+    std::unique_ptr<PixelType[]> pixels;
 
     const int pixelWidth;
     const int pixelHeight;
 };
 
-inline void Splat(SampleBuffer &buffer, const Vector2 screenPos, const Vector3 &contrib) {
+using SampleBuffer = BasicSampleBuffer<Pixel>;
+
+// The single precision accumulation SampleBuffer had before, kept as the reference that
+// tests/film_accumulation.cpp measures the bias of
+using FloatPixel = std::array<AtomicFloat, 3>;
+using FloatSampleBuffer = BasicSampleBuffer<FloatPixel>;
+
+template <typename PixelType>
+inline void Splat(BasicSampleBuffer<PixelType> &buffer,
+                  const Vector2 screenPos,
+                  const Vector3 &contrib) {
     int ix = Clamp(int(screenPos[0] * buffer.pixelWidth), 0, buffer.pixelWidth - 1);
     int iy = Clamp(int(screenPos[1] * buffer.pixelHeight), 0, buffer.pixelHeight - 1);
 
-    Pixel &pixel = buffer.pixels[iy * buffer.pixelWidth + ix];
+    PixelType &pixel = buffer.pixels[iy * buffer.pixelWidth + ix];
 
     if (contrib.allFinite()) {
         for (int i = 0; i < int(pixel.size()); i++) {
@@ -76,6 +90,107 @@ inline void Splat(SampleBuffer &buffer, const Vector2 screenPos, const Vector3 &
     }
 }
 
+// Splat target that avoids the per-channel CAS of SampleBuffer on the hot path.  Every thread
+// accumulates into its own sparse set of tiles, which are only added to the shared
+// SampleBuffer by FlushSplats.  A tile is taken from a per-thread pool the first time the
+// thread splats into it and stays with the thread, a flush only clears it.  The pool grows by
+// blocks of tiles and keeps a spare block that the next flush replaces once it is used, so
+// after warm-up splatting never allocates and the pool never holds more than the tiles the
+// thread splatted into and two blocks.
+struct SplatBuffer {
+    static const int tileSize = 16;
+    static const int tileFloats = tileSize * tileSize * 3;
+    static const int blockTiles = 64;
+
+    struct ThreadTiles {
+        // The storage of every tile, null until the tile is first splatted into
+        std::vector<Float *> tiles;
+        // Whether a tile was splatted into since the previous flush
+        std::vector<uint8_t> dirty;
+        // The tiles in use, in the order they were first splatted into
+        std::vector<int> residentTiles;
+        // The blocks the tiles are taken from, the tiles of the last one from _nextTile_ on
+        // are not in use yet
+        std::vector<std::unique_ptr<Float[]>> blocks;
+        Float *nextTile = nullptr;
+        int freeTiles = 0;
+        // The block taken when the last one runs out between two flushes
+        std::unique_ptr<Float[]> spareBlock;
+        Float flushTime = Float(0.0);
+    };
+
+    SplatBuffer(SampleBuffer &target, const int numThreads)
+        : target(target),
+          nXTiles((target.pixelWidth + tileSize - 1) / tileSize),
+          nYTiles((target.pixelHeight + tileSize - 1) / tileSize),
+          threadTiles(numThreads) {
+        const size_t numTiles = size_t(nXTiles) * size_t(nYTiles);
+        for (auto &t : threadTiles) {
+            t.tiles.resize(numTiles, nullptr);
+            t.dirty.resize(numTiles, 0);
+            t.residentTiles.reserve(numTiles);
+            t.blocks.reserve((numTiles + blockTiles - 1) / blockTiles + 1);
+        }
+    }
+
+    SampleBuffer &target;
+    const int nXTiles;
+    const int nYTiles;
+    std::vector<ThreadTiles> threadTiles;
+};
+
+// Takes a cleared tile from the pool of _threadTiles_, the spare block or a new one when the
+// last block is used up
+Float *NewTile(SplatBuffer::ThreadTiles &threadTiles);
+
+// Returns tile _tileId_ of _threadTiles_ marked as dirty, takes it from the pool the first time
+// it is used
+inline Float *UseTile(SplatBuffer::ThreadTiles &threadTiles, const int tileId) {
+    Float *tile = threadTiles.tiles[tileId];
+    if (tile == nullptr) {
+        tile = NewTile(threadTiles);
+        threadTiles.tiles[tileId] = tile;
+        threadTiles.residentTiles.push_back(tileId);
+    }
+    threadTiles.dirty[tileId] = 1;
+    return tile;
+}
+
+inline void Splat(SplatBuffer &buffer, const Vector2 screenPos, const Vector3 &contrib) {
+    if (!contrib.allFinite()) {
+        return;
+    }
+    const SampleBuffer &target = buffer.target;
+    int ix = Clamp(int(screenPos[0] * target.pixelWidth), 0, target.pixelWidth - 1);
+    int iy = Clamp(int(screenPos[1] * target.pixelHeight), 0, target.pixelHeight - 1);
+    const int tileId = (iy / SplatBuffer::tileSize) * buffer.nXTiles + ix / SplatBuffer::tileSize;
+
+    Float *tile = UseTile(buffer.threadTiles[threadIndex], tileId);
+    const int offset =
+        3 * ((iy % SplatBuffer::tileSize) * SplatBuffer::tileSize + ix % SplatBuffer::tileSize);
+    for (int i = 0; i < 3; i++) {
+        tile[offset + i] += contrib[i];
+    }
+}
+
+// Adds the tiles of thread _tIndex_ to the target buffer and resets them, and replaces the
+// spare block of its pool if it was used. Has to be called by the thread owning the tiles or
+// when no thread is splatting
+void FlushSplats(SplatBuffer &buffer, const int tIndex);
+// Flushes the tiles of all threads, returns the accumulated flush time over all threads
+Float FlushAllSplats(SplatBuffer &buffer);
+
+// A pixel of the tiles that was not flushed yet
+struct PendingSplat {
+    int pixel;
+    Float value[3];
+};
+// Moves the splats that thread _tIndex_ has not flushed into _splats_ instead of the target
+// buffer, and adds such splats back to the tiles of _tIndex_. As FlushSplats, both are called
+// by the thread owning the tiles.
+void TakeSplats(SplatBuffer &buffer, const int tIndex, std::vector<PendingSplat> &splats);
+void RestoreSplats(SplatBuffer &buffer, const int tIndex, const std::vector<PendingSplat> &splats);
+
 inline void MergeBuffer(const SampleBuffer &buffer1,
                         const Float b1Weight,
                         const SampleBuffer &buffer2,
@@ -90,8 +205,8 @@ inline void MergeBuffer(const SampleBuffer &buffer1,
         const Pixel &pixel2 = buffer2.pixels[i];
         Pixel &pixelOut = bufferOut.pixels[i];
         for (int j = 0; j < int(pixelOut.size()); j++) {
-            pixelOut[j].Add(b1Weight * pixel1[j]);
-            pixelOut[j].Add(b2Weight * pixel2[j]);
+            pixelOut[j].Add(double(b1Weight) * double(pixel1[j]) +
+                            double(b2Weight) * double(pixel2[j]));
         }
     }
 }
@@ -101,7 +216,7 @@ inline void BufferToFilm(const SampleBuffer &buffer,
                          const Float factor = Float(1.0)) {
     for (int i = 0; i < buffer.pixelWidth * buffer.pixelHeight; i++) {
         const Pixel &pixel = buffer.pixels[i];
-        Vector3 color = factor * Vector3(Float(pixel[0]), Float(pixel[1]), Float(pixel[2]));
+        Vector3 color(Float(factor * pixel[0]), Float(factor * pixel[1]), Float(factor * pixel[2]));
         film->At(i) = color;
     }
 }
@@ -67,9 +67,10 @@ struct Light {
     Float samplingWeight;
 };
 
+// Empty until a path samples a light or hits one, paths without a light subpath keep it so
 struct LightInst {
-    const Light *light;
-    LightPrimID lPrimID;
+    const Light *light = nullptr;
+    LightPrimID lPrimID = 0;
 };
 
 const ADFloat *SampleDirect(const ADFloat *buffer,
@@ -102,9 +102,9 @@ ZStream::~ZStream() {
     inflateEnd(&m_inflateStream);
 }
 
-inline void ComputeNormal(const std::vector<Vector3> &vertices,
-                          const std::vector<TriIndex> &triangles,
-                          std::vector<Vector3> &normals,
+inline void ComputeNormal(const VertexBuffer &vertices,
+                          const TriIndexBuffer &triangles,
+                          NormalBuffer &normals,
                           bool flipNormals) {
     normals.resize(vertices.size(), Vector3::Zero());
 
@@ -269,8 +269,8 @@ std::shared_ptr<TriMeshData> LoadSerialized(const std::string &filename,
 
     std::shared_ptr<TriMeshData> data = std::make_shared<TriMeshData>();
     data->isMoving = isMoving;
-    data->position0 = std::vector<Vector3>(vertexCount);
-    data->position1 = std::vector<Vector3>(vertexCount);
+    data->position0 = VertexBuffer(vertexCount);
+    data->position1 = VertexBuffer(vertexCount);
     if (fileDoublePrecision) {
         LoadPosition<double>(zs, data, toWorld0, toWorld1, isMoving);
     } else {
@@ -278,8 +278,8 @@ std::shared_ptr<TriMeshData> LoadSerialized(const std::string &filename,
     }
 
     if (flags & EHasNormals) {
-        data->normal0 = std::vector<Vector3>(vertexCount);
-        data->normal1 = std::vector<Vector3>(vertexCount);
+        data->normal0 = NormalBuffer(vertexCount);
+        data->normal1 = NormalBuffer(vertexCount);
         if (fileDoublePrecision) {
             LoadNormal<double>(zs, data, invToWorld0, invToWorld1, isMoving, flipNormals);
         } else {
@@ -288,7 +288,7 @@ std::shared_ptr<TriMeshData> LoadSerialized(const std::string &filename,
     }
 
     if (flags & EHasTexcoords) {
-        data->st = std::vector<Vector2>(vertexCount);
+        data->st = STBuffer(vertexCount);
         if (fileDoublePrecision) {
             LoadUV<double>(zs, data);
         } else {
@@ -297,7 +297,7 @@ std::shared_ptr<TriMeshData> LoadSerialized(const std::string &filename,
     }
 
     if (flags & EHasColors) {
-        data->colors = std::vector<Vector3>(vertexCount);
+        data->colors = NormalBuffer(vertexCount);
         if (fileDoublePrecision) {
             LoadColor<double>(zs, data);
         } else {
@@ -305,7 +305,7 @@ std::shared_ptr<TriMeshData> LoadSerialized(const std::string &filename,
         }
     }
 
-    data->indices = std::vector<TriIndex>(triangleCount);
+    data->indices = TriIndexBuffer(triangleCount);
     zs.read(&data->indices[0], triangleCount * sizeof(TriIndex));
     if (data->normal0.size() == 0 || faceNormals) {
         ComputeNormal(data->position0, data->indices, data->normal0, flipNormals);
@@ -44,8 +44,14 @@ int main(int argc, char *argv[]) {
         bool compileBidirPathLib = false;
         bool compileBidirPathLib2 = false;
         int maxDervDepth = 8;
+        bool lazyDerivatives = false;
         std::vector<std::string> filenames;
         int seedoffset = 0;
+        bool resume = false;
+        int64_t checkpointStep = 0;
+        int initPathBatch = -1;
+        bool requireNoAllocations = false;
+        bool useSceneCache = false;
         for (int i = 1; i < argc; ++i) {
             if (std::string(argv[i]) == "--compile-pathlib") {
                 compilePathLib = true;
@@ -57,6 +63,24 @@ int main(int argc, char *argv[]) {
                 maxDervDepth = std::stoi(std::string(argv[++i]));
             } else if (std::string(argv[i]) == "--seedoffset") {
                 seedoffset = std::stoi(std::string(argv[++i]));
+            } else if (std::string(argv[i]) == "--resume") {
+                resume = true;
+            } else if (std::string(argv[i]) == "--checkpoint-at") {
+                checkpointStep = std::stoll(std::string(argv[++i]));
+            } else if (std::string(argv[i]) == "--init-path-batch") {
+                initPathBatch = std::stoi(std::string(argv[++i]));
+            } else if (std::string(argv[i]) == "--require-no-allocations") {
+                requireNoAllocations = true;
+            } else if (std::string(argv[i]) == "--scene-cache") {
+                useSceneCache = true;
+            } else if (std::string(argv[i]) == "--lazy-derivatives") {
+                lazyDerivatives = true;
+            } else if (std::string(argv[i]) == "--interpret-path-funcs") {
+                SetPathFuncBackend(Library::Backend::Interpreted);
+            } else if (std::string(argv[i]) == "--no-simplify-derivatives") {
+                SetSimplifyExprs(false);
+            } else if (std::string(argv[i]) == "--thread-affinity") {
+                SetThreadAffinity(true);
             }
             else {
                 filenames.push_back(std::string(argv[i]));
@@ -83,25 +107,31 @@ int main(int argc, char *argv[]) {
                 filename = filename.substr(filename.rfind('/') + 1);
             }
 
-            std::unique_ptr<Scene> scene = ParseScene(filename);
+            std::unique_ptr<Scene> scene = ParseScene(filename, useSceneCache);
 
             std::string integrator = scene->options->integrator;
                 
             scene->options->seedOffset = seedoffset;
+            scene->options->resume = resume;
+            scene->options->checkpointStep = checkpointStep;
+            if (initPathBatch >= 0) {
+                scene->options->initPathBatch = initPathBatch;
+            }
+            scene->options->requireNoAllocations = requireNoAllocations;
             
             std::cout << "Scene parsing done !" << std::endl;
             if (integrator == "mc") {
-                std::shared_ptr<const PathFuncLib> library =
-                    BuildPathFuncLibrary(scene->options->bidirectional, maxDervDepth);
+                std::shared_ptr<const PathFuncLib> library = BuildPathFuncLibrary(
+                    scene->options->bidirectional, maxDervDepth, lazyDerivatives);
                 PathTrace(scene.get(), library);
             } else if (integrator == "mcmc") {
                 if (scene->options->mala) { // MALA builds only first-order derivatives
                     std::shared_ptr<const PathFuncLib> library = 
-                        BuildPathFuncLibrary2(maxDervDepth);
+                        BuildPathFuncLibrary2(maxDervDepth, lazyDerivatives);
                     MLT(scene.get(), library);
                 } else {    // Hessian otherwise 
-                    std::shared_ptr<const PathFuncLib> library =
-                        BuildPathFuncLibrary(scene->options->bidirectional, maxDervDepth);
+                    std::shared_ptr<const PathFuncLib> library = BuildPathFuncLibrary(
+                        scene->options->bidirectional, maxDervDepth, lazyDerivatives);
                     MLT(scene.get(), library);
                 }
             } else {
@@ -20,25 +20,16 @@ void ComputeGaussian(const int dim,
     const Float shrk = inverse(shk * shk);
 	if (sc <= Float(1e-10)) {
         const Float cov = Float(shk);
-        if (gaussian.mean.size() != dim) {
-            gaussian.mean = Vector::Zero(dim);
-            gaussian.invCov_d = Vector::Constant(dim, shrk);
-            gaussian.covL_d = Vector::Constant(dim, cov);
-        } else {
-            for (int i = 0; i < dim; i++) {
-                gaussian.mean[i] = Float(0.0);
-                gaussian.invCov_d[i] = shrk;
-                gaussian.covL_d[i] = cov;
-            }
+        Resize(gaussian, dim);
+        for (int i = 0; i < dim; i++) {
+            gaussian.mean[i] = Float(0.0);
+            gaussian.invCov_d[i] = shrk;
+            gaussian.covL_d[i] = cov;
         }
         gaussian.logDet = dim * fastlog(inverse(shk * shk));
     }
     else {
-        if (gaussian.mean.size() != dim) {
-            gaussian.mean = Vector::Zero(dim);
-            gaussian.covL_d = Vector::Zero(dim);
-            gaussian.invCov_d = Vector::Zero(dim);
-        }
+        Resize(gaussian, dim);
     	for (int i = 0; i < dim; i++) {
             Float cov_t = ss * ss * (M[i] + Float(1.0));
             Float invcov = inverse(cov_t) + shrk; 
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// An array that either owns its elements or refers to elements that live elsewhere, typically
+// in the mapping of a SceneCache. Whoever holds a view keeps the memory alive (see
+// TriMeshData::storage). A view is read-only memory, so it is copied into owned storage before
+// anything writes to it; loaders only ever fill owned arrays.
+template <typename T, typename Alloc = std::allocator<T>>
+class MappedArray {
+    public:
+    MappedArray() {
+    }
+    explicit MappedArray(const size_t count) : owned(count) {
+    }
+    MappedArray(const T *viewData, const size_t viewSize)
+        : view(viewSize > 0 ? viewData : nullptr), viewSize(viewSize) {
+    }
+
+    bool IsView() const {
+        return view != nullptr;
+    }
+    size_t size() const {
+        return view != nullptr ? viewSize : owned.size();
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+    const T *data() const {
+        return view != nullptr ? view : owned.data();
+    }
+    T *data() {
+        Own();
+        return owned.data();
+    }
+    const T &operator[](const size_t i) const {
+        return data()[i];
+    }
+    T &operator[](const size_t i) {
+        Own();
+        return owned[i];
+    }
+    const T *begin() const {
+        return data();
+    }
+    const T *end() const {
+        return data() + size();
+    }
+    T *begin() {
+        return data();
+    }
+    T *end() {
+        return data() + size();
+    }
+    const T &back() const {
+        return data()[size() - 1];
+    }
+    T &back() {
+        Own();
+        return owned.back();
+    }
+
+    void resize(const size_t count) {
+        Own();
+        owned.resize(count);
+    }
+    void resize(const size_t count, const T &value) {
+        Own();
+        owned.resize(count, value);
+    }
+    void reserve(const size_t count) {
+        Own();
+        owned.reserve(count);
+    }
+    void push_back(const T &value) {
+        Own();
+        owned.push_back(value);
+    }
+    void assign(const T *first, const T *last) {
+        view = nullptr;
+        viewSize = 0;
+        owned.assign(first, last);
+    }
+    void clear() {
+        view = nullptr;
+        viewSize = 0;
+        owned.clear();
+    }
+
+    private:
+    void Own() {
+        if (view != nullptr) {
+            owned.assign(view, view + viewSize);
+            view = nullptr;
+            viewSize = 0;
+        }
+    }
+
+    std::vector<T, Alloc> owned;
+    const T *view = nullptr;
+    size_t viewSize = 0;
+};
@@ -0,0 +1,36 @@
+#include "mappedfile.h"
+#include "commondef.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string &filename) {
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        Error("Unable to open " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        Error("Unable to stat " + filename);
+    }
+    size = size_t(st.st_size);
+    if (size > 0) {
+        void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            Error("Unable to map " + filename);
+        }
+        madvise(ptr, size, MADV_WILLNEED);
+        data = static_cast<const char *>(ptr);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data != nullptr) {
+        munmap(const_cast<char *>(data), size);
+    }
+}
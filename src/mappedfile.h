@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+
+// A read-only mapping of a whole file
+class MappedFile {
+    public:
+    MappedFile(const std::string &filename);
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data = nullptr;
+    size_t size = 0;
+};
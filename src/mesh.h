@@ -2,7 +2,9 @@
 
 #include "commondef.h"
 #include "utils.h"
+#include "mappedarray.h"
 
+#include <memory>
 #include <vector>
 
 struct TriIndex {
@@ -18,17 +20,36 @@ struct TriIndex {
 
 std::ostream& operator<<(std::ostream& os, const TriIndex& triindex);
 
+// Positions and indices are handed to Embree as shared buffers instead of being copied. Embree
+// reads the last element of a shared buffer with a 16-byte load, hence the padding (the scene
+// cache pads the arrays it maps the same way).
+using VertexBuffer = MappedArray<Vector3, padded_allocator<Vector3, 16>>;
+using TriIndexBuffer = MappedArray<TriIndex, padded_allocator<TriIndex, 16>>;
+using NormalBuffer = MappedArray<Vector3>;
+using STBuffer = MappedArray<Vector2>;
+
 struct TriMeshData {
-    std::vector<Vector3> position0;
-    std::vector<Vector3> position1;
-    std::vector<Vector3> normal0;
-    std::vector<Vector3> normal1;
-    std::vector<Vector2> st;
-    std::vector<Vector3> colors;
-    std::vector<TriIndex> indices;
+    VertexBuffer position0;
+    VertexBuffer position1;
+    NormalBuffer normal0;
+    NormalBuffer normal1;
+    STBuffer st;
+    NormalBuffer colors;
+    TriIndexBuffer indices;
     bool isMoving;
+    // The distribution of the triangle areas, only computed for the meshes of area lights
+    // (see ComputeAreaDistribution)
+    MappedArray<Float> areaFunc;
+    MappedArray<Float> areaCdf;
+    Float areaFuncInt = Float(0.0);
+    Float totalArea = Float(0.0);
+    // Keeps the memory of the arrays that are views alive
+    std::shared_ptr<const void> storage;
 };
 
+// Fills the area distribution of _data_ with the layout of PiecewiseConstant1D
+void ComputeAreaDistribution(TriMeshData &data);
+
 // Numerical robust computation of angle between unit vectors
 template <typename VectorType>
 inline Float UnitAngle(const VectorType &u, const VectorType &v) {
@@ -39,9 +60,9 @@ inline Float UnitAngle(const VectorType &u, const VectorType &v) {
 }
 
 
-inline void ComputeNormal(const std::vector<Vector3> &vertices,
-                          const std::vector<TriIndex> &triangles,
-                          std::vector<Vector3> &normals) {
+inline void ComputeNormal(const VertexBuffer &vertices,
+                          const TriIndexBuffer &triangles,
+                          NormalBuffer &normals) {
     normals.resize(vertices.size(), Vector3::Zero());
 
     // Nelson Max, "Computing Vertex Vector3ds from Facet Vector3ds", 1999
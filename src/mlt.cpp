@@ -6,6 +6,11 @@
 #include "mutation_h2mc.h"
 #include "mutation_mala.h"
 #include "fastmath.h"
+#include "allocation.h"
+#include "checkpoint.h"
+#include <algorithm>
+#include <array>
+#include <shared_mutex>
 #include <omp.h>
 /**
  *  We implement a hybrid algorithm that combines Primary Sample Space MLT [Kelemen et al. 2002]
@@ -17,12 +22,224 @@
  *  we fix the camera and light subpath lengthes of the state.
  */
 
+void DervBatch::Add(const MLTState &mltState,
+                    const SubpathContrib &spContrib,
+                    const SerializedSubpath &ssubPath,
+                    const Float *sceneParams,
+                    const int dim,
+                    Float *grad,
+                    Float *hess) {
+    bool ready;
+    Request request;
+    request.pair = {spContrib.camDepth, spContrib.lightDepth};
+    request.derv = FindDervFunc(mltState, spContrib, ready);
+    request.dervBatch = FindDervBatchFunc(mltState, spContrib);
+    request.screenPos = &spContrib.screenPos[0];
+    request.ssubPath = &ssubPath;
+    request.sceneParams = sceneParams;
+    request.dim = dim;
+    request.grad = grad;
+    request.hess = hess;
+    requests.push_back(request);
+}
+
+void DervBatch::Flush() {
+    std::stable_sort(requests.begin(),
+                     requests.end(),
+                     [](const Request &r0, const Request &r1) { return r0.pair < r1.pair; });
+    for (size_t begin = 0; begin < requests.size();) {
+        size_t end = begin + 1;
+        while (end < requests.size() && requests[end].pair == requests[begin].pair &&
+               (requests[end].hess == nullptr) == (requests[begin].hess == nullptr)) {
+            end++;
+        }
+        const Request &first = requests[begin];
+        const int count = int(end - begin);
+        if (count == 1 || first.dervBatch == nullptr) {
+            for (size_t r = begin; r < end; r++) {
+                const Request &request = requests[r];
+                request.derv(request.screenPos,
+                             &request.ssubPath->primary[0],
+                             request.sceneParams,
+                             &request.ssubPath->vertParams[0],
+                             request.grad,
+                             request.hess);
+            }
+            begin = end;
+            continue;
+        }
+
+        const int dim = first.dim;
+        const size_t primarySize = GetPrimaryParamSize(first.pair.first, first.pair.second);
+        const size_t vertParamSize = GetVertParamSize(first.pair.first, first.pair.second);
+        screenPos.resize(2 * count);
+        primary.resize(primarySize * count);
+        vertParams.resize(vertParamSize * count);
+        grad.resize(dim * count);
+        if (first.hess != nullptr) {
+            hess.resize(dim * dim * count);
+        }
+        for (int i = 0; i < count; i++) {
+            const Request &request = requests[begin + i];
+            for (int j = 0; j < 2; j++) {
+                screenPos[j * count + i] = request.screenPos[j];
+            }
+            for (size_t j = 0; j < primarySize; j++) {
+                primary[j * count + i] = request.ssubPath->primary[j];
+            }
+            for (size_t j = 0; j < vertParamSize; j++) {
+                vertParams[j * count + i] = request.ssubPath->vertParams[j];
+            }
+        }
+        first.dervBatch(count,
+                        &screenPos[0],
+                        &primary[0],
+                        first.sceneParams,
+                        &vertParams[0],
+                        &grad[0],
+                        first.hess != nullptr ? &hess[0] : nullptr);
+        for (int i = 0; i < count; i++) {
+            const Request &request = requests[begin + i];
+            for (int j = 0; j < dim; j++) {
+                request.grad[j] = grad[j * count + i];
+            }
+            if (request.hess != nullptr) {
+                for (int j = 0; j < dim * dim; j++) {
+                    request.hess[j] = hess[j * count + i];
+                }
+            }
+        }
+        begin = end;
+    }
+    requests.clear();
+}
+
+static void Save(CheckpointWriter &writer, const MarkovState &state) {
+    writer.Write(state.valid);
+    writer.Write(state.spContrib);
+    writer.Write(state.path);
+    writer.Write(state.scoreSum);
+    writer.Write(state.pss);
+    writer.Write(state.gaussianInitialized);
+    writer.Write(state.gaussian);
+    writer.Write(uint64_t(state.toSplat.size()));
+    for (const SplatSample &splat : state.toSplat) {
+        writer.Write(splat.screenPos);
+        writer.Write(splat.contrib);
+    }
+}
+
+static void Load(CheckpointReader &reader, MarkovState &state) {
+    reader.Read(state.valid);
+    reader.Read(state.spContrib);
+    reader.Read(state.path);
+    reader.Read(state.scoreSum);
+    reader.Read(state.pss);
+    reader.Read(state.gaussianInitialized);
+    reader.Read(state.gaussian);
+    uint64_t numSplats;
+    reader.Read(numSplats);
+    state.toSplat.resize(numSplats);
+    for (SplatSample &splat : state.toSplat) {
+        reader.Read(splat.screenPos);
+        reader.Read(splat.contrib);
+    }
+}
+
+// Everything but the cache, which the chains share. The path of the last proposal is only
+// pushed to the cache, and only defined, while the chain is buffered.
+static void Save(CheckpointWriter &writer, const Chain &chain) {
+    writer.Write(chain.pss);
+    writer.Write(chain.last_pss);
+    writer.Write(chain.v1);
+    writer.Write(chain.v2);
+    writer.Write(chain.g);
+    writer.Write(chain.M);
+    writer.Write(chain.curr_new_v1);
+    writer.Write(chain.curr_new_v2);
+    writer.Write(chain.curr_new_g);
+    writer.Write(chain.prop_new_v1);
+    writer.Write(chain.prop_new_v2);
+    writer.Write(chain.prop_new_g);
+    writer.Write(chain.buffered);
+    if (chain.buffered) {
+        writer.Write(chain.path);
+        writer.Write(chain.spContrib);
+        writer.Write(chain.pathWeight);
+    }
+    writer.Write(chain.proposalDifferentiated);
+    writer.Write(chain.differentiated);
+    writer.Write(chain.ss);
+    writer.Write(chain.chainId);
+    writer.Write(chain.t);
+    writer.Write(chain.queried);
+}
+
+static void Load(CheckpointReader &reader, Chain &chain) {
+    reader.Read(chain.pss);
+    reader.Read(chain.last_pss);
+    reader.Read(chain.v1);
+    reader.Read(chain.v2);
+    reader.Read(chain.g);
+    reader.Read(chain.M);
+    reader.Read(chain.curr_new_v1);
+    reader.Read(chain.curr_new_v2);
+    reader.Read(chain.curr_new_g);
+    reader.Read(chain.prop_new_v1);
+    reader.Read(chain.prop_new_v2);
+    reader.Read(chain.prop_new_g);
+    reader.Read(chain.buffered);
+    if (chain.buffered) {
+        reader.Read(chain.path);
+        reader.Read(chain.spContrib);
+        reader.Read(chain.pathWeight);
+    }
+    reader.Read(chain.proposalDifferentiated);
+    reader.Read(chain.differentiated);
+    reader.Read(chain.ss);
+    reader.Read(chain.chainId);
+    reader.Read(chain.t);
+    reader.Read(chain.queried);
+}
+
+template <int dim>
+static void Save(CheckpointWriter &writer, const cache_record_t<dim> &record) {
+    writer.Write(record.pss);
+    writer.Write(record.v1);
+    writer.Write(record.v2);
+    writer.Write(record.tag);
+    writer.Write(record.pathWeight);
+    writer.Write(record.path);
+}
+
+template <int dim>
+static void Load(CheckpointReader &reader, cache_record_t<dim> &record) {
+    reader.Read(record.pss);
+    reader.Read(record.v1);
+    reader.Read(record.v2);
+    reader.Read(record.tag);
+    reader.Read(record.pathWeight);
+    reader.Read(record.path);
+}
+
+// The samples of a chain that ProgressReporter was told about after _steps_ of its
+// _numSamples_ steps
+static uint64_t ReportedWork(const int64_t numSamples, const int64_t steps, const int reportInterval) {
+    if (steps >= numSamples) {
+        return uint64_t(((numSamples - 1) / reportInterval) * reportInterval +
+                        numSamples % reportInterval);
+    }
+    return steps > 0 ? uint64_t(((steps - 1) / reportInterval) * reportInterval) : 0;
+}
+
 void MLT(const Scene *scene, const std::shared_ptr<const PathFuncLib> pathFuncLib) {
     const MLTState mltState{scene,
                             GeneratePathBidir,
                             PerturbPathBidir,
                             pathFuncLib->staticFuncMap,
-                            pathFuncLib->staticDervFuncMap};
+                            pathFuncLib->staticDervFuncMap,
+                            pathFuncLib->staticDervBatchFuncMap,
+                            pathFuncLib->lazyDervFuncs.get()};
     const int spp = scene->options->spp;
     std::shared_ptr<const Camera> camera = scene->camera;
     const Float largeStepProb = scene->options->largeStepProbability;
@@ -49,169 +266,645 @@ void MLT(const Scene *scene, const std::shared_ptr<const PathFuncLib> pathFuncLi
     ProgressReporter reporter(totalSamples);
     const int reportInterval = 1000;
     int intervalImgId = 1;
+    // Until then a chain may still grow its buffers for a longer path than it has seen so far
+    const int allocationWarmup = reportInterval;
+    std::atomic<uint64_t> steadyAllocations(0);
+    // The scene queries and BSDF samples of the perturbations of every mutation type
+    constexpr int numMutationTypes = int(MutationType::MALASmall) + 1;
+    std::atomic<uint64_t> raysTraced[numMutationTypes] = {};
+    std::atomic<uint64_t> raysReused[numMutationTypes] = {};
+    std::atomic<uint64_t> bsdfSampled[numMutationTypes] = {};
+    std::atomic<uint64_t> bsdfReused[numMutationTypes] = {};
+    // The proposals of every mutation type and the sum of their acceptance probabilities
+    std::atomic<uint64_t> proposals[numMutationTypes] = {};
+    AtomicDouble acceptance[numMutationTypes];
+    // The derivatives that the small steps evaluated
+    std::atomic<uint64_t> smallStepDerivatives(0);
 
-    GlobalCache globalCache; 
+    cache_index_config_t cacheIndex;
+    cacheIndex.type = scene->options->cacheIndex == "rpforest" ? CacheIndex::RPForest
+                                                               : CacheIndex::KDTree;
+    cacheIndex.numTrees = scene->options->cacheIndexTrees;
+    GlobalCache globalCache(MaxThreadIndex(), scene->options->maxDepth, cacheIndex); 
 
     SampleBuffer indirectBuffer(pixelWidth, pixelHeight);
+    // Chains splat into per-thread tiles that are merged into indirectBuffer at report
+    // intervals, unless the scene asks for the direct atomic splatting
+    std::unique_ptr<SplatBuffer> splatBuffer =
+        scene->options->threadLocalSplat
+            ? std::unique_ptr<SplatBuffer>(new SplatBuffer(indirectBuffer, MaxThreadIndex()))
+            : nullptr;
+    // A thread flushes its tiles and reports the work they hold under a shared lock, the
+    // intermediate images are taken under an exclusive one: indirectBuffer then holds the splats
+    // of exactly the work reported so far (direct atomic splats land before they are reported)
+    std::shared_mutex splatFlushMutex;
+    auto splatIndirect = [&](const Vector2 screenPos, const Vector3 &contrib) {
+        if (splatBuffer) {
+            Splat(*splatBuffer, screenPos, contrib);
+        } else {
+            Splat(indirectBuffer, screenPos, contrib);
+        }
+    };
     Timer timer;
     Tick(timer);
 
     std::chrono::time_point<std::chrono::system_clock> _start_t = std::chrono::system_clock::now();
-    ParallelFor([&](const int chainId) {
-        const int seed = chainId + scene->options->seedOffset;
-        RNG rng(seed);
-        std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
-
-        int64_t numSamplesThisChain =
-            numSamplesPerChain + ((chainId < chainsNeedExtraSamples) ? 1 : 0);
-        std::vector<Float> contribCdf;
-        MarkovState currentState = initStates[chainId];
-        MarkovState proposalState{false};
-        int64_t adjacentReject = 0;
-        std::unique_ptr<LargeStep> largeStep = scene->options->sampleFromGlobalCache && scene->options->mala ? 
-            std::unique_ptr<LargeStepCache>(new LargeStepCache(lengthDist, pathFuncLib->maxDepth)): // sample from global cache
-            std::unique_ptr<LargeStep>(new LargeStep(lengthDist)); 
-        std::unique_ptr<Mutation> smallStep =
-            scene->options->h2mc // H2MC
-                ? std::unique_ptr<Mutation>(new H2MCSmallStep(scene,
-                                                              pathFuncLib->maxDepth,
-                                                              scene->options->perturbStdDev))
-                : 
-                ( 
-                scene->options->mala // LMC
-                    ? std::unique_ptr<Mutation>(new MALASmallStep(scene, 
-                                                                  pathFuncLib->maxDepth))
-                : std::unique_ptr<Mutation>(new SmallStep()) // Isotropic   
-                );
-                
+    // Chains run in groups that take their steps in lockstep, so that the small step
+    // proposals of a group are differentiated together by the batched derivative entries.
+    // Every chain still draws from its own generator in the same order; only the rounding of
+    // the vectorized derivatives differs from the one by one evaluation.
+    // The interpreter has no batched entries, there the lockstep only adds overhead
+    int chainBatch = std::max(scene->options->chainBatch, 1);
+    if (chainBatch > 1 && !PathFuncHasBatch()) {
+        std::cout << "[Warning] chainbatch needs the batched entries of the compiled path "
+                     "functions, running chains one by one"
+                  << std::endl;
+        chainBatch = 1;
+    }
+    const int64_t numGroups = (numChains + chainBatch - 1) / chainBatch;
+    struct ChainRun {
+        int chainId;
+        RNG rng;
+        int64_t numSamples;
+        MarkovState currentState;
+        MarkovState proposalState;
+        int64_t adjacentReject;
+        std::unique_ptr<LargeStep> largeStep;
+        std::unique_ptr<Mutation> smallStep;
         Chain chain;
-        chain.chainId = chainId;    
-        chain.globalCache = &globalCache;
-        chain.ss = scene->options->malaStepsize;
-        for (int sampleIdx = 0; sampleIdx < numSamplesThisChain; sampleIdx++) {
-            // std::cout << "-chainId[ " << chainId << "] mutationCtr[" << sampleIdx << "]" << std::endl;
-            Float a = Float(1.0);
-            bool isLargeStep = false;
-            // In online exploration stage, use a smaller largestep prob to ensure MALA chain learns better pc. matrix
-            // In H2MC case, this is disabled and lsScale will always be 1.0 
-            Float lsScale = (sampleIdx > numSamplesThisChain * LS_RATIO) ? scene->options->largeStepProbScale : Float(1.0);
-            if (!currentState.valid || uniDist(rng) < largeStepProb * lsScale) {
-                isLargeStep = true;
-                // std::cout << "-largeStep chainId[ " << chainId << "] mutationCtr[" << sampleIdx << "]" << std::endl;
-                a = largeStep->Mutate(mltState, normalization, currentState, proposalState, rng, &chain);
-                // std::cout << "+largeStep chainId[ " << chainId << "] mutationCtr[" << sampleIdx << "]" << std::endl;
+        // The step in flight
+        Float a;
+        bool isLargeStep;
+        bool pending;
+    };
+
+    // A checkpoint stops every running group between two of its steps. indirectBuffer holds
+    // the splats of the reported steps, the splats of the later steps are still in the tiles of
+    // the group's thread and go into the checkpoint next to its chains. It is copied while the
+    // chains wait and written to disk while they go on.
+    const std::string checkpointFile = scene->outputName + ".checkpoint";
+    struct GroupProgress {
+        // The steps the group took so far
+        int64_t steps = 0;
+        bool done = false;
+        // The chains of the group, while it runs
+        std::vector<ChainRun> *runs = nullptr;
+        // The splats of the group that were not flushed when it parked
+        std::vector<PendingSplat> splats;
+        // The chains and splats of a resumed or stopped group that does not run, as in the
+        // checkpoint
+        std::vector<char> resumed;
+    };
+    std::vector<GroupProgress> groupProgress(numGroups);
+    auto saveRun = [&](CheckpointWriter &writer, const ChainRun &run) {
+        writer.Write(run.rng);
+        writer.Write(run.adjacentReject);
+        Save(writer, run.currentState);
+        Save(writer, run.proposalState);
+        writer.Write(run.largeStep->lastScoreSum);
+        writer.Write(run.largeStep->lastScore);
+        Save(writer, run.chain);
+    };
+    auto loadRun = [&](CheckpointReader &reader, ChainRun &run) {
+        reader.Read(run.rng);
+        reader.Read(run.adjacentReject);
+        Load(reader, run.currentState);
+        Load(reader, run.proposalState);
+        reader.Read(run.largeStep->lastScoreSum);
+        reader.Read(run.largeStep->lastScore);
+        Load(reader, run.chain);
+    };
+    auto saveGroup = [&](CheckpointWriter &writer,
+                         const std::vector<ChainRun> &runs,
+                         const std::vector<PendingSplat> &splats) {
+        for (const ChainRun &run : runs) {
+            saveRun(writer, run);
+        }
+        writer.Write(splats);
+    };
+    // The settings a checkpoint has to be resumed with, the brightness checks that the
+    // bootstrap found the same initial states
+    auto saveSettings = [&](CheckpointWriter &writer) {
+        writer.Write(numChains);
+        writer.Write(chainBatch);
+        writer.Write(totalSamples);
+        writer.Write(pixelWidth);
+        writer.Write(pixelHeight);
+        writer.Write(scene->options->seedOffset);
+        writer.Write(normalization);
+    };
+    // The settings, the image, the cache and the groups are blocks of their own, so that a
+    // checkpoint can be compared part by part (see tests/checkpoint_compare.cpp)
+    auto captureCheckpoint = [&](CheckpointWriter &writer) {
+        size_t block = writer.BeginBlock();
+        saveSettings(writer);
+        writer.EndBlock(block);
+        block = writer.BeginBlock();
+        for (int64_t i = 0; i < numPixels; i++) {
+            for (const AtomicDouble &channel : indirectBuffer.pixels[i]) {
+                writer.Write(double(channel));
+            }
+        }
+        writer.EndBlock(block);
+        block = writer.BeginBlock();
+        globalCache.save(
+            [&](const auto &records) {
+                writer.Write(uint64_t(records.size()));
+                for (const auto *record : records) {
+                    Save(writer, *record);
+                }
+            },
+            [&](const int builds) { writer.Write(builds); });
+        writer.EndBlock(block);
+        block = writer.BeginBlock();
+        for (const GroupProgress &group : groupProgress) {
+            writer.Write(group.steps);
+            writer.Write(group.done);
+            if (group.done || group.steps == 0) {
+                continue;
+            }
+            if (group.runs == nullptr) {
+                writer.Write(group.resumed);
+                continue;
+            }
+            const size_t groupBlock = writer.BeginBlock();
+            saveGroup(writer, *group.runs, group.splats);
+            writer.EndBlock(groupBlock);
+        }
+        writer.EndBlock(block);
+    };
+
+    std::vector<char> resumeData;
+    if (scene->options->resume) {
+        resumeData = ReadCheckpointFile(checkpointFile);
+        CheckpointReader file(scene, resumeData.data(), resumeData.size());
+        std::vector<char> settings, pixels, cache, groups;
+        file.Read(settings);
+        file.Read(pixels);
+        file.Read(cache);
+        file.Read(groups);
+        CheckpointWriter expected(scene);
+        saveSettings(expected);
+        if (!file.AtEnd() || settings != expected.GetData()) {
+            Error("The checkpoint was written with different settings");
+        }
+        CheckpointReader pixelReader(scene, pixels.data(), pixels.size());
+        for (int64_t i = 0; i < numPixels; i++) {
+            for (AtomicDouble &channel : indirectBuffer.pixels[i]) {
+                double value;
+                pixelReader.Read(value);
+                channel = value;
+            }
+        }
+        CheckpointReader cacheReader(scene, cache.data(), cache.size());
+        globalCache.load(
+            [&](auto &records) {
+                uint64_t numRecords;
+                cacheReader.Read(numRecords);
+                records.resize(numRecords);
+                for (auto &record : records) {
+                    Load(cacheReader, record);
+                }
+            },
+            [&]() {
+                int builds;
+                cacheReader.Read(builds);
+                return builds;
+            });
+        CheckpointReader reader(scene, groups.data(), groups.size());
+        uint64_t resumedWork = 0;
+        for (int64_t groupId = 0; groupId < numGroups; groupId++) {
+            GroupProgress &group = groupProgress[groupId];
+            reader.Read(group.steps);
+            reader.Read(group.done);
+            if (!group.done && group.steps > 0) {
+                reader.Read(group.resumed);
+            }
+            const int64_t lastChain = std::min((groupId + 1) * chainBatch, numChains);
+            for (int64_t chainId = groupId * chainBatch; chainId < lastChain; chainId++) {
+                const int64_t numSamples =
+                    numSamplesPerChain + ((chainId < chainsNeedExtraSamples) ? 1 : 0);
+                resumedWork += ReportedWork(
+                    numSamples, group.done ? numSamples : group.steps, reportInterval);
+            }
+        }
+        if (!pixelReader.AtEnd() || !cacheReader.AtEnd() || !reader.AtEnd()) {
+            Error("The checkpoint does not match the scene");
+        }
+        reporter.Update(resumedWork);
+        if (scene->options->reportIntervalSpp > 0) {
+            intervalImgId +=
+                int(resumedWork / uint64_t(numPixels * scene->options->reportIntervalSpp));
+        }
+        std::cout << std::endl << "Resumed from " << checkpointFile << std::endl;
+    }
+
+    CheckpointBarrier checkpoints;
+    std::thread checkpointThread;
+    std::mutex checkpointMutex;
+    std::condition_variable checkpointCondition;
+    bool chainsDone = false;
+    if (scene->options->checkpointInterval > Float(0.0)) {
+        checkpointThread = std::thread([&]() {
+            const std::chrono::duration<double> interval(scene->options->checkpointInterval);
+            std::unique_lock<std::mutex> lock(checkpointMutex);
+            while (!checkpointCondition.wait_for(lock, interval, [&]() { return chainsDone; })) {
+                lock.unlock();
+                try {
+                    CheckpointWriter writer(scene);
+                    checkpoints.Capture([&]() { captureCheckpoint(writer); });
+                    WriteCheckpointFile(checkpointFile, writer.GetData());
+                } catch (std::exception &ex) {
+                    std::cerr << ex.what() << std::endl;
+                }
+                lock.lock();
+            }
+        });
+    }
+
+    ParallelFor([&](const int groupId) {
+        checkpoints.Enter();
+        GroupProgress &progress = groupProgress[groupId];
+        if (progress.done) {
+            checkpoints.Leave();
+            return;
+        }
+        std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
+        const int firstChain = groupId * chainBatch;
+        const int groupSize = int(std::min(int64_t(chainBatch), numChains - firstChain));
+        std::vector<ChainRun> runs(groupSize);
+        int64_t maxSamples = 0;
+        for (int i = 0; i < groupSize; i++) {
+            ChainRun &run = runs[i];
+            const int chainId = firstChain + i;
+            const int seed = chainId + scene->options->seedOffset;
+            run.chainId = chainId;
+            run.rng = RNG(seed);
+            run.numSamples = numSamplesPerChain + ((chainId < chainsNeedExtraSamples) ? 1 : 0);
+            maxSamples = std::max(maxSamples, run.numSamples);
+            run.proposalState.valid = false;
+            run.adjacentReject = 0;
+            run.largeStep = scene->options->sampleFromGlobalCache && scene->options->mala ? 
+                std::unique_ptr<LargeStepCache>(new LargeStepCache(lengthDist, pathFuncLib->maxDepth)): // sample from global cache
+                std::unique_ptr<LargeStep>(new LargeStep(lengthDist)); 
+            run.smallStep =
+                scene->options->h2mc // H2MC
+                    ? std::unique_ptr<Mutation>(new H2MCSmallStep(scene,
+                                                                  pathFuncLib->maxDepth,
+                                                                  scene->options->perturbStdDev))
+                    : 
+                    ( 
+                    scene->options->mala // LMC
+                        ? std::unique_ptr<Mutation>(new MALASmallStep(scene, 
+                                                                      pathFuncLib->maxDepth))
+                    : std::unique_ptr<Mutation>(new SmallStep()) // Isotropic   
+                    );
+            // Sized for the longest path, so that the steps do not allocate. A negative
+            // maxDepth leaves the paths unbounded and the buffers grow as needed.
+            const int maxDepth = scene->options->maxDepth;
+            if (maxDepth >= 0) {
+                Reserve(run.currentState, maxDepth);
+                Reserve(run.proposalState, maxDepth);
+                run.largeStep->Reserve(maxDepth);
+                run.smallStep->Reserve(maxDepth);
+            }
+            run.currentState = initStates[chainId];
+            run.chain.chainId = chainId;    
+            run.chain.globalCache = &globalCache;
+            run.chain.ss = scene->options->malaStepsize;
+        }
+        if (!progress.resumed.empty()) {
+            CheckpointReader reader(scene, progress.resumed.data(), progress.resumed.size());
+            for (ChainRun &run : runs) {
+                loadRun(reader, run);
+            }
+            // The splats of the steps that were not reported yet go back to the tiles, they
+            // are flushed with the next report as if the group had not stopped
+            std::vector<PendingSplat> splats;
+            reader.Read(splats);
+            if (splatBuffer) {
+                RestoreSplats(*splatBuffer, threadIndex, splats);
             } else {
-                // std::cout << "-SmallStep chainId[ " << chainId << "] mutationCtr[" << sampleIdx << "]" << std::endl;
-                a = smallStep->Mutate(mltState, normalization, currentState, proposalState, rng, &chain);
-                // std::cout << "+SmallStep chainId[ " << chainId << "] mutationCtr[" << sampleIdx << "]" << std::endl;
-            }
-            if (currentState.valid && a < Float(1.0)) {
-                for (const auto splat : currentState.toSplat) {
-                    Splat(indirectBuffer, splat.screenPos, (Float(1.0) - a) * splat.contrib);
-                }
-            }
-            if (a > Float(0.0)) {
-                for (const auto splat : proposalState.toSplat) {
-                    Splat(indirectBuffer, splat.screenPos, a * splat.contrib);
-                }
-            }
-            if (a > Float(0.0) && uniDist(rng) <= a) {
-                ToSubpath(proposalState.spContrib.camDepth,
-                          proposalState.spContrib.lightDepth,
-                          proposalState.path);
-                std::swap(currentState, proposalState);
-                currentState.valid = true;
-                adjacentReject = 0;
-                if (isLargeStep) {
-                    if (chain.buffered && chain.pathWeight > Float(1e-10)) {
-                        int dim = GetDimension(proposalState.path); 
-                        if (dim >= PSS_MIN_LENGTH && dim <= PSS_MAX_LENGTH && !globalCache.isReady(dim)) { // update global cache
-                            std::lock_guard<std::mutex> global_cache_lock(globalCache.getMutex(dim));
-                            globalCache.push(dim, chain.pss, chain.v1, chain.v2, 
-                                chain.path, chain.spContrib, chain.pathWeight);
-                        }
+                for (const PendingSplat &splat : splats) {
+                    for (int i = 0; i < 3; i++) {
+                        indirectBuffer.pixels[splat.pixel][i].Add(splat.value[i]);
                     }
-                    largeStep->lastScoreSum = currentState.scoreSum;
-                    largeStep->lastScore = currentState.spContrib.lsScore;
-                    currentState.gaussianInitialized = false;
-                    chain.buffered = false;
+                }
+            }
+            std::vector<char>().swap(progress.resumed);
+        }
+        progress.runs = &runs;
+        DervBatch dervBatch;
+        DervBatch *batch = chainBatch > 1 ? &dervBatch : nullptr;
+        uint64_t groupAllocations = 0;
+        std::array<PerturbStats, numMutationTypes> groupPerturbStats;
+        std::array<uint64_t, numMutationTypes> groupProposals = {};
+        std::array<double, numMutationTypes> groupAcceptance = {};
+
+        const int64_t stopStep = scene->options->checkpointStep;
+        bool stopped = false;
+        for (int sampleIdx = int(progress.steps); sampleIdx < maxSamples; sampleIdx++) {
+            if (stopStep > 0 && sampleIdx >= stopStep) {
+                // The group stops unfinished and keeps its chains and unreported splats for
+                // the checkpoint, the tiles are left empty for the next group of this thread
+                progress.splats.clear();
+                if (splatBuffer) {
+                    TakeSplats(*splatBuffer, threadIndex, progress.splats);
+                }
+                CheckpointWriter writer(scene);
+                saveGroup(writer, runs, progress.splats);
+                progress.resumed = writer.GetData();
+                progress.steps = sampleIdx;
+                stopped = true;
+                break;
+            }
+            if (checkpoints.Requested()) {
+                // The splats of the steps since the last report stay unflushed: they are not
+                // reported, and indirectBuffer only holds the splats of the reported work
+                progress.splats.clear();
+                if (splatBuffer) {
+                    TakeSplats(*splatBuffer, threadIndex, progress.splats);
+                    RestoreSplats(*splatBuffer, threadIndex, progress.splats);
+                }
+                progress.steps = sampleIdx;
+                checkpoints.Park();
+            }
+            // Every step of the group sees the same snapshots of the global cache
+            globalCache.refresh(threadIndex);
+            // The reports write images and are not part of the steps
+            uint64_t stepAllocations = ThreadAllocationCount();
+            for (ChainRun &run : runs) {
+                if (sampleIdx >= run.numSamples) {
+                    continue;
+                }
+                MarkovState &currentState = run.currentState;
+                MarkovState &proposalState = run.proposalState;
+                // std::cout << "-chainId[ " << run.chainId << "] mutationCtr[" << sampleIdx << "]" << std::endl;
+                const PerturbStats perturbStats = GetPerturbStats();
+                run.a = Float(1.0);
+                run.isLargeStep = false;
+                run.pending = false;
+                // In online exploration stage, use a smaller largestep prob to ensure MALA chain learns better pc. matrix
+                // In H2MC case, this is disabled and lsScale will always be 1.0 
+                Float lsScale = (sampleIdx > run.numSamples * LS_RATIO) ? scene->options->largeStepProbScale : Float(1.0);
+                if (!currentState.valid || uniDist(run.rng) < largeStepProb * lsScale) {
+                    run.isLargeStep = true;
+                    run.a = run.largeStep->Mutate(mltState, normalization, currentState, proposalState, run.rng, &run.chain);
                 } else {
-                    if (smallStep->lastMutationType == MutationType::MALASmall) {
-                        chain.g = chain.prop_new_g;
-                        chain.v1 = chain.prop_new_v1;
-                        chain.v2 = chain.prop_new_v2;
-                        chain.t += 1; 
-                        chain.buffered = true; 
-                        currentState.gaussianInitialized = true; 
+                    run.pending = !run.smallStep->Propose(mltState,
+                                                          normalization,
+                                                          currentState,
+                                                          proposalState,
+                                                          run.rng,
+                                                          &run.chain,
+                                                          batch,
+                                                          run.a);
+                }
+                const MutationType type = run.isLargeStep ? run.largeStep->lastMutationType
+                                                          : run.smallStep->lastMutationType;
+                PerturbStats &typeStats = groupPerturbStats[int(type)];
+                typeStats.traced += GetPerturbStats().traced - perturbStats.traced;
+                typeStats.reused += GetPerturbStats().reused - perturbStats.reused;
+                typeStats.bsdfSampled += GetPerturbStats().bsdfSampled - perturbStats.bsdfSampled;
+                typeStats.bsdfReused += GetPerturbStats().bsdfReused - perturbStats.bsdfReused;
+            }
+            if (batch != nullptr) {
+                batch->Flush();
+            }
+            for (ChainRun &run : runs) {
+                if (sampleIdx >= run.numSamples) {
+                    continue;
+                }
+                const int chainId = run.chainId;
+                MarkovState &currentState = run.currentState;
+                MarkovState &proposalState = run.proposalState;
+                Chain &chain = run.chain;
+                std::unique_ptr<LargeStep> &largeStep = run.largeStep;
+                std::unique_ptr<Mutation> &smallStep = run.smallStep;
+                RNG &rng = run.rng;
+                if (run.pending) {
+                    run.a = smallStep->Complete(mltState, normalization, currentState, proposalState, &chain);
+                }
+                const Float a = run.a;
+                const bool isLargeStep = run.isLargeStep;
+                const int type = int(isLargeStep ? largeStep->lastMutationType
+                                                 : smallStep->lastMutationType);
+                groupProposals[type]++;
+                groupAcceptance[type] += a;
+                if (currentState.valid && a < Float(1.0)) {
+                    for (const auto splat : currentState.toSplat) {
+                        splatIndirect(splat.screenPos, (Float(1.0) - a) * splat.contrib);
                     }
                 }
-            } else {
-                // Sometimes the derivatives are noisy so that the light paths
-                // will "stuck" in some regions, we reset the Markov chain state
-                // when a light path is "stuck" 
-                #ifdef REMOVE_OUTLIERS // addresses outliers
-                    adjacentReject += 1; 
-                    bool strongReject = currentState.spContrib.lsScore > OUTLIER_RATIO_THRESHOLD * normalization;
-                    if (adjacentReject > OUTLIER_WEAK_REJECT_CNT || 
-                        (strongReject && adjacentReject > OUTLIER_STRONG_REJECT_CNT)) {
-                        int _chainId = chainId, cnt = 0; 
-                        // std::cout << "-outlier rejection" << std::endl;
-                        while (true) { 
-                            currentState = initStates[_chainId];
-                            // std::cout << "%% outlier rejection path camDepth:" << initStates[_chainId].path.camDepth 
-                            //             << ", " << " lgtDepth:" << initStates[_chainId].path.lgtDepth 
-                            //             << ", lscore : " << currentState.spContrib.lsScore << std::endl; 
-                            if (currentState.spContrib.lsScore < OUTLIER_RATIO_THRESHOLD * normalization)
-                                break;
-                            _chainId = (_chainId + sampleIdx + cnt++) % numChains;
+                if (a > Float(0.0)) {
+                    for (const auto splat : proposalState.toSplat) {
+                        splatIndirect(splat.screenPos, a * splat.contrib);
+                    }
+                }
+                if (a > Float(0.0) && uniDist(rng) <= a) {
+                    ToSubpath(proposalState.spContrib.camDepth,
+                              proposalState.spContrib.lightDepth,
+                              proposalState.path);
+                    std::swap(currentState, proposalState);
+                    currentState.valid = true;
+                    run.adjacentReject = 0;
+                    if (isLargeStep) {
+                        if (chain.buffered && chain.pathWeight > Float(1e-10)) {
+                            int dim = GetDimension(proposalState.path); 
+                            if (dim >= PSS_MIN_LENGTH && dim <= PSS_MAX_LENGTH && chain.differentiated) { // update global cache
+                                globalCache.push(threadIndex, dim, chain.pss, chain.v1, chain.v2, 
+                                    chain.path, chain.spContrib, chain.pathWeight);
+                            }
                         }
-                        // std::cout << "+outlier rejection" << std::endl;
-                        currentState.valid = false;
-                        currentState.gaussianInitialized = false; 
-                        currentState.toSplat.clear();
-                        proposalState.valid = false;
-                        proposalState.gaussianInitialized = false; 
-                        proposalState.toSplat.clear();
-                        proposalState.pss.clear(); 
-                        Clear(proposalState.path);
+                        largeStep->lastScoreSum = currentState.scoreSum;
+                        largeStep->lastScore = currentState.spContrib.lsScore;
+                        currentState.gaussianInitialized = false;
                         chain.buffered = false;
+                    } else {
+                        if (smallStep->lastMutationType == MutationType::MALASmall) {
+                            chain.g = chain.prop_new_g;
+                            chain.v1 = chain.prop_new_v1;
+                            chain.v2 = chain.prop_new_v2;
+                            chain.t += 1; 
+                            chain.buffered = true; 
+                            chain.differentiated = chain.proposalDifferentiated;
+                            currentState.gaussianInitialized = true; 
+                        }
                     }
-                #endif 
-            }
-            if (sampleIdx > 0 && (sampleIdx % reportInterval == 0)) {
-                // std::cout << "Reporting!" << std::endl;
-                reporter.Update(reportInterval);
-                const int reportIntervalSpp = scene->options->reportIntervalSpp;
-                if (threadIndex == 0 && reportIntervalSpp > 0) {
-                    if (reporter.GetWorkDone() >
-                        uint64_t(numPixels * reportIntervalSpp * intervalImgId)) {
-
-                        std::chrono::time_point<std::chrono::system_clock> _end_t = std::chrono::system_clock::now();
-                        std::chrono::duration<double> _timeuse = _end_t - _start_t;
-                        Float timeuse = _timeuse.count();
-
-                        SampleBuffer buffer(pixelWidth, pixelHeight);
-                        Float directWeight = scene->options->directSpp > 0 ? inverse(Float(scene->options->directSpp)) : Float(0.0);
-                        Float indirectWeight = reportIntervalSpp * intervalImgId > 0 ? inverse(Float(reportIntervalSpp * intervalImgId)) : Float(0.0);
-                        MergeBuffer(directBuffer, directWeight, indirectBuffer, indirectWeight, buffer);
-                        BufferToFilm(buffer, film.get());
-                        WriteImage("intermediate.exr", film.get());
-                        std::string hdr2ldr = "hdrmanip --tonemap filmic -o intermediate.png intermediate.exr";
-                        system(hdr2ldr.c_str());
-                        intervalImgId++;
+                } else {
+                    // Sometimes the derivatives are noisy so that the light paths
+                    // will "stuck" in some regions, we reset the Markov chain state
+                    // when a light path is "stuck" 
+                    #ifdef REMOVE_OUTLIERS // addresses outliers
+                        run.adjacentReject += 1; 
+                        bool strongReject = currentState.spContrib.lsScore > OUTLIER_RATIO_THRESHOLD * normalization;
+                        if (run.adjacentReject > OUTLIER_WEAK_REJECT_CNT || 
+                            (strongReject && run.adjacentReject > OUTLIER_STRONG_REJECT_CNT)) {
+                            int _chainId = chainId, cnt = 0; 
+                            // std::cout << "-outlier rejection" << std::endl;
+                            while (true) { 
+                                currentState = initStates[_chainId];
+                                // std::cout << "%% outlier rejection path camDepth:" << initStates[_chainId].path.camDepth 
+                                //             << ", " << " lgtDepth:" << initStates[_chainId].path.lgtDepth 
+                                //             << ", lscore : " << currentState.spContrib.lsScore << std::endl; 
+                                if (currentState.spContrib.lsScore < OUTLIER_RATIO_THRESHOLD * normalization)
+                                    break;
+                                _chainId = (_chainId + sampleIdx + cnt++) % numChains;
+                            }
+                            // std::cout << "+outlier rejection" << std::endl;
+                            currentState.valid = false;
+                            currentState.gaussianInitialized = false; 
+                            currentState.toSplat.clear();
+                            proposalState.valid = false;
+                            proposalState.gaussianInitialized = false; 
+                            proposalState.toSplat.clear();
+                            proposalState.pss.clear(); 
+                            Clear(proposalState.path);
+                            chain.buffered = false;
+                        }
+                    #endif 
+                }
+                if (sampleIdx >= allocationWarmup) {
+                    groupAllocations += ThreadAllocationCount() - stepAllocations;
+                }
+                if (sampleIdx > 0 && (sampleIdx % reportInterval == 0)) {
+                    // std::cout << "Reporting!" << std::endl;
+                    {
+                        std::shared_lock<std::shared_mutex> lock(splatFlushMutex);
+                        if (splatBuffer) {
+                            FlushSplats(*splatBuffer, threadIndex);
+                        }
+                        reporter.Update(reportInterval);
+                    }
+                    const int reportIntervalSpp = scene->options->reportIntervalSpp;
+                    if (threadIndex == 0 && reportIntervalSpp > 0) {
+                        if (reporter.GetWorkDone() >
+                            uint64_t(numPixels * reportIntervalSpp * intervalImgId)) {
+
+                            std::chrono::time_point<std::chrono::system_clock> _end_t = std::chrono::system_clock::now();
+                            std::chrono::duration<double> _timeuse = _end_t - _start_t;
+                            Float timeuse = _timeuse.count();
+
+                            SampleBuffer buffer(pixelWidth, pixelHeight);
+                            Float directWeight = scene->options->directSpp > 0 ? inverse(Float(scene->options->directSpp)) : Float(0.0);
+                            // The tiles that the other threads have not flushed yet hold work
+                            // that is not reported either, so the image is normalized by the
+                            // reported work instead of the spp it is written for
+                            std::unique_lock<std::shared_mutex> lock(splatFlushMutex);
+                            const uint64_t workDone = reporter.GetWorkDone();
+                            Float indirectWeight = workDone > 0 ? Float(numPixels) / Float(workDone) : Float(0.0);
+                            MergeBuffer(directBuffer, directWeight, indirectBuffer, indirectWeight, buffer);
+                            lock.unlock();
+                            BufferToFilm(buffer, film.get());
+                            WriteImage("intermediate.exr", film.get());
+                            std::string hdr2ldr = "hdrmanip --tonemap filmic -o intermediate.png intermediate.exr";
+                            system(hdr2ldr.c_str());
+                            intervalImgId++;
+                        }
                     }
                 }
-            }
+                stepAllocations = ThreadAllocationCount();
 
-            // std::cout << "+chainId[ " << chainId << "] mutationCtr[" << sampleIdx << "]" << std::endl;
+                // std::cout << "+chainId[ " << chainId << "] mutationCtr[" << sampleIdx << "]" << std::endl;
+            }
         }
-        reporter.Update(numSamplesThisChain % reportInterval);
-        
-    }, numChains); 
+        globalCache.release(threadIndex);
+        steadyAllocations += groupAllocations;
+        for (const ChainRun &run : runs) {
+            smallStepDerivatives += run.smallStep->numDifferentiated;
+        }
+        for (int type = 0; type < numMutationTypes; type++) {
+            raysTraced[type] += groupPerturbStats[type].traced;
+            raysReused[type] += groupPerturbStats[type].reused;
+            bsdfSampled[type] += groupPerturbStats[type].bsdfSampled;
+            bsdfReused[type] += groupPerturbStats[type].bsdfReused;
+            proposals[type] += groupProposals[type];
+            acceptance[type].Add(groupAcceptance[type]);
+        }
+        progress.runs = nullptr;
+        if (stopped) {
+            checkpoints.Leave();
+            return;
+        }
+        {
+            std::shared_lock<std::shared_mutex> lock(splatFlushMutex);
+            if (splatBuffer) {
+                FlushSplats(*splatBuffer, threadIndex);
+            }
+            for (const ChainRun &run : runs) {
+                reporter.Update(run.numSamples % reportInterval);
+            }
+        }
+        progress.steps = maxSamples;
+        progress.done = true;
+        checkpoints.Leave();
+    }, numGroups); 
+    if (checkpointThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(checkpointMutex);
+            chainsDone = true;
+        }
+        checkpointCondition.notify_one();
+        checkpointThread.join();
+    }
+    if (scene->options->requireNoAllocations) {
+        if (!CountingAllocations()) {
+            Error("--require-no-allocations needs a build with DPT_COUNT_ALLOCATIONS");
+        }
+        if (steadyAllocations > 0) {
+            Error("The chains made " + std::to_string(steadyAllocations.load()) +
+                  " heap allocations after warm-up");
+        }
+    }
+    if (std::any_of(groupProgress.begin(), groupProgress.end(),
+                    [](const GroupProgress &group) { return !group.done; })) {
+        // Stopped at checkpointStep, the run goes on with --resume
+        CheckpointWriter writer(scene);
+        captureCheckpoint(writer);
+        WriteCheckpointFile(checkpointFile, writer.GetData());
+        TerminateWorkerThreads();
+        std::cout << std::endl << "Stopped before step " << scene->options->checkpointStep
+                  << ", wrote " << checkpointFile << std::endl;
+        return;
+    }
     
     std::cout << "PARFOR done!" << std::endl;
+    if (CountingAllocations()) {
+        std::cout << "Heap allocations after warm-up:" << steadyAllocations << std::endl;
+    }
+    const char *typeNames[numMutationTypes] = {"large", "small", "H2MC small", "MALA small"};
+    for (int type = 0; type < numMutationTypes; type++) {
+        if (proposals[type] > 0) {
+            std::cout << "Acceptance rate (" << typeNames[type]
+                      << "):" << double(acceptance[type]) / double(proposals[type]) << " of "
+                      << proposals[type] << std::endl;
+        }
+    }
+    if (smallStepDerivatives > 0) {
+        std::cout << "Derivative evaluations (small steps):" << smallStepDerivatives << std::endl;
+    }
+    if (scene->options->incrementalPerturb) {
+        for (int type = 0; type < numMutationTypes; type++) {
+            const uint64_t queries = raysTraced[type] + raysReused[type];
+            if (queries > 0) {
+                std::cout << "Rays saved by incremental perturbation (" << typeNames[type]
+                          << "):" << Float(raysReused[type]) / Float(queries) << " of " << queries
+                          << std::endl;
+            }
+            const uint64_t samples = bsdfSampled[type] + bsdfReused[type];
+            if (samples > 0) {
+                std::cout << "BSDF samples saved by incremental perturbation (" << typeNames[type]
+                          << "):" << Float(bsdfReused[type]) / Float(samples) << " of " << samples
+                          << std::endl;
+            }
+        }
+    }
     TerminateWorkerThreads();
     reporter.Done();
+    if (splatBuffer) {
+        const Float flushTime = FlushAllSplats(*splatBuffer);
+        std::cout << "Splat reduction time (summed over threads):" << flushTime << std::endl;
+    }
     Float elapsed = Tick(timer);
     std::cout << "Elapsed time:" << elapsed << std::endl;
 
@@ -9,8 +9,10 @@
 #include "distribution.h"
 #include <vector>
 #include <deque>
+#include <atomic>
 #include <mutex>
 #include <memory>
+#include <type_traits>
 
 struct PathFuncLib;
 
@@ -20,6 +22,66 @@ struct MLTState {
     const decltype(&PerturbPathBidir) perturbPathFunc;
     PathFuncMap staticFuncMap;
     PathFuncDervMap staticFuncDervMap;
+    PathFuncDervBatchMap staticFuncDervBatchMap;
+    PathFuncJit *lazyDervFuncs;
+};
+
+// The derivative kernel of the pair of _spContrib_, nullptr if there is none. _ready_ is false
+// while a lazily compiled kernel is not available yet.
+inline PathFuncDerv FindDervFunc(const MLTState &mltState,
+                                 const SubpathContrib &spContrib,
+                                 bool &ready) {
+    if (mltState.lazyDervFuncs != nullptr) {
+        return mltState.lazyDervFuncs->Request(spContrib.camDepth, spContrib.lightDepth, ready);
+    }
+    ready = true;
+    const auto &fmap = mltState.staticFuncDervMap;
+    auto funcIt = fmap.find({spContrib.camDepth, spContrib.lightDepth});
+    return funcIt != fmap.end() ? funcIt->second : nullptr;
+}
+
+// The batched derivative kernel of the pair of _spContrib_, nullptr if there is none (yet)
+inline PathFuncDervBatch FindDervBatchFunc(const MLTState &mltState,
+                                           const SubpathContrib &spContrib) {
+    if (mltState.lazyDervFuncs != nullptr) {
+        return mltState.lazyDervFuncs->RequestBatch(spContrib.camDepth, spContrib.lightDepth);
+    }
+    const auto &fmap = mltState.staticFuncDervBatchMap;
+    auto funcIt = fmap.find({spContrib.camDepth, spContrib.lightDepth});
+    return funcIt != fmap.end() ? funcIt->second : nullptr;
+}
+
+// Derivative evaluations of the proposals of a group of chains. Flush sorts them by
+// (camDepth, lightDepth), small steps keep the pair of their chain, and differentiates the
+// paths of every pair with one call of its batched kernel, or one by one if it has none.
+class DervBatch {
+    public:
+    // Everything passed in has to stay untouched until the next Flush, which writes the
+    // gradient to _grad_ and, unless it is nullptr, the Hessian to _hess_
+    void Add(const MLTState &mltState,
+             const SubpathContrib &spContrib,
+             const SerializedSubpath &ssubPath,
+             const Float *sceneParams,
+             const int dim,
+             Float *grad,
+             Float *hess);
+    void Flush();
+
+    private:
+    struct Request {
+        std::pair<int, int> pair;
+        PathFuncDerv derv;
+        PathFuncDervBatch dervBatch;
+        const Float *screenPos;
+        const SerializedSubpath *ssubPath;
+        const Float *sceneParams;
+        int dim;
+        Float *grad;
+        Float *hess;
+    };
+    std::vector<Request> requests;
+    // Structures of arrays of the pair that is evaluated
+    AlignedStdVector screenPos, primary, vertParams, grad, hess;
 };
 
 struct SplatSample {
@@ -38,6 +100,26 @@ struct MarkovState {
     std::vector<SplatSample> toSplat;
 };
 
+// Reserves the buffers of _state_ for paths up to _maxDepth_, so that a chain that copies,
+// swaps and regrows its states does not allocate
+inline void Reserve(MarkovState &state, const int maxDepth) {
+    Reserve(state.path, maxDepth);
+    state.pss.reserve(GetMaxDimension(maxDepth));
+    Reserve(state.gaussian, GetMaxDimension(maxDepth));
+    state.toSplat.reserve(GetMaxNumContribs(maxDepth));
+}
+
+// A generator of its own for a path of a bootstrap batch, seeded with the next 64 bits of
+// _rng_. The seed is the whole state of RNG, so distinct seeds give distinct generators. The two
+// draws are sequenced so that every compiler takes the first as the high word.
+static_assert(std::is_same<RNG::state_type, uint64_t>::value,
+              "the path generators are seeded with 64 bits");
+inline RNG PathRNG(RNG &rng) {
+    const uint64_t hi = rng();
+    const uint64_t lo = rng();
+    return RNG((hi << 32) | lo);
+}
+
 static Float MLTInit(const MLTState &mltState,
                      const int64_t numInitSamples,
                      const int numChains,
@@ -48,32 +130,87 @@ static Float MLTInit(const MLTState &mltState,
     Timer timer;
     Tick(timer);
 
-    const int64_t numSamplesPerThread = numInitSamples / NumSystemCores();
-    const int64_t threadsNeedExtraSamples = numInitSamples % NumSystemCores();
+    const int numThreads = NumSystemCores();
+    const int64_t numSamplesPerThread = numInitSamples / numThreads;
+    const int64_t threadsNeedExtraSamples = numInitSamples % numThreads;
     const Scene *scene = mltState.scene;
     auto genPathFunc = mltState.genPathFunc;
 
-    std::mutex mStateMutex;
     struct LightMarkovState {
         RNG rng;
         int camDepth;
         int lightDepth;
         Float lsScore;
     };
-    std::vector<LightMarkovState> mStates;
-    Float totalScore(Float(0.0));
-    std::vector<Float> lengthContrib;
+    // Every thread records its bootstrap samples, their running score sum and a length
+    // histogram in its own buffers, so path generation never takes a lock
+    struct ThreadSamples {
+        std::vector<LightMarkovState> states;
+        std::vector<Float> cdf;
+        std::vector<Float> lengthContrib;
+    };
+    std::vector<ThreadSamples> threadSamples(numThreads);
+    // The paths draw from the thread's generator one after the other, and its state before a
+    // path is the checkpoint to replay it. Bidirectional paths can also be generated a batch
+    // at a time, advancing together so that their scene queries are traced as streams. The
+    // paths of a batch draw their numbers interleaved, so each one draws from a generator of
+    // its own, seeded from the thread's one, and that generator is its checkpoint.
+    const int pathBatch = genPathFunc == &GeneratePathBidir ? scene->options->initPathBatch : 0;
     ParallelFor([&](const int threadId) {
         RNG rng(threadId + scene->options->seedOffset);
         int64_t numSamplesThisThread =
-            numSamplesPerThread + ((threadIndex < threadsNeedExtraSamples) ? 1 : 0);
+            numSamplesPerThread + ((threadId < threadsNeedExtraSamples) ? 1 : 0);
+        ThreadSamples &samples = threadSamples[threadId];
+        const int minPathLength = std::max(scene->options->minDepth, 3);
+        auto record = [&](const RNG &rngCheckpoint, const std::vector<SubpathContrib> &spContribs) {
+            for (const auto &spContrib : spContribs) {
+                const int pathLength = GetPathLength(spContrib.camDepth, spContrib.lightDepth);
+                if (pathLength >= int(samples.lengthContrib.size())) {
+                    samples.lengthContrib.resize(pathLength + 1, Float(0.0));
+                }
+                samples.lengthContrib[pathLength] += spContrib.lsScore;
+                samples.states.emplace_back(LightMarkovState{
+                    rngCheckpoint, spContrib.camDepth, spContrib.lightDepth, spContrib.lsScore});
+                const Float lastCdf = samples.cdf.empty() ? Float(0.0) : samples.cdf.back();
+                samples.cdf.push_back(lastCdf + spContrib.lsScore);
+            }
+        };
+        if (pathBatch > 0) {
+            std::vector<Path> paths;
+            std::vector<std::vector<SubpathContrib>> spContribs;
+            std::vector<RNG> rngs, rngCheckpoints;
+            for (int64_t batchStart = 0; batchStart < numSamplesThisThread;
+                 batchStart += pathBatch) {
+                const int batchSize =
+                    int(std::min(int64_t(pathBatch), numSamplesThisThread - batchStart));
+                rngs.clear();
+                for (int i = 0; i < batchSize; i++) {
+                    rngs.push_back(PathRNG(rng));
+                }
+                rngCheckpoints = rngs;
+                paths.resize(batchSize);
+                for (Path &path : paths) {
+                    Clear(path);
+                }
+                GeneratePathBidirBatch(scene,
+                                       Vector2i(-1, -1),
+                                       minPathLength,
+                                       scene->options->maxDepth,
+                                       paths,
+                                       spContribs,
+                                       rngs);
+                for (int i = 0; i < batchSize; i++) {
+                    record(rngCheckpoints[i], spContribs[i]);
+                }
+            }
+            return;
+        }
         std::vector<SubpathContrib> spContribs;
         Path path;
         for (int sampleIdx = 0; sampleIdx < numSamplesThisThread; sampleIdx++) {
             spContribs.clear();
-            RNG rngCheckpoint = rng;
+            const RNG rngCheckpoint = rng;
             Clear(path);
-            const int minPathLength = std::max(scene->options->minDepth, 3);
             genPathFunc(scene,
                         Vector2i(-1, -1),
                         minPathLength,
@@ -81,70 +218,126 @@ static Float MLTInit(const MLTState &mltState,
                         path,
                         spContribs,
                         rng);
+            record(rngCheckpoint, spContribs);
+        }
+    }, numThreads);
 
-            std::lock_guard<std::mutex> lock(mStateMutex);
-            for (const auto &spContrib : spContribs) {
-                totalScore += spContrib.lsScore;
-                const int pathLength = GetPathLength(spContrib.camDepth, spContrib.lightDepth);
-                if (pathLength >= int(lengthContrib.size())) {
-                    lengthContrib.resize(pathLength + 1, Float(0.0));
-                }
-                lengthContrib[pathLength] += spContrib.lsScore;
-                mStates.emplace_back(LightMarkovState{
-                    rngCheckpoint, spContrib.camDepth, spContrib.lightDepth, spContrib.lsScore});
-            }
+    // Exclusive scan over the per-thread buffer sizes and score sums, which gives each
+    // thread its offset in the merged state list and cdf
+    std::vector<int64_t> stateOffset(numThreads + 1, 0);
+    std::vector<Float> scoreOffset(numThreads + 1, Float(0.0));
+    std::vector<Float> lengthContrib;
+    for (int i = 0; i < numThreads; i++) {
+        const ThreadSamples &samples = threadSamples[i];
+        stateOffset[i + 1] = stateOffset[i] + int64_t(samples.states.size());
+        scoreOffset[i + 1] =
+            scoreOffset[i] + (samples.cdf.empty() ? Float(0.0) : samples.cdf.back());
+        if (samples.lengthContrib.size() > lengthContrib.size()) {
+            lengthContrib.resize(samples.lengthContrib.size(), Float(0.0));
+        }
+        for (int j = 0; j < int(samples.lengthContrib.size()); j++) {
+            lengthContrib[j] += samples.lengthContrib[j];
         }
-    }, NumSystemCores());
+    }
+    const int64_t numStates = stateOffset.back();
+    const Float totalScore = scoreOffset.back();
 
     lengthDist = std::make_shared<PiecewiseConstant1D>(&lengthContrib[0], lengthContrib.size());
 
-    if (int(mStates.size()) < numChains) {
+    if (numStates < numChains) {
         Error(
             "MLT initialization failed, consider using a larger number of initial samples or "
             "smaller number of chains");
     }
 
-    // Equal-spaced seeding (See p.340 in Veach's thesis)
-    std::vector<Float> cdf(mStates.size() + 1);
+    // Adding the offsets to the per-thread running sums completes the scan
+    std::vector<LightMarkovState> mStates(numStates);
+    std::vector<Float> cdf(numStates + 1);
     cdf[0] = Float(0.0);
-    for (int i = 0; i < (int)mStates.size(); i++) {
-        cdf[i + 1] = cdf[i] + mStates[i].lsScore;
-    }
+    ParallelFor([&](const int threadId) {
+        const ThreadSamples &samples = threadSamples[threadId];
+        const int64_t offset = stateOffset[threadId];
+        std::copy(samples.states.begin(), samples.states.end(), mStates.begin() + offset);
+        for (int64_t i = 0; i < int64_t(samples.cdf.size()); i++) {
+            cdf[offset + i + 1] = scoreOffset[threadId] + samples.cdf[i];
+        }
+    }, numThreads);
+    threadSamples.clear();
+
+    // Equal-spaced seeding (See p.340 in Veach's thesis)
     const Float interval = cdf.back() / Float(numChains);
     std::uniform_real_distribution<Float> uniDist(Float(0.0), interval);
     RNG rng(mStates.size());
-    Float pos = uniDist(rng);
-    int cdfPos = 0;
-    initStates.reserve(numChains);
-    std::vector<SubpathContrib> spContribs;
-    for (int i = 0; i < (int)numChains; i++) {
-        while (pos > cdf[cdfPos]) {
-            cdfPos = std::min(cdfPos + 1, int(mStates.size()) - 1);
-        }
-        initStates.push_back(MarkovState{false});
-        MarkovState &state = initStates.back();
-        spContribs.clear();
-        Clear(state.path);
-        RNG rngCheckpoint = mStates[cdfPos - 1].rng;
-        genPathFunc(scene,
-                    Vector2i(-1, -1),
-                    std::max(scene->options->minDepth, 3),
-                    scene->options->maxDepth,
-                    state.path,
-                    spContribs,
-                    rngCheckpoint);
-        state.scoreSum = Float(0.0);
-        for (const auto &spContrib : spContribs) {
-            state.scoreSum += spContrib.lsScore;
-            if (spContrib.camDepth == mStates[cdfPos - 1].camDepth &&
-                spContrib.lightDepth == mStates[cdfPos - 1].lightDepth) {
-                state.spContrib = spContrib;
+    const Float firstPos = uniDist(rng);
+    initStates.assign(numChains, MarkovState{false});
+    std::atomic<int> numResampled(0);
+    ParallelFor([&](const int i) {
+        const Float pos = firstPos + Float(i) * interval;
+        // First cdf entry that is not below pos, clamped to the same range as the original
+        // linear walk over the cdf
+        const auto cdfEnd = cdf.begin() + std::max(numStates - 1, int64_t(1));
+        int64_t cdfPos = std::lower_bound(cdf.begin() + 1, cdfEnd, pos) - cdf.begin();
+        MarkovState &state = initStates[i];
+        std::vector<SubpathContrib> spContribs;
+        // The chains are seeded by replaying the selected paths with the scalar generator. A
+        // path whose rays were streamed at bootstrap can resolve a near-tie differently on
+        // replay and miss the selected (camDepth, lightDepth). Its seed is then resampled from
+        // the contributions of the replayed path, and a replay without any moves on to the
+        // next bootstrap sample.
+        RNG resampleRng(i);
+        for (int64_t attempt = 0; attempt < numStates; attempt++) {
+            const LightMarkovState &mState = mStates[(cdfPos - 1 + attempt) % numStates];
+            spContribs.clear();
+            Clear(state.path);
+            RNG rngCheckpoint = mState.rng;
+            genPathFunc(scene,
+                        Vector2i(-1, -1),
+                        std::max(scene->options->minDepth, 3),
+                        scene->options->maxDepth,
+                        state.path,
+                        spContribs,
+                        rngCheckpoint);
+            state.scoreSum = Float(0.0);
+            const SubpathContrib *selected = nullptr;
+            for (const auto &spContrib : spContribs) {
+                state.scoreSum += spContrib.lsScore;
+                if (spContrib.camDepth == mState.camDepth &&
+                    spContrib.lightDepth == mState.lightDepth && spContrib.lsScore > Float(0.0)) {
+                    selected = &spContrib;
+                }
+            }
+            if (selected == nullptr && state.scoreSum > Float(0.0)) {
+                std::uniform_real_distribution<Float> resampleDist(Float(0.0), state.scoreSum);
+                Float target = resampleDist(resampleRng);
+                for (const auto &spContrib : spContribs) {
+                    if (spContrib.lsScore > Float(0.0)) {
+                        selected = &spContrib;
+                        target -= spContrib.lsScore;
+                        if (target <= Float(0.0)) {
+                            break;
+                        }
+                    }
+                }
             }
+            if (selected != nullptr) {
+                if (attempt > 0 || selected->camDepth != mState.camDepth ||
+                    selected->lightDepth != mState.lightDepth) {
+                    numResampled++;
+                }
+                state.spContrib = *selected;
+                break;
+            }
+        }
+        if (state.spContrib.lsScore <= Float(0.0)) {
+            Error("MLT initialization failed, no bootstrap path could be replayed");
         }
         ToSubpath(state.spContrib.camDepth, state.spContrib.lightDepth, state.path);
         GetPathPss(state.path, state.pss);
         state.gaussianInitialized = false;
-        pos += interval;
+    }, numChains);
+    if (numResampled > 0) {
+        std::cout << numResampled << " chains were seeded from a resampled contribution, their "
+                  << "bootstrap paths replayed differently" << std::endl;
     }
 
     Float invNumInitSamples = inverse(Float(numInitSamples));
@@ -22,7 +22,36 @@ struct Mutation {
                          RNG &rng,
                          Chain *chain = NULL) = 0;
 
+    // Mutate in two halves, so that a group of chains can differentiate their proposals
+    // together. Propose returns true and sets _a_ if the mutation is done, otherwise it
+    // queued the derivatives of the proposal in _batch_, and after the batch is flushed
+    // Complete returns the acceptance probability. Together they draw the same random numbers
+    // as Mutate.
+    virtual bool Propose(const MLTState &mltState,
+                         const Float normalization,
+                         MarkovState &currentState,
+                         MarkovState &proposalState,
+                         RNG &rng,
+                         Chain *chain,
+                         DervBatch *batch,
+                         Float &a) {
+        a = Mutate(mltState, normalization, currentState, proposalState, rng, chain);
+        return true;
+    }
+    virtual Float Complete(const MLTState &mltState,
+                           const Float normalization,
+                           MarkovState &currentState,
+                           MarkovState &proposalState,
+                           Chain *chain) {
+        return Float(0.0);
+    }
+    // Reserves the buffers of the mutation for paths up to _maxDepth_
+    virtual void Reserve(const int maxDepth) {
+    }
+
     MutationType lastMutationType;
+    // The derivatives the mutation evaluated so far
+    uint64_t numDifferentiated = 0;
 };
 
 struct Chain {
@@ -35,6 +64,10 @@ struct Chain {
     Float pathWeight;
 
     bool buffered = false;
+    // Whether the last proposal, and the moments the chain accepted last, come from the
+    // derivatives of the chain rather than from the global cache. Only those are pushed.
+    bool proposalDifferentiated = false;
+    bool differentiated = false;
     Float ss; 
     int chainId, t = 0;
     
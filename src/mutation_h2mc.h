@@ -14,6 +14,24 @@ struct H2MCSmallStep : public Mutation {
                  MarkovState &proposalState,
                  RNG &rng, 
                  Chain *chain = NULL) override;
+    bool Propose(const MLTState &mltState,
+                 const Float normalization,
+                 MarkovState &currentState,
+                 MarkovState &proposalState,
+                 RNG &rng,
+                 Chain *chain,
+                 DervBatch *batch,
+                 Float &a) override;
+    Float Complete(const MLTState &mltState,
+                   const Float normalization,
+                   MarkovState &currentState,
+                   MarkovState &proposalState,
+                   Chain *chain) override;
+    void Reserve(const int maxDepth) override;
+    // Differentiates _state_ into vGrad and vHess, or queues it in _batch_ if there is one.
+    // Returns false if its pair has no derivatives.
+    bool Differentiate(const MLTState &mltState, const MarkovState &state, DervBatch *batch);
+    void InitGaussian(MarkovState &state, const bool differentiated);
     std::vector<SubpathContrib> spContribs;
     H2MCParam h2mcParam;
     AlignedStdVector sceneParams;
@@ -22,6 +40,10 @@ struct H2MCSmallStep : public Mutation {
 
     AlignedStdVector vGrad;
     AlignedStdVector vHess;
+    Vector offset;
+    // The offset back from the proposal, kept so that it is not allocated every step
+    Vector reverseOffset;
+    bool proposalDifferentiated;
 };
 
 H2MCSmallStep::H2MCSmallStep(const Scene *scene,
@@ -35,6 +57,68 @@ H2MCSmallStep::H2MCSmallStep(const Scene *scene,
     ssubPath.vertParams.resize(GetVertParamSize(maxDervDepth, maxDervDepth));
 }
 
+void H2MCSmallStep::Reserve(const int maxDepth) {
+    const int maxDim = GetMaxDimension(maxDepth);
+    spContribs.reserve(GetMaxNumContribs(maxDepth));
+    isotropicSmallStep.Reserve(maxDepth);
+    vGrad.reserve(maxDim);
+    vHess.reserve(maxDim * maxDim);
+    offset.resize(maxDim);
+    reverseOffset.resize(maxDim);
+}
+
+bool H2MCSmallStep::Differentiate(const MLTState &mltState,
+                                  const MarkovState &state,
+                                  DervBatch *batch) {
+    const SubpathContrib &cspContrib = state.spContrib;
+    bool ready;
+    PathFuncDerv dervFunc = FindDervFunc(mltState, cspContrib, ready);
+    if (dervFunc == nullptr) {
+        return false;
+    }
+    const int dim = GetDimension(state.path);
+    // Cleared rather than resized, a path the kernel skips below must not see the derivatives
+    // of the previous one, or a resumed chain would not take the same steps
+    vGrad.assign(dim, Float(0.0));
+    vHess.assign(dim * dim, Float(0.0));
+    if (cspContrib.ssScore > Float(1e-15)) {
+        Serialize(mltState.scene, state.path, ssubPath);
+        if (batch != nullptr) {
+            batch->Add(mltState, cspContrib, ssubPath, &sceneParams[0], dim, &vGrad[0], &vHess[0]);
+        } else {
+            dervFunc(&cspContrib.screenPos[0],
+                     &ssubPath.primary[0],
+                     &sceneParams[0],
+                     &ssubPath.vertParams[0],
+                     &vGrad[0],
+                     &vHess[0]);
+        }
+    }
+    return true;
+}
+
+void H2MCSmallStep::InitGaussian(MarkovState &state, const bool differentiated) {
+    const SubpathContrib &cspContrib = state.spContrib;
+    if (differentiated) {
+        if (cspContrib.ssScore > Float(1e-15)) {
+            if (!IsFinite(vGrad) || !IsFinite(vHess)) {
+                // std::cout << "H2MC finiteness check vgrad:" << IsFinite(vGrad) << ", hess:" << IsFinite(vHess) << std::endl;
+                ++numInf;
+                // Usually caused by floating point round-off error
+                // (or, of course, bugs)
+                std::fill(vGrad.begin(), vGrad.end(), Float(0.0));
+                std::fill(vHess.begin(), vHess.end(), Float(0.0));
+            }
+            assert(IsFinite(vGrad));
+            assert(IsFinite(vHess));
+        }
+        ComputeGaussian(h2mcParam, cspContrib.ssScore, vGrad, vHess, state.gaussian);
+    } else {
+        IsotropicGaussian(GetDimension(state.path), h2mcParam.sigma, state.gaussian);
+    }
+    state.gaussianInitialized = true;
+}
+
 Float H2MCSmallStep::Mutate(const MLTState &mltState,
                             const Float normalization,
                             MarkovState &currentState,
@@ -42,89 +126,84 @@ Float H2MCSmallStep::Mutate(const MLTState &mltState,
                             RNG &rng, 
                             Chain *chain) 
 {
+    Float a = Float(0.0);
+    if (!Propose(mltState, normalization, currentState, proposalState, rng, chain, nullptr, a)) {
+        a = Complete(mltState, normalization, currentState, proposalState, chain);
+    }
+    return a;
+}
+
+bool H2MCSmallStep::Propose(const MLTState &mltState,
+                            const Float normalization,
+                            MarkovState &currentState,
+                            MarkovState &proposalState,
+                            RNG &rng,
+                            Chain *chain,
+                            DervBatch *batch,
+                            Float &a) {
     const Scene *scene = mltState.scene;
     // Sometimes the derivatives are noisy so that the light paths
     // will "stuck" in some regions, we probabilistically switch to
     // uniform sampling to avoid stucking
     std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
-    if (uniDist(rng) < scene->options->uniformMixingProbability) {
-        Float a =
-            isotropicSmallStep.Mutate(mltState, normalization, currentState, proposalState, rng);
+    // The same happens while the kernel of a lazily compiled pair is not ready
+    bool dervReady = true;
+    FindDervFunc(mltState, currentState.spContrib, dervReady);
+    if (uniDist(rng) < scene->options->uniformMixingProbability || !dervReady) {
+        a = isotropicSmallStep.Mutate(mltState, normalization, currentState, proposalState, rng);
         lastMutationType = isotropicSmallStep.lastMutationType;
-        return a;
+        return true;
     }
     spContribs.clear();
-    Float a = Float(1.0);
     assert(currentState.valid);
     lastMutationType = MutationType::H2MCSmall;
     const auto perturbPathFunc = mltState.perturbPathFunc;
     const int dim = GetDimension(currentState.path);
-    auto initGaussian = [&](MarkovState &state) {
-        const SubpathContrib &cspContrib = state.spContrib;
-        const auto &fmap = mltState.staticFuncDervMap;
-        auto funcIt = fmap.find({cspContrib.camDepth, cspContrib.lightDepth});
-        const int dim = GetDimension(state.path);
-        if (funcIt != fmap.end()) {
-            vGrad.resize(dim, Float(0.0));
-            vHess.resize(dim * dim, Float(0.0));
-            if (cspContrib.ssScore > Float(1e-15)) {
-                PathFuncDerv dervFunc = funcIt->second;
-                assert(dervFunc != nullptr);
-                Serialize(scene, state.path, ssubPath);
-                dervFunc(&cspContrib.screenPos[0],
-                         &ssubPath.primary[0],
-                         &sceneParams[0],
-                         &ssubPath.vertParams[0],
-                         &vGrad[0],
-                         &vHess[0]);
-                if (!IsFinite(vGrad) || !IsFinite(vHess)) {
-                    // std::cout << "H2MC finiteness check vgrad:" << IsFinite(vGrad) << ", hess:" << IsFinite(vHess) << std::endl;
-                    ++numInf;
-                    // Usually caused by floating point round-off error
-                    // (or, of course, bugs)
-                    std::fill(vGrad.begin(), vGrad.end(), Float(0.0));
-                    std::fill(vHess.begin(), vHess.end(), Float(0.0));
-                }
-                assert(IsFinite(vGrad));
-                assert(IsFinite(vHess));
-            }
-            ComputeGaussian(h2mcParam, cspContrib.ssScore, vGrad, vHess, state.gaussian);
-        } else {
-            IsotropicGaussian(dim, h2mcParam.sigma, state.gaussian);
-        }
-        state.gaussianInitialized = true;
-    };
-
     if (!currentState.gaussianInitialized) {
-        initGaussian(currentState);
+        // Only the first small step after a large step gets here, so it is not batched
+        InitGaussian(currentState, Differentiate(mltState, currentState, nullptr));
     }
 
     assert(currentState.gaussianInitialized);
 
-    Vector offset(dim);
-    GenerateSample(currentState.gaussian, offset, rng);
+    // The offsets only grow, the Gaussians read their first dim entries
+    if (offset.size() < dim) {
+        offset.resize(dim);
+    }
+    assert(GetDimension(currentState.gaussian) == dim);
+    GenerateSample(dim, currentState.gaussian, offset, rng);
     proposalState.path = currentState.path;
     perturbPathFunc(scene, offset, proposalState.path, spContribs, rng);
-    if (spContribs.size() > 0) {
-        assert(spContribs.size() == 1);
-        proposalState.spContrib = spContribs[0];
-        initGaussian(proposalState);
-        Float py = GaussianLogPdf(offset, currentState.gaussian);
-        Float px = GaussianLogPdf(-offset, proposalState.gaussian);
-
-        a = Clamp(std::exp(px - py) * proposalState.spContrib.ssScore /
-                      currentState.spContrib.ssScore,
-                  Float(0.0),
-                  Float(1.0));
-
-        proposalState.toSplat.clear();
-        for (const auto &spContrib : spContribs) {
-            proposalState.toSplat.push_back(SplatSample{
-                spContrib.screenPos, spContrib.contrib * (normalization / spContrib.lsScore)});
-        }
-    } else {
+    if (spContribs.size() == 0) {
         a = Float(0.0);
+        return true;
     }
+    assert(spContribs.size() == 1);
+    proposalState.spContrib = spContribs[0];
+    proposalDifferentiated = Differentiate(mltState, proposalState, batch);
+    return false;
+}
 
+Float H2MCSmallStep::Complete(const MLTState &mltState,
+                              const Float normalization,
+                              MarkovState &currentState,
+                              MarkovState &proposalState,
+                              Chain *chain) {
+    const int dim = GetDimension(proposalState.path);
+    InitGaussian(proposalState, proposalDifferentiated);
+    Float py = GaussianLogPdf(dim, offset, currentState.gaussian);
+    reverseOffset = -offset;
+    Float px = GaussianLogPdf(dim, reverseOffset, proposalState.gaussian);
+
+    Float a = Clamp(std::exp(px - py) * proposalState.spContrib.ssScore /
+                        currentState.spContrib.ssScore,
+                    Float(0.0),
+                    Float(1.0));
+
+    proposalState.toSplat.clear();
+    for (const auto &spContrib : spContribs) {
+        proposalState.toSplat.push_back(SplatSample{
+            spContrib.screenPos, spContrib.contrib * (normalization / spContrib.lsScore)});
+    }
     return a;
-}
\ No newline at end of file
+}
@@ -10,6 +10,10 @@ struct LargeStep : public Mutation {
                  MarkovState &proposalState,
                  RNG &rng,
                  Chain *chain = NULL) override;
+    void Reserve(const int maxDepth) override {
+        spContribs.reserve(GetMaxNumContribs(maxDepth));
+        contribCdf.reserve(GetMaxNumContribs(maxDepth) + 1);
+    }
     std::shared_ptr<PiecewiseConstant1D> lengthDist;
     std::vector<SubpathContrib> spContribs;
     std::vector<Float> contribCdf;
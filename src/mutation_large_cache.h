@@ -73,10 +73,10 @@ Float LargeStepCache::Mutate(const MLTState &mltState,
             GetPathPss(proposalState.path, proposalState.pss);
         }
     } else { /* sampling from the global cache */
-        std::vector<Float> pss; Float pathWeight; SubpathContrib spContrib;
+        std::vector<Float> pss; Float pathWeight; path_tag_t tag;
         chain->globalCache->sampleCache(proposalDim, 
-            proposalState.path, pss, spContrib, pathWeight, rng);
-        ToSubpath(spContrib.camDepth, spContrib.lightDepth, proposalState.path);
+            proposalState.path, pss, tag, pathWeight, rng);
+        ToSubpath(tag.camDepth, tag.lightDepth, proposalState.path);
         
         std::normal_distribution<Float> normDist(Float(0.0), CACHE_SIG);
         proposalState.pss.resize(proposalDim);
@@ -18,11 +18,33 @@ struct MALASmallStep : public Mutation {
                  MarkovState &proposalState,
                  RNG &rng,
                  Chain *chain = NULL) override;
+    bool Propose(const MLTState &mltState,
+                 const Float normalization,
+                 MarkovState &currentState,
+                 MarkovState &proposalState,
+                 RNG &rng,
+                 Chain *chain,
+                 DervBatch *batch,
+                 Float &a) override;
+    Float Complete(const MLTState &mltState,
+                   const Float normalization,
+                   MarkovState &currentState,
+                   MarkovState &proposalState,
+                   Chain *chain) override;
+    void Reserve(const int maxDepth) override;
+    // Looks up the moments of the gradient at the point of the chain in the global cache,
+    // the last ones are reused while the chain stays close to where they were looked up
+    bool LookUpCache(Chain *chain, const int dim);
     SmallStep isotropicSmallStep;
     std::vector<SubpathContrib> spContribs;
     AlignedStdVector sceneParams;
     SerializedSubpath ssubPath;
     AlignedStdVector vGrad;
+    Vector offset;
+    // The offset back from the proposal, kept so that it is not allocated every step
+    Vector reverseOffset;
+    bool proposalDifferentiated;
+    bool proposalCached;
 };
 
 MALASmallStep::MALASmallStep(const Scene *scene,
@@ -34,12 +56,56 @@ MALASmallStep::MALASmallStep(const Scene *scene,
     ssubPath.vertParams.resize(GetVertParamSize(maxDervDepth, maxDervDepth));
 }
 
+void MALASmallStep::Reserve(const int maxDepth) {
+    const int maxDim = GetMaxDimension(maxDepth);
+    spContribs.reserve(GetMaxNumContribs(maxDepth));
+    isotropicSmallStep.Reserve(maxDepth);
+    vGrad.reserve(maxDim);
+    offset.resize(maxDim);
+    reverseOffset.resize(maxDim);
+}
+
+bool MALASmallStep::LookUpCache(Chain *chain, const int dim) {
+    if (chain->queried) {
+        Float dist_sqr(0.f);
+        for (int i = 0; i < dim; i++) {
+            Float diff = chain->pss[i] - chain->last_pss[i];
+            dist_sqr += diff * diff;
+        }
+        if (dist_sqr < dim * (PSS_REUSE_DIST * PSS_REUSE_DIST)) {
+            return true; 
+        }
+    }
+    if (chain->globalCache->query(dim, chain->pss, chain->v1, chain->v2)) {
+        chain->queried = true; 
+        chain->last_pss = chain->pss;
+        return true;
+    }
+    return false;
+}
+
 Float MALASmallStep::Mutate(const MLTState &mltState,
                             const Float normalization,
                             MarkovState &currentState,
                             MarkovState &proposalState,
                             RNG &rng,
                             Chain *chain) 
+{
+    Float a = Float(0.0);
+    if (!Propose(mltState, normalization, currentState, proposalState, rng, chain, nullptr, a)) {
+        a = Complete(mltState, normalization, currentState, proposalState, chain);
+    }
+    return a;
+}
+
+bool MALASmallStep::Propose(const MLTState &mltState,
+                            const Float normalization,
+                            MarkovState &currentState,
+                            MarkovState &proposalState,
+                            RNG &rng,
+                            Chain *chain,
+                            DervBatch *batch,
+                            Float &a) 
 {
     // std::cout << "-MALA mutate" << std::endl;
     const Scene *scene = mltState.scene;
@@ -47,13 +113,15 @@ Float MALASmallStep::Mutate(const MLTState &mltState,
     // will "stuck" in some regions, we probabilistically switch to
     // uniform sampling to avoid stucking
     std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
-    if (uniDist(rng) < scene->options->uniformMixingProbability) {
-        Float a = isotropicSmallStep.Mutate(mltState, normalization, currentState, proposalState, rng);
+    // The same happens while the kernel of a lazily compiled pair is not ready
+    bool dervReady = true;
+    FindDervFunc(mltState, currentState.spContrib, dervReady);
+    if (uniDist(rng) < scene->options->uniformMixingProbability || !dervReady) {
+        a = isotropicSmallStep.Mutate(mltState, normalization, currentState, proposalState, rng);
         lastMutationType = isotropicSmallStep.lastMutationType;
-        return a;
+        return true;
     }
     spContribs.clear();
-    Float a = Float(1.0);
     assert(currentState.valid);
     lastMutationType = MutationType::MALASmall;
     const auto perturbPathFunc = mltState.perturbPathFunc;
@@ -81,12 +149,15 @@ Float MALASmallStep::Mutate(const MLTState &mltState,
         std::fill(chain->M.begin(), chain->M.end(), Float(0.0));
         chain->buffered = true;   
         chain->queried = false;
+        chain->differentiated = false;
     }
 
+    // Only the first small step after a large step differentiates the current state, so it is
+    // not batched
     if (!currentState.gaussianInitialized) {
         const SubpathContrib &cspContrib = currentState.spContrib;
-        const auto &fmap = mltState.staticFuncDervMap;
-        auto funcIt = fmap.find({cspContrib.camDepth, cspContrib.lightDepth});
+        bool ready;
+        PathFuncDerv dervFunc = FindDervFunc(mltState, cspContrib, ready);
         const int dim = GetDimension(currentState.path);
         
         GetPathPss(currentState.path, chain->pss);
@@ -94,13 +165,19 @@ Float MALASmallStep::Mutate(const MLTState &mltState,
         chain->spContrib = currentState.spContrib;
         chain->pathWeight = currentState.spContrib.lsScore; 
 
-        if (dim >= PSS_MIN_LENGTH && dim <= PSS_MAX_LENGTH && 
-            !chain->globalCache->isReady(dim) &&
-            funcIt != fmap.end()) {
-            vGrad.resize(dim, Float(0.0));
+        // The chains differentiate until the global cache of the dimension is ready, then they
+        // look the moments up and take an isotropic step where it has no record nearby. With
+        // mala-differentiate-uncached they differentiate there instead, so that what they find
+        // keeps flowing into the cache.
+        const bool inCache = dim >= PSS_MIN_LENGTH && dim <= PSS_MAX_LENGTH;
+        const bool cacheReady = inCache && chain->globalCache->isReady(dim);
+        const bool cached = cacheReady && LookUpCache(chain, dim);
+        if (inCache && !cached && (!cacheReady || scene->options->malaDifferentiateUncached) &&
+            dervFunc != nullptr) {
+            // Cleared rather than resized, as in H2MCSmallStep::Differentiate
+            vGrad.assign(dim, Float(0.0));
             if (cspContrib.ssScore > Float(1e-10)) {
-                PathFuncDerv dervFunc = funcIt->second;
-                assert(dervFunc != nullptr);
+                numDifferentiated++;
                 Serialize(scene, currentState.path, ssubPath);
                 dervFunc(&cspContrib.screenPos[0],
                          &ssubPath.primary[0],
@@ -133,153 +210,131 @@ Float MALASmallStep::Mutate(const MLTState &mltState,
             ComputeGaussian(dim, chain->curr_new_v1, chain->curr_new_v2, chain->ss, scene->options->malaStdDev, \
                 chain->M, chain->t, cspContrib.ssScore, currentState.gaussian);
 
+        } else if (cached) {
+            for (int i = 0; i < dim; i++) {
+                chain->M[i] = Clamp(Float(1.0) / Float(Float(1e-3) + sqrt(chain->v2[i])), PCD_MIN, PCD_MAX);
+            }
+            ComputeGaussian(dim, chain->v1, chain->v2, chain->ss, scene->options->malaStdDev, \
+                chain->M, chain->t, cspContrib.ssScore, currentState.gaussian);
         } else {
-            if (dim >= PSS_MIN_LENGTH && dim <= PSS_MAX_LENGTH && 
-                chain->globalCache->isReady(dim)) {
-                bool reuse = false;
-                if (chain->queried) {
-                    Float dist_sqr(0.f);
-                    for (int i = 0; i < dim; i++) {
-                        Float diff = chain->pss[i] - chain->last_pss[i];
-                        dist_sqr += diff * diff;
-                    }
-                    if (dist_sqr < dim * (PSS_REUSE_DIST * PSS_REUSE_DIST)) {
-                        reuse = true; 
-                    }
-                }
-                if (reuse) {
-                    for (int i = 0; i < dim; i++) {
-                        chain->M[i] = Clamp(Float(1.0) / Float(Float(1e-3) + sqrt(chain->v2[i])), PCD_MIN, PCD_MAX);
-                    }
-                    ComputeGaussian(dim, chain->v1, chain->v2, chain->ss, scene->options->malaStdDev, \
-                        chain->M, chain->t, cspContrib.ssScore, currentState.gaussian);
-                } else if (chain->globalCache->query(dim, chain->pss, chain->v1, chain->v2)) {
-                    chain->queried = true; 
-                    chain->last_pss = chain->pss;
-                    for (int i = 0; i < dim; i++) {
-                        chain->M[i] = Clamp(Float(1.0) / Float(Float(1e-3) + sqrt(chain->v2[i])), PCD_MIN, PCD_MAX);
-                    }
-                    ComputeGaussian(dim, chain->v1, chain->v2, chain->ss, scene->options->malaStdDev, \
-                        chain->M, chain->t, cspContrib.ssScore, currentState.gaussian);
-                } else {
-                    IsotropicGaussian(dim, scene->options->malaStdDev, currentState.gaussian);
-                }
-            } else 
-                IsotropicGaussian(dim, scene->options->malaStdDev, currentState.gaussian);
+            IsotropicGaussian(dim, scene->options->malaStdDev, currentState.gaussian);
         }
         currentState.gaussianInitialized = true;
     }
     assert(currentState.gaussianInitialized);
-    Vector offset(dim);
-    GenerateSample(currentState.gaussian, offset, rng);
+    // The offsets only grow, the Gaussians read their first dim entries
+    if (offset.size() < dim) {
+        offset.resize(dim);
+    }
+    assert(GetDimension(currentState.gaussian) == dim);
+    GenerateSample(dim, currentState.gaussian, offset, rng);
     proposalState.path = currentState.path;
 
     perturbPathFunc(scene, offset, proposalState.path, spContribs, rng);
   
-    if (spContribs.size() > 0) {
-        assert(spContribs.size() == 1);
-        proposalState.spContrib = spContribs[0];
-        
-        {
-            const SubpathContrib &cspContrib = proposalState.spContrib;
-            const auto &fmap =  mltState.staticFuncDervMap;
-            auto funcIt = fmap.find({cspContrib.camDepth, cspContrib.lightDepth});
-            const int dim = GetDimension(proposalState.path);
+    if (spContribs.size() == 0) {
+        a = Float(0.0);
+        return true;
+    }
+    assert(spContribs.size() == 1);
+    proposalState.spContrib = spContribs[0];
 
-            GetPathPss(proposalState.path, chain->pss);
-            chain->path = proposalState.path; 
-            chain->spContrib = proposalState.spContrib;
-            chain->pathWeight = proposalState.spContrib.lsScore; 
-            
-            if (dim >= PSS_MIN_LENGTH && dim <= PSS_MAX_LENGTH && 
-                !chain->globalCache->isReady(dim) &&
-                funcIt != fmap.end()) {
-                vGrad.resize(dim, Float(0.0));
-                if (cspContrib.ssScore > Float(1e-10)) {
-                    PathFuncDerv dervFunc = funcIt->second;
-                    assert(dervFunc != nullptr);
-                    Serialize(scene, proposalState.path, ssubPath);
-                    dervFunc(&cspContrib.screenPos[0],
-                             &ssubPath.primary[0],
-                             &sceneParams[0],
-                             &ssubPath.vertParams[0],
-                             &vGrad[0],
-                             NULL);
-                    if (!IsFinite(vGrad)) {
-                        // std::cout << "MALA mut vgrads infinite!" << std::endl;
-                        ++numInf;
-                        std::fill(vGrad.begin(), vGrad.end(), Float(0.0));
-                    }
-                    assert(IsFinite(vGrad));
-                }
-                Float norm(0.0), drift(scene->options->malaGN);    // bounded drift for Truncated MALA
-                for (int i = 0; i < dim; i++) { norm += vGrad[i] * vGrad[i]; } norm = sqrt(norm);
-                for (int i = 0; i < dim; i++) { vGrad[i] *= drift / std::max(drift, norm); }
-                bool first = true; 
-                for (int i = 0; i < dim; i++)
-                    if (chain->prop_new_v2[i] > Float(1e-10)) {
-                        first = false;    break; 
-                    }
-                for (int i = 0; i < dim; i++) {
-                    Float g = vGrad[i];
-                    chain->prop_new_g[i] = g;
-                    chain->prop_new_v1[i] = first ? g : Float(0.9)   * chain->v1[i] + Float(0.1)   * g;
-                    chain->prop_new_v2[i] = first ? g * g : Float(0.999) * chain->v2[i] + Float(0.001) * g * g; 
-                    chain->M[i] = Clamp(Float(1.0) / Float(Float(1e-3) + sqrt(chain->prop_new_v2[i])), PCD_MIN, PCD_MAX);
-                }
-                ComputeGaussian(dim, chain->prop_new_v1, chain->prop_new_v2, chain->ss, scene->options->malaStdDev, \
-                    chain->M, chain->t, cspContrib.ssScore, proposalState.gaussian);
+    const SubpathContrib &cspContrib = proposalState.spContrib;
+    bool ready;
+    PathFuncDerv dervFunc = FindDervFunc(mltState, cspContrib, ready);
+    const int proposalDim = GetDimension(proposalState.path);
+
+    GetPathPss(proposalState.path, chain->pss);
+    chain->path = proposalState.path; 
+    chain->spContrib = proposalState.spContrib;
+    chain->pathWeight = proposalState.spContrib.lsScore; 
+
+    const bool inCache = proposalDim >= PSS_MIN_LENGTH && proposalDim <= PSS_MAX_LENGTH;
+    const bool proposalReady = inCache && chain->globalCache->isReady(proposalDim);
+    proposalCached = proposalReady && LookUpCache(chain, proposalDim);
+    proposalDifferentiated = inCache && !proposalCached &&
+                             (!proposalReady || scene->options->malaDifferentiateUncached) &&
+                             dervFunc != nullptr;
+    chain->proposalDifferentiated = proposalDifferentiated;
+    if (proposalDifferentiated) {
+        vGrad.assign(proposalDim, Float(0.0));
+        if (cspContrib.ssScore > Float(1e-10)) {
+            numDifferentiated++;
+            Serialize(scene, proposalState.path, ssubPath);
+            if (batch != nullptr) {
+                batch->Add(
+                    mltState, cspContrib, ssubPath, &sceneParams[0], proposalDim, &vGrad[0], NULL);
             } else {
-                if (dim >= PSS_MIN_LENGTH && dim <= PSS_MAX_LENGTH && 
-                    chain->globalCache->isReady(dim)) {
-                    bool reuse = false;
-                    if (chain->queried) {
-                        Float dist_sqr(0.f);
-                        for (int i = 0; i < dim; i++) {
-                            Float diff = chain->pss[i] - chain->last_pss[i];
-                            dist_sqr += diff * diff;
-                        }
-                        if (dist_sqr < dim * (PSS_REUSE_DIST * PSS_REUSE_DIST)) {
-                            reuse = true; 
-                        }
-                    }
-                    if (reuse) {
-                        for (int i = 0; i < dim; i++) {
-                            chain->M[i] = Clamp(Float(1.0) / Float(Float(1e-3) + sqrt(chain->v2[i])), PCD_MIN, PCD_MAX);
-                        }
-                        ComputeGaussian(dim, chain->v1, chain->v2, chain->ss, scene->options->malaStdDev, \
-                            chain->M, chain->t, cspContrib.ssScore, proposalState.gaussian);
-                    } else if (chain->globalCache->query(dim, chain->pss, chain->v1, chain->v2)) {
-                        chain->queried = true; 
-                        chain->last_pss = chain->pss;
-                        for (int i = 0; i < dim; i++) {
-                            chain->M[i] = Clamp(Float(1.0) / Float(Float(1e-3) + sqrt(chain->v2[i])), PCD_MIN, PCD_MAX);
-                        }
-                        ComputeGaussian(dim, chain->v1, chain->v2, chain->ss, scene->options->malaStdDev, \
-                            chain->M, chain->t, cspContrib.ssScore, proposalState.gaussian);
-                    } else {
-                        IsotropicGaussian(dim, scene->options->malaStdDev, proposalState.gaussian);
-                    }
-                } else 
-                    IsotropicGaussian(dim, scene->options->malaStdDev, proposalState.gaussian);
+                dervFunc(&cspContrib.screenPos[0],
+                         &ssubPath.primary[0],
+                         &sceneParams[0],
+                         &ssubPath.vertParams[0],
+                         &vGrad[0],
+                         NULL);
             }
-            proposalState.gaussianInitialized = true;
         }
+    }
+    return false;
+}
 
-        Float py = GaussianLogPdf(offset, currentState.gaussian);
-        Float px = GaussianLogPdf(-offset, proposalState.gaussian);
-        a = Clamp(std::exp(px - py) * proposalState.spContrib.ssScore /
-                      currentState.spContrib.ssScore,
-                  Float(0.0),
-                  Float(1.0));
-        proposalState.toSplat.clear();
-        for (const auto &spContrib : spContribs) {
-            proposalState.toSplat.push_back(SplatSample{
-                spContrib.screenPos, spContrib.contrib * normalization / spContrib.lsScore});
-        }
+Float MALASmallStep::Complete(const MLTState &mltState,
+                              const Float normalization,
+                              MarkovState &currentState,
+                              MarkovState &proposalState,
+                              Chain *chain) 
+{
+    const Scene *scene = mltState.scene;
+    const SubpathContrib &cspContrib = proposalState.spContrib;
+    const int dim = GetDimension(proposalState.path);
 
+    if (proposalDifferentiated) {
+        if (cspContrib.ssScore > Float(1e-10)) {
+            if (!IsFinite(vGrad)) {
+                // std::cout << "MALA mut vgrads infinite!" << std::endl;
+                ++numInf;
+                std::fill(vGrad.begin(), vGrad.end(), Float(0.0));
+            }
+            assert(IsFinite(vGrad));
+        }
+        Float norm(0.0), drift(scene->options->malaGN);    // bounded drift for Truncated MALA
+        for (int i = 0; i < dim; i++) { norm += vGrad[i] * vGrad[i]; } norm = sqrt(norm);
+        for (int i = 0; i < dim; i++) { vGrad[i] *= drift / std::max(drift, norm); }
+        bool first = true; 
+        for (int i = 0; i < dim; i++)
+            if (chain->prop_new_v2[i] > Float(1e-10)) {
+                first = false;    break; 
+            }
+        for (int i = 0; i < dim; i++) {
+            Float g = vGrad[i];
+            chain->prop_new_g[i] = g;
+            chain->prop_new_v1[i] = first ? g : Float(0.9)   * chain->v1[i] + Float(0.1)   * g;
+            chain->prop_new_v2[i] = first ? g * g : Float(0.999) * chain->v2[i] + Float(0.001) * g * g; 
+            chain->M[i] = Clamp(Float(1.0) / Float(Float(1e-3) + sqrt(chain->prop_new_v2[i])), PCD_MIN, PCD_MAX);
+        }
+        ComputeGaussian(dim, chain->prop_new_v1, chain->prop_new_v2, chain->ss, scene->options->malaStdDev, \
+            chain->M, chain->t, cspContrib.ssScore, proposalState.gaussian);
+    } else if (proposalCached) {
+        for (int i = 0; i < dim; i++) {
+            chain->M[i] = Clamp(Float(1.0) / Float(Float(1e-3) + sqrt(chain->v2[i])), PCD_MIN, PCD_MAX);
+        }
+        ComputeGaussian(dim, chain->v1, chain->v2, chain->ss, scene->options->malaStdDev, \
+            chain->M, chain->t, cspContrib.ssScore, proposalState.gaussian);
     } else {
-        a = Float(0.0);
+        IsotropicGaussian(dim, scene->options->malaStdDev, proposalState.gaussian);
+    }
+    proposalState.gaussianInitialized = true;
+
+    Float py = GaussianLogPdf(dim, offset, currentState.gaussian);
+    reverseOffset = -offset;
+    Float px = GaussianLogPdf(dim, reverseOffset, proposalState.gaussian);
+    Float a = Clamp(std::exp(px - py) * proposalState.spContrib.ssScore /
+                        currentState.spContrib.ssScore,
+                    Float(0.0),
+                    Float(1.0));
+    proposalState.toSplat.clear();
+    for (const auto &spContrib : spContribs) {
+        proposalState.toSplat.push_back(SplatSample{
+            spContrib.screenPos, spContrib.contrib * normalization / spContrib.lsScore});
     }
 
     // std::cout << "+MALA mutate" << std::endl;
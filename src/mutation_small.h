@@ -10,6 +10,9 @@ struct SmallStep : public Mutation {
                  MarkovState &proposalState,
                  RNG &rng,
                  Chain *chain = NULL) override;
+    void Reserve(const int maxDepth) override {
+        spContribs.reserve(GetMaxNumContribs(maxDepth));
+    }
 
     std::vector<SubpathContrib> spContribs;
     Vector offset;
@@ -1,207 +1,391 @@
 #include "parallel.h"
-#include <list>
 #include <thread>
 #include <condition_variable>
-
-// From https://github.com/mmp/pbrt-v3/blob/master/src/core/parallel.cpp
+#include <fstream>
+#include <memory>
+#include <string>
+#include <algorithm>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Interface from https://github.com/mmp/pbrt-v3/blob/master/src/core/parallel.cpp
+//
+// Instead of pulling every chunk through a global work list, each thread owns a contiguous
+// range of chunks of the current loop and only touches the ranges of other threads when its
+// own one runs dry, in which case it steals the back half of a victim's range.  A range is
+// packed into a single 64-bit word so that the owner (popping from the front) and the thieves
+// (splitting off the back) synchronize with one CAS.  A thread claims a batch of
+// 1/c_ClaimFraction of the chunks left in a range at once, so that loops of many small chunks
+// do not pay a CAS per chunk, while the rest of the range can still be stolen.  The global
+// mutex is only taken when a thread joins or leaves a loop.
+//
+// Several loops can be in flight at once: loops started from other threads and loops nested
+// in the body of another loop are pushed to the front of a list, and idle workers join the
+// newest loop that still has unclaimed chunks.  The thread that starts a loop only helps with
+// that loop, so a thread never runs a body of an outer loop while one of its bodies is
+// suspended in a nested loop.
 
 static std::vector<std::thread> threads;
 static bool shutdownThreads = false;
+static bool useThreadAffinity = false;
+// For each thread index, the other threads ordered by preference as steal victims
+static std::vector<std::vector<int>> stealOrder;
 struct ParallelForLoop;
 static ParallelForLoop *workList = nullptr;
 static std::mutex workListMutex;
+static std::condition_variable workListCondition;
+// Threads that are neither a worker nor the thread that launched them share the last thread
+// index, one of them at a time
+static std::mutex guestMutex;
+static std::mutex launchMutex;
+static bool workersLaunched = false;
+
+// A claim takes this fraction of the chunks left in a range, at least one
+static const uint32_t c_ClaimFraction = 16;
+
+static inline uint32_t ClaimSize(const uint32_t begin, const uint32_t end) {
+    return std::max((end - begin) / c_ClaimFraction, uint32_t(1));
+}
+
+static inline uint64_t PackRange(const uint32_t begin, const uint32_t end) {
+    return (uint64_t(begin) << 32) | uint64_t(end);
+}
+static inline uint32_t RangeBegin(const uint64_t range) {
+    return uint32_t(range >> 32);
+}
+static inline uint32_t RangeEnd(const uint64_t range) {
+    return uint32_t(range & 0xffffffffu);
+}
+
+// Padded so that neighbouring threads do not share a cache line
+struct alignas(64) ChunkRange {
+    std::atomic<uint64_t> bits;
+};
+
 struct ParallelForLoop {
-    ParallelForLoop(std::function<void(int64_t)> func1D, int64_t maxIndex, int chunkSize)
-        : func1D(std::move(func1D)), maxIndex(maxIndex), chunkSize(chunkSize) {
-    }
-    ParallelForLoop(const std::function<void(Vector2i)> &f, const Vector2i count)
-        : func2D(f), maxIndex(count[0] * count[1]), chunkSize(1) {
-        nX = count[0];
+    ParallelForLoop(const std::function<void(int64_t)> *func1D,
+                    const std::function<void(Vector2i)> *func2D,
+                    const int64_t maxIndex,
+                    const int chunkSize,
+                    const int nX,
+                    const int numRanges)
+        : func1D(func1D), func2D(func2D), maxIndex(maxIndex), chunkSize(chunkSize), nX(nX),
+          numRanges(numRanges) {
+        // Chunk indices have to fit in half of a 64-bit word
+        while ((maxIndex + this->chunkSize - 1) / this->chunkSize > int64_t(0xffffffffu)) {
+            this->chunkSize *= 2;
+        }
+        const int64_t numChunks = (maxIndex + this->chunkSize - 1) / this->chunkSize;
+        chunksLeft = numChunks;
+        // Contiguous initial assignment keeps neighbouring indices (e.g. image tiles) on the
+        // same thread
+        ranges = std::unique_ptr<ChunkRange[]>(new ChunkRange[numRanges]);
+        for (int i = 0; i < numRanges; i++) {
+            const uint32_t begin = uint32_t((numChunks * i) / numRanges);
+            const uint32_t end = uint32_t((numChunks * (i + 1)) / numRanges);
+            ranges[i].bits.store(PackRange(begin, end), std::memory_order_relaxed);
+        }
     }
 
-    std::function<void(int64_t)> func1D;
-    std::function<void(Vector2i)> func2D;
+    const std::function<void(int64_t)> *func1D;
+    const std::function<void(Vector2i)> *func2D;
     const int64_t maxIndex;
-    const int chunkSize;
-    int64_t nextIndex = 0;
+    int64_t chunkSize;
+    const int nX;
+    const int numRanges;
+    std::unique_ptr<ChunkRange[]> ranges;
+    std::atomic<int64_t> chunksLeft;
     int activeWorkers = 0;
     ParallelForLoop *next = nullptr;
-    int nX = -1;
 
     bool Finished() const {
-        return nextIndex >= maxIndex && activeWorkers == 0;
+        return chunksLeft.load(std::memory_order_acquire) == 0 && activeWorkers == 0;
+    }
+    // Whether some range still has chunks that no thread has taken, idle workers only join
+    // such loops
+    bool HasUnclaimedChunks() const {
+        for (int i = 0; i < numRanges; i++) {
+            const uint64_t range = ranges[i].bits.load(std::memory_order_acquire);
+            if (RangeBegin(range) < RangeEnd(range)) {
+                return true;
+            }
+        }
+        return false;
     }
-};
 
-static std::condition_variable workListCondition;
-static void workerThreadFunc(const int tIndex) {
-    threadIndex = tIndex;
-    std::unique_lock<std::mutex> lock(workListMutex);
-    while (!shutdownThreads) {
-        if (!workList) {
-            // Sleep until there are more tasks to run
-            workListCondition.wait(lock);
-        } else {
-            // Get work from _workList_ and run loop iterations
-            ParallelForLoop &loop = *workList;
+    // Claims the chunks [_first_, _last_) from the front of the range of _tIndex_
+    bool Pop(const int tIndex, int64_t &first, int64_t &last) {
+        std::atomic<uint64_t> &range = ranges[tIndex].bits;
+        uint64_t cur = range.load(std::memory_order_acquire);
+        while (RangeBegin(cur) < RangeEnd(cur)) {
+            const uint32_t claimEnd = RangeBegin(cur) + ClaimSize(RangeBegin(cur), RangeEnd(cur));
+            if (range.compare_exchange_weak(cur,
+                                            PackRange(claimEnd, RangeEnd(cur)),
+                                            std::memory_order_acq_rel)) {
+                first = RangeBegin(cur);
+                last = claimEnd;
+                return true;
+            }
+        }
+        return false;
+    }
 
-            // Run a chunk of loop iterations for _loop_
+    bool Steal(const int tIndex, int64_t &first, int64_t &last) {
+        for (const int victim : stealOrder[tIndex]) {
+            if (victim >= numRanges) {
+                continue;
+            }
+            std::atomic<uint64_t> &range = ranges[victim].bits;
+            uint64_t cur = range.load(std::memory_order_acquire);
+            while (RangeBegin(cur) < RangeEnd(cur)) {
+                const uint32_t begin = RangeBegin(cur);
+                const uint32_t end = RangeEnd(cur);
+                const uint32_t mid = begin + (end - begin) / 2;
+                if (range.compare_exchange_weak(
+                        cur, PackRange(begin, mid), std::memory_order_acq_rel)) {
+                    // Run the first batch of the stolen chunks right away and keep the rest.
+                    // Our own range is empty here and its old first chunk has been run, so
+                    // the new value cannot match a stale read of another thief.
+                    first = mid;
+                    last = mid + ClaimSize(mid, end);
+                    ranges[tIndex].bits.store(PackRange(uint32_t(last), end),
+                                              std::memory_order_release);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
 
-            // Find the set of loop iterations to run next
-            int64_t indexStart = loop.nextIndex;
-            int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
+    void RunChunk(const int64_t chunk) const {
+        const int64_t indexStart = chunk * chunkSize;
+        const int64_t indexEnd = std::min(indexStart + chunkSize, maxIndex);
+        if (func1D) {
+            for (int64_t index = indexStart; index < indexEnd; ++index) {
+                (*func1D)(index);
+            }
+        }
+        // Handle other types of loops
+        else {
+            assert(func2D != nullptr);
+            for (int64_t index = indexStart; index < indexEnd; ++index) {
+                (*func2D)(Vector2i(index % nX, index / nX));
+            }
+        }
+    }
 
-            // Update _loop_ to reflect iterations this thread will run
-            loop.nextIndex = indexEnd;
-            if (loop.nextIndex == loop.maxIndex)
-                workList = loop.next;
-            loop.activeWorkers++;
+    void Run(const int tIndex) {
+        int64_t first, last;
+        while (Pop(tIndex, first, last) || Steal(tIndex, first, last)) {
+            for (int64_t chunk = first; chunk < last; chunk++) {
+                RunChunk(chunk);
+            }
+            chunksLeft.fetch_sub(last - first, std::memory_order_acq_rel);
+        }
+    }
+};
 
-            // Run loop indices in _[indexStart, indexEnd)_
-            lock.unlock();
-            for (int64_t index = indexStart; index < indexEnd; ++index) {
-                if (loop.func1D) {
-                    loop.func1D(index);
-                }
-                // Handle other types of loops
-                else {
-                    assert(loop.func2D != nullptr);
-                    loop.func2D(Vector2i(index % loop.nX, index / loop.nX));
+// Returns the NUMA node of each logical cpu, all zeros if the topology is not available
+static std::vector<int> CpuNodes(const int numCpus) {
+    std::vector<int> nodes(numCpus, 0);
+#if defined(__linux__)
+    for (int node = 0;; node++) {
+        std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!ifs.is_open()) {
+            break;
+        }
+        // Format: "0-15,32-47"
+        std::string list;
+        std::getline(ifs, list);
+        size_t pos = 0;
+        while (pos < list.size()) {
+            size_t next = list.find(',', pos);
+            if (next == std::string::npos) {
+                next = list.size();
+            }
+            const std::string item = list.substr(pos, next - pos);
+            const size_t dash = item.find('-');
+            try {
+                const int first = std::stoi(item.substr(0, dash));
+                const int last =
+                    dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+                for (int cpu = first; cpu <= last && cpu < numCpus; cpu++) {
+                    nodes[cpu] = node;
                 }
+            } catch (const std::exception &) {
             }
-            lock.lock();
-
-            // Update _loop_ to reflect completion of iterations
-            loop.activeWorkers--;
-            if (loop.Finished())
-                workListCondition.notify_all();
+            pos = next + 1;
         }
     }
+#endif
+    return nodes;
 }
 
-void ParallelFor(const std::function<void(int64_t)> &func, int64_t count, int chunkSize) {
-    // Run iterations immediately if not using threads or if _count_ is small
-    if (count < chunkSize) {
-        for (int64_t i = 0; i < count; ++i) {
-            func(i);
+// Returns the cpus this process may run on, in increasing order
+static std::vector<int> AllowedCpus(const int numCpus) {
+    std::vector<int> cpus;
+#if defined(__linux__)
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &cpuset) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &cpuset)) {
+                cpus.push_back(cpu);
+            }
         }
-        return;
     }
-
-    // Launch worker threads if needed
-    if (threads.size() == 0) {
-        threadIndex = 0;
-        for (int i = 0; i < NumSystemCores() - 1; ++i) {
-            threads.push_back(std::thread(workerThreadFunc, i + 1));
+#endif
+    if (cpus.empty()) {
+        for (int cpu = 0; cpu < numCpus; cpu++) {
+            cpus.push_back(cpu);
         }
     }
+    return cpus;
+}
 
-    // Create and enqueue _ParallelForLoop_ for this loop
-    ParallelForLoop loop(func, count, chunkSize);
-    workListMutex.lock();
-    loop.next = workList;
-    workList = &loop;
-    workListMutex.unlock();
-
-    // Notify worker threads of work to be done
-    std::unique_lock<std::mutex> lock(workListMutex);
-    workListCondition.notify_all();
-
-    // Help out with parallel loop iterations in the current thread
-    while (!loop.Finished()) {
-        // Run a chunk of loop iterations for _loop_
-
-        // Find the set of loop iterations to run next
-        int64_t indexStart = loop.nextIndex;
-        int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
+static void PinThread(std::thread &thread, const int cpu) {
+#if defined(__linux__)
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpuset);
+#endif
+}
 
-        // Update _loop_ to reflect iterations this thread will run
-        loop.nextIndex = indexEnd;
-        if (loop.nextIndex == loop.maxIndex) {
-            workList = loop.next;
+// The newest loop in flight that still has chunks to hand out, called with _workListMutex_ held
+static ParallelForLoop *FindLoop() {
+    for (ParallelForLoop *loop = workList; loop != nullptr; loop = loop->next) {
+        if (loop->HasUnclaimedChunks()) {
+            return loop;
         }
-        loop.activeWorkers++;
+    }
+    return nullptr;
+}
 
-        // Run loop indices in _[indexStart, indexEnd)_
-        lock.unlock();
-        for (int64_t index = indexStart; index < indexEnd; ++index) {
-            if (loop.func1D) {
-                loop.func1D(index);
-            }
-            // Handle other types of loops
-            else {
-                assert(loop.func2D != nullptr);
-                loop.func2D(Vector2i(index % loop.nX, index / loop.nX));
+static void workerThreadFunc(const int tIndex) {
+    threadIndex = tIndex;
+    std::unique_lock<std::mutex> lock(workListMutex);
+    while (!shutdownThreads) {
+        ParallelForLoop *found = FindLoop();
+        if (!found) {
+            // Sleep until there are more tasks to run
+            workListCondition.wait(lock);
+        } else {
+            ParallelForLoop &loop = *found;
+            loop.activeWorkers++;
+            lock.unlock();
+            loop.Run(tIndex);
+            lock.lock();
+            loop.activeWorkers--;
+            if (loop.Finished()) {
+                workListCondition.notify_all();
             }
         }
-        lock.lock();
-
-        // Update _loop_ to reflect completion of iterations
-        loop.activeWorkers--;
     }
 }
 
-thread_local int threadIndex;
-int MaxThreadIndex() {
-    // Launch worker threads if needed
-    if (threads.size() == 0) {
-        threadIndex = 0;
-        for (int i = 0; i < NumSystemCores() - 1; ++i)
-            threads.push_back(std::thread(workerThreadFunc, i + 1));
+static void LaunchWorkerThreads() {
+    std::lock_guard<std::mutex> lock(launchMutex);
+    if (workersLaunched) {
+        return;
+    }
+    workersLaunched = true;
+    threadIndex = 0;
+    const int numThreads = NumSystemCores();
+    // Worker i runs on the i-th cpu of the process, so victims on the same NUMA node are
+    // tried first, nearest thread index first.  The guest index (last) is not pinned and is
+    // tried last.
+    const std::vector<int> cpus = AllowedCpus(numThreads);
+    const std::vector<int> cpuNodes = CpuNodes(cpus.back() + 1);
+    const int numIndices = numThreads + 1;
+    std::vector<int> nodes(numIndices, -1);
+    for (int i = 0; i < numThreads; i++) {
+        nodes[i] = cpuNodes[cpus[i % cpus.size()]];
+    }
+    stealOrder.assign(numIndices, std::vector<int>());
+    for (int i = 0; i < numIndices; i++) {
+        for (int d = 1; d < numIndices; d++) {
+            stealOrder[i].push_back((i + d) % numIndices);
+        }
+        std::stable_sort(stealOrder[i].begin(), stealOrder[i].end(), [&](int a, int b) {
+            return (nodes[a] != nodes[i]) < (nodes[b] != nodes[i]);
+        });
+    }
+    for (int i = 0; i < numThreads - 1; ++i) {
+        threads.push_back(std::thread(workerThreadFunc, i + 1));
+        if (useThreadAffinity) {
+            PinThread(threads.back(), cpus[(i + 1) % cpus.size()]);
+        }
     }
-    return 1 + threads.size();
 }
 
-void ParallelFor(std::function<void(Vector2i)> func, const Vector2i count) {
-    // Launch worker threads if needed
-    if (threads.size() == 0) {
-        threadIndex = 0;
-        for (int i = 0; i < NumSystemCores() - 1; ++i)
-            threads.push_back(std::thread(workerThreadFunc, i + 1));
+static void RunParallelForLoop(ParallelForLoop &loop) {
+    // A thread outside of the pool takes the guest index for the whole loop, including the
+    // loops nested in it
+    std::unique_lock<std::mutex> guestLock;
+    const bool isGuest = threadIndex < 0;
+    if (isGuest) {
+        guestLock = std::unique_lock<std::mutex>(guestMutex);
+        threadIndex = int(threads.size()) + 1;
     }
 
-    ParallelForLoop loop(std::move(func), count);
     {
         std::lock_guard<std::mutex> lock(workListMutex);
         loop.next = workList;
         workList = &loop;
     }
-
-    std::unique_lock<std::mutex> lock(workListMutex);
+    // Notify worker threads of work to be done
     workListCondition.notify_all();
 
     // Help out with parallel loop iterations in the current thread
-    while (!loop.Finished()) {
-        // Run a chunk of loop iterations for _loop_
+    loop.Run(threadIndex);
 
-        // Find the set of loop iterations to run next
-        int64_t indexStart = loop.nextIndex;
-        int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
+    std::unique_lock<std::mutex> lock(workListMutex);
+    workListCondition.wait(lock, [&]() { return loop.Finished(); });
+    ParallelForLoop **link = &workList;
+    while (*link != &loop) {
+        link = &(*link)->next;
+    }
+    *link = loop.next;
+    lock.unlock();
 
-        // Update _loop_ to reflect iterations this thread will run
-        loop.nextIndex = indexEnd;
-        if (loop.nextIndex == loop.maxIndex) {
-            workList = loop.next;
-        }
-        loop.activeWorkers++;
+    if (isGuest) {
+        threadIndex = -1;
+    }
+}
 
-        // Run loop indices in _[indexStart, indexEnd)_
-        lock.unlock();
-        for (int64_t index = indexStart; index < indexEnd; ++index) {
-            if (loop.func1D) {
-                loop.func1D(index);
-            }
-            // Handle other types of loops
-            else {
-                assert(loop.func2D != nullptr);
-                loop.func2D(Vector2i(index % loop.nX, index / loop.nX));
-            }
+void ParallelFor(const std::function<void(int64_t)> &func, int64_t count, int chunkSize) {
+    // Run iterations immediately if _count_ is small
+    if (count < chunkSize) {
+        for (int64_t i = 0; i < count; ++i) {
+            func(i);
         }
-        lock.lock();
-
-        // Update _loop_ to reflect completion of iterations
-        loop.activeWorkers--;
+        return;
     }
+
+    const int numIndices = MaxThreadIndex();
+    ParallelForLoop loop(&func, nullptr, count, chunkSize, -1, numIndices);
+    RunParallelForLoop(loop);
+}
+
+// -1 until the thread launches the pool or takes the guest index
+thread_local int threadIndex = -1;
+int MaxThreadIndex() {
+    LaunchWorkerThreads();
+    return 2 + threads.size();
+}
+
+void ParallelFor(std::function<void(Vector2i)> func, const Vector2i count) {
+    const int numIndices = MaxThreadIndex();
+    ParallelForLoop loop(nullptr,
+                         &func,
+                         int64_t(count[0]) * int64_t(count[1]),
+                         1,
+                         count[0],
+                         numIndices);
+    RunParallelForLoop(loop);
 }
 
 int NumSystemCores() {
@@ -216,7 +400,13 @@ int NumSystemCores() {
     return ret;
 }
 
+void SetThreadAffinity(const bool enable) {
+    useThreadAffinity = enable;
+}
+
 void TerminateWorkerThreads() {
+    std::lock_guard<std::mutex> launchLock(launchMutex);
+    workersLaunched = false;
     if (threads.size() == 0) {
         return;
     }
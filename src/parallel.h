@@ -40,9 +40,36 @@ class AtomicFloat {
 #endif
 };
 
+// Film accumulator, stays accurate when billions of small splats are added to a large sum
+class AtomicDouble {
+    public:
+    explicit AtomicDouble(double v = 0) {
+        bits = FloatToBits(v);
+    }
+    operator double() const {
+        return BitsToFloat(bits);
+    }
+    double operator=(double v) {
+        bits = FloatToBits(v);
+        return v;
+    }
+    void Add(double v) {
+        uint64_t oldBits = bits, newBits;
+        do {
+            newBits = FloatToBits(BitsToFloat(oldBits) + v);
+        } while (!bits.compare_exchange_weak(oldBits, newBits));
+    }
+
+    private:
+    std::atomic<uint64_t> bits;
+};
+
 void ParallelFor(const std::function<void(int64_t)> &func, int64_t count, int chunkSize = 1);
 extern thread_local int threadIndex;
 void ParallelFor(std::function<void(Vector2i)> func, const Vector2i count);
 int MaxThreadIndex();
 int NumSystemCores();
+// Pin worker thread i to the i-th cpu the process may run on (Linux only, off by default), has
+// to be called before the first ParallelFor
+void SetThreadAffinity(bool enable);
 void TerminateWorkerThreads();
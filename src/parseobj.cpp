@@ -68,11 +68,11 @@ size_t GetVertexId(const ObjVertex &vertex,
                    const Matrix4x4 &toWorld0,
                    const Matrix4x4 &toWorld1,
                    bool isMoving,
-                   std::vector<Vector3> &pos0,
-                   std::vector<Vector3> &pos1,
-                   std::vector<Vector2> &st,
-                   std::vector<Vector3> &nor0,
-                   std::vector<Vector3> &nor1,
+                   VertexBuffer &pos0,
+                   VertexBuffer &pos1,
+                   STBuffer &st,
+                   NormalBuffer &nor0,
+                   NormalBuffer &nor1,
                    std::map<ObjVertex, size_t> &vertexMap) {
     auto it = vertexMap.find(vertex);
     if (it != vertexMap.end()) {
@@ -1,306 +1,503 @@
 #include "parseply.h"
 #include "transform.h"
 #include "utils.h"
-
-#include <map>
-#include <fstream>
-#include <regex>
+#include "parallel.h"
+#include "mappedfile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
 #include <string>
-#include <stdexcept>
-
-enum ByteOrder {
-        LittleEndian,
-        BigEndian,
-        HostByteOrder
-    };
-
-// trim from start
-static inline std::string &ltrim(std::string &s) {
-    s.erase(s.begin(),
-            std::find_if(s.begin(), s.end(), std::not1(std::ptr_fun<int, int>(std::isspace))));
-    return s;
-}
-
-// trim from end
-static inline std::string &rtrim(std::string &s) {
-    s.erase(
-        std::find_if(s.rbegin(), s.rend(), std::not1(std::ptr_fun<int, int>(std::isspace))).base(),
-        s.end());
-    return s;
-}
 
-// trim from both ends
-static inline std::string &trim(std::string &s) {
-    return ltrim(rtrim(s));
+// Elements decoded by one task of the binary loader
+static const int64_t c_PlyChunkSize = 1 << 16;
+
+enum class PlyFormat { Ascii, BinaryLittleEndian, BinaryBigEndian };
+
+enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+struct PlyProperty {
+    std::string name;
+    PlyType type;
+    bool isList;
+    PlyType countType;
+    // Offset in the record, only valid for the properties before the first list
+    size_t offset;
+};
+
+struct PlyElement {
+    std::string name;
+    int64_t count;
+    std::vector<PlyProperty> properties;
+    // The size of a record without lists
+    size_t fixedSize;
+    int numLists;
+};
+
+struct PlyHeader {
+    PlyFormat format;
+    std::vector<PlyElement> elements;
+    size_t bodyOffset;
+};
+
+static PlyType ParsePlyType(const std::string &token) {
+    if (token == "char" || token == "int8") {
+        return PlyType::Int8;
+    } else if (token == "uchar" || token == "uint8") {
+        return PlyType::UInt8;
+    } else if (token == "short" || token == "int16") {
+        return PlyType::Int16;
+    } else if (token == "ushort" || token == "uint16") {
+        return PlyType::UInt16;
+    } else if (token == "int" || token == "int32") {
+        return PlyType::Int32;
+    } else if (token == "uint" || token == "uint32") {
+        return PlyType::UInt32;
+    } else if (token == "float" || token == "float32") {
+        return PlyType::Float32;
+    } else if (token == "double" || token == "float64") {
+        return PlyType::Float64;
+    }
+    Error("invalid PLY header: unknown property type " + token);
 }
 
-ByteOrder getMachineEndianness() {
-    unsigned char i=1;
-    char *c = (char *)&i;
-    if (*c)
-        return ByteOrder::LittleEndian;
-    else
-        return ByteOrder::BigEndian;
+static size_t PlyTypeSize(const PlyType type) {
+    switch (type) {
+        case PlyType::Int8:
+        case PlyType::UInt8:
+            return 1;
+        case PlyType::Int16:
+        case PlyType::UInt16:
+            return 2;
+        case PlyType::Int32:
+        case PlyType::UInt32:
+        case PlyType::Float32:
+            return 4;
+        case PlyType::Float64:
+            return 8;
+    }
+    return 0;
 }
 
-std::shared_ptr<TriMeshData> ParsePly(const std::string &filename,
-                                      const Matrix4x4 &toWorld0,
-                                      const Matrix4x4 &toWorld1,
-                                      bool isMoving,
-                                      bool flipNormals,
-                                      bool faceNormals) {
-    
-    std::shared_ptr<TriMeshData> data = std::make_shared<TriMeshData>();
-    data->isMoving = isMoving;
-
-    std::ifstream ifs(filename.c_str(), std::ifstream::in);
-
-    if (!ifs.is_open())
-        throw std::runtime_error("Unable to open the obj file");
-    else
-        std::cout << "Parsing " << filename << std::endl;
-
-    bool ply_tag_seen = false,
-     ascii = false,
-     header_processsed = false,
-     contain_vert_normal = false,
-     contain_uv = false;
-
-    ByteOrder byte_order = ByteOrder::HostByteOrder;
-
-    unsigned int stream_pos;
-    // parse header
-    while (ifs.good()) {
-        std::string line;
-        std::getline(ifs, line);
-        line = trim(line);
-        if (line.size() == 0)
-            continue;
+static PlyHeader ParsePlyHeader(const MappedFile &file) {
+    const char *const end = file.data + file.size;
+    const char *const headerEnd = std::search(
+        file.data, end, "end_header", "end_header" + std::strlen("end_header"));
+    if (headerEnd == end) {
+        Error("invalid PLY header: missing \"end_header\"");
+    }
+    const char *body = static_cast<const char *>(std::memchr(headerEnd, '\n', end - headerEnd));
+    if (body == nullptr) {
+        Error("invalid PLY header: missing newline after \"end_header\"");
+    }
 
-        std::stringstream ss(line);
+    PlyHeader header;
+    bool plyTagSeen = false, formatSeen = false;
+    std::istringstream lines(std::string(file.data, headerEnd));
+    std::string line;
+    while (std::getline(lines, line)) {
+        std::istringstream ss(line);
         std::string token;
-        ss >> token;
-
-        // std::cout << token << std::endl;
-
-        if ( token ==  "comment")  // comment
+        if (!(ss >> token) || token == "comment" || token == "obj_info") {
             continue;
-        else if (token == "ply")
-            ply_tag_seen = true;
-        else if( token == "format") {
-            if(!ply_tag_seen)
-                throw std::runtime_error("invalid PLY header: \"format\" before \"ply\" tag");
-            if(header_processsed)
-                throw std::runtime_error("invalid PLY header: duplicate \"format\" tag");
-            
-            if (!(ss >> token))
-                throw std::runtime_error("invalid PLY header: missing token after \"format\"");
-
-            if ( token == "ascii")
-                ascii = true;
-            else if (token == "binary_little_endian")
-                byte_order = ByteOrder::LittleEndian;
-            else if (token == "binary_big_endian")
-                byte_order = ByteOrder::BigEndian;
-            else
-                throw std::runtime_error("invalid PLY header: invalid token after \"format\"");
-
-            if (!(ss >> token))
-                throw std::runtime_error("invalid PLY header: missing version number after \"format\"");
-            if (token != "1.0")
-                throw std::runtime_error("PLY file has unknown version number " + token);
-            if (ss >> token)
-                throw std::runtime_error("invalid PLY header: excess tokens after \"format\"");
-            header_processsed = true;
-        } else if ( token == "element" ) {
-            ss >> token;
-            if ( token == "vertex" ) {
-                int numVert;
-                ss >> numVert;
-                std::cout << "Num verts : " << numVert << std::endl; 
-                data->position0.resize(numVert);
-                data->position1.resize(numVert);
-                // posPool.resize(numVert);
-            } else if ( token == "face" ) {
-                int numFaces;
-                ss >> numFaces;
-                std::cout << "Num faces : " << numFaces << std::endl;
-                // posPool.resize(numVert);
-                data->indices.resize(numFaces);
-            } 
-
-        } else if ( token == "property" ) {
-            ss >> token;  // type
+        }
+        if (token == "ply") {
+            plyTagSeen = true;
+        } else if (token == "format") {
+            if (!plyTagSeen) {
+                Error("invalid PLY header: \"format\" before \"ply\" tag");
+            }
+            if (formatSeen) {
+                Error("invalid PLY header: duplicate \"format\" tag");
+            }
+            std::string version;
+            if (!(ss >> token >> version)) {
+                Error("invalid PLY header: missing tokens after \"format\"");
+            }
+            if (token == "ascii") {
+                header.format = PlyFormat::Ascii;
+            } else if (token == "binary_little_endian") {
+                header.format = PlyFormat::BinaryLittleEndian;
+            } else if (token == "binary_big_endian") {
+                header.format = PlyFormat::BinaryBigEndian;
+            } else {
+                Error("invalid PLY header: invalid token after \"format\"");
+            }
+            if (version != "1.0") {
+                Error("PLY file has unknown version number " + version);
+            }
+            formatSeen = true;
+        } else if (token == "element") {
+            PlyElement element;
+            if (!(ss >> element.name >> element.count) || element.count < 0) {
+                Error("invalid PLY header: bad \"element\"");
+            }
+            element.fixedSize = 0;
+            element.numLists = 0;
+            header.elements.push_back(element);
+        } else if (token == "property") {
+            if (header.elements.empty()) {
+                Error("invalid PLY header: \"property\" before \"element\"");
+            }
+            PlyElement &element = header.elements.back();
+            PlyProperty property;
+            property.offset = element.fixedSize;
             ss >> token;
-            // std::cout << "Parsing property : " << token << std::endl;
-            if ( token == "nx") {
-                contain_vert_normal = true;
-                data->normal0.resize(data->position0.size());
-                data->normal1.resize(data->position1.size());
-            } else if ( token == "u" || token == "s") {
-                contain_uv = true;
-                data->st.resize(data->position0.size());
+            property.isList = token == "list";
+            if (property.isList) {
+                ss >> token;
+                property.countType = ParsePlyType(token);
+                ss >> token;
+                element.numLists++;
+            } else {
+                element.fixedSize += PlyTypeSize(ParsePlyType(token));
             }
-
-        } else if ( token == "end_header" ) {
-            stream_pos = ifs.tellg();
-            break;
+            property.type = ParsePlyType(token);
+            if (!(ss >> property.name)) {
+                Error("invalid PLY header: property without a name");
+            }
+            element.properties.push_back(property);
         }
     }
+    if (!formatSeen) {
+        Error("invalid PLY header: missing \"format\"");
+    }
+    header.bodyOffset = size_t(body + 1 - file.data);
+    return header;
+}
 
-    ifs.close();
-
+template <typename T>
+static inline T LoadScalar(const char *ptr, const bool swap) {
+    T value;
+    if (swap) {
+        char bytes[sizeof(T)];
+        std::reverse_copy(ptr, ptr + sizeof(T), bytes);
+        std::memcpy(&value, bytes, sizeof(T));
+    } else {
+        std::memcpy(&value, ptr, sizeof(T));
+    }
+    return value;
+}
 
-    if(ascii)
-        ifs = std::ifstream(filename.c_str(), std::ifstream::in);
-    else    
-        ifs = std::ifstream(filename.c_str(), std::ifstream::in | std::ifstream::binary);
-    
-    ifs.seekg(stream_pos);
+static inline double LoadValue(const char *ptr, const PlyType type, const bool swap) {
+    switch (type) {
+        case PlyType::Int8:
+            return double(LoadScalar<int8_t>(ptr, swap));
+        case PlyType::UInt8:
+            return double(LoadScalar<uint8_t>(ptr, swap));
+        case PlyType::Int16:
+            return double(LoadScalar<int16_t>(ptr, swap));
+        case PlyType::UInt16:
+            return double(LoadScalar<uint16_t>(ptr, swap));
+        case PlyType::Int32:
+            return double(LoadScalar<int32_t>(ptr, swap));
+        case PlyType::UInt32:
+            return double(LoadScalar<uint32_t>(ptr, swap));
+        case PlyType::Float32:
+            return double(LoadScalar<float>(ptr, swap));
+        case PlyType::Float64:
+            return LoadScalar<double>(ptr, swap);
+    }
+    return 0.0;
+}
 
-    std::cout << "Ascii format : " << ascii << std::endl;
-    if ( getMachineEndianness() != byte_order)
-        std::cout << "Problem detected! machine endianness : " << getMachineEndianness() << ", file endianness : " << byte_order << std::endl;
+enum class ByteOrder { LittleEndian, BigEndian };
 
-    // std::cout << "contain vert normals : " << contain_vert_normal << ", contain uv : " << contain_uv << std::endl;
-    // parse the vert data
-    int numVertParsed = 0;
-    while (ifs.good()) {
+static ByteOrder GetMachineEndianness() {
+    const uint16_t one = 1;
+    uint8_t firstByte;
+    std::memcpy(&firstByte, &one, 1);
+    return firstByte == 1 ? ByteOrder::LittleEndian : ByteOrder::BigEndian;
+}
 
+// The vertex properties the renderer uses, -1 for the missing ones
+struct PlyVertexLayout {
+    int x = -1, y = -1, z = -1;
+    int nx = -1, ny = -1, nz = -1;
+    int u = -1, v = -1;
+};
+
+static PlyVertexLayout GetVertexLayout(const PlyElement &element) {
+    PlyVertexLayout layout;
+    for (int i = 0; i < int(element.properties.size()); i++) {
+        const PlyProperty &property = element.properties[i];
+        if (property.isList) {
+            continue;
+        }
+        const std::string &name = property.name;
+        if (name == "x") {
+            layout.x = i;
+        } else if (name == "y") {
+            layout.y = i;
+        } else if (name == "z") {
+            layout.z = i;
+        } else if (name == "nx") {
+            layout.nx = i;
+        } else if (name == "ny") {
+            layout.ny = i;
+        } else if (name == "nz") {
+            layout.nz = i;
+        } else if (name == "u" || name == "s") {
+            layout.u = i;
+        } else if (name == "v" || name == "t") {
+            layout.v = i;
+        }
+    }
+    if (layout.x < 0 || layout.y < 0 || layout.z < 0) {
+        Error("PLY vertices have no position");
+    }
+    if (layout.nx < 0 || layout.ny < 0 || layout.nz < 0) {
+        layout.nx = layout.ny = layout.nz = -1;
+    }
+    if (layout.u < 0 || layout.v < 0) {
+        layout.u = layout.v = -1;
+    }
+    return layout;
+}
 
-        // get vertex data
-        if (numVertParsed < data->position0.size()) {
-            std::string line;
-            std::stringstream ss;
-            // std::string token;
-            if (ascii) {
-                // parse per line
-                std::getline(ifs, line);
-                line = trim(line);
-                
-                if (line.size() == 0)
-                    continue;            
-                // ss << line;
-                ss.str(line);
-                // ss >> token;
-            }
+static int GetFaceIndexProperty(const PlyElement &element) {
+    for (int i = 0; i < int(element.properties.size()); i++) {
+        const PlyProperty &property = element.properties[i];
+        if (property.isList &&
+            (property.name == "vertex_indices" || property.name == "vertex_index")) {
+            return i;
+        }
+    }
+    Error("PLY faces have no vertex_indices");
+}
 
-            Float x, y, z;
-            if (ascii)
-                ss >> x >> y >> z;
-            else{
-                                
-                ifs.read(reinterpret_cast<char*>(&x), sizeof(Float));
-                ifs.read(reinterpret_cast<char*>(&y), sizeof(Float));
-                ifs.read(reinterpret_cast<char*>(&z), sizeof(Float));
-            }
-                
+static void ThrowNotTriangle(const int64_t numVertPerFace) {
+    Error("Only support trimeshes!. Input mesh contains " + std::to_string(numVertPerFace) +
+          " faces");
+}
 
-            Vector3 vert(x,y,z);
-            // std::cout << numVertParsed << " vert " << vert.transpose() << std::endl;
-            data->position0[numVertParsed] = (XformPoint(toWorld0, vert));
-            data->position1[numVertParsed] = (XformPoint(toWorld1, vert));
+// Stores vertex _i_, _value(p)_ returns the value of vertex property p
+template <typename Values>
+static inline void StoreVertex(const int64_t i,
+                               const Values &value,
+                               const PlyVertexLayout &layout,
+                               const Matrix4x4 &toWorld0,
+                               const Matrix4x4 &toWorld1,
+                               const Matrix4x4 &invToWorld0,
+                               const Matrix4x4 &invToWorld1,
+                               TriMeshData &data) {
+    const Vector3 vert(Float(value(layout.x)), Float(value(layout.y)), Float(value(layout.z)));
+    data.position0[i] = XformPoint(toWorld0, vert);
+    data.position1[i] = XformPoint(toWorld1, vert);
+    if (layout.nx >= 0) {
+        const Vector3 normal(Float(value(layout.nx)), Float(value(layout.ny)), Float(value(layout.nz)));
+        data.normal0[i] = XformNormal(invToWorld0, normal);
+        data.normal1[i] = XformNormal(invToWorld1, normal);
+    }
+    if (layout.u >= 0) {
+        data.st[i] = Vector2(Float(value(layout.u)), Float(value(layout.v)));
+    }
+}
 
-            // parse normals
-            if (contain_vert_normal) {
-                Float nx, ny, nz;
-                if (ascii)
-                    ss >> nx >> ny >> nz;
-                else{
-                                    
-                    ifs.read(reinterpret_cast<char*>(&nx), sizeof(Float));
-                    ifs.read(reinterpret_cast<char*>(&ny), sizeof(Float));
-                    ifs.read(reinterpret_cast<char*>(&nz), sizeof(Float));
+// Decodes _element_ record by record, _next(type)_ returns the next value of the body
+template <typename Next>
+static void DecodeElement(const PlyElement &element,
+                          Next &next,
+                          const Matrix4x4 &toWorld0,
+                          const Matrix4x4 &toWorld1,
+                          const Matrix4x4 &invToWorld0,
+                          const Matrix4x4 &invToWorld1,
+                          TriMeshData &data) {
+    const bool isVertex = element.name == "vertex";
+    const bool isFace = element.name == "face";
+    const PlyVertexLayout layout = isVertex ? GetVertexLayout(element) : PlyVertexLayout();
+    const int listId = isFace ? GetFaceIndexProperty(element) : -1;
+    std::vector<double> values(element.properties.size());
+    auto value = [&](const int p) { return values[p]; };
+    for (int64_t i = 0; i < element.count; i++) {
+        for (int p = 0; p < int(element.properties.size()); p++) {
+            const PlyProperty &property = element.properties[p];
+            if (!property.isList) {
+                values[p] = next(property.type);
+                continue;
+            }
+            const int64_t count = int64_t(next(property.countType));
+            if (p == listId) {
+                if (count != 3) {
+                    ThrowNotTriangle(count);
                 }
-                    
-
-                Vector3 normal(nx,ny,nz);
-                // std::cout << numVertParsed << " normal " << normal.transpose() << std::endl;
-                data->normal0[numVertParsed] = (XformNormal(Matrix4x4(toWorld0.inverse()), normal));
-                data->normal1[numVertParsed] = (XformNormal(Matrix4x4(toWorld1.inverse()), normal));
+                const TriIndexID i0 = TriIndexID(next(property.type));
+                const TriIndexID i1 = TriIndexID(next(property.type));
+                const TriIndexID i2 = TriIndexID(next(property.type));
+                data.indices[i] = TriIndex(i0, i1, i2);
+                continue;
+            }
+            for (int64_t j = 0; j < count; j++) {
+                next(property.type);
             }
+        }
+        if (isVertex) {
+            StoreVertex(i, value, layout, toWorld0, toWorld1, invToWorld0, invToWorld1, data);
+        }
+    }
+}
 
-            // parse uv
-            if ( contain_uv ) {
-                Float u, v;
-                if (ascii)
-                    ss >> u >> v;
-                else{
-                    ifs.read(reinterpret_cast<char*>(&u), sizeof(Float));
-                    ifs.read(reinterpret_cast<char*>(&v), sizeof(Float));
+// Binary bodies: the vertices, and the faces when their only list is the indices, have
+// records of a fixed size, taking faces to be triangles, and are decoded in parallel chunks
+// straight from the mapping. Every face checks that it is a triangle.
+static void DecodeBinaryBody(const MappedFile &file,
+                             const PlyHeader &header,
+                             const Matrix4x4 &toWorld0,
+                             const Matrix4x4 &toWorld1,
+                             TriMeshData &data) {
+    const bool swap = (header.format == PlyFormat::BinaryBigEndian) !=
+                      (GetMachineEndianness() == ByteOrder::BigEndian);
+    const Matrix4x4 invToWorld0 = toWorld0.inverse();
+    const Matrix4x4 invToWorld1 = toWorld1.inverse();
+    const char *ptr = file.data + header.bodyOffset;
+    const char *const end = file.data + file.size;
+    auto next = [&](const PlyType type) {
+        const size_t size = PlyTypeSize(type);
+        if (size > size_t(end - ptr)) {
+            Error("PLY file is truncated");
+        }
+        const double value = LoadValue(ptr, type, swap);
+        ptr += size;
+        return value;
+    };
+    for (const PlyElement &element : header.elements) {
+        const int64_t numChunks = (element.count + c_PlyChunkSize - 1) / c_PlyChunkSize;
+        if (element.name == "vertex" && element.numLists == 0 && element.fixedSize > 0) {
+            if (element.count > int64_t(size_t(end - ptr) / element.fixedSize)) {
+                Error("PLY file is truncated");
+            }
+            const PlyVertexLayout layout = GetVertexLayout(element);
+            const char *begin = ptr;
+            ParallelFor([&](const int64_t chunk) {
+                const int64_t last = std::min((chunk + 1) * c_PlyChunkSize, element.count);
+                for (int64_t i = chunk * c_PlyChunkSize; i < last; i++) {
+                    const char *record = begin + i * element.fixedSize;
+                    auto value = [&](const int p) {
+                        const PlyProperty &property = element.properties[p];
+                        return LoadValue(record + property.offset, property.type, swap);
+                    };
+                    StoreVertex(
+                        i, value, layout, toWorld0, toWorld1, invToWorld0, invToWorld1, data);
                 }
-                    
-
-                Vector2 uv(u, v);
-                // std::cout << numVertParsed << " uv " << uv.transpose() << std::endl;
-                data->st[numVertParsed] = uv;
+            }, numChunks);
+            ptr += element.count * element.fixedSize;
+        } else if (element.name == "face" && element.numLists == 1 &&
+                   element.properties[GetFaceIndexProperty(element)].offset ==
+                       element.fixedSize) {
+            // The index list is the last property, the ones before it are at fixed offsets
+            const PlyProperty &list = element.properties[GetFaceIndexProperty(element)];
+            const size_t countSize = PlyTypeSize(list.countType);
+            const size_t indexSize = PlyTypeSize(list.type);
+            const size_t stride = element.fixedSize + countSize + 3 * indexSize;
+            if (element.count > int64_t(size_t(end - ptr) / stride)) {
+                Error("PLY file is truncated");
             }
-
-            ++numVertParsed;
-        } else
-            break;
-        
+            const char *begin = ptr + list.offset;
+            // A face that is not a triangle moves all the records after it, the first one
+            // is enough to reject the mesh
+            std::atomic<int64_t> firstBad(element.count);
+            ParallelFor([&](const int64_t chunk) {
+                const int64_t last = std::min((chunk + 1) * c_PlyChunkSize, element.count);
+                for (int64_t i = chunk * c_PlyChunkSize; i < last; i++) {
+                    const char *record = begin + i * stride;
+                    if (LoadValue(record, list.countType, swap) != 3.0) {
+                        int64_t bad = firstBad.load();
+                        while (i < bad && !firstBad.compare_exchange_weak(bad, i)) {
+                        }
+                        return;
+                    }
+                    record += countSize;
+                    data.indices[i] =
+                        TriIndex(TriIndexID(LoadValue(record, list.type, swap)),
+                                 TriIndexID(LoadValue(record + indexSize, list.type, swap)),
+                                 TriIndexID(LoadValue(record + 2 * indexSize, list.type, swap)));
+                }
+            }, numChunks);
+            if (firstBad < element.count) {
+                const char *record = begin + firstBad * stride;
+                ThrowNotTriangle(int64_t(LoadValue(record, list.countType, swap)));
+            }
+            ptr += element.count * stride;
+        } else {
+            DecodeElement(
+                element, next, toWorld0, toWorld1, invToWorld0, invToWorld1, data);
+        }
     }
+}
 
-    int numFacesParsed = 0;
-    while (ifs.good()) {
-
+// ASCII bodies are one token after the other, whatever the line breaks
+static void DecodeAsciiBody(const MappedFile &file,
+                            const PlyHeader &header,
+                            const Matrix4x4 &toWorld0,
+                            const Matrix4x4 &toWorld1,
+                            TriMeshData &data) {
+    const Matrix4x4 invToWorld0 = toWorld0.inverse();
+    const Matrix4x4 invToWorld1 = toWorld1.inverse();
+    const char *ptr = file.data + header.bodyOffset;
+    const char *const end = file.data + file.size;
+    // strtod needs a terminated token, which the mapping does not have at its very end
+    char token[64];
+    auto next = [&](const PlyType) {
+        while (ptr < end && std::isspace((unsigned char)*ptr)) {
+            ptr++;
+        }
+        size_t length = 0;
+        while (ptr + length < end && !std::isspace((unsigned char)ptr[length]) &&
+               length + 1 < sizeof(token)) {
+            token[length] = ptr[length];
+            length++;
+        }
+        token[length] = '\0';
+        char *tokenEnd;
+        const double value = std::strtod(token, &tokenEnd);
+        if (length == 0 || tokenEnd != token + length) {
+            Error("PLY file has an invalid value");
+        }
+        ptr += length;
+        return value;
+    };
+    for (const PlyElement &element : header.elements) {
+        DecodeElement(element, next, toWorld0, toWorld1, invToWorld0, invToWorld1, data);
+    }
+}
 
-        // get face data
-        if (numFacesParsed < data->indices.size()) {
-            std::string line;
-            std::stringstream ss;
-            // std::string token;
-            if (ascii) {
-                
-                std::getline(ifs, line);
-                line = trim(line);
-                if (line.size() == 0)
-                    continue;      
-                // ss << line; 
-                ss.str(line);     
-                // ss >> token;
-            }
+std::shared_ptr<TriMeshData> ParsePly(const std::string &filename,
+                                      const Matrix4x4 &toWorld0,
+                                      const Matrix4x4 &toWorld1,
+                                      bool isMoving,
+                                      bool flipNormals,
+                                      bool faceNormals) {
+    std::shared_ptr<TriMeshData> data = std::make_shared<TriMeshData>();
+    data->isMoving = isMoving;
 
-            // int numVertPerFace = 3;
-            unsigned char numVertPerFace_char;
-            if (ascii)
-                ss >> numVertPerFace_char;
-            else {    
-                ifs.read(reinterpret_cast<char*>(&numVertPerFace_char), sizeof(numVertPerFace_char));
+    const MappedFile file(filename);
+    std::cout << "Parsing " << filename << std::endl;
+    const PlyHeader header = ParsePlyHeader(file);
+    for (const PlyElement &element : header.elements) {
+        if (element.name == "vertex") {
+            std::cout << "Num verts : " << element.count << std::endl;
+            data->position0.resize(element.count);
+            data->position1.resize(element.count);
+            if (GetVertexLayout(element).nx >= 0) {
+                data->normal0.resize(element.count);
+                data->normal1.resize(element.count);
             }
-
-            // std::cout << "readVal : " << numVertPerFace_char << std::endl;
-            int numVertPerFace;
-            if (ascii)
-                numVertPerFace = numVertPerFace_char - '0';
-            else
-                numVertPerFace = numVertPerFace_char;
-              
-            if (numVertPerFace != 3)
-                throw std::runtime_error("Only support trimeshes!. Input mesh contains " + std::to_string(numVertPerFace) + " faces");
-            
-            int si0, si1, si2;
-
-            if (ascii)
-                ss >> si0 >> si1 >> si2;
-            else {
-                ifs.read(reinterpret_cast<char*>(&si0), sizeof(si0));
-                ifs.read(reinterpret_cast<char*>(&si1), sizeof(si1));
-                ifs.read(reinterpret_cast<char*>(&si2), sizeof(si2));
-                // std::cout << "i0 : " << si0 << ", i1 : " << si1 << ", i2 : " << si2 << std::endl;
+            if (GetVertexLayout(element).u >= 0) {
+                data->st.resize(element.count);
             }
-                
-
-            int v0id = (si0),
-                v1id = (si1),
-                v2id = (si2);
+        } else if (element.name == "face") {
+            std::cout << "Num faces : " << element.count << std::endl;
+            data->indices.resize(element.count);
+        }
+    }
 
-            // std::cout << "i0 : " << v0id << ", i1 : " << v1id << ", i2 : " << v2id << std::endl;
-            data->indices[numFacesParsed] = (TriIndex(v0id, v1id, v2id));
-            ++numFacesParsed;
-        } else
-            break;
+    if (header.format == PlyFormat::Ascii) {
+        DecodeAsciiBody(file, header, toWorld0, toWorld1, *data);
+    } else {
+        DecodeBinaryBody(file, header, toWorld0, toWorld1, *data);
     }
 
     if (data->normal0.size() == 0 || faceNormals) {
@@ -309,42 +506,11 @@ std::shared_ptr<TriMeshData> ParsePly(const std::string &filename,
     }
 
     if (flipNormals) {
-        for (int i = 0; i < data->normal0.size(); i++)
+        for (size_t i = 0; i < data->normal0.size(); i++)
             data->normal0[i] = -data->normal0[i];
-        for (int i = 0; i < data->normal1.size(); i++) 
+        for (size_t i = 0; i < data->normal1.size(); i++) 
             data->normal1[i] = -data->normal1[i];
     }
 
-    // std::cout << "Loaded Mesh contains " << data->position0.size() << " vertices "
-    //     << data->indices.size() << " faces" << std::endl;
-
-    // std::cout << "Vert info" << std::endl;
-    // // print mesh info
-    // for (size_t i = 0; i < data->position0.size(); i++)
-    // {
-    //     std::cout << i << " " << data->position0.at(i).transpose() << std::endl;
-    // }
-
-    // std::cout << "=========" << std::endl;
-
-    // if(data->normal0.size() > 0) {
-    //     std::cout << "Normal info" << std::endl;
-    //     for (size_t i = 0; i < data->normal0.size(); i++)
-    //     {
-    //         std::cout << i << " " << data->normal0.at(i).transpose() << std::endl;
-    //     }
-        
-    //     std::cout << "================" << std::endl;
-    // }
-
-    // std::cout << "Face Info" << std::endl;
-
-    // for (size_t i = 0; i < data->indices.size(); i++)
-    // {
-    //     std::cout << i << " " << data->indices.at(i) << std::endl;
-    // }
-    
-    // std::cout << "===========" << std::endl;
-
     return data;
-}
\ No newline at end of file
+}
@@ -8,6 +8,7 @@
 #include "parseobj.h"
 #include "parseply.h"
 #include "loadserialized.h"
+#include "scenecache.h"
 #include "pointlight.h"
 #include "arealight.h"
 #include "ieslight.h"
@@ -22,10 +23,14 @@
 #include "bitmaptexture.h"
 
 #include "spotlight.h"
+#include "parallel.h"
+#include "timer.h"
 
+#include <exception>
 #include <iostream>
-#include <regex>
 #include <map>
+#include <mutex>
+#include <regex>
 
 using BSDFMap = std::map<std::string, std::shared_ptr<const BSDF>>;
 using TextureMap = std::map<std::string, std::shared_ptr<const TextureRGB>>;
@@ -34,17 +39,21 @@ Vector3 ParseVector3(const std::string &value);
 Matrix4x4 ParseMatrix4x4(const std::string &value);
 Matrix4x4 ParseTransform(pugi::xml_node node);
 AnimatedTransform ParseAnimatedTransform(pugi::xml_node node);
-std::unique_ptr<Scene> ParseScene(pugi::xml_node node);
+std::unique_ptr<Scene> ParseScene(pugi::xml_node node, SceneCache *cache);
 std::shared_ptr<const Camera> ParseSensor(pugi::xml_node node, std::string &filename);
 std::shared_ptr<Image3> ParseFilm(pugi::xml_node node, std::string &filename);
+std::shared_ptr<const BSDF> ParseShapeBSDF(pugi::xml_node node,
+                                           const BSDFMap &bsdfMap,
+                                           const TextureMap &textureMap);
 std::shared_ptr<const Shape> ParseShape(pugi::xml_node node,
-                                        const BSDFMap &bsdfMap,
-                                        const TextureMap &textureMap,
+                                        const std::shared_ptr<const BSDF> &bsdf,
+                                        SceneCache *cache,
                                         std::shared_ptr<const Light> &areaLight);
 std::shared_ptr<const BSDF> ParseBSDF(pugi::xml_node node,
                                       const TextureMap &textureMap,
                                       bool twoSided = false);
 std::shared_ptr<const Light> ParseEmitter(pugi::xml_node node,
+                                          SceneCache *cache,
                                           std::shared_ptr<const EnvLight> &envLight);
 std::shared_ptr<const TextureRGB> ParseTexture(pugi::xml_node node);
 std::shared_ptr<const Texture1D> Parse1DMap(pugi::xml_node node, const TextureMap &textureMap);
@@ -238,10 +247,9 @@ std::shared_ptr<const Camera> ParseSensor(pugi::xml_node node, std::string &file
         Eigen::aligned_allocator<Camera>(), toWorld, fov, film, nearClip, farClip, cropOffsetX, cropOffsetY, cropWidth, cropHeight );
 }
 
-std::shared_ptr<const Shape> ParseShape(pugi::xml_node node,
-                                        const BSDFMap &bsdfMap,
-                                        const TextureMap &textureMap,
-                                        std::shared_ptr<const Light> &areaLight) {
+std::shared_ptr<const BSDF> ParseShapeBSDF(pugi::xml_node node,
+                                           const BSDFMap &bsdfMap,
+                                           const TextureMap &textureMap) {
     std::shared_ptr<const BSDF> bsdf;
     for (auto child : node.children()) {
         std::string name = child.name();
@@ -264,8 +272,58 @@ std::shared_ptr<const Shape> ParseShape(pugi::xml_node node,
             }
         }
     }
+    return bsdf;
+}
+
+// Runs the loader of _type_, or takes the processed mesh from _cache_ if there is one. The
+// meshes of area lights get their area distribution, which the cache keeps too.
+static std::shared_ptr<TriMeshData> LoadMesh(SceneCache *cache,
+                                             const std::string &type,
+                                             const std::string &filename,
+                                             const int shapeIndex,
+                                             const Matrix4x4 toWorld[2],
+                                             const bool isMoving,
+                                             const bool flipNormals,
+                                             const bool faceNormals,
+                                             const bool emitter) {
+    auto load = [&]() {
+        std::shared_ptr<TriMeshData> data;
+        if (type == "serialized") {
+            data = LoadSerialized(
+                filename, shapeIndex, toWorld[0], toWorld[1], isMoving, flipNormals, faceNormals);
+        } else if (type == "obj") {
+            data = ParseObj(filename, toWorld[0], toWorld[1], isMoving, flipNormals, faceNormals);
+        } else {
+            data = ParsePly(filename, toWorld[0], toWorld[1], isMoving, flipNormals, faceNormals);
+        }
+        if (emitter) {
+            ComputeAreaDistribution(*data);
+        }
+        return data;
+    };
+    if (cache == nullptr) {
+        return load();
+    }
+    return cache->Get(MeshCacheKey(type,
+                                   filename,
+                                   shapeIndex,
+                                   toWorld[0],
+                                   toWorld[1],
+                                   isMoving,
+                                   flipNormals,
+                                   faceNormals,
+                                   emitter),
+                      load);
+}
+
+// Loads the mesh of a shape, called from the threads of a ParallelFor
+std::shared_ptr<const Shape> ParseShape(pugi::xml_node node,
+                                        const std::shared_ptr<const BSDF> &bsdf,
+                                        SceneCache *cache,
+                                        std::shared_ptr<const Light> &areaLight) {
     std::shared_ptr<Shape> shape;
     std::string type = node.attribute("type").value();
+    const bool emitter = bool(node.child("emitter"));
     if (type == "serialized") {
         std::string filename;
         int shapeIndex = 0;
@@ -306,7 +364,7 @@ std::shared_ptr<const Shape> ParseShape(pugi::xml_node node,
         }
         // printf("load serialized fn: %s\n", filename.c_str());
         shape = std::make_shared<TriangleMesh>(
-            bsdf, LoadSerialized(filename, shapeIndex, toWorld[0], toWorld[1], isMoving, flipNormals, faceNormals));
+            bsdf, LoadMesh(cache, type, filename, shapeIndex, toWorld, isMoving, flipNormals, faceNormals, emitter));
     } else if (type == "obj") {
         std::string filename;
         Matrix4x4 toWorld[2];
@@ -343,7 +401,7 @@ std::shared_ptr<const Shape> ParseShape(pugi::xml_node node,
             }
         }
         shape = std::make_shared<TriangleMesh>(
-            bsdf, ParseObj(filename, toWorld[0], toWorld[1], isMoving, flipNormals, faceNormals));
+            bsdf, LoadMesh(cache, type, filename, 0, toWorld, isMoving, flipNormals, faceNormals, emitter));
     } else if (type == "ply") {
         std::string filename;
         Matrix4x4 toWorld[2];
@@ -380,7 +438,7 @@ std::shared_ptr<const Shape> ParseShape(pugi::xml_node node,
             }
         }
         shape = std::make_shared<TriangleMesh>(
-            bsdf, ParsePly(filename, toWorld[0], toWorld[1], isMoving, flipNormals, faceNormals));
+            bsdf, LoadMesh(cache, type, filename, 0, toWorld, isMoving, flipNormals, faceNormals, emitter));
     } else {
         printf("shape type: %s not found.\n", type.c_str());
     }
@@ -602,6 +660,7 @@ std::shared_ptr<const Texture1D> Parse1DMap(pugi::xml_node node, const TextureMa
 }
 
 std::shared_ptr<const Light> ParseEmitter(pugi::xml_node node,
+                                          SceneCache *cache,
                                           std::shared_ptr<const EnvLight> &envLight) {
     std::string type = node.attribute("type").value();
     if (type == "point") {
@@ -723,7 +782,7 @@ std::shared_ptr<const Light> ParseEmitter(pugi::xml_node node,
                 }
             }
         }
-        envLight = std::make_shared<EnvLight>(Float(1.0), toWorld, filename);
+        envLight = std::make_shared<EnvLight>(Float(1.0), toWorld, filename, cache);
         return envLight;
     }
 
@@ -765,6 +824,29 @@ std::shared_ptr<DptOptions> ParseDptOptions(pugi::xml_node node) {
             dptOptions->seedOffset = std::stoi(child.attribute("value").value());
         } else if (name == "reportintervalspp") {
             dptOptions->reportIntervalSpp = std::stoi(child.attribute("value").value());
+        } else if (name == "initpathbatch") {
+            dptOptions->initPathBatch = std::stoi(child.attribute("value").value());
+        } else if (name == "chainbatch") {
+            dptOptions->chainBatch = std::stoi(child.attribute("value").value());
+        } else if (name == "threadlocalsplat") {
+            dptOptions->threadLocalSplat = child.attribute("value").value() == std::string("true");
+        } else if (name == "cacheindex") {
+            dptOptions->cacheIndex = child.attribute("value").value();
+            if (dptOptions->cacheIndex != "kdtree" && dptOptions->cacheIndex != "rpforest") {
+                Error("Unknown cacheindex");
+            }
+            if (dptOptions->cacheIndex == "rpforest") {
+                std::cerr << "[Warning] cacheindex rpforest is experimental, it is not yet "
+                             "compared with the exact kdtree lookups on scenes"
+                          << std::endl;
+            }
+        } else if (name == "cacheindextrees") {
+            dptOptions->cacheIndexTrees = std::stoi(child.attribute("value").value());
+        } else if (name == "checkpointinterval") {
+            dptOptions->checkpointInterval = std::stof(child.attribute("value").value());
+        } else if (name == "incrementalperturb") {
+            dptOptions->incrementalPerturb =
+                child.attribute("value").value() == std::string("true");
         } else if (name == "uselightcoordinatesampling") {
             dptOptions->useLightCoordinateSampling =
                 child.attribute("value").value() == std::string("true");
@@ -779,6 +861,9 @@ std::shared_ptr<DptOptions> ParseDptOptions(pugi::xml_node node) {
             dptOptions->malaStepsize = std::stof(child.attribute("value").value());
         } else if (name == "mala-gn") {
             dptOptions->malaGN = std::stof(child.attribute("value").value());
+        } else if (name == "mala-differentiate-uncached") {
+            dptOptions->malaDifferentiateUncached =
+                child.attribute("value").value() == std::string("true");
         } else if (name == "samplecache") {
             dptOptions->sampleFromGlobalCache = child.attribute("value").value() == std::string("true");
         } else {
@@ -788,7 +873,7 @@ std::shared_ptr<DptOptions> ParseDptOptions(pugi::xml_node node) {
     return dptOptions;
 }
 
-std::unique_ptr<Scene> ParseScene(pugi::xml_node node) {
+std::unique_ptr<Scene> ParseScene(pugi::xml_node node, SceneCache *cache) {
     std::shared_ptr<DptOptions> options = std::make_shared<DptOptions>();
     std::shared_ptr<const Camera> camera;
     std::vector<std::shared_ptr<const Shape>> objs;
@@ -797,21 +882,89 @@ std::unique_ptr<Scene> ParseScene(pugi::xml_node node) {
     std::map<std::string, std::shared_ptr<const BSDF>> bsdfMap;
     std::map<std::string, std::shared_ptr<const TextureRGB>> textureMap;
     std::string outputName = "image.exr";
+    // Meshes are loaded after the pass over the scene, into the slots of objs and lights they
+    // would have been appended to, so that geometry and light indices do not change
+    struct PendingShape {
+        pugi::xml_node node;
+        std::shared_ptr<const BSDF> bsdf;
+        // The slot in the shapes of _group_, or in objs if _group_ is nullptr
+        ShapeGroup *group;
+        size_t objIndex;
+        int lightIndex;
+    };
+    std::vector<PendingShape> pendingShapes;
+    // Instances are placed once the shapes of their group are loaded
+    struct PendingInstance {
+        std::shared_ptr<const ShapeGroup> group;
+        Matrix4x4 toWorld;
+        size_t objIndex;
+    };
+    std::vector<PendingInstance> pendingInstances;
+    std::map<std::string, std::shared_ptr<ShapeGroup>> groupMap;
+    Timer timer;
+    Tick(timer);
     for (auto child : node.children()) {
         std::string name = child.name();
         if (name == "sensor") {
             camera = ParseSensor(child, outputName);
+        } else if (name == "shape" && child.attribute("type").value() == std::string("shapegroup")) {
+            std::shared_ptr<ShapeGroup> group = std::make_shared<ShapeGroup>();
+            for (auto grandChild : child.children("shape")) {
+                if (!grandChild.child("emitter").empty()) {
+                    Error("The shapes of a shapegroup cannot be emitters");
+                }
+                PendingShape pending;
+                pending.node = grandChild;
+                pending.bsdf = ParseShapeBSDF(grandChild, bsdfMap, textureMap);
+                pending.group = group.get();
+                pending.objIndex = group->shapes.size();
+                pending.lightIndex = -1;
+                group->shapes.push_back(nullptr);
+                pendingShapes.push_back(pending);
+            }
+            groupMap[child.attribute("id").value()] = group;
+        } else if (name == "shape" && child.attribute("type").value() == std::string("instance")) {
+            PendingInstance pending;
+            pending.toWorld = Matrix4x4::Identity();
+            for (auto grandChild : child.children()) {
+                if (std::string(grandChild.name()) == "ref") {
+                    auto groupIt = groupMap.find(grandChild.attribute("id").value());
+                    if (groupIt == groupMap.end()) {
+                        printf("ref: %s\n", grandChild.attribute("id").value());
+                        Error("ref not found");
+                    }
+                    pending.group = groupIt->second;
+                } else if (grandChild.attribute("name").value() == std::string("toWorld")) {
+                    if (std::string(grandChild.name()) != "transform") {
+                        Error("Instances only support a static toWorld transform");
+                    }
+                    pending.toWorld = ParseTransform(grandChild);
+                }
+            }
+            if (pending.group.get() == nullptr) {
+                Error("Instance without a shapegroup");
+            }
+            pending.objIndex = objs.size();
+            objs.resize(objs.size() + pending.group->shapes.size());
+            pendingInstances.push_back(pending);
         } else if (name == "shape") {
-            std::shared_ptr<const Light> areaLight;
-            objs.push_back(ParseShape(child, bsdfMap, textureMap, areaLight));
-            if (areaLight.get() != nullptr) {
-                lights.push_back(areaLight);
+            PendingShape pending;
+            pending.node = child;
+            pending.bsdf = ParseShapeBSDF(child, bsdfMap, textureMap);
+            pending.group = nullptr;
+            pending.objIndex = objs.size();
+            objs.push_back(nullptr);
+            pending.lightIndex = -1;
+            if (!child.child("emitter").empty()) {
+                pending.lightIndex = int(lights.size());
+                lights.push_back(nullptr);
             }
+            pendingShapes.push_back(pending);
         } else if (name == "bsdf") {
             std::string id = child.attribute("id").value();
             bsdfMap[id] = ParseBSDF(child, textureMap);
         } else if (name == "emitter") {
-            lights.push_back(ParseEmitter(child, envLight));
+            lights.push_back(ParseEmitter(child, cache, envLight));
         } else if (name == "texture") {
             std::string id = child.attribute("id").value();
             textureMap[id] = ParseTexture(child);
@@ -822,16 +975,65 @@ std::unique_ptr<Scene> ParseScene(pugi::xml_node node) {
                 "maxDepth : " << options->maxDepth << std::endl;
         }
     }
+    const Float parseTime = Tick(timer);
+
+    // Errors are rethrown on this thread, the worker threads cannot unwind into the caller
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    auto loadShape = [&](const int64_t i) {
+        const PendingShape &pending = pendingShapes[i];
+        try {
+            std::shared_ptr<const Light> areaLight;
+            std::shared_ptr<const Shape> shape =
+                ParseShape(pending.node, pending.bsdf, cache, areaLight);
+            if (pending.group != nullptr) {
+                pending.group->shapes[pending.objIndex] = shape;
+            } else {
+                objs[pending.objIndex] = shape;
+            }
+            if (pending.lightIndex >= 0) {
+                lights[pending.lightIndex] = areaLight;
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    };
+    // The chunks of a large PLY body are decoded by a nested loop that the idle workers join
+    ParallelFor(loadShape, pendingShapes.size());
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if (cache != nullptr) {
+        cache->Write();
+    }
+    for (const PendingInstance &pending : pendingInstances) {
+        std::shared_ptr<const GroupInstance> instance =
+            std::make_shared<GroupInstance>(pending.group, pending.toWorld);
+        for (size_t i = 0; i < pending.group->shapes.size(); i++) {
+            objs[pending.objIndex + i] = pending.group->shapes[i]->Instantiate(instance);
+        }
+    }
+    const Float shapeTime = Tick(timer);
+    std::cout << "Scene description parsed in " << parseTime << "s, " << pendingShapes.size()
+              << " shapes loaded and " << pendingInstances.size() << " instances placed in "
+              << shapeTime << "s" << std::endl;
     return std::unique_ptr<Scene>(
         new Scene(options, camera, objs, lights, envLight, outputName));
 }
 
-std::unique_ptr<Scene> ParseScene(const std::string &filename) {
+std::unique_ptr<Scene> ParseScene(const std::string &filename, const bool useSceneCache) {
     pugi::xml_document doc;
     pugi::xml_parse_result result = doc.load_file(filename.c_str());
     std::unique_ptr<Scene> scene;
     if (result) {
-        scene = ParseScene(doc.child("scene"));
+        std::unique_ptr<SceneCache> cache;
+        if (useSceneCache) {
+            cache = std::unique_ptr<SceneCache>(new SceneCache(filename + ".cache"));
+        }
+        scene = ParseScene(doc.child("scene"), cache.get());
     } else {
         std::cerr << "Error description: " << result.description() << std::endl;
         std::cerr << "Error offset: " << result.offset << std::endl;
@@ -5,4 +5,5 @@
 #include <string>
 #include <memory>
 
-std::unique_ptr<Scene> ParseScene(const std::string &filename);
+// With _useSceneCache_ the processed meshes are kept in <filename>.cache for the next run
+std::unique_ptr<Scene> ParseScene(const std::string &filename, const bool useSceneCache = false);
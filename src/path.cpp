@@ -9,8 +9,10 @@
 #include "arealight.h"
 #include "ray.h"
 #include "sampling.h"
+#include "timer.h"
 
 #include <limits>
+#include <numeric>
 #include <random>
 
 void Clear(Path &path) {
@@ -20,6 +22,11 @@ void Clear(Path &path) {
     path.isSubpath = false;
 }
 
+void Reserve(Path &path, const int maxDepth) {
+    path.camSurfaceVertex.reserve(maxDepth + 1);
+    path.lgtSurfaceVertex.reserve(maxDepth + 1);
+}
+
 template <typename FloatType>
 static inline FloatType MISWeight(const FloatType pdfA, const FloatType pdfB) {
     FloatType ratioSq = square(pdfB / pdfA);
@@ -101,6 +108,60 @@ static inline bool Intersect(const Scene *scene,
     return hit;
 }
 
+static thread_local PerturbStats t_PerturbStats;
+
+const PerturbStats &GetPerturbStats() {
+    return t_PerturbStats;
+}
+
+static inline bool SameQuery(const Scene *scene,
+                             const VertexCache &cache,
+                             const Float time,
+                             const RaySegment &raySeg) {
+    return cache.hitValid && cache.raySeg.ray.org == raySeg.ray.org &&
+           cache.raySeg.ray.dir == raySeg.ray.dir && cache.raySeg.minT == raySeg.minT &&
+           cache.raySeg.maxT == raySeg.maxT && (scene->staticGeometry || cache.time == time);
+}
+
+// Intersect for the vertices of PerturbPathBidir. The scene answers an identical query with
+// the same primitive, so only the intersection with that primitive is recomputed. _cache_ is
+// nullptr without DptOptions::incrementalPerturb.
+static inline bool IntersectCached(const Scene *scene,
+                                   const Float time,
+                                   const RaySegment &raySeg,
+                                   SurfaceVertex &surfVertex,
+                                   VertexCache *cache,
+                                   Intersection &isect) {
+    ShapeInst &shapeInst = surfVertex.shapeInst;
+    bool found;
+    if (cache != nullptr && SameQuery(scene, *cache, time, raySeg)) {
+        t_PerturbStats.reused++;
+        found = cache->hit;
+        if (found) {
+            shapeInst = cache->shapeInst;
+        }
+    } else {
+        t_PerturbStats.traced++;
+        found = Intersect(scene, time, raySeg, shapeInst);
+        if (cache != nullptr) {
+            cache->hitValid = true;
+            cache->raySeg = raySeg;
+            cache->time = time;
+            cache->hit = found;
+            cache->shapeInst = shapeInst;
+            // The incoming direction or the surface changed
+            cache->bsdfValid = false;
+        }
+    }
+    return found && shapeInst.obj->Intersect(shapeInst.primID, time, raySeg, isect, shapeInst.st);
+}
+
+// The cache of vertex _depth_ of a subpath in PerturbPathBidir, nullptr without
+// DptOptions::incrementalPerturb
+static inline VertexCache *GetVertexCache(std::vector<VertexCache> &caches, const int depth) {
+    return caches.empty() ? nullptr : &caches[depth];
+}
+
 static inline const Light *GetHitLight(const Scene *scene,
                                        const bool hitSurface,
                                        const Shape *shape) {
@@ -675,39 +736,99 @@ static inline void ConvertMIS(const int depth,
     pathState.accMISWThis *= invCosTheta;
 }
 
-static void ConnectToCamera(const int lgtDepth,
-                            const Scene *scene,
-                            const Camera *camera,
-                            const Float time,
-                            const BidirPathState &pathState,
-                            const SurfaceVertex &lgtVertex,
-                            const Vector3 &prevLensContrib,
-                            const Vector3 &prevPosition,
-                            std::vector<SubpathContrib> &contribs) {
-    RaySegment centerRaySeg;
-    SamplePrimary(camera, Vector2(Float(0.5), Float(0.5)), time, centerRaySeg);
-    const Vector3 camOrg = centerRaySeg.ray.org;
-    const Vector3 camDir = centerRaySeg.ray.dir;
-    Vector3 dirToCamera = camOrg - pathState.isect.position;
-    // Check point is in front of camera
-    if (-Dot(camDir, dirToCamera) <= Float(0.0)) {
-        return;
+// Visibility tests of the connections made while generating one bidirectional path.
+// Instead of tracing every shadow ray as soon as a connection is made, the connection
+// strategies record the ray together with what its contribution is evaluated from, and all
+// rays are traced in a single stream query once the path is complete. Only the terms that
+// take a few dot products are checked up front, the BSDFs and MIS weights are evaluated for
+// the connections that turn out to be unoccluded.
+struct ShadowRayQueue {
+    enum class ConnectionType { Camera, DirectLight, Vertex };
+    struct Entry {
+        ConnectionType type;
+        // Index into the contribution list, the connection holds its place until it is
+        // evaluated, so the contributions keep the order they are found in
+        int contribId;
+        int camDepth;
+        int lgtDepth;
+        // Index into _camStates_, the camera subpath state changes as the path grows
+        int camStateId;
+        Vector2 screenPos;
+        Vector3 dir;
+        Float distSq;
+        // Camera connections
+        Vector3 camDir;
+        Vector3 prevLensContrib;
+        Vector3 prevPosition;
+        // Direct lighting
+        Float lightPickProb;
+        Vector3 lightContrib;
+        Float cosAtLight;
+        Float directPdf;
+        Float emissionPdf;
+        bool bidirMIS;
+    };
+
+    void Push(const Float time,
+              const RaySegment &raySeg,
+              const Entry &entry,
+              std::vector<SubpathContrib> &contribs) {
+        times.push_back(time);
+        raySegs.push_back(raySeg);
+        entries.push_back(entry);
+        entries.back().contribId = int(contribs.size());
+        contribs.emplace_back();
     }
 
-    Vector2 screenPos;
-    if (!ProjectPoint(camera, pathState.isect.position, time, screenPos)) {
-        // If the point is outside of image plane
-        return;
+    int AddCamState(const int camDepth, const BidirPathState &camPathState) {
+        if (camStateDepths.empty() || camStateDepths.back() != camDepth) {
+            camStates.push_back(camPathState);
+            camStateDepths.push_back(camDepth);
+        }
+        return int(camStates.size()) - 1;
     }
 
-    const Float distSq = LengthSquared(dirToCamera);
-    const Float dist = sqrt(distSq);
-    assert(dist > Float(0.0));
-    dirToCamera *= inverse(dist);
-    if (Occluded(scene, time, Ray{pathState.isect.position, dirToCamera}, dist)) {
-        return;
+    void Clear() {
+        times.clear();
+        raySegs.clear();
+        entries.clear();
+        camStates.clear();
+        camStateDepths.clear();
     }
 
+    std::vector<Float> times;
+    std::vector<RaySegment> raySegs;
+    std::vector<Entry> entries;
+    std::vector<BidirPathState> camStates;
+    std::vector<int> camStateDepths;
+    std::vector<uint8_t> occluded;
+    std::vector<uint8_t> keep;
+};
+
+static void TraceShadowRays(const Scene *scene, ShadowRayQueue &queue) {
+    const int numRays = int(queue.raySegs.size());
+    queue.occluded.resize(numRays);
+    if (numRays > 0) {
+        Occluded(scene, &queue.times[0], &queue.raySegs[0], numRays, &queue.occluded[0]);
+    }
+}
+
+// The contribution of connecting light subpath vertex _lgtDepth_ to the camera along
+// _dirToCamera_, without the visibility test. Returns false if there is none, and sets
+// _clearContribs_ if the contributions found before have to be discarded as well.
+static bool EvaluateCameraConnection(const int lgtDepth,
+                                     const Scene *scene,
+                                     const Camera *camera,
+                                     const BidirPathState &pathState,
+                                     const SurfaceVertex &lgtVertex,
+                                     const Vector3 &prevLensContrib,
+                                     const Vector3 &prevPosition,
+                                     const Vector3 &camDir,
+                                     const Vector3 &dirToCamera,
+                                     const Float distSq,
+                                     const Vector2 screenPos,
+                                     SubpathContrib &spContrib,
+                                     bool &clearContribs) {
     const BSDF *bsdf = lgtVertex.shapeInst.obj->bsdf.get();
 
     Vector3 bsdfContrib;
@@ -722,12 +843,12 @@ static void ConnectToCamera(const int lgtDepth,
                           bsdfRevPdf);
 
     if (bsdfContrib.isZero()) {
-        return;
+        return false;
     }
 
     const Float factor = ShadingNormalCorrection<true>(pathState.wi, pathState.isect, dirToCamera);
     if (factor <= Float(0.0)) {
-        return;
+        return false;
     }
     bsdfContrib *= factor;
 
@@ -748,8 +869,8 @@ static void ConnectToCamera(const int lgtDepth,
 
         const Float distSq = DistanceSquared(pathState.isect.position, prevPosition);
         if (distSq <= Float(0.0)) {
-            contribs.clear();
-            return;
+            clearContribs = true;
+            return false;
         } else {
             lensContrib = bsdfContrib.cwiseProduct(prevLensContrib) * inverse(distSq);
         }
@@ -774,18 +895,95 @@ static void ConnectToCamera(const int lgtDepth,
     Vector3 contrib = misWeight * bsdfContrib / (screenPixelCount * surfaceToImageFactor);
     contrib = contrib.cwiseProduct(pathState.throughput);
     const Float score = Luminance(contrib);
-    if (score > Float(0.0)) {
-        const Float lensScore = Luminance(lensContrib);
-        contribs.emplace_back(SubpathContrib{
-            1,                             // camDepth
-            2 + lgtDepth,                  // lightDepth
-            screenPos,                     // screenPos
-            contrib,                       // contrib
-            score,                         // lsScore
-            score * pathState.ssJacobian,  // ssScore
-            lensScore,                     // lensScore
-            misWeight                      // misWeight
-        });
+    if (score <= Float(0.0)) {
+        return false;
+    }
+    const Float lensScore = Luminance(lensContrib);
+    spContrib = SubpathContrib{
+        1,                             // camDepth
+        2 + lgtDepth,                  // lightDepth
+        screenPos,                     // screenPos
+        contrib,                       // contrib
+        score,                         // lsScore
+        score * pathState.ssJacobian,  // ssScore
+        lensScore,                     // lensScore
+        misWeight                      // misWeight
+    };
+    return true;
+}
+
+static void ConnectToCamera(const int lgtDepth,
+                            const Scene *scene,
+                            const Camera *camera,
+                            const Float time,
+                            const BidirPathState &pathState,
+                            const SurfaceVertex &lgtVertex,
+                            const Vector3 &prevLensContrib,
+                            const Vector3 &prevPosition,
+                            std::vector<SubpathContrib> &contribs,
+                            ShadowRayQueue *shadowRays = nullptr) {
+    RaySegment centerRaySeg;
+    SamplePrimary(camera, Vector2(Float(0.5), Float(0.5)), time, centerRaySeg);
+    const Vector3 camOrg = centerRaySeg.ray.org;
+    const Vector3 camDir = centerRaySeg.ray.dir;
+    Vector3 dirToCamera = camOrg - pathState.isect.position;
+    // Check point is in front of camera
+    if (-Dot(camDir, dirToCamera) <= Float(0.0)) {
+        return;
+    }
+
+    Vector2 screenPos;
+    if (!ProjectPoint(camera, pathState.isect.position, time, screenPos)) {
+        // If the point is outside of image plane
+        return;
+    }
+
+    const Float distSq = LengthSquared(dirToCamera);
+    const Float dist = sqrt(distSq);
+    assert(dist > Float(0.0));
+    dirToCamera *= inverse(dist);
+    const RaySegment shadowRaySeg =
+        ShadowRaySegment(Ray{pathState.isect.position, dirToCamera}, dist);
+    if (shadowRays != nullptr) {
+        if (pathState.throughput.isZero() ||
+            ShadingNormalCorrection<true>(pathState.wi, pathState.isect, dirToCamera) <=
+                Float(0.0)) {
+            return;
+        }
+        ShadowRayQueue::Entry entry = {};
+        entry.type = ShadowRayQueue::ConnectionType::Camera;
+        entry.lgtDepth = lgtDepth;
+        entry.screenPos = screenPos;
+        entry.dir = dirToCamera;
+        entry.distSq = distSq;
+        entry.camDir = camDir;
+        entry.prevLensContrib = prevLensContrib;
+        entry.prevPosition = prevPosition;
+        shadowRays->Push(time, shadowRaySeg, entry, contribs);
+        return;
+    }
+    if (Occluded(scene, time, shadowRaySeg)) {
+        return;
+    }
+
+    SubpathContrib spContrib;
+    bool clearContribs = false;
+    if (EvaluateCameraConnection(lgtDepth,
+                                 scene,
+                                 camera,
+                                 pathState,
+                                 lgtVertex,
+                                 prevLensContrib,
+                                 prevPosition,
+                                 camDir,
+                                 dirToCamera,
+                                 distSq,
+                                 screenPos,
+                                 spContrib,
+                                 clearContribs)) {
+        contribs.push_back(spContrib);
+    } else if (clearContribs) {
+        contribs.clear();
     }
 }
 
@@ -796,7 +994,8 @@ static bool BSDFSampling(const Float roughnessThreshold,
                          SurfaceVertex &surfVertex,
                          BidirPathState &nextPathState,
                          Vector3 &dir,
-                         Vector3 &bsdfContrib) {
+                         Vector3 &bsdfContrib,
+                         VertexCache *cache = nullptr) {
     const BSDF *bsdf = surfVertex.shapeInst.obj->bsdf.get();
 
     Float cosWo;
@@ -804,9 +1003,37 @@ static bool BSDFSampling(const Float roughnessThreshold,
     Float bsdfRevPdf;
     surfVertex.useAbsoluteParam = BoolToFloat(
         bsdf->Roughness(surfVertex.shapeInst.st, surfVertex.bsdfDiscrete) > roughnessThreshold);
-    if (!perturb || surfVertex.useAbsoluteParam == FFALSE) {
-        if (adjoint) {
-            if (!bsdf->SampleAdjoint(pathState.wi,
+    const bool sampled = !perturb || surfVertex.useAbsoluteParam == FFALSE;
+    Float sphereJacobian = Float(0.0);
+    bool found;
+    // The incoming direction and the surface are those of the cached sample, see
+    // IntersectCached
+    if (cache != nullptr && cache->bsdfValid && cache->bsdfRndParam == surfVertex.bsdfRndParam &&
+        cache->bsdfDiscrete == surfVertex.bsdfDiscrete) {
+        t_PerturbStats.bsdfReused++;
+        found = cache->bsdfFound;
+        dir = cache->dir;
+        bsdfContrib = cache->bsdfContrib;
+        cosWo = cache->cosWo;
+        bsdfPdf = cache->bsdfPdf;
+        bsdfRevPdf = cache->bsdfRevPdf;
+        sphereJacobian = cache->sphereJacobian;
+    } else {
+        const Vector2 bsdfRndParam = surfVertex.bsdfRndParam;
+        if (sampled) {
+            if (adjoint) {
+                found = bsdf->SampleAdjoint(pathState.wi,
+                                            pathState.isect.shadingNormal,
+                                            surfVertex.shapeInst.st,
+                                            surfVertex.bsdfRndParam,
+                                            surfVertex.bsdfDiscrete,
+                                            dir,
+                                            bsdfContrib,
+                                            cosWo,
+                                            bsdfPdf,
+                                            bsdfRevPdf);
+            } else {
+                found = bsdf->Sample(pathState.wi,
                                      pathState.isect.shadingNormal,
                                      surfVertex.shapeInst.st,
                                      surfVertex.bsdfRndParam,
@@ -815,23 +1042,49 @@ static bool BSDFSampling(const Float roughnessThreshold,
                                      bsdfContrib,
                                      cosWo,
                                      bsdfPdf,
-                                     bsdfRevPdf)) {
-                return false;
+                                     bsdfRevPdf);
             }
         } else {
-            if (!bsdf->Sample(pathState.wi,
-                              pathState.isect.shadingNormal,
-                              surfVertex.shapeInst.st,
-                              surfVertex.bsdfRndParam,
-                              surfVertex.bsdfDiscrete,
-                              dir,
-                              bsdfContrib,
-                              cosWo,
-                              bsdfPdf,
-                              bsdfRevPdf)) {
-                return false;
+            dir = SampleSphere(surfVertex.bsdfRndParam, sphereJacobian);
+            if (adjoint) {
+                bsdf->EvaluateAdjoint(pathState.wi,
+                                      pathState.isect.shadingNormal,
+                                      dir,
+                                      surfVertex.shapeInst.st,
+                                      bsdfContrib,
+                                      cosWo,
+                                      bsdfPdf,
+                                      bsdfRevPdf);
+            } else {
+                bsdf->Evaluate(pathState.wi,
+                               pathState.isect.shadingNormal,
+                               dir,
+                               surfVertex.shapeInst.st,
+                               bsdfContrib,
+                               cosWo,
+                               bsdfPdf,
+                               bsdfRevPdf);
             }
+            found = !bsdfContrib.isZero() && bsdfPdf > Float(0.0);
         }
+        if (cache != nullptr) {
+            t_PerturbStats.bsdfSampled++;
+            cache->bsdfValid = true;
+            cache->bsdfRndParam = bsdfRndParam;
+            cache->bsdfDiscrete = surfVertex.bsdfDiscrete;
+            cache->bsdfFound = found;
+            cache->dir = dir;
+            cache->bsdfContrib = bsdfContrib;
+            cache->cosWo = cosWo;
+            cache->bsdfPdf = bsdfPdf;
+            cache->bsdfRevPdf = bsdfRevPdf;
+            cache->sphereJacobian = sphereJacobian;
+        }
+    }
+    if (!found) {
+        return false;
+    }
+    if (sampled) {
         if (surfVertex.useAbsoluteParam == FTRUE) {
             Float jacobian;
             surfVertex.bsdfRndParam = ToSphericalCoord(dir, jacobian);
@@ -842,30 +1095,7 @@ static bool BSDFSampling(const Float roughnessThreshold,
             nextPathState.lcJacobian = bsdfPdf;
         }
     } else {
-        Float jacobian;
-        dir = SampleSphere(surfVertex.bsdfRndParam, jacobian);
-        if (adjoint) {
-            bsdf->EvaluateAdjoint(pathState.wi,
-                                  pathState.isect.shadingNormal,
-                                  dir,
-                                  surfVertex.shapeInst.st,
-                                  bsdfContrib,
-                                  cosWo,
-                                  bsdfPdf,
-                                  bsdfRevPdf);
-        } else {
-            bsdf->Evaluate(pathState.wi,
-                           pathState.isect.shadingNormal,
-                           dir,
-                           surfVertex.shapeInst.st,
-                           bsdfContrib,
-                           cosWo,
-                           bsdfPdf,
-                           bsdfRevPdf);
-        }
-        if (bsdfContrib.isZero() || bsdfPdf <= Float(0.0)) {
-            return false;
-        }
+        Float jacobian = sphereJacobian;
         bsdfContrib *= inverse(bsdfPdf);
         nextPathState.lcJacobian = inverse(jacobian);
         jacobian *= bsdfPdf;
@@ -1011,45 +1241,23 @@ static void HandleHitLight(const int camDepth,
     }
 }
 
-static void DirectLighting(const int camDepth,
-                           const Scene *scene,
-                           const Float time,
-                           const BidirPathState &pathState,
-                           const Vector2 screenPos,
-                           const Float lightPickProb,
-                           SurfaceVertex &camVertex,
-                           const bool doOcclusion,
-                           const bool bidirMIS,
-                           std::vector<SubpathContrib> &contribs) {
+// The contribution of the light sample of _camVertex_ in direction _dirToLight_, without the
+// visibility test. Returns false if there is none.
+static bool EvaluateDirectLighting(const int camDepth,
+                                   const Scene *scene,
+                                   const BidirPathState &pathState,
+                                   const Vector2 screenPos,
+                                   const Float lightPickProb,
+                                   const SurfaceVertex &camVertex,
+                                   const Vector3 &dirToLight,
+                                   const Vector3 &lightContrib,
+                                   const Float cosAtLight,
+                                   const Float directPdf,
+                                   const Float emissionPdf,
+                                   const bool bidirMIS,
+                                   SubpathContrib &spContrib) {
     const BSDF *bsdf = camVertex.shapeInst.obj->bsdf.get();
-    LightInst &dirLightInst = camVertex.directLightInst;
-    const Light *light = dirLightInst.light;
-    LightPrimID &lPrimID = dirLightInst.lPrimID;
-    Vector3 dirToLight;
-    Float dist;
-    Vector3 lightContrib;
-    Float cosAtLight;
-    Float directPdf;
-    Float emissionPdf;
-    if (!light->SampleDirect(scene->bSphere,
-                             pathState.isect.position,
-                             pathState.isect.shadingNormal,
-                             camVertex.directLightRndParam,
-                             time,
-                             lPrimID,
-                             dirToLight,
-                             dist,
-                             lightContrib,
-                             cosAtLight,
-                             directPdf,
-                             emissionPdf)) {
-        return;
-    }
-
-    if (doOcclusion && Occluded(scene, time, Ray{pathState.isect.position, dirToLight}, dist)) {
-        return;
-    }
-
+    const Light *light = camVertex.directLightInst.light;
     Vector3 bsdfContrib;
     Float cosToLight;
     Float bsdfPdf;
@@ -1063,11 +1271,11 @@ static void DirectLighting(const int camDepth,
                    bsdfPdf,
                    bsdfRevPdf);
     if (bsdfContrib.isZero()) {
-        return;
+        return false;
     }
     const Float factor = ShadingNormalCorrection<false>(pathState.wi, pathState.isect, dirToLight);
     if (factor <= Float(0.0)) {
-        return;
+        return false;
     }
     bsdfContrib *= factor;
 
@@ -1116,44 +1324,119 @@ static void DirectLighting(const int camDepth,
     }
 
     const Float score = Luminance(contrib);
-    if (score > Float(0.0)) {
-        const Float lensScore = camDepth >= 1 ? Luminance(lensContrib) : Float(0.0);
-        assert(std::isfinite(score * pathState.ssJacobian));
-        assert(std::isfinite(lensScore));
-        contribs.emplace_back(SubpathContrib{
-            2 + camDepth,                  // camDepth
-            1,                             // lightDepth
-            screenPos,                     // screenPos
-            contrib,                       // contrib
-            score,                         // lsScore
-            score * pathState.ssJacobian,  // ssScore
-            lensScore,                     // lensScore
-            misWeight                      // misWeight
-        });
+    if (score <= Float(0.0)) {
+        return false;
     }
+    const Float lensScore = camDepth >= 1 ? Luminance(lensContrib) : Float(0.0);
+    assert(std::isfinite(score * pathState.ssJacobian));
+    assert(std::isfinite(lensScore));
+    spContrib = SubpathContrib{
+        2 + camDepth,                  // camDepth
+        1,                             // lightDepth
+        screenPos,                     // screenPos
+        contrib,                       // contrib
+        score,                         // lsScore
+        score * pathState.ssJacobian,  // ssScore
+        lensScore,                     // lensScore
+        misWeight                      // misWeight
+    };
+    return true;
 }
 
-static void ConnectVertex(const int camDepth,
-                          const int lgtDepth,
-                          const Scene *scene,
-                          const Float time,
-                          const BidirPathState &lgtPathState,
-                          const SurfaceVertex &lgtVertex,
-                          const BidirPathState &camPathState,
-                          const SurfaceVertex &camVertex,
-                          const Vector2 screenPos,
-                          const bool doOcclusion,
-                          std::vector<SubpathContrib> &contribs) {
-    Vector3 dirToLight = lgtPathState.isect.position - camPathState.isect.position;
-    const Float distSq = LengthSquared(dirToLight);
-    const Float dist = sqrt(distSq);
-    assert(dist > Float(0.0));
-    dirToLight *= inverse(dist);
+static void DirectLighting(const int camDepth,
+                           const Scene *scene,
+                           const Float time,
+                           const BidirPathState &pathState,
+                           const Vector2 screenPos,
+                           const Float lightPickProb,
+                           SurfaceVertex &camVertex,
+                           const bool doOcclusion,
+                           const bool bidirMIS,
+                           std::vector<SubpathContrib> &contribs,
+                           ShadowRayQueue *shadowRays = nullptr) {
+    LightInst &dirLightInst = camVertex.directLightInst;
+    const Light *light = dirLightInst.light;
+    LightPrimID &lPrimID = dirLightInst.lPrimID;
+    Vector3 dirToLight;
+    Float dist;
+    Vector3 lightContrib;
+    Float cosAtLight;
+    Float directPdf;
+    Float emissionPdf;
+    if (!light->SampleDirect(scene->bSphere,
+                             pathState.isect.position,
+                             pathState.isect.shadingNormal,
+                             camVertex.directLightRndParam,
+                             time,
+                             lPrimID,
+                             dirToLight,
+                             dist,
+                             lightContrib,
+                             cosAtLight,
+                             directPdf,
+                             emissionPdf)) {
+        return;
+    }
 
-    if (doOcclusion && Occluded(scene, time, Ray{camPathState.isect.position, dirToLight}, dist)) {
+    const RaySegment shadowRaySeg =
+        ShadowRaySegment(Ray{pathState.isect.position, dirToLight}, dist);
+    if (doOcclusion && shadowRays != nullptr) {
+        if (pathState.throughput.isZero() || lightContrib.isZero() ||
+            ShadingNormalCorrection<false>(pathState.wi, pathState.isect, dirToLight) <=
+                Float(0.0)) {
+            return;
+        }
+        ShadowRayQueue::Entry entry = {};
+        entry.type = ShadowRayQueue::ConnectionType::DirectLight;
+        entry.camDepth = camDepth;
+        entry.camStateId = shadowRays->AddCamState(camDepth, pathState);
+        entry.screenPos = screenPos;
+        entry.dir = dirToLight;
+        entry.lightPickProb = lightPickProb;
+        entry.lightContrib = lightContrib;
+        entry.cosAtLight = cosAtLight;
+        entry.directPdf = directPdf;
+        entry.emissionPdf = emissionPdf;
+        entry.bidirMIS = bidirMIS;
+        shadowRays->Push(time, shadowRaySeg, entry, contribs);
+        return;
+    }
+    if (doOcclusion && Occluded(scene, time, shadowRaySeg)) {
         return;
     }
 
+    SubpathContrib spContrib;
+    if (EvaluateDirectLighting(camDepth,
+                               scene,
+                               pathState,
+                               screenPos,
+                               lightPickProb,
+                               camVertex,
+                               dirToLight,
+                               lightContrib,
+                               cosAtLight,
+                               directPdf,
+                               emissionPdf,
+                               bidirMIS,
+                               spContrib)) {
+        contribs.push_back(spContrib);
+    }
+}
+
+// The contribution of connecting camera subpath vertex _camDepth_ to light subpath vertex
+// _lgtDepth_ in direction _dirToLight_, without the visibility test. Returns false if there is
+// none.
+static bool EvaluateVertexConnection(const int camDepth,
+                                     const int lgtDepth,
+                                     const Scene *scene,
+                                     const BidirPathState &lgtPathState,
+                                     const SurfaceVertex &lgtVertex,
+                                     const BidirPathState &camPathState,
+                                     const SurfaceVertex &camVertex,
+                                     const Vector2 screenPos,
+                                     const Vector3 &dirToLight,
+                                     const Float distSq,
+                                     SubpathContrib &spContrib) {
     Vector3 camBsdfFactor;
     Float cosCamera, camBsdfPdf, camBsdfRevPdf;
     const BSDF *camBSDF = camVertex.shapeInst.obj->bsdf.get();
@@ -1167,13 +1450,13 @@ static void ConnectVertex(const int camDepth,
                       camBsdfRevPdf);
 
     if (camBsdfFactor.isZero()) {
-        return;
+        return false;
     }
 
     Float camFactor =
         ShadingNormalCorrection<false>(camPathState.wi, camPathState.isect, dirToLight);
     if (camFactor <= Float(0.0)) {
-        return;
+        return false;
     }
     camBsdfFactor *= camFactor;
 
@@ -1194,13 +1477,13 @@ static void ConnectVertex(const int camDepth,
                              lgtBsdfRevPdf);
 
     if (lgtBsdfFactor.isZero()) {
-        return;
+        return false;
     }
 
     Float lgtFactor =
         ShadingNormalCorrection<true>(lgtPathState.wi, lgtPathState.isect, -dirToLight);
     if (lgtFactor <= Float(0.0)) {
-        return;
+        return false;
     }
     lgtBsdfFactor *= lgtFactor;
 
@@ -1264,236 +1547,601 @@ static void ConnectVertex(const int camDepth,
     contrib *= misWeight;
     const Float ssJacobian = lgtPathState.ssJacobian * camPathState.ssJacobian;
     const Float score = Luminance(contrib);
-    if (score > Float(0.0)) {
-        const Float lensScore = Luminance(lensContrib);
-        contribs.emplace_back(SubpathContrib{
-            2 + camDepth,        // camDepth
-            2 + lgtDepth,        // lightDepth
-            screenPos,           // screenPos
-            contrib,             // contrib
-            score,               // lsScore
-            score * ssJacobian,  // ssScore
-            lensScore,           // lensScore
-            misWeight            // misWeight
-        });
+    if (score <= Float(0.0)) {
+        return false;
     }
+    const Float lensScore = Luminance(lensContrib);
+    spContrib = SubpathContrib{
+        2 + camDepth,        // camDepth
+        2 + lgtDepth,        // lightDepth
+        screenPos,           // screenPos
+        contrib,             // contrib
+        score,               // lsScore
+        score * ssJacobian,  // ssScore
+        lensScore,           // lensScore
+        misWeight            // misWeight
+    };
+    return true;
 }
 
-void GeneratePathBidir(const Scene *scene,
-                       const Vector2i screenPosi,
-                       const int minDepth,
-                       const int maxDepth,
-                       Path &path,
-                       std::vector<SubpathContrib> &contribs,
-                       RNG &rng) {
-    std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
-    const Camera *camera = scene->camera.get();
+static void ConnectVertex(const int camDepth,
+                          const int lgtDepth,
+                          const Scene *scene,
+                          const Float time,
+                          const BidirPathState &lgtPathState,
+                          const SurfaceVertex &lgtVertex,
+                          const BidirPathState &camPathState,
+                          const SurfaceVertex &camVertex,
+                          const Vector2 screenPos,
+                          const bool doOcclusion,
+                          std::vector<SubpathContrib> &contribs,
+                          ShadowRayQueue *shadowRays = nullptr) {
+    Vector3 dirToLight = lgtPathState.isect.position - camPathState.isect.position;
+    const Float distSq = LengthSquared(dirToLight);
+    const Float dist = sqrt(distSq);
+    assert(dist > Float(0.0));
+    dirToLight *= inverse(dist);
 
-    path.time = uniDist(rng);
+    const RaySegment shadowRaySeg =
+        ShadowRaySegment(Ray{camPathState.isect.position, dirToLight}, dist);
+    if (doOcclusion && shadowRays != nullptr) {
+        if (lgtPathState.throughput.isZero() || camPathState.throughput.isZero() ||
+            ShadingNormalCorrection<false>(camPathState.wi, camPathState.isect, dirToLight) <=
+                Float(0.0) ||
+            ShadingNormalCorrection<true>(lgtPathState.wi, lgtPathState.isect, -dirToLight) <=
+                Float(0.0)) {
+            return;
+        }
+        ShadowRayQueue::Entry entry = {};
+        entry.type = ShadowRayQueue::ConnectionType::Vertex;
+        entry.camDepth = camDepth;
+        entry.lgtDepth = lgtDepth;
+        entry.camStateId = shadowRays->AddCamState(camDepth, camPathState);
+        entry.screenPos = screenPos;
+        entry.dir = dirToLight;
+        entry.distSq = distSq;
+        shadowRays->Push(time, shadowRaySeg, entry, contribs);
+        return;
+    }
+    if (doOcclusion && Occluded(scene, time, shadowRaySeg)) {
+        return;
+    }
+
+    SubpathContrib spContrib;
+    if (EvaluateVertexConnection(camDepth,
+                                 lgtDepth,
+                                 scene,
+                                 lgtPathState,
+                                 lgtVertex,
+                                 camPathState,
+                                 camVertex,
+                                 screenPos,
+                                 dirToLight,
+                                 distSq,
+                                 spContrib)) {
+        contribs.push_back(spContrib);
+    }
+}
+
+// Evaluates the connections of _path_ whose rays in _queue_ are not occluded according to
+// _occluded_ into the places they hold in _contribs_, and removes the others
+static void ApplyShadowRays(const Scene *scene,
+                            const Path &path,
+                            const std::vector<BidirPathState> &lightPathStates,
+                            ShadowRayQueue &queue,
+                            const uint8_t *occluded,
+                            std::vector<SubpathContrib> &contribs) {
+    const int numRays = int(queue.entries.size());
+    if (numRays == 0) {
+        return;
+    }
+    queue.keep.assign(contribs.size(), 1);
+    for (int i = 0; i < numRays; i++) {
+        const ShadowRayQueue::Entry &entry = queue.entries[i];
+        queue.keep[entry.contribId] = 0;
+        if (occluded[i]) {
+            continue;
+        }
+        SubpathContrib &spContrib = contribs[entry.contribId];
+        bool evaluated = false;
+        switch (entry.type) {
+            case ShadowRayQueue::ConnectionType::Camera: {
+                bool clearContribs = false;
+                evaluated = EvaluateCameraConnection(entry.lgtDepth,
+                                                     scene,
+                                                     scene->camera.get(),
+                                                     lightPathStates[entry.lgtDepth],
+                                                     path.lgtSurfaceVertex[entry.lgtDepth],
+                                                     entry.prevLensContrib,
+                                                     entry.prevPosition,
+                                                     entry.camDir,
+                                                     entry.dir,
+                                                     entry.distSq,
+                                                     entry.screenPos,
+                                                     spContrib,
+                                                     clearContribs);
+                if (clearContribs) {
+                    std::fill(queue.keep.begin(), queue.keep.begin() + entry.contribId, 0);
+                }
+                break;
+            }
+            case ShadowRayQueue::ConnectionType::DirectLight: {
+                evaluated = EvaluateDirectLighting(entry.camDepth,
+                                                   scene,
+                                                   queue.camStates[entry.camStateId],
+                                                   entry.screenPos,
+                                                   entry.lightPickProb,
+                                                   path.camSurfaceVertex[entry.camDepth],
+                                                   entry.dir,
+                                                   entry.lightContrib,
+                                                   entry.cosAtLight,
+                                                   entry.directPdf,
+                                                   entry.emissionPdf,
+                                                   entry.bidirMIS,
+                                                   spContrib);
+                break;
+            }
+            case ShadowRayQueue::ConnectionType::Vertex: {
+                evaluated = EvaluateVertexConnection(entry.camDepth,
+                                                     entry.lgtDepth,
+                                                     scene,
+                                                     lightPathStates[entry.lgtDepth],
+                                                     path.lgtSurfaceVertex[entry.lgtDepth],
+                                                     queue.camStates[entry.camStateId],
+                                                     path.camSurfaceVertex[entry.camDepth],
+                                                     entry.screenPos,
+                                                     entry.dir,
+                                                     entry.distSq,
+                                                     spContrib);
+                break;
+            }
+        }
+        queue.keep[entry.contribId] = evaluated ? 1 : 0;
+    }
+    size_t numKept = 0;
+    for (size_t i = 0; i < contribs.size(); i++) {
+        if (queue.keep[i]) {
+            contribs[numKept++] = contribs[i];
+        }
+    }
+    contribs.resize(numKept);
+}
+
+static void ResolveShadowRays(const Scene *scene,
+                              const Path &path,
+                              const std::vector<BidirPathState> &lightPathStates,
+                              ShadowRayQueue &queue,
+                              std::vector<SubpathContrib> &contribs) {
+    TraceShadowRays(scene, queue);
+    ApplyShadowRays(scene, path, lightPathStates, queue, queue.occluded.data(), contribs);
+    queue.Clear();
+}
+
+// The state of one bidirectional path between two intersection queries. The light subpath
+// is traced first, then the camera subpath, each step consumes the intersection of _raySeg_.
+// Sharing these steps between the depth-first generator and the batched one below keeps
+// both consuming random numbers in the same order, so they produce identical paths.
+struct BidirPathWalker {
+    enum class Stage { LightSubpath, CameraSubpath, Done };
+    Stage stage;
+    int depth;
+    Vector2i screenPosi;
     std::vector<BidirPathState> lightPathStates;
-    lightPathStates.push_back(BidirPathState());
+    BidirPathState camPathState;
+    RaySegment raySeg;
+    Vector3 prevLensContrib;
+    ShadowRayQueue shadowRays;
+};
+
+static void BeginPathBidir(const Scene *scene,
+                           const Vector2i screenPosi,
+                           Path &path,
+                           BidirPathWalker &walker,
+                           RNG &rng) {
+    std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
+    path.time = uniDist(rng);
+    walker.stage = BidirPathWalker::Stage::LightSubpath;
+    walker.depth = 0;
+    walker.screenPosi = screenPosi;
+    walker.lightPathStates.clear();
+    walker.lightPathStates.push_back(BidirPathState());
+    walker.shadowRays.Clear();
     Float lightPickProb = Float(1.0);
     EmitFromLightInit(scene, path.lgtVertex, lightPickProb, rng);
-    RaySegment raySeg;
-    EmitFromLight(
-        scene->bSphere, lightPickProb, path.time, path.lgtVertex, raySeg.ray, lightPathStates[0]);
-    raySeg.minT = c_IsectEpsilon;
-    raySeg.maxT = std::numeric_limits<Float>::infinity();
-    Vector3 prevLensContrib = Vector3::Zero();
-    for (int lgtDepth = 0;; lgtDepth++) {
+    EmitFromLight(scene->bSphere,
+                  lightPickProb,
+                  path.time,
+                  path.lgtVertex,
+                  walker.raySeg.ray,
+                  walker.lightPathStates[0]);
+    walker.raySeg.minT = c_IsectEpsilon;
+    walker.raySeg.maxT = std::numeric_limits<Float>::infinity();
+    walker.prevLensContrib = Vector3::Zero();
+}
+
+// Appends the vertex that _walker.raySeg_ is about to hit, and returns where its surface
+// intersection goes
+static SurfaceVertex &PushVertex(Path &path, BidirPathWalker &walker, Intersection *&isect) {
+    if (walker.stage == BidirPathWalker::Stage::LightSubpath) {
         path.lgtSurfaceVertex.push_back(SurfaceVertex());
-        SurfaceVertex &surfVertex = path.lgtSurfaceVertex.back();
-        bool hitSurface = Intersect(
-            scene, path.time, raySeg, surfVertex.shapeInst, lightPathStates[lgtDepth].isect);
+        isect = &walker.lightPathStates[walker.depth].isect;
+        return path.lgtSurfaceVertex.back();
+    }
+    path.camSurfaceVertex.push_back(SurfaceVertex());
+    isect = &walker.camPathState.isect;
+    return path.camSurfaceVertex.back();
+}
 
-        // If we do full BDPT with non-pinhole cameras we need to handle camera hit here
+static void BeginCameraSubpath(const Scene *scene,
+                               Path &path,
+                               BidirPathWalker &walker,
+                               RNG &rng) {
+    const Camera *camera = scene->camera.get();
+    EmitFromCameraInit(camera, walker.screenPosi, path.camVertex, rng);
+    EmitFromCamera(path.time, camera, path.camVertex, walker.raySeg, walker.camPathState);
+    walker.stage = BidirPathWalker::Stage::CameraSubpath;
+    walker.depth = 0;
+}
 
-        if (!hitSurface) {
-            lightPathStates.pop_back();
-            path.lgtSurfaceVertex.pop_back();
-            break;
-        }
+// Processes the light subpath vertex pushed by PushVertex, returns false when the light
+// subpath ends
+static bool StepLightSubpath(const Scene *scene,
+                             const int minDepth,
+                             const int maxDepth,
+                             const bool hitSurface,
+                             Path &path,
+                             std::vector<SubpathContrib> &contribs,
+                             BidirPathWalker &walker,
+                             RNG &rng) {
+    std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
+    const int lgtDepth = walker.depth;
+    std::vector<BidirPathState> &lightPathStates = walker.lightPathStates;
+    RaySegment &raySeg = walker.raySeg;
+    SurfaceVertex &surfVertex = path.lgtSurfaceVertex.back();
 
-        surfVertex.bsdfDiscrete = uniDist(rng);
-        lightPathStates[lgtDepth].wi = -raySeg.ray.dir;
+    // If we do full BDPT with non-pinhole cameras we need to handle camera hit here
+
+    if (!hitSurface) {
+        lightPathStates.pop_back();
+        path.lgtSurfaceVertex.pop_back();
+        return false;
+    }
 
-        ConvertMIS(lgtDepth, path.lgtVertex.lightInst.light, raySeg.ray, lightPathStates[lgtDepth]);
+    surfVertex.bsdfDiscrete = uniDist(rng);
+    lightPathStates[lgtDepth].wi = -raySeg.ray.dir;
+
+    ConvertMIS(lgtDepth, path.lgtVertex.lightInst.light, raySeg.ray, lightPathStates[lgtDepth]);
+
+    if (lgtDepth + 2 >= minDepth) {
+        ConnectToCamera(lgtDepth,
+                        scene,
+                        scene->camera.get(),
+                        path.time,
+                        lightPathStates[lgtDepth],
+                        path.lgtSurfaceVertex[lgtDepth],
+                        walker.prevLensContrib,
+                        raySeg.ray.org,
+                        contribs,
+                        &walker.shadowRays);
+    }
+
+    if (maxDepth != -1 && lgtDepth + 2 >= maxDepth) {
+        return false;
+    }
 
-        if (lgtDepth + 2 >= minDepth) {
-            ConnectToCamera(lgtDepth,
-                            scene,
-                            camera,
-                            path.time,
+    lightPathStates.push_back(BidirPathState());
+    surfVertex.bsdfRndParam = Vector2(uniDist(rng), uniDist(rng));
+    Vector3 bsdfContrib;
+    if (!BSDFSampling<true>(scene->options->roughnessThreshold,
+                            lgtDepth,
                             lightPathStates[lgtDepth],
-                            path.lgtSurfaceVertex[lgtDepth],
-                            prevLensContrib,
-                            raySeg.ray.org,
-                            contribs);
-        }
+                            surfVertex,
+                            lightPathStates[lgtDepth + 1],
+                            raySeg.ray.dir,
+                            bsdfContrib)) {
+        lightPathStates.pop_back();
+        return false;
+    }
+
+    if (!RussianRoulette(lgtDepth,
+                         bsdfContrib,
+                         surfVertex.rrWeight,
+                         lightPathStates[lgtDepth + 1].throughput,
+                         rng)) {
+        lightPathStates.pop_back();
+        return false;
+    }
+
+    walker.prevLensContrib = lightPathStates[lgtDepth + 1].lensContrib;
+    raySeg.ray.org = lightPathStates[lgtDepth].isect.position;
+    walker.depth++;
+    return true;
+}
+
+// Processes the camera subpath vertex pushed by PushVertex, returns false when the path is
+// complete
+static bool StepCameraSubpath(const Scene *scene,
+                              const int minDepth,
+                              const int maxDepth,
+                              const bool hitSurface,
+                              Path &path,
+                              std::vector<SubpathContrib> &contribs,
+                              BidirPathWalker &walker,
+                              RNG &rng) {
+    std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
+    const int camDepth = walker.depth;
+    const std::vector<BidirPathState> &lightPathStates = walker.lightPathStates;
+    BidirPathState &camPathState = walker.camPathState;
+    RaySegment &raySeg = walker.raySeg;
+    SurfaceVertex &surfVertex = path.camSurfaceVertex.back();
+
+    camPathState.wi = -raySeg.ray.dir;
+
+    if (hitSurface) {
+        ConvertMIS(camDepth, nullptr, raySeg.ray, camPathState);
+    }
 
-        if (maxDepth != -1 && lgtDepth + 2 >= maxDepth) {
-            break;
+    if (camDepth + 1 >= minDepth) {
+        const Light *light = GetHitLight(scene, hitSurface, surfVertex.shapeInst.obj);
+        if (light != nullptr) {
+            if (scene->options->useLightCoordinateSampling && camDepth > 1 &&
+                light->GetType() == LightType::AreaLight) {
+                assert(hitSurface);
+                SurfaceVertex &prevSurfVertex =
+                    path.camSurfaceVertex[path.camSurfaceVertex.size() - 2];
+                // Special case for area light: transform the BSDF sampling coordinates to the
+                // light's direct sampling coordinates
+                // Note that we don't handle pure Dirac surfaces here, to do this we need
+                // something like Manifold exploration (and it's derivatives)
+                const ShapeInst &shapeInst = surfVertex.shapeInst;
+                prevSurfVertex.bsdfRndParam = shapeInst.obj->GetSampleParam(
+                    shapeInst.primID, camPathState.isect.position, path.time);
+                // Correct the jacobian since we've changed the sampling method
+                Vector3 dirToPrev = camPathState.isect.position - raySeg.ray.org;
+                const Float distSq = LengthSquared(dirToPrev);
+                const Float invDistSq = inverse(distSq);
+                const Float invDist = sqrt(invDistSq);
+                dirToPrev *= invDist;
+                camPathState.ssJacobian *=
+                    fabs(Dot(dirToPrev, camPathState.isect.shadingNormal) * invDistSq) *
+                    (camPathState.lcJacobian * surfVertex.shapeInst.obj->SamplePdf());
+            }
+            HandleHitLight(camDepth,
+                           scene,
+                           light,
+                           hitSurface,
+                           raySeg.ray,
+                           path.time,
+                           path.camVertex.screenPos,
+                           camPathState,
+                           true,
+                           path.envLightInst,
+                           contribs);
+            // Assume lights have zero reflectance
+            return false;
         }
+    }
 
-        lightPathStates.push_back(BidirPathState());
-        surfVertex.bsdfRndParam = Vector2(uniDist(rng), uniDist(rng));
-        Vector3 bsdfContrib;
-        if (!BSDFSampling<true>(scene->options->roughnessThreshold,
-                                lgtDepth,
-                                lightPathStates[lgtDepth],
-                                surfVertex,
-                                lightPathStates[lgtDepth + 1],
-                                raySeg.ray.dir,
-                                bsdfContrib)) {
-            lightPathStates.pop_back();
-            break;
-        }
+    if (!hitSurface || (maxDepth != -1 && camDepth + 1 >= maxDepth)) {
+        return false;
+    }
 
-        if (!RussianRoulette(lgtDepth,
-                             bsdfContrib,
-                             surfVertex.rrWeight,
-                             lightPathStates[lgtDepth + 1].throughput,
-                             rng)) {
-            lightPathStates.pop_back();
-            break;
+    if (camDepth == 1) {
+        path.lensVertexPos = camPathState.isect.position;
+        const Float distSq = DistanceSquared(camPathState.isect.position, raySeg.ray.org);
+        if (distSq <= Float(0.0)) {
+            contribs.clear();
+            walker.shadowRays.Clear();
+            return false;
+        } else {
+            camPathState.lensContrib *= inverse(distSq);
         }
-
-        prevLensContrib = lightPathStates[lgtDepth + 1].lensContrib;
-        raySeg.ray.org = lightPathStates[lgtDepth].isect.position;
-        // std::cout << "Noting light path contribs : " << prevLensContrib.transpose() << std::endl;
-        
     }
 
-    BidirPathState camPathState;
-    EmitFromCameraInit(camera, screenPosi, path.camVertex, rng);
-    EmitFromCamera(path.time, camera, path.camVertex, raySeg, camPathState);
+    surfVertex.bsdfDiscrete = uniDist(rng);
+
+    if (camDepth + 2 >= minDepth) {
+        Float directLightPickProb = Float(1.0);
+        DirectLightingInit(scene, surfVertex, directLightPickProb, rng);
+        DirectLighting(camDepth,
+                       scene,
+                       path.time,
+                       camPathState,
+                       path.camVertex.screenPos,
+                       directLightPickProb,
+                       surfVertex,
+                       true,
+                       true,
+                       contribs,
+                       &walker.shadowRays);
+    }
 
-    for (int camDepth = 0;; camDepth++) {
-        path.camSurfaceVertex.push_back(SurfaceVertex());
-        SurfaceVertex &surfVertex = path.camSurfaceVertex.back();
-        bool hitSurface =
-            Intersect(scene, path.time, raySeg, surfVertex.shapeInst, camPathState.isect);
+    int maxLgtDepth =
+        maxDepth == -1 ? ((int)lightPathStates.size() - 1)
+                       : std::min((maxDepth - camDepth - 3), ((int)lightPathStates.size() - 1));
+    for (int lgtDepth = 0; lgtDepth <= maxLgtDepth; lgtDepth++) {
+        if (camDepth + lgtDepth + 3 >= minDepth) {
+            ConnectVertex(camDepth,
+                          lgtDepth,
+                          scene,
+                          path.time,
+                          lightPathStates[lgtDepth],
+                          path.lgtSurfaceVertex[lgtDepth],
+                          camPathState,
+                          surfVertex,
+                          path.camVertex.screenPos,
+                          true,
+                          contribs,
+                          &walker.shadowRays);
+        }
+    }
 
-        camPathState.wi = -raySeg.ray.dir;
+    surfVertex.bsdfRndParam = Vector2(uniDist(rng), uniDist(rng));
+    Vector3 bsdfContrib;
+    if (!BSDFSampling<false>(scene->options->roughnessThreshold,
+                             camDepth,
+                             camPathState,
+                             surfVertex,
+                             camPathState,
+                             raySeg.ray.dir,
+                             bsdfContrib)) {
+        return false;
+    }
 
-        if (hitSurface) {
-            ConvertMIS(camDepth, nullptr, raySeg.ray, camPathState);
-        }
+    if (!RussianRoulette(
+            camDepth, bsdfContrib, surfVertex.rrWeight, camPathState.throughput, rng)) {
+        return false;
+    }
 
-        if (camDepth + 1 >= minDepth) {
-            const Light *light = GetHitLight(scene, hitSurface, surfVertex.shapeInst.obj);
-            if (light != nullptr) {
-                if (scene->options->useLightCoordinateSampling && camDepth > 1 &&
-                    light->GetType() == LightType::AreaLight) {
-                    assert(hitSurface);
-                    SurfaceVertex &prevSurfVertex =
-                        path.camSurfaceVertex[path.camSurfaceVertex.size() - 2];
-                    // Special case for area light: transform the BSDF sampling coordinates to the
-                    // light's direct sampling coordinates
-                    // Note that we don't handle pure Dirac surfaces here, to do this we need
-                    // something like Manifold exploration (and it's derivatives)
-                    const ShapeInst &shapeInst = surfVertex.shapeInst;
-                    prevSurfVertex.bsdfRndParam = shapeInst.obj->GetSampleParam(
-                        shapeInst.primID, camPathState.isect.position, path.time);
-                    // Correct the jacobian since we've changed the sampling method
-                    Vector3 dirToPrev = camPathState.isect.position - raySeg.ray.org;
-                    const Float distSq = LengthSquared(dirToPrev);
-                    const Float invDistSq = inverse(distSq);
-                    const Float invDist = sqrt(invDistSq);
-                    dirToPrev *= invDist;
-                    camPathState.ssJacobian *=
-                        fabs(Dot(dirToPrev, camPathState.isect.shadingNormal) * invDistSq) *
-                        (camPathState.lcJacobian * surfVertex.shapeInst.obj->SamplePdf());
-                }
-                HandleHitLight(camDepth,
-                               scene,
-                               light,
-                               hitSurface,
-                               raySeg.ray,
-                               path.time,
-                               path.camVertex.screenPos,
-                               camPathState,
-                               true,
-                               path.envLightInst,
-                               contribs);
-                // Assume lights have zero reflectance
-                return;
-            }
-        }
+    raySeg.ray.org = camPathState.isect.position;
+    raySeg.minT = c_IsectEpsilon;
+    raySeg.maxT = std::numeric_limits<Float>::infinity();
+    walker.depth++;
+    return true;
+}
 
-        if (!hitSurface || (maxDepth != -1 && camDepth + 1 >= maxDepth)) {
-            break;
+// Advances _walker_ past the vertex pushed by PushVertex
+static void StepPathBidir(const Scene *scene,
+                          const int minDepth,
+                          const int maxDepth,
+                          const bool hitSurface,
+                          Path &path,
+                          std::vector<SubpathContrib> &contribs,
+                          BidirPathWalker &walker,
+                          RNG &rng) {
+    if (walker.stage == BidirPathWalker::Stage::LightSubpath) {
+        if (!StepLightSubpath(
+                scene, minDepth, maxDepth, hitSurface, path, contribs, walker, rng)) {
+            BeginCameraSubpath(scene, path, walker, rng);
         }
+    } else if (!StepCameraSubpath(
+                   scene, minDepth, maxDepth, hitSurface, path, contribs, walker, rng)) {
+        walker.stage = BidirPathWalker::Stage::Done;
+    }
+}
 
-        if (camDepth == 1) {
-            path.lensVertexPos = camPathState.isect.position;
-            const Float distSq = DistanceSquared(camPathState.isect.position, raySeg.ray.org);
-            if (distSq <= Float(0.0)) {
-                contribs.clear();
-                return;
-            } else {
-                camPathState.lensContrib *= inverse(distSq);
-            }
-        }
+void GeneratePathBidir(const Scene *scene,
+                       const Vector2i screenPosi,
+                       const int minDepth,
+                       const int maxDepth,
+                       Path &path,
+                       std::vector<SubpathContrib> &contribs,
+                       RNG &rng) {
+    static thread_local BidirPathWalker walker;
+    BeginPathBidir(scene, screenPosi, path, walker, rng);
+    while (walker.stage != BidirPathWalker::Stage::Done) {
+        Intersection *isect;
+        SurfaceVertex &surfVertex = PushVertex(path, walker, isect);
+        const bool hitSurface =
+            Intersect(scene, path.time, walker.raySeg, surfVertex.shapeInst, *isect);
+        StepPathBidir(scene, minDepth, maxDepth, hitSurface, path, contribs, walker, rng);
+    }
+    ResolveShadowRays(scene, path, walker.lightPathStates, walker.shadowRays, contribs);
+}
 
-        surfVertex.bsdfDiscrete = uniDist(rng);
+void GeneratePathBidirBatch(const Scene *scene,
+                            const Vector2i screenPosi,
+                            const int minDepth,
+                            const int maxDepth,
+                            std::vector<Path> &paths,
+                            std::vector<std::vector<SubpathContrib>> &contribs,
+                            std::vector<RNG> &rngs,
+                            const bool streamQueries) {
+    const int numPaths = int(rngs.size());
+    paths.resize(numPaths);
+    contribs.resize(numPaths);
+    static thread_local std::vector<BidirPathWalker> walkers;
+    if (int(walkers.size()) < numPaths) {
+        walkers.resize(numPaths);
+    }
+    for (int i = 0; i < numPaths; i++) {
+        contribs[i].clear();
+        BeginPathBidir(scene, screenPosi, paths[i], walkers[i], rngs[i]);
+    }
 
-        if (camDepth + 2 >= minDepth) {
-            Float directLightPickProb = Float(1.0);
-            DirectLightingInit(scene, surfVertex, directLightPickProb, rng);
-            DirectLighting(camDepth,
-                           scene,
-                           path.time,
-                           camPathState,
-                           path.camVertex.screenPos,
-                           directLightPickProb,
-                           surfVertex,
-                           true,
-                           true,
-                           contribs);
+    // Every iteration advances all unfinished paths by one vertex, with a single stream
+    // query for their rays if _streamQueries_. The shading of the hits, BSDF sampling and
+    // evaluation included, stays scalar in StepPathBidir.
+    static thread_local std::vector<int> active;
+    static thread_local std::vector<Float> times;
+    static thread_local std::vector<RaySegment> raySegs;
+    static thread_local std::vector<ShapeInst> shapeInsts;
+    static thread_local std::vector<uint8_t> hit;
+    active.resize(numPaths);
+    std::iota(active.begin(), active.end(), 0);
+    while (!active.empty()) {
+        const int numActive = int(active.size());
+        times.resize(numActive);
+        raySegs.resize(numActive);
+        shapeInsts.resize(numActive);
+        hit.resize(numActive);
+        for (int i = 0; i < numActive; i++) {
+            times[i] = paths[active[i]].time;
+            raySegs[i] = walkers[active[i]].raySeg;
         }
-
-        int maxLgtDepth =
-            maxDepth == -1 ? ((int)lightPathStates.size() - 1)
-                           : std::min((maxDepth - camDepth - 3), ((int)lightPathStates.size() - 1));
-        for (int lgtDepth = 0; lgtDepth <= maxLgtDepth; lgtDepth++) {
-            if (camDepth + lgtDepth + 3 >= minDepth) {
-                ConnectVertex(camDepth,
-                              lgtDepth,
-                              scene,
-                              path.time,
-                              lightPathStates[lgtDepth],
-                              path.lgtSurfaceVertex[lgtDepth],
-                              camPathState,
-                              surfVertex,
-                              path.camVertex.screenPos,
-                              true,
-                              contribs);
+        if (streamQueries) {
+            Intersect(scene, &times[0], &raySegs[0], numActive, &shapeInsts[0], &hit[0]);
+        } else {
+            for (int i = 0; i < numActive; i++) {
+                hit[i] = Intersect(scene, times[i], raySegs[i], shapeInsts[i]) ? 1 : 0;
             }
         }
 
-        surfVertex.bsdfRndParam = Vector2(uniDist(rng), uniDist(rng));
-        Vector3 bsdfContrib;
-        if (!BSDFSampling<false>(scene->options->roughnessThreshold,
-                                 camDepth,
-                                 camPathState,
-                                 surfVertex,
-                                 camPathState,
-                                 raySeg.ray.dir,
-                                 bsdfContrib)) {
-            break;
+        int numRemaining = 0;
+        for (int i = 0; i < numActive; i++) {
+            const int pathId = active[i];
+            Path &path = paths[pathId];
+            BidirPathWalker &walker = walkers[pathId];
+            Intersection *isect;
+            SurfaceVertex &surfVertex = PushVertex(path, walker, isect);
+            bool hitSurface = false;
+            if (hit[i]) {
+                surfVertex.shapeInst = shapeInsts[i];
+                const ShapeInst &shapeInst = surfVertex.shapeInst;
+                hitSurface = shapeInst.obj->Intersect(
+                    shapeInst.primID, path.time, walker.raySeg, *isect, surfVertex.shapeInst.st);
+            }
+            StepPathBidir(
+                scene, minDepth, maxDepth, hitSurface, path, contribs[pathId], walker, rngs[pathId]);
+            if (walker.stage != BidirPathWalker::Stage::Done) {
+                active[numRemaining++] = pathId;
+            }
         }
+        active.resize(numRemaining);
+    }
 
-        if (!RussianRoulette(
-                camDepth, bsdfContrib, surfVertex.rrWeight, camPathState.throughput, rng)) {
-            break;
+    if (!streamQueries) {
+        for (int i = 0; i < numPaths; i++) {
+            ResolveShadowRays(
+                scene, paths[i], walkers[i].lightPathStates, walkers[i].shadowRays, contribs[i]);
         }
+        return;
+    }
 
-        raySeg.ray.org = camPathState.isect.position;
-        raySeg.minT = c_IsectEpsilon;
-        raySeg.maxT = std::numeric_limits<Float>::infinity();
+    // The connections of all paths are tested in one stream query as well
+    static thread_local ShadowRayQueue allShadowRays;
+    allShadowRays.Clear();
+    for (int i = 0; i < numPaths; i++) {
+        const ShadowRayQueue &queue = walkers[i].shadowRays;
+        allShadowRays.times.insert(
+            allShadowRays.times.end(), queue.times.begin(), queue.times.end());
+        allShadowRays.raySegs.insert(
+            allShadowRays.raySegs.end(), queue.raySegs.begin(), queue.raySegs.end());
     }
-} 
+    TraceShadowRays(scene, allShadowRays);
+    size_t offset = 0;
+    for (int i = 0; i < numPaths; i++) {
+        ShadowRayQueue &queue = walkers[i].shadowRays;
+        ApplyShadowRays(scene,
+                        paths[i],
+                        walkers[i].lightPathStates,
+                        queue,
+                        allShadowRays.occluded.data() + offset,
+                        contribs[i]);
+        offset += queue.raySegs.size();
+        queue.Clear();
+    }
+}
 
 void GenerateSubpath(const Scene *scene,
                      const Vector2i screenPosi,
@@ -2009,6 +2657,16 @@ void PerturbPathBidir(const Scene *scene,
 
     int offsetId = 0;
     path.time = Modulo(path.time + normDist(rng), Float(1.0));
+    if (scene->options->incrementalPerturb) {
+        // Grown to the longest subpath so far, a cache stays valid whatever path it was
+        // written by since it is keyed on the whole query
+        if (path.camVertexCache.size() < path.camSurfaceVertex.size()) {
+            path.camVertexCache.resize(path.camSurfaceVertex.size());
+        }
+        if (path.lgtVertexCache.size() < path.lgtSurfaceVertex.size()) {
+            path.lgtVertexCache.resize(path.lgtSurfaceVertex.size());
+        }
+    }
     BidirPathState lightPathState;
     if (path.lgtDepth > 1) {
         const Float lightPickProb = PickLightProb(scene, path.lgtVertex.lightInst.light);
@@ -2025,7 +2683,9 @@ void PerturbPathBidir(const Scene *scene,
         Vector3 prevLensContrib = Vector3::Zero();
         for (int lgtDepth = 0; lgtDepth < (int)path.lgtSurfaceVertex.size(); lgtDepth++) {
             SurfaceVertex &surfVertex = path.lgtSurfaceVertex[lgtDepth];
-            if (!Intersect(scene, path.time, raySeg, surfVertex.shapeInst, lightPathState.isect)) {
+            VertexCache *cache = GetVertexCache(path.lgtVertexCache, lgtDepth);
+            if (!IntersectCached(
+                    scene, path.time, raySeg, surfVertex, cache, lightPathState.isect)) {
                 return;
             }
 
@@ -2062,7 +2722,8 @@ void PerturbPathBidir(const Scene *scene,
                                           surfVertex,
                                           lightPathState,
                                           raySeg.ray.dir,
-                                          bsdfContrib)) {
+                                          bsdfContrib,
+                                          cache)) {
                 return;
             }
 
@@ -2084,8 +2745,9 @@ void PerturbPathBidir(const Scene *scene,
     bool useLightCoordinatesPerturb = false;
     for (int camDepth = 0; camDepth < (int)path.camSurfaceVertex.size(); camDepth++) {
         SurfaceVertex &surfVertex = path.camSurfaceVertex[camDepth];
+        VertexCache *cache = GetVertexCache(path.camVertexCache, camDepth);
         bool hitSurface =
-            Intersect(scene, path.time, raySeg, surfVertex.shapeInst, camPathState.isect);
+            IntersectCached(scene, path.time, raySeg, surfVertex, cache, camPathState.isect);
 
         camPathState.wi = -raySeg.ray.dir;
 
@@ -2192,7 +2854,8 @@ void PerturbPathBidir(const Scene *scene,
                                            surfVertex,
                                            camPathState,
                                            raySeg.ray.dir,
-                                           bsdfContrib)) {
+                                           bsdfContrib,
+                                           cache)) {
                 return;
             }
         }
@@ -2705,6 +3368,8 @@ std::string GetFuncName(const int camDepth, const int lightDepth, const PathFunc
     return baseName;
 }
 
+// Every path of a batch shares the scene
+static const BatchSignature c_PathFuncBatch{{"scene"}};
 
 std::string RegisterPathFunc(const int maxCamDepth,
                              const int maxLightDepth,
@@ -2839,7 +3504,7 @@ std::string RegisterPathFunc(const int maxCamDepth,
         wrt = lensParams;
     }
     lib.RegisterFunc(func);
-    lib.RegisterFuncDerv(func, wrt, logLumValue);
+    lib.RegisterFuncDerv(func, wrt, logLumValue, true, &c_PathFuncBatch);
     return func->name;
 }
 
@@ -3714,7 +4379,7 @@ std::string RegisterPathFuncBidir(const int maxCamDepth,
     }
 
     lib.RegisterFunc(func);
-    lib.RegisterFuncDerv(func, wrt, logLumValue);
+    lib.RegisterFuncDerv(func, wrt, logLumValue, true, &c_PathFuncBatch);
     return func->name;
 }
 
@@ -3962,20 +4627,88 @@ std::string RegisterPathFuncBidirMALA(const int maxCamDepth,
     }
 
     lib.RegisterFunc2(func);
-    lib.RegisterFuncDerv2(func, wrt, logLumValue);
+    lib.RegisterFuncDerv2(func, wrt, logLumValue, true, &c_PathFuncBatch);
     return func->name;
 
 }
 
+static Library::Backend g_PathFuncBackend = Library::Backend::Cached;
+
+void SetPathFuncBackend(const Library::Backend backend) {
+    g_PathFuncBackend = backend;
+}
+
+bool PathFuncHasBatch() {
+    return g_PathFuncBackend != Library::Backend::Interpreted;
+}
+
+// The number of (camera, light) depth pairs that have a path function
+static int NumPathFuncPairs(const int maxDepth, const bool bidirectional) {
+    int numPairs = 0;
+    for (int maxCamDepth = 1; maxCamDepth <= maxDepth + 1; maxCamDepth++) {
+        for (int maxLgtDepth = 0; maxLgtDepth <= (bidirectional ? maxDepth : 1); maxLgtDepth++) {
+            if (maxCamDepth + maxLgtDepth > 2 && maxCamDepth + maxLgtDepth - 1 <= maxDepth) {
+                numPairs++;
+            }
+        }
+    }
+    return numPairs;
+}
+
+// The Interpreted backend has a fixed number of entry points, so a maxDepth that needs more
+// fails before any function is recorded
+static void CheckInterpretedCapacity(const int maxDepth, const bool bidirectional) {
+    if (g_PathFuncBackend != Library::Backend::Interpreted) {
+        return;
+    }
+    const int numPairs = NumPathFuncPairs(maxDepth, bidirectional);
+    // The arguments of PathFunc and PathFuncDerv
+    const int numFree = std::min(Library::FreeTapeSlots(5), Library::FreeTapeSlots(6));
+    if (numPairs > numFree) {
+        Error("maxDepth " + std::to_string(maxDepth) + " needs " + std::to_string(numPairs) +
+              " interpreted path functions but only " + std::to_string(numFree) +
+              " entry points are left, lower maxDepth or compile the path functions");
+    }
+}
+
+// Prints how much the simplification shrank the derivatives generated since _start_
+static void ReportSimplifyStats(const SimplifyStats &start) {
+    const SimplifyStats end = GetSimplifyStats();
+    const int64_t before = end.nodesBefore - start.nodesBefore;
+    const int64_t after = end.nodesAfter - start.nodesAfter;
+    if (before == 0) {
+        return;
+    }
+    std::cout << "Simplified derivative expressions from " << before << " to " << after
+              << " nodes (" << Float(100.0) * Float(after) / Float(before) << "%)" << std::endl;
+}
+
+// Prints how much of the Hessians registered since _start_ is structurally nonzero
+static void ReportHessianStats(const HessianStats &start) {
+    const HessianStats end = GetHessianStats();
+    const int64_t entries = end.entries - start.entries;
+    const int64_t nonZeros = end.nonZeros - start.nonZeros;
+    if (entries == 0) {
+        return;
+    }
+    std::cout << "Hessians of the path functions: " << nonZeros << " of " << entries
+              << " entries structurally nonzero ("
+              << Float(100.0) * Float(nonZeros) / Float(entries) << "%)" << std::endl;
+}
+
 std::shared_ptr<Library> CompilePathFuncLibrary(const bool bidirectional,
                                                 const int maxDepth,
                                                 std::shared_ptr<Library> *library) 
 {
     std::shared_ptr<Library> pathLib =
         library == nullptr
-            ? std::make_shared<Library>(GetLibPath(), bidirectional ? "pathlibbidir" : "pathlib")
+            ? std::make_shared<Library>(GetPathFuncCacheDir(),
+                                        bidirectional ? "pathlibbidir" : "pathlib",
+                                        g_PathFuncBackend)
             : *library;
     std::cout << "Compiling path function libraries..." << std::endl;
+    const SimplifyStats simplifyStats = GetSimplifyStats();
+    const HessianStats hessianStats = GetHessianStats();
     for (int maxCamDepth = 1; maxCamDepth <= maxDepth + 1; maxCamDepth++) {
         for (int maxLgtDepth = 0; maxLgtDepth <= (bidirectional ? maxDepth : 1); maxLgtDepth++) {
             if (maxCamDepth + maxLgtDepth <= 2 || (maxCamDepth + maxLgtDepth - 1) > maxDepth) {
@@ -3998,6 +4731,8 @@ std::shared_ptr<Library> CompilePathFuncLibrary(const bool bidirectional,
         }
     }
     pathLib->Link();
+    ReportSimplifyStats(simplifyStats);
+    ReportHessianStats(hessianStats);
     std::cout << "Compiled" << std::endl;
     return pathLib;
 }
@@ -4006,9 +4741,11 @@ std::shared_ptr<Library> CompilePathFuncLibrary2(const int maxDepth,
                                                  std::shared_ptr<Library> *library) {
     std::shared_ptr<Library> pathLib = 
         library == nullptr 
-            ? std::make_shared<Library>(GetLibPath(), "pathlibbidir_mala")
+            ? std::make_shared<Library>(
+                  GetPathFuncCacheDir(), "pathlibbidir_mala", g_PathFuncBackend)
             : *library;
     std::cout << "Compiling path function libraries (MALA)..." << std::endl; 
+    const SimplifyStats simplifyStats = GetSimplifyStats();
     for (int maxCamDepth = 1; maxCamDepth <= maxDepth + 1; maxCamDepth++) {
         for (int maxLgtDepth = 0; maxLgtDepth <= maxDepth; maxLgtDepth++) {
             if (maxCamDepth + maxLgtDepth <= 2 || (maxCamDepth + maxLgtDepth - 1) > maxDepth) {
@@ -4024,21 +4761,178 @@ std::shared_ptr<Library> CompilePathFuncLibrary2(const int maxDepth,
         }
     }
     pathLib->Link();
+    ReportSimplifyStats(simplifyStats);
     std::cout << "Compiled (MALA) " << std::endl;
     return pathLib;
 }
 
+PathFuncJit::PathFuncJit(const Kind kind, const int maxDepth)
+    : kind(kind),
+      maxDepth(maxDepth),
+      kernels(new std::atomic<PathFuncDerv>[(maxDepth + 2) * (maxDepth + 1)]),
+      batchKernels(new std::atomic<PathFuncDervBatch>[(maxDepth + 2) * (maxDepth + 1)]),
+      states(new std::atomic<int>[(maxDepth + 2) * (maxDepth + 1)]),
+      shutdown(false) {
+    const char *name = kind == Kind::Unidirectional ? "pathlib"
+                       : kind == Kind::Bidirectional ? "pathlibbidir"
+                                                     : "pathlibbidir_mala";
+    // Checked here, the functions are recorded by the thread of CompileLoop
+    CheckInterpretedCapacity(maxDepth, kind != Kind::Unidirectional);
+    library = std::make_shared<Library>(GetPathFuncCacheDir(), name, g_PathFuncBackend);
+    for (int i = 0; i < (maxDepth + 2) * (maxDepth + 1); i++) {
+        kernels[i].store(nullptr);
+        batchKernels[i].store(nullptr);
+        states[i].store(0);
+    }
+    thread = std::thread([this]() { CompileLoop(); });
+}
+
+PathFuncJit::~PathFuncJit() {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        shutdown = true;
+        queueCondition.notify_all();
+    }
+    // A compilation in flight is finished, so that it lands in the cache
+    thread.join();
+}
+
+int PathFuncJit::PairIndex(const int camDepth, const int lightDepth) const {
+    if (camDepth < 1 || lightDepth < 0 || camDepth + lightDepth <= 2 ||
+        camDepth + lightDepth - 1 > maxDepth ||
+        (kind == Kind::Unidirectional && lightDepth > 1)) {
+        return -1;
+    }
+    return camDepth * (maxDepth + 1) + lightDepth;
+}
+
+PathFuncDerv PathFuncJit::Request(const int camDepth, const int lightDepth, bool &ready) {
+    const int index = PairIndex(camDepth, lightDepth);
+    if (index < 0) {
+        ready = true;
+        return nullptr;
+    }
+    // 0: not requested, 1: being compiled, 2: done
+    int state = states[index].load(std::memory_order_acquire);
+    if (state == 0 && states[index].compare_exchange_strong(state, 1)) {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        queue.push_back({camDepth, lightDepth});
+        queueCondition.notify_one();
+        state = 1;
+    }
+    ready = state == 2;
+    return ready ? kernels[index].load(std::memory_order_relaxed) : nullptr;
+}
+
+PathFuncDervBatch PathFuncJit::RequestBatch(const int camDepth, const int lightDepth) const {
+    const int index = PairIndex(camDepth, lightDepth);
+    if (index < 0 || states[index].load(std::memory_order_acquire) != 2) {
+        return nullptr;
+    }
+    return batchKernels[index].load(std::memory_order_relaxed);
+}
+
+void PathFuncJit::CompileLoop() {
+    // chad builds expressions in global state, so all kernels are generated on this thread
+    Timer timer;
+    Tick(timer);
+    for (;;) {
+        std::pair<int, int> pair;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueCondition.wait(lock, [this]() { return shutdown || !queue.empty(); });
+            if (shutdown) {
+                return;
+            }
+            pair = queue.front();
+            queue.pop_front();
+        }
+        const int camDepth = pair.first, lightDepth = pair.second;
+        const SimplifyStats simplifyStats = GetSimplifyStats();
+        const HessianStats hessianStats = GetHessianStats();
+        const std::string funcName =
+            kind == Kind::Unidirectional
+                ? GetFuncName(camDepth, lightDepth, PathFuncMode::Static)
+                : kind == Kind::Bidirectional
+                      ? GetFuncNameBidir(camDepth, lightDepth, PathFuncMode::Static)
+                      : GetFuncNameBidirMALA(camDepth, lightDepth, PathFuncMode::Static);
+        if (!library->LoadCached(funcName) || !library->LoadCached(GetDervName(funcName)) ||
+            !library->LoadCached(GetBatchName(funcName))) {
+            if (kind == Kind::Unidirectional) {
+                RegisterPathFunc(camDepth, lightDepth, PathFuncMode::Static, *library);
+            } else if (kind == Kind::Bidirectional) {
+                RegisterPathFuncBidir(camDepth, lightDepth, PathFuncMode::Static, *library);
+            } else {
+                RegisterPathFuncBidirMALA(camDepth, lightDepth, PathFuncMode::Static, *library);
+            }
+            library->Link();
+        }
+        PathFuncDerv f = (PathFuncDerv)library->GetFuncDerv(funcName);
+        if (f == nullptr) {
+            std::cout << "[Warning] Can't find derivatives function:" << funcName << std::endl;
+        }
+        const int index = PairIndex(camDepth, lightDepth);
+        kernels[index].store(f, std::memory_order_relaxed);
+        batchKernels[index].store((PathFuncDervBatch)library->GetFuncDervBatch(funcName),
+                                  std::memory_order_relaxed);
+        states[index].store(2, std::memory_order_release);
+        Timer elapsed = timer;
+        std::cout << "Derivatives of " << funcName << " ready after " << Tick(elapsed) << "s"
+                  << std::endl;
+        ReportSimplifyStats(simplifyStats);
+        ReportHessianStats(hessianStats);
+    }
+}
+
 std::shared_ptr<const PathFuncLib> BuildPathFuncLibrary(const bool bidirectional,
-                                                        const int maxDepth) 
+                                                        const int maxDepth,
+                                                        const bool lazy)
 {
-    std::shared_ptr<Library> pathLib =
-        std::make_shared<Library>(GetLibPath(), bidirectional ? "pathlibbidir" : "pathlib");
-    if (!pathLib->IsLinked()) {
-        pathLib = CompilePathFuncLibrary(bidirectional, maxDepth, &pathLib);
+    if (lazy) {
+        return std::make_shared<PathFuncLib>(PathFuncLib{
+            maxDepth,
+            nullptr,
+            PathFuncMap(),
+            PathFuncDervMap(),
+            PathFuncDervBatchMap(),
+            std::make_shared<PathFuncJit>(bidirectional ? PathFuncJit::Kind::Bidirectional
+                                                        : PathFuncJit::Kind::Unidirectional,
+                                          maxDepth)});
     }
+    CheckInterpretedCapacity(maxDepth, bidirectional);
+    std::shared_ptr<Library> pathLib = std::make_shared<Library>(
+        GetPathFuncCacheDir(), bidirectional ? "pathlibbidir" : "pathlib", g_PathFuncBackend);
+    const SimplifyStats simplifyStats = GetSimplifyStats();
+    const HessianStats hessianStats = GetHessianStats();
 
     PathFuncMap staticFuncMap;
     PathFuncDervMap staticFuncDervMap;
+    PathFuncDervBatchMap staticFuncDervBatchMap;
+    for (int maxCamDepth = 1; maxCamDepth <= maxDepth + 1; maxCamDepth++) {
+        for (int maxLgtDepth = 0; maxLgtDepth <= (bidirectional ? maxDepth : 1); maxLgtDepth++) {
+            if (maxCamDepth + maxLgtDepth <= 2 || (maxCamDepth + maxLgtDepth - 1) > maxDepth) {
+                continue;
+            }
+
+            std::string staticFuncName =
+                bidirectional ? GetFuncNameBidir(maxCamDepth, maxLgtDepth, PathFuncMode::Static)
+                              : GetFuncName(maxCamDepth, maxLgtDepth, PathFuncMode::Static);
+            // Only the functions this build has not compiled before are generated, and only
+            // those whose source changed are compiled again
+            if (!pathLib->LoadCached(staticFuncName) ||
+                !pathLib->LoadCached(GetDervName(staticFuncName)) ||
+                !pathLib->LoadCached(GetBatchName(staticFuncName))) {
+                if (bidirectional) {
+                    RegisterPathFuncBidir(maxCamDepth, maxLgtDepth, PathFuncMode::Static, *pathLib);
+                } else {
+                    RegisterPathFunc(maxCamDepth, maxLgtDepth, PathFuncMode::Static, *pathLib);
+                }
+            }
+        }
+    }
+    // Compiles the generated functions in parallel
+    pathLib->Link();
+
     for (int maxCamDepth = 1; maxCamDepth <= maxDepth + 1; maxCamDepth++) {
         for (int maxLgtDepth = 0; maxLgtDepth <= (bidirectional ? maxDepth : 1); maxLgtDepth++) {
             if (maxCamDepth + maxLgtDepth <= 2 || (maxCamDepth + maxLgtDepth - 1) > maxDepth) {
@@ -4065,25 +4959,46 @@ std::shared_ptr<const PathFuncLib> BuildPathFuncLibrary(const bool bidirectional
                               << std::endl;
                 }
             }
+            {
+                // Without it the chains of the pair are differentiated one by one
+                PathFuncDervBatch f =
+                    (PathFuncDervBatch)pathLib->GetFuncDervBatch(staticFuncName);
+                if (f != nullptr) {
+                    staticFuncDervBatchMap[{maxCamDepth, maxLgtDepth}] = f;
+                }
+            }
 
         }
     }
 
+    ReportSimplifyStats(simplifyStats);
+    ReportHessianStats(hessianStats);
     return std::make_shared<PathFuncLib>(PathFuncLib{maxDepth,
                                                      pathLib,
                                                      staticFuncMap,
-                                                     staticFuncDervMap});
+                                                     staticFuncDervMap,
+                                                     staticFuncDervBatchMap,
+                                                     nullptr});
 }
 
-std::shared_ptr<const PathFuncLib> BuildPathFuncLibrary2(const int maxDepth) {
-    std::shared_ptr<Library> pathLib = 
-        std::make_shared<Library>(GetLibPath(), "pathlibbidir_mala");
-    if (!pathLib->IsLinked()) {
-        pathLib = CompilePathFuncLibrary2(maxDepth, &pathLib);
+std::shared_ptr<const PathFuncLib> BuildPathFuncLibrary2(const int maxDepth, const bool lazy) {
+    if (lazy) {
+        return std::make_shared<PathFuncLib>(PathFuncLib{
+            maxDepth,
+            nullptr,
+            PathFuncMap(),
+            PathFuncDervMap(),
+            PathFuncDervBatchMap(),
+            std::make_shared<PathFuncJit>(PathFuncJit::Kind::BidirectionalMALA, maxDepth)});
     }
+    CheckInterpretedCapacity(maxDepth, true);
+    std::shared_ptr<Library> pathLib =
+        std::make_shared<Library>(GetPathFuncCacheDir(), "pathlibbidir_mala", g_PathFuncBackend);
+    const SimplifyStats simplifyStats = GetSimplifyStats();
 
     PathFuncMap staticFuncMap;
     PathFuncDervMap staticFuncDervMap;
+    PathFuncDervBatchMap staticFuncDervBatchMap;
     for (int maxCamDepth = 1; maxCamDepth <= maxDepth + 1; maxCamDepth++) {
         for (int maxLgtDepth = 0; maxLgtDepth <= maxDepth; maxLgtDepth++) {
             if (maxCamDepth + maxLgtDepth <= 2 || (maxCamDepth + maxLgtDepth - 1) > maxDepth) {
@@ -4091,6 +5006,24 @@ std::shared_ptr<const PathFuncLib> BuildPathFuncLibrary2(const int maxDepth) {
             }
  
 
+            std::string staticFuncName = GetFuncNameBidirMALA(maxCamDepth, maxLgtDepth, PathFuncMode::Static);
+            if (!pathLib->LoadCached(staticFuncName) ||
+                !pathLib->LoadCached(GetDervName(staticFuncName)) ||
+                !pathLib->LoadCached(GetBatchName(staticFuncName))) {
+                RegisterPathFuncBidirMALA(
+                    maxCamDepth, maxLgtDepth, PathFuncMode::Static, *pathLib);
+            }
+        }
+    }
+    // Compiles the generated functions in parallel
+    pathLib->Link();
+
+    for (int maxCamDepth = 1; maxCamDepth <= maxDepth + 1; maxCamDepth++) {
+        for (int maxLgtDepth = 0; maxLgtDepth <= maxDepth; maxLgtDepth++) {
+            if (maxCamDepth + maxLgtDepth <= 2 || (maxCamDepth + maxLgtDepth - 1) > maxDepth) {
+                continue;
+            }
+
             std::string staticFuncName = GetFuncNameBidirMALA(maxCamDepth, maxLgtDepth, PathFuncMode::Static);
             {
                 PathFunc f = (PathFunc)pathLib->GetFunc(staticFuncName);
@@ -4109,12 +5042,23 @@ std::shared_ptr<const PathFuncLib> BuildPathFuncLibrary2(const int maxDepth) {
                               << std::endl;
                 }
             } 
+            {
+                // Without it the chains of the pair are differentiated one by one
+                PathFuncDervBatch f =
+                    (PathFuncDervBatch)pathLib->GetFuncDervBatch(staticFuncName);
+                if (f != nullptr) {
+                    staticFuncDervBatchMap[{maxCamDepth, maxLgtDepth}] = f;
+                }
+            }
 
         }
     }
 
+    ReportSimplifyStats(simplifyStats);
     return std::make_shared<PathFuncLib>(PathFuncLib{maxDepth, 
                                                      pathLib,
                                                      staticFuncMap,
-                                                     staticFuncDervMap});
+                                                     staticFuncDervMap,
+                                                     staticFuncDervBatchMap,
+                                                     nullptr});
 }
\ No newline at end of file
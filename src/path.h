@@ -6,6 +6,11 @@
 #include "shape.h"
 #include <vector>
 #include <unordered_map>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 struct EnvLight;
 
@@ -28,6 +33,27 @@ struct CameraVertex {
     Vector2 screenPos;
 };
 
+// What PerturbPathBidir computed at a surface vertex the last time its path was evaluated
+struct VertexCache {
+    // The scene query that found the vertex
+    bool hitValid = false;
+    RaySegment raySeg;
+    Float time;
+    bool hit;
+    ShapeInst shapeInst;
+    // The raw BSDF sample taken at the vertex, only valid while the query above was reused
+    bool bsdfValid = false;
+    Vector2 bsdfRndParam;
+    Float bsdfDiscrete;
+    bool bsdfFound;
+    Vector3 dir;
+    Vector3 bsdfContrib;
+    Float cosWo;
+    Float bsdfPdf;
+    Float bsdfRevPdf;
+    Float sphereJacobian;
+};
+
 struct SurfaceVertex {
     ShapeInst shapeInst;
     Vector2 bsdfRndParam;
@@ -54,6 +80,10 @@ struct Path {
     LightInst envLightInst;
     // Only used by camera subpaths
     Vector3 lensVertexPos;
+    // Parallel to the surface vertices with DptOptions::incrementalPerturb and empty otherwise.
+    // They are not part of the state of a chain and are not checkpointed.
+    std::vector<VertexCache> camVertexCache;
+    std::vector<VertexCache> lgtVertexCache;
 
     bool isSubpath;
     // undefined for non subpath
@@ -91,6 +121,9 @@ struct SerializedSubpath {
 };
 
 void Clear(Path &path);
+// Reserves the vertices of paths up to _maxDepth_, so that regrowing the path or copying one
+// into it does not allocate
+void Reserve(Path &path, const int maxDepth);
 void GeneratePath(const Scene *scene,
                   const Vector2i screenPosi,
                   const int minDepth,
@@ -105,6 +138,21 @@ void GeneratePathBidir(const Scene *scene,
                        Path &path,
                        std::vector<SubpathContrib> &contribs,
                        RNG &rng);
+// Generates _rngs.size()_ paths like GeneratePathBidir, advancing them together one vertex at
+// a time so that their scene queries can be batched. Only the queries are batched, the BSDFs
+// are sampled and evaluated one path at a time. With _streamQueries_ the rays of all paths
+// are traced with Embree's stream kernels, which may resolve a near-tie between two hits to
+// another primitive than rtcIntersect1 and so continue a path differently. Without, every ray
+// is traced as GeneratePathBidir traces it, and path i drawn from _rngs[i]_ gets the same
+// vertices and contributions as GeneratePathBidir with that generator.
+void GeneratePathBidirBatch(const Scene *scene,
+                            const Vector2i screenPosi,
+                            const int minDepth,
+                            const int maxDepth,
+                            std::vector<Path> &paths,
+                            std::vector<std::vector<SubpathContrib>> &contribs,
+                            std::vector<RNG> &rngs,
+                            const bool streamQueries = true);
 void GenerateSubpath(const Scene *scene,
                      const Vector2i screenPosi,
                      const int camLength,
@@ -119,11 +167,25 @@ void PerturbPath(const Scene *scene,
                  Path &path,
                  std::vector<SubpathContrib> &contribs,
                  RNG &rng);
+// With DptOptions::incrementalPerturb a vertex whose ray is identical to the one it was found
+// with last time, because the coordinates before it did not change, reuses the primitive it
+// hit instead of querying the scene again. If its BSDF coordinates did not change either, the
+// BSDF sample is reused too.
 void PerturbPathBidir(const Scene *scene,
                       const Vector &offset,
                       Path &path,
                       std::vector<SubpathContrib> &contribs,
                       RNG &rng);
+// The scene queries of the surface vertices in PerturbPathBidir so far on this thread, and
+// how many of them were answered from the vertex caches. The same for the BSDF samples, only
+// counted with the caches.
+struct PerturbStats {
+    uint64_t traced = 0;
+    uint64_t reused = 0;
+    uint64_t bsdfSampled = 0;
+    uint64_t bsdfReused = 0;
+};
+const PerturbStats &GetPerturbStats();
 size_t GetVertParamSize(const int maxCamDepth, const int maxLgtDepth);
 size_t GetPrimaryParamSize(const int camDepth, const int lightDepth);
 void Serialize(const Scene *scene, const Path &path, SerializedSubpath &subPath);
@@ -138,6 +200,17 @@ inline int GetDimension(const Path &path) {
     return pps;
 }
 
+// The dimension of the longest path up to _maxDepth_
+inline int GetMaxDimension(const int maxDepth) {
+    return int(GetPrimaryParamSize(maxDepth, 1)) - 1;
+}
+
+// A bound of the contributions that generating one path up to _maxDepth_ can return, one per
+// pair of subpath lengths
+inline int GetMaxNumContribs(const int maxDepth) {
+    return (maxDepth + 2) * (maxDepth + 3) / 2;
+}
+
 inline int GetPathLength(const int camLength, const int lgtLength) {
     return camLength + lgtLength - 1;
 }
@@ -145,16 +218,66 @@ inline int GetPathLength(const int camLength, const int lgtLength) {
 using PathFunc = void (*)(const Float *, const Float *, const Float *, const Float *, Float *);
 using PathFuncDerv =
     void (*)(const Float *, const Float *, const Float *, const Float *, Float *, Float *);
+// Derivatives of _count_ paths of the same pair at once, every argument but the scene
+// parameters and every output as a structure of arrays, see chad::BatchSignature
+using PathFuncDervBatch = void (*)(const int,
+                                   const Float *,
+                                   const Float *,
+                                   const Float *,
+                                   const Float *,
+                                   Float *,
+                                   Float *);
 using PathFuncMap = std::unordered_map<std::pair<int, int>, PathFunc>;
 using PathFuncDervMap = std::unordered_map<std::pair<int, int>, PathFuncDerv>;
+using PathFuncDervBatchMap = std::unordered_map<std::pair<int, int>, PathFuncDervBatch>;
+
+// Derivative kernels of the (camDepth, lightDepth) pairs, compiled on a background thread the
+// first time a pair is requested instead of all before rendering. Compiled kernels go
+// through the shared cache of the path function libraries.
+class PathFuncJit {
+    public:
+    enum class Kind { Unidirectional, Bidirectional, BidirectionalMALA };
+    PathFuncJit(const Kind kind, const int maxDepth);
+    ~PathFuncJit();
+    // Returns the kernel of the pair, or nullptr if it has none. _ready_ is false while the
+    // kernel is being compiled, the first request of a pair schedules its compilation.
+    PathFuncDerv Request(const int camDepth, const int lightDepth, bool &ready);
+    // The batched kernel of the pair once it is compiled, nullptr before or if it has none
+    PathFuncDervBatch RequestBatch(const int camDepth, const int lightDepth) const;
+
+    private:
+    void CompileLoop();
+    int PairIndex(const int camDepth, const int lightDepth) const;
+
+    const Kind kind;
+    const int maxDepth;
+    std::shared_ptr<Library> library;
+    std::unique_ptr<std::atomic<PathFuncDerv>[]> kernels;
+    std::unique_ptr<std::atomic<PathFuncDervBatch>[]> batchKernels;
+    std::unique_ptr<std::atomic<int>[]> states;
+    std::mutex queueMutex;
+    std::condition_variable queueCondition;
+    std::deque<std::pair<int, int>> queue;
+    bool shutdown;
+    std::thread thread;
+};
 
 struct PathFuncLib {
     int maxDepth;
     std::shared_ptr<const Library> library;
     PathFuncMap staticFuncMap;
     PathFuncDervMap staticDervFuncMap;
+    PathFuncDervBatchMap staticDervBatchFuncMap;
+    // Set instead of the maps above when the kernels are compiled on demand
+    std::shared_ptr<PathFuncJit> lazyDervFuncs;
 };
 
+// Selects how the path function libraries below evaluate their functions, compiled objects
+// in the cache directory by default, or the in-process interpreter that needs no toolchain
+void SetPathFuncBackend(const Library::Backend backend);
+// Whether the derivatives have batched entries, the interpreter has none
+bool PathFuncHasBatch();
+
 std::shared_ptr<Library> CompilePathFuncLibrary(const bool bidirectional,
                                                 const int maxDepth,
                                                 std::shared_ptr<Library> *library = nullptr);
@@ -163,6 +286,8 @@ std::shared_ptr<Library> CompilePathFuncLibrary2(const int maxDepth,
                                                 std::shared_ptr<Library> *library = nullptr);
 
 std::shared_ptr<const PathFuncLib> BuildPathFuncLibrary(const bool bidirectional,
-                                                        const int maxDepth);
+                                                        const int maxDepth,
+                                                        const bool lazy = false);
 
-std::shared_ptr<const PathFuncLib> BuildPathFuncLibrary2(const int maxDepth); 
+std::shared_ptr<const PathFuncLib> BuildPathFuncLibrary2(const int maxDepth,
+                                                         const bool lazy = false);
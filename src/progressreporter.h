@@ -25,11 +25,12 @@ class ProgressReporter {
                 (unsigned long long)totalWork);
     }
     uint64_t GetWorkDone() const {
+        std::lock_guard<std::mutex> lock(mutex);
         return workDone;
     }
 
     private:
     const uint64_t totalWork;
     uint64_t workDone;
-    std::mutex mutex;
+    mutable std::mutex mutex;
 };
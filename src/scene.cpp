@@ -4,6 +4,10 @@
 #include "light.h"
 #include "camera.h"
 #include "bounds.h"
+#include "parallel.h"
+#include "timer.h"
+
+#include <map>
 
 Scene::Scene(std::shared_ptr<DptOptions> &options,
              const std::shared_ptr<const Camera> &camera,
@@ -31,22 +35,106 @@ Scene::Scene(std::shared_ptr<DptOptions> &options,
     // rtcSetSceneFlags(rtcScene,RTC_BUILD_QUALITY_MEDIUM | RTC_SCENE_FLAG_NONE | RTC_BUILD_QUALITY_HIGH | RTC_SCENE_FLAG_ROBUST); // EMBREE_FIXME: set proper scene flags
     // rtcSetSceneBuildQuality(rtcScene,RTC_BUILD_QUALITY_MEDIUM | RTC_SCENE_FLAG_NONE | RTC_BUILD_QUALITY_HIGH | RTC_SCENE_FLAG_ROBUST); // EMBREE_FIXME: set proper build quality
     
+    Timer timer;
+    Tick(timer);
+    // A geometry of the top scene is either one object or an instance, whose shapes follow each
+    // other in objects. The shapes of a group get a scene of their own that its instances
+    // reference.
+    std::vector<const ShapeGroup *> groups;
+    std::map<const ShapeGroup *, int> groupIndices;
+    for (size_t i = 0; i < objects.size(); i++) {
+        const GroupInstance *instance = objects[i]->GetGroupInstance();
+        if (instance != nullptr && i > 0 && objects[i - 1]->GetGroupInstance() == instance) {
+            continue;
+        }
+        geomObjects.push_back(int(i));
+        if (instance != nullptr && groupIndices.find(instance->group.get()) == groupIndices.end()) {
+            groupIndices[instance->group.get()] = int(groups.size());
+            groups.push_back(instance->group.get());
+        }
+    }
+
+    // Geometries are filled and committed in parallel, then attached under their index: the
+    // shapes of the top scene first, the shapes of the groups after them
+    std::vector<const Shape *> geometryShapes;
+    for (const int objIndex : geomObjects) {
+        if (objects[objIndex]->GetGroupInstance() == nullptr) {
+            geometryShapes.push_back(objects[objIndex].get());
+        }
+    }
+    const size_t numTopShapes = geometryShapes.size();
+    for (const ShapeGroup *group : groups) {
+        for (const auto &shape : group->shapes) {
+            geometryShapes.push_back(shape.get());
+        }
+    }
+    std::vector<RTCGeometry> geometries(geometryShapes.size());
+    ParallelFor([&](const int64_t i) {
+        geometries[i] = geometryShapes[i]->RtcNewGeometry(rtcDevice);
+    }, geometryShapes.size());
+
+    size_t geometryIndex = numTopShapes;
+    for (const ShapeGroup *group : groups) {
+        RTCScene groupScene = rtcNewScene(rtcDevice);
+        for (size_t i = 0; i < group->shapes.size(); i++) {
+            rtcAttachGeometryByID(groupScene, geometries[geometryIndex], (unsigned int)i);
+            rtcReleaseGeometry(geometries[geometryIndex]);
+            geometryIndex++;
+        }
+        rtcCommitScene(groupScene);
+        groupScenes.push_back(groupScene);
+    }
+
+    geometryIndex = 0;
+    for (size_t geomID = 0; geomID < geomObjects.size(); geomID++) {
+        const GroupInstance *instance = objects[geomObjects[geomID]]->GetGroupInstance();
+        RTCGeometry geometry;
+        if (instance == nullptr) {
+            geometry = geometries[geometryIndex++];
+        } else {
+            geometry = rtcNewGeometry(rtcDevice, RTC_GEOMETRY_TYPE_INSTANCE);
+            rtcSetGeometryInstancedScene(geometry,
+                                         groupScenes[groupIndices[instance->group.get()]]);
+            float toWorld[16];
+            for (int col = 0; col < 4; col++) {
+                for (int row = 0; row < 4; row++) {
+                    toWorld[4 * col + row] = float(instance->toWorld(row, col));
+                }
+            }
+            rtcSetGeometryTransform(geometry, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, toWorld);
+            rtcCommitGeometry(geometry);
+        }
+        rtcAttachGeometryByID(rtcScene, geometry, (unsigned int)geomID);
+        rtcReleaseGeometry(geometry);
+    }
+
     BBox bbox;
-    for (auto &obj : objects) {
-        obj->RtcRegister(rtcScene, rtcDevice);
+    staticGeometry = true;
+    for (const auto &obj : objects) {
         bbox = Merge(bbox, obj->GetBBox());
+        if (obj->IsMoving()) {
+            staticGeometry = false;
+        }
     }
+    const Float geometryTime = Tick(timer);
     bSphere = BSphere(bbox);
     bSphere.radius *= Float(1000.0); // important: ensure it's far enough for MIS weighting
     std::cout << "bSphere: center = " << bSphere.center[0] << "," << 
                                          bSphere.center[1] << "," << 
                                          bSphere.center[2] << 
                          " radius = " << bSphere.radius << std::endl; 
+    // Embree builds the BVH on its own threads
     rtcCommitScene(rtcScene);
+    const Float bvhTime = Tick(timer);
+    std::cout << "Embree geometries created in " << geometryTime << "s, BVH built in " << bvhTime
+              << "s" << std::endl;
 }
 
 Scene::~Scene() {
     rtcReleaseScene(rtcScene);
+    for (RTCScene groupScene : groupScenes) {
+        rtcReleaseScene(groupScene);
+    }
     rtcReleaseDevice (rtcDevice);
 }
 
@@ -103,6 +191,16 @@ static inline RTCRay ToRTCRay(const Float time, const RaySegment &raySeg) {
     return rtcRay;
 }
 
+// For a hit through an instance, _geomID_ is the shape in the scene of the group
+static inline const Shape *HitShape(const Scene *scene,
+                                    const unsigned int geomID,
+                                    const unsigned int instID) {
+    if (instID == RTC_INVALID_GEOMETRY_ID) {
+        return scene->objects[scene->geomObjects[geomID]].get();
+    }
+    return scene->objects[scene->geomObjects[instID] + geomID].get();
+}
+
 bool Intersect(const Scene *scene,
                const Float time,
                const RaySegment &raySeg,
@@ -120,12 +218,12 @@ bool Intersect(const Scene *scene,
         return false;
     }
 
-    shapeInst.obj = scene->objects[rtcRay.hit.geomID].get();
+    shapeInst.obj = HitShape(scene, rtcRay.hit.geomID, rtcRay.hit.instID[0]);
     shapeInst.primID = rtcRay.hit.primID;
     return true;
 }
 
-bool Occluded(const Scene *scene, const Float time, const Ray &ray, const Float dist) {
+RaySegment ShadowRaySegment(const Ray &ray, const Float dist) {
     Float minT, maxT;
     if (dist == std::numeric_limits<Float>::infinity()) {
         minT = c_IsectEpsilon;
@@ -134,7 +232,11 @@ bool Occluded(const Scene *scene, const Float time, const Ray &ray, const Float
         minT = c_IsectEpsilon;
         maxT = (Float(1.0) - c_ShadowEpsilon) * dist;
     }
-    return Occluded(scene, time, RaySegment{ray, minT, maxT});
+    return RaySegment{ray, minT, maxT};
+}
+
+bool Occluded(const Scene *scene, const Float time, const Ray &ray, const Float dist) {
+    return Occluded(scene, time, ShadowRaySegment(ray, dist));
 }
 
 bool Occluded(const Scene *scene, const Float time, const RaySegment &raySeg) {
@@ -148,6 +250,105 @@ bool Occluded(const Scene *scene, const Float time, const RaySegment &raySeg) {
     return rtcRay.tfar < Float(0.0f);
 }
 
+// Rays in the pointer structure-of-arrays layout of rtcIntersectNp
+struct RayHitSoA {
+    void Resize(const int count) {
+        for (auto *v : {&orgX, &orgY, &orgZ, &tnear, &dirX, &dirY, &dirZ, &time, &tfar, &ngX, &ngY,
+                        &ngZ, &u, &v}) {
+            v->resize(count);
+        }
+        for (auto *v : {&mask, &id, &flags, &primID, &geomID, &instID}) {
+            v->resize(count);
+        }
+        rayHit.ray = RTCRayNp{&orgX[0], &orgY[0], &orgZ[0], &tnear[0], &dirX[0], &dirY[0],
+                              &dirZ[0], &time[0], &tfar[0], &mask[0], &id[0], &flags[0]};
+        rayHit.hit.Ng_x = &ngX[0];
+        rayHit.hit.Ng_y = &ngY[0];
+        rayHit.hit.Ng_z = &ngZ[0];
+        rayHit.hit.u = &u[0];
+        rayHit.hit.v = &v[0];
+        rayHit.hit.primID = &primID[0];
+        rayHit.hit.geomID = &geomID[0];
+        rayHit.hit.instID[0] = &instID[0];
+    }
+
+    void Set(const int i, const Float rayTime, const RaySegment &raySeg) {
+        const Ray &ray = raySeg.ray;
+        orgX[i] = float(ray.org[0]);
+        orgY[i] = float(ray.org[1]);
+        orgZ[i] = float(ray.org[2]);
+        dirX[i] = float(ray.dir[0]);
+        dirY[i] = float(ray.dir[1]);
+        dirZ[i] = float(ray.dir[2]);
+        tnear[i] = float(raySeg.minT);
+        tfar[i] = float(raySeg.maxT);
+        time[i] = float(rayTime);
+        mask[i] = 0xFFFFFFFF;
+        id[i] = i;
+        flags[i] = 0;
+        geomID[i] = RTC_INVALID_GEOMETRY_ID;
+        primID[i] = RTC_INVALID_GEOMETRY_ID;
+        instID[i] = RTC_INVALID_GEOMETRY_ID;
+    }
+
+    std::vector<float> orgX, orgY, orgZ, tnear, dirX, dirY, dirZ, time, tfar, ngX, ngY, ngZ, u, v;
+    std::vector<unsigned int> mask, id, flags, primID, geomID, instID;
+    RTCRayHitNp rayHit;
+};
+
+void Intersect(const Scene *scene,
+               const Float *times,
+               const RaySegment *raySegs,
+               const int count,
+               ShapeInst *shapeInsts,
+               uint8_t *hit) {
+    if (count == 0) {
+        return;
+    }
+    static thread_local RayHitSoA rays;
+    rays.Resize(count);
+    for (int i = 0; i < count; i++) {
+        rays.Set(i, times[i], raySegs[i]);
+    }
+    {
+      RTCIntersectContext context;
+      rtcInitIntersectContext(&context);
+      rtcIntersectNp(scene->rtcScene, &context, &rays.rayHit, count);
+    }
+    for (int i = 0; i < count; i++) {
+        hit[i] = rays.geomID[i] != RTC_INVALID_GEOMETRY_ID ? 1 : 0;
+        if (hit[i]) {
+            shapeInsts[i].obj = HitShape(scene, rays.geomID[i], rays.instID[i]);
+            shapeInsts[i].primID = rays.primID[i];
+        }
+    }
+}
+
+void Occluded(const Scene *scene,
+              const Float *times,
+              const RaySegment *raySegs,
+              const int count,
+              uint8_t *occluded) {
+    if (count == 0) {
+        return;
+    }
+    static thread_local std::vector<RTCRay> rtcRays;
+    rtcRays.resize(count);
+    for (int i = 0; i < count; i++) {
+        rtcRays[i] = ToRTCRay(times[i], raySegs[i]);
+    }
+    {
+      RTCIntersectContext context;
+      rtcInitIntersectContext(&context);
+      // Shadow rays from different vertices of a path are incoherent
+      context.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+      rtcOccluded1M(scene->rtcScene, &context, rtcRays.data(), count, sizeof(RTCRay));
+    }
+    for (int i = 0; i < count; i++) {
+        occluded[i] = rtcRays[i].tfar < Float(0.0f) ? 1 : 0;
+    }
+}
+
 const Light *PickLight(const Scene *scene, const Float u, Float &prob) {
     int lightId = scene->lightDist->SampleDiscrete(u, &prob);
     return scene->lights[lightId].get();
@@ -36,11 +36,18 @@ struct Scene {
     std::unique_ptr<PiecewiseConstant1D> lightDist;
     std::shared_ptr<const EnvLight> envLight;
     BSphere bSphere;
+    // No shape moves over the shutter interval, so that scene queries do not depend on time
+    bool staticGeometry;
 
     std::string outputName;
 
     RTCDevice rtcDevice;
     RTCScene rtcScene;
+    // The index in objects of the shape of each geometry of rtcScene, for an instance the
+    // index of its first shape
+    std::vector<int> geomObjects;
+    // One scene per shape group, referenced by the instances in rtcScene
+    std::vector<RTCScene> groupScenes;
 
     Float lightWeightSum;
 };
@@ -50,8 +57,22 @@ bool Intersect(const Scene *scene,
                const RaySegment &raySeg,
                ShapeInst &shapeInst);
 
+RaySegment ShadowRaySegment(const Ray &ray, const Float dist);
 bool Occluded(const Scene *scene, const Float time, const Ray &ray, const Float dist);
 bool Occluded(const Scene *scene, const Float time, const RaySegment &raySeg);
+// Batched queries through the Embree stream interface, ray i is traced at times[i].
+// _shapeInsts[i]_ is only written if _hit[i]_ is set.
+void Intersect(const Scene *scene,
+               const Float *times,
+               const RaySegment *raySegs,
+               const int count,
+               ShapeInst *shapeInsts,
+               uint8_t *hit);
+void Occluded(const Scene *scene,
+              const Float *times,
+              const RaySegment *raySegs,
+              const int count,
+              uint8_t *occluded);
 
 const Light *PickLight(const Scene *scene, const Float u, Float &prob);
 
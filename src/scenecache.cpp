@@ -0,0 +1,386 @@
+#include "scenecache.h"
+#include "envlight.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char c_Magic[8] = {'D', 'P', 'T', 'S', 'C', 'N', 'C', '1'};
+static const uint32_t c_Version = 2;
+// Arrays are aligned to and padded by this many bytes
+static const size_t c_Alignment = 16;
+
+enum class CacheRecord : uint8_t { Mesh, Envmap };
+
+struct SceneCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t floatSize;
+    uint32_t indexSize;
+    uint32_t padding;
+    uint64_t numEntries;
+};
+
+// Starts the data of an entry, followed by its arrays
+struct alignas(c_Alignment) CacheRecordHeader {
+    CacheRecord type;
+    uint8_t isMoving;
+    // Mesh: areaFuncInt, totalArea. Envmap: normalization, pixelSize.
+    Float scalars[3];
+};
+
+static SceneCacheHeader MakeHeader(const uint64_t numEntries) {
+    SceneCacheHeader header;
+    std::memcpy(header.magic, c_Magic, sizeof(c_Magic));
+    header.version = c_Version;
+    header.floatSize = sizeof(Float);
+    header.indexSize = sizeof(TriIndexID);
+    header.padding = 0;
+    header.numEntries = numEntries;
+    return header;
+}
+
+static CacheRecordHeader MakeRecordHeader(const CacheRecord type) {
+    CacheRecordHeader header;
+    // The padding bytes are written too
+    std::memset(&header, 0, sizeof(header));
+    header.type = type;
+    return header;
+}
+
+// The bytes an array of _size_ bytes takes in the file after its count
+static size_t PaddedSize(const size_t size) {
+    return (size + c_Alignment - 1) / c_Alignment * c_Alignment + c_Alignment;
+}
+
+template <typename T, typename Alloc>
+static uint64_t ArraySize(const MappedArray<T, Alloc> &values) {
+    return c_Alignment + PaddedSize(sizeof(T) * values.size());
+}
+
+// Bounds checked reads from the mapping
+class CacheCursor {
+    public:
+    CacheCursor(const char *begin, const size_t size) : pos(begin), end(begin + size) {
+    }
+
+    bool Read(void *bytes, const size_t size) {
+        if (size > size_t(end - pos)) {
+            return false;
+        }
+        std::memcpy(bytes, pos, size);
+        pos += size;
+        return true;
+    }
+    bool Skip(const size_t size, const char *&begin) {
+        if (size > size_t(end - pos)) {
+            return false;
+        }
+        begin = pos;
+        pos += size;
+        return true;
+    }
+    // The mapping starts on a page, so addresses and file offsets agree on the alignment
+    bool Align() {
+        const size_t misalignment = size_t(reinterpret_cast<uintptr_t>(pos) % c_Alignment);
+        const char *begin;
+        return misalignment == 0 || Skip(c_Alignment - misalignment, begin);
+    }
+    // Points _values_ at the next array instead of copying it
+    template <typename T, typename Alloc>
+    bool View(MappedArray<T, Alloc> &values) {
+        static_assert(alignof(T) <= c_Alignment, "Arrays of the scene cache are 16-byte aligned");
+        uint64_t header[2];
+        if (!Read(header, sizeof(header)) || header[0] > size_t(end - pos) / sizeof(T)) {
+            return false;
+        }
+        const char *begin;
+        if (!Skip(PaddedSize(sizeof(T) * header[0]), begin)) {
+            return false;
+        }
+        values = MappedArray<T, Alloc>(reinterpret_cast<const T *>(begin), header[0]);
+        return true;
+    }
+
+    private:
+    const char *pos;
+    const char *end;
+};
+
+// Keeps track of the offset in the file to align the arrays
+class CacheWriter {
+    public:
+    explicit CacheWriter(const std::string &filename) : ofs(filename, std::ios::binary) {
+    }
+
+    void Write(const void *bytes, const size_t size) {
+        ofs.write(reinterpret_cast<const char *>(bytes), size);
+        offset += size;
+    }
+    void Pad(size_t size) {
+        static const char zeros[c_Alignment] = {};
+        while (size > 0) {
+            const size_t count = std::min(size, c_Alignment);
+            Write(zeros, count);
+            size -= count;
+        }
+    }
+    void Align() {
+        Pad((c_Alignment - offset % c_Alignment) % c_Alignment);
+    }
+    template <typename T, typename Alloc>
+    void WriteArray(const MappedArray<T, Alloc> &values) {
+        const uint64_t header[2] = {values.size(), 0};
+        const size_t size = sizeof(T) * values.size();
+        Write(header, sizeof(header));
+        Write(values.data(), size);
+        Pad(PaddedSize(size) - size);
+    }
+    bool Good() const {
+        return bool(ofs);
+    }
+
+    private:
+    std::ofstream ofs;
+    uint64_t offset = 0;
+};
+
+static uint64_t MeshDataSize(const TriMeshData &data) {
+    return sizeof(CacheRecordHeader) + ArraySize(data.position0) + ArraySize(data.position1) +
+           ArraySize(data.normal0) + ArraySize(data.normal1) + ArraySize(data.st) +
+           ArraySize(data.colors) + ArraySize(data.indices) + ArraySize(data.areaFunc) +
+           ArraySize(data.areaCdf);
+}
+
+static uint64_t EnvmapDataSize(const EnvmapSampleInfo &sampleInfo) {
+    return sizeof(CacheRecordHeader) + ArraySize(sampleInfo.cdfRows) +
+           ArraySize(sampleInfo.cdfCols) + ArraySize(sampleInfo.rowWeights);
+}
+
+static void WriteMesh(CacheWriter &writer, const TriMeshData &data) {
+    CacheRecordHeader header = MakeRecordHeader(CacheRecord::Mesh);
+    header.isMoving = data.isMoving ? 1 : 0;
+    header.scalars[0] = data.areaFuncInt;
+    header.scalars[1] = data.totalArea;
+    writer.Write(&header, sizeof(header));
+    writer.WriteArray(data.position0);
+    writer.WriteArray(data.position1);
+    writer.WriteArray(data.normal0);
+    writer.WriteArray(data.normal1);
+    writer.WriteArray(data.st);
+    writer.WriteArray(data.colors);
+    writer.WriteArray(data.indices);
+    writer.WriteArray(data.areaFunc);
+    writer.WriteArray(data.areaCdf);
+}
+
+static void WriteEnvmap(CacheWriter &writer, const EnvmapSampleInfo &sampleInfo) {
+    CacheRecordHeader header = MakeRecordHeader(CacheRecord::Envmap);
+    header.scalars[0] = sampleInfo.normalization;
+    header.scalars[1] = sampleInfo.pixelSize[0];
+    header.scalars[2] = sampleInfo.pixelSize[1];
+    writer.Write(&header, sizeof(header));
+    writer.WriteArray(sampleInfo.cdfRows);
+    writer.WriteArray(sampleInfo.cdfCols);
+    writer.WriteArray(sampleInfo.rowWeights);
+}
+
+SceneCache::SceneCache(const std::string &filename) : filename(filename) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return;
+    }
+    file = std::make_shared<const MappedFile>(filename);
+    CacheCursor cursor(file->data, file->size);
+    SceneCacheHeader header;
+    const SceneCacheHeader expected = MakeHeader(0);
+    if (!cursor.Read(&header, sizeof(header)) ||
+        std::memcmp(&header, &expected, offsetof(SceneCacheHeader, numEntries)) != 0) {
+        std::cout << "Ignoring scene cache " << filename << " from another build" << std::endl;
+        file.reset();
+        return;
+    }
+    for (uint64_t i = 0; i < header.numEntries; i++) {
+        uint64_t keySize, dataSize;
+        const char *key, *data;
+        if (!cursor.Read(&keySize, sizeof(keySize)) || !cursor.Skip(keySize, key) ||
+            !cursor.Read(&dataSize, sizeof(dataSize)) || !cursor.Align() ||
+            !cursor.Skip(dataSize, data)) {
+            std::cout << "Ignoring truncated scene cache " << filename << std::endl;
+            entries.clear();
+            file.reset();
+            return;
+        }
+        entries[std::string(key, keySize)] = std::make_pair(data, size_t(dataSize));
+    }
+}
+
+std::shared_ptr<TriMeshData> SceneCache::Get(
+    const std::string &key,
+    const std::function<std::shared_ptr<TriMeshData>()> &load) {
+    auto it = entries.find(key);
+    std::shared_ptr<TriMeshData> data;
+    if (it != entries.end()) {
+        data = std::make_shared<TriMeshData>();
+        CacheCursor cursor(it->second.first, it->second.second);
+        CacheRecordHeader header;
+        if (cursor.Read(&header, sizeof(header)) && header.type == CacheRecord::Mesh &&
+            cursor.View(data->position0) && cursor.View(data->position1) &&
+            cursor.View(data->normal0) && cursor.View(data->normal1) && cursor.View(data->st) &&
+            cursor.View(data->colors) && cursor.View(data->indices) &&
+            cursor.View(data->areaFunc) && cursor.View(data->areaCdf)) {
+            data->isMoving = header.isMoving != 0;
+            data->areaFuncInt = header.scalars[0];
+            data->totalArea = header.scalars[1];
+            data->storage = file;
+        } else {
+            // A bad entry is loaded again and rewritten like a missing one
+            std::cerr << "[Warning] ignoring corrupted mesh in scene cache " << filename
+                      << std::endl;
+            data.reset();
+        }
+    }
+    const bool hit = data != nullptr;
+    if (!hit) {
+        data = load();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    used[key] = data;
+    if (!hit) {
+        missed = true;
+    }
+    return data;
+}
+
+std::shared_ptr<const EnvmapSampleInfo> SceneCache::GetEnvmap(
+    const std::string &key,
+    const std::function<std::shared_ptr<const EnvmapSampleInfo>()> &load) {
+    auto it = entries.find(key);
+    std::shared_ptr<const EnvmapSampleInfo> sampleInfo;
+    if (it != entries.end()) {
+        std::shared_ptr<EnvmapSampleInfo> cached = std::make_shared<EnvmapSampleInfo>();
+        CacheCursor cursor(it->second.first, it->second.second);
+        CacheRecordHeader header;
+        if (cursor.Read(&header, sizeof(header)) && header.type == CacheRecord::Envmap &&
+            cursor.View(cached->cdfRows) && cursor.View(cached->cdfCols) &&
+            cursor.View(cached->rowWeights)) {
+            cached->normalization = header.scalars[0];
+            cached->pixelSize = Vector2(header.scalars[1], header.scalars[2]);
+            cached->storage = file;
+            sampleInfo = cached;
+        } else {
+            std::cerr << "[Warning] ignoring corrupted envmap in scene cache " << filename
+                      << std::endl;
+        }
+    }
+    const bool hit = sampleInfo != nullptr;
+    if (!hit) {
+        sampleInfo = load();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    usedEnvmaps[key] = sampleInfo;
+    if (!hit) {
+        missed = true;
+    }
+    return sampleInfo;
+}
+
+void SceneCache::Write() {
+    if (!missed && used.size() + usedEnvmaps.size() == entries.size()) {
+        return;
+    }
+    // Sorted so that the same scene always gives the same file
+    std::vector<std::string> keys;
+    for (const auto &it : used) {
+        keys.push_back(it.first);
+    }
+    for (const auto &it : usedEnvmaps) {
+        keys.push_back(it.first);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    // The mapping of the old file stays valid after it is replaced, the views into it are
+    // written out as they are. Renders of the same scene that miss at the same time each write
+    // their own file and the last rename wins.
+    const std::string tmpFilename = filename + ".tmp" + std::to_string(getpid());
+    {
+        CacheWriter writer(tmpFilename);
+        const SceneCacheHeader header = MakeHeader(keys.size());
+        writer.Write(&header, sizeof(header));
+        for (const std::string &key : keys) {
+            auto mesh = used.find(key);
+            const uint64_t keySize = key.size();
+            const uint64_t dataSize = mesh != used.end() ? MeshDataSize(*mesh->second)
+                                                         : EnvmapDataSize(*usedEnvmaps[key]);
+            writer.Write(&keySize, sizeof(keySize));
+            writer.Write(key.data(), keySize);
+            writer.Write(&dataSize, sizeof(dataSize));
+            writer.Align();
+            if (mesh != used.end()) {
+                WriteMesh(writer, *mesh->second);
+            } else {
+                WriteEnvmap(writer, *usedEnvmaps[key]);
+            }
+        }
+        if (!writer.Good()) {
+            std::cerr << "[Warning] can't write scene cache " << tmpFilename << std::endl;
+            std::remove(tmpFilename.c_str());
+            return;
+        }
+    }
+    if (std::rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+        std::cerr << "[Warning] can't replace scene cache " << filename << std::endl;
+        std::remove(tmpFilename.c_str());
+        return;
+    }
+    std::cout << "Scene cache " << filename << " written with " << used.size() << " meshes and "
+              << usedEnvmaps.size() << " envmaps" << std::endl;
+}
+
+// Appends the size and modification time of _filename_ to _key_
+static void AppendFileStamp(const std::string &filename, std::string &key) {
+    struct stat st;
+    int64_t stamp[3] = {-1, 0, 0};
+    if (stat(filename.c_str(), &st) == 0) {
+        stamp[0] = int64_t(st.st_size);
+        stamp[1] = int64_t(st.st_mtim.tv_sec);
+        stamp[2] = int64_t(st.st_mtim.tv_nsec);
+    }
+    key.append(reinterpret_cast<const char *>(stamp), sizeof(stamp));
+}
+
+std::string MeshCacheKey(const std::string &type,
+                         const std::string &filename,
+                         const int shapeIndex,
+                         const Matrix4x4 &toWorld0,
+                         const Matrix4x4 &toWorld1,
+                         const bool isMoving,
+                         const bool flipNormals,
+                         const bool faceNormals,
+                         const bool emitter) {
+    std::string key = type + '\0' + filename + '\0';
+    auto append = [&](const void *bytes, const size_t size) {
+        key.append(reinterpret_cast<const char *>(bytes), size);
+    };
+    append(&shapeIndex, sizeof(shapeIndex));
+    append(toWorld0.data(), sizeof(Float) * 16);
+    append(toWorld1.data(), sizeof(Float) * 16);
+    const char flags[4] = {
+        char(isMoving), char(flipNormals), char(faceNormals), char(emitter)};
+    append(flags, sizeof(flags));
+    AppendFileStamp(filename, key);
+    return key;
+}
+
+std::string EnvmapCacheKey(const std::string &filename) {
+    std::string key = std::string("envmap") + '\0' + filename + '\0';
+    AppendFileStamp(filename, key);
+    return key;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "commondef.h"
+#include "mesh.h"
+#include "mappedfile.h"
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct EnvmapSampleInfo;
+
+// The processed meshes of a scene (transformed, with normals computed) and the sampling
+// distributions of its lights, kept in a file next to it so that renders of the same scene skip
+// computing them again. The file is mapped and the arrays handed out are views into the
+// mapping, which the returned data keeps alive. Every array starts on a 16-byte boundary and is
+// followed by 16 zero bytes, so Embree can share the positions and indices in place. Values are
+// written as their bytes, so a cache written by a build with a different Float is ignored and
+// written again.
+class SceneCache {
+    public:
+    // Maps _filename_ if it holds a cache, otherwise starts empty
+    explicit SceneCache(const std::string &filename);
+
+    // Returns the mesh stored under _key_, or calls _load_ and keeps its result for Write. A
+    // corrupted entry is loaded again the same way and rewritten.
+    // Called from the threads that load the shapes.
+    std::shared_ptr<TriMeshData> Get(const std::string &key,
+                                     const std::function<std::shared_ptr<TriMeshData>()> &load);
+    // The same for the sampling distribution of an envmap
+    std::shared_ptr<const EnvmapSampleInfo> GetEnvmap(
+        const std::string &key,
+        const std::function<std::shared_ptr<const EnvmapSampleInfo>()> &load);
+
+    // Rewrites the file with the entries asked for, if any was missing or some were not used
+    void Write();
+
+    private:
+    std::string filename;
+    std::shared_ptr<const MappedFile> file;
+    // Where the data of each entry lies in the mapping
+    std::unordered_map<std::string, std::pair<const char *, size_t>> entries;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<const TriMeshData>> used;
+    std::unordered_map<std::string, std::shared_ptr<const EnvmapSampleInfo>> usedEnvmaps;
+    bool missed = false;
+};
+
+// Identifies a mesh by the arguments of its loader and the size and modification time of the
+// file it is loaded from
+std::string MeshCacheKey(const std::string &type,
+                         const std::string &filename,
+                         const int shapeIndex,
+                         const Matrix4x4 &toWorld0,
+                         const Matrix4x4 &toWorld1,
+                         const bool isMoving,
+                         const bool flipNormals,
+                         const bool faceNormals,
+                         const bool emitter);
+
+// Identifies the distribution of an envmap by the size and modification time of its image
+std::string EnvmapCacheKey(const std::string &filename);
@@ -9,8 +9,12 @@
 #include <embree3/rtcore.h>
 #include <embree3/rtcore_ray.h>
 
+#include <memory>
+#include <vector>
+
 struct AreaLight;
 struct BSDF;
+struct Shape;
 
 enum class ShapeType { TriangleMesh };
 
@@ -26,11 +30,38 @@ struct TIntersection {
 using Intersection = TIntersection<Float>;
 using ADIntersection = TIntersection<ADFloat>;
 
+// The shapes of a Mitsuba shapegroup, in the space of the group. Embree traces them through one
+// scene of their own that every instance of the group references with its transform.
+struct ShapeGroup {
+    std::vector<std::shared_ptr<const Shape>> shapes;
+};
+
+// One placement of a shape group. The shapes of an instance follow each other in Scene::objects,
+// in the order of the group, and share this object.
+struct GroupInstance {
+    GroupInstance(const std::shared_ptr<const ShapeGroup> &group, const Matrix4x4 &toWorld)
+        : group(group), toWorld(toWorld), invToWorld(toWorld.inverse()) {
+    }
+
+    const std::shared_ptr<const ShapeGroup> group;
+    const Matrix4x4 toWorld;
+    const Matrix4x4 invToWorld;
+};
+
 struct Shape {
     Shape(const std::shared_ptr<const BSDF> bsdf) : bsdf(bsdf), areaLight(nullptr) {
     }
     virtual ShapeType GetType() const = 0;
-    virtual ShapeID RtcRegister(const RTCScene &scene, const RTCDevice &device) const = 0;
+    // Creates and commits the Embree geometry of the shape, may run on several threads at once
+    virtual RTCGeometry RtcNewGeometry(const RTCDevice &device) const = 0;
+    // The shape placed by _instance_, this shape being one of its group. It answers every query
+    // in world space and shares the data of this shape.
+    virtual std::shared_ptr<const Shape> Instantiate(
+        const std::shared_ptr<const GroupInstance> &instance) const = 0;
+    // The instance this shape belongs to, nullptr for a shape that is not instanced
+    virtual const GroupInstance *GetGroupInstance() const {
+        return nullptr;
+    }
     virtual void Serialize(const PrimID primID, Float *buffer) const = 0;
     virtual bool Intersect(const PrimID &primID,
                            const Float time,
@@ -1,4 +1,5 @@
 #include "trianglemesh.h"
+#include "transform.h"
 
 int GetTriangleMeshSerializedSize() {
     return 1 +                    // type
@@ -22,11 +23,56 @@ BBox ComputeBBox(const std::shared_ptr<TriMeshData> data) {
     return bbox;
 }
 
+// The box around the corners of _bbox_ after _xform_
+static BBox XformBBox(const Matrix4x4 &xform, const BBox &bbox) {
+    BBox ret;
+    for (int corner = 0; corner < 8; corner++) {
+        const Vector3 p((corner & 1) ? bbox.pMax[0] : bbox.pMin[0],
+                        (corner & 2) ? bbox.pMax[1] : bbox.pMin[1],
+                        (corner & 4) ? bbox.pMax[2] : bbox.pMin[2]);
+        ret = Grow(ret, XformPoint(xform, p));
+    }
+    return ret;
+}
+
 TriangleMesh::TriangleMesh(const std::shared_ptr<const BSDF> bsdf,
                            const std::shared_ptr<TriMeshData> data)
     : Shape(bsdf), data(data), bbox(ComputeBBox(data)) {
 }
 
+TriangleMesh::TriangleMesh(const TriangleMesh &prototype,
+                           const std::shared_ptr<const GroupInstance> &instance)
+    : Shape(prototype.bsdf), data(prototype.data), instance(instance),
+      bbox(XformBBox(instance->toWorld, prototype.bbox)) {
+}
+
+std::shared_ptr<const Shape> TriangleMesh::Instantiate(
+    const std::shared_ptr<const GroupInstance> &instance) const {
+    return std::make_shared<TriangleMesh>(*this, instance);
+}
+
+void TriangleMesh::GetTriangle(const PrimID primID, Triangle &tri) const {
+    assert(primID < int(data->indices.size()));
+    const TriIndex &index = data->indices[primID];
+    for (int i = 0; i < 3; i++) {
+        tri.p[0][i] = &data->position0[index.index[i]];
+        tri.p[1][i] = &data->position1[index.index[i]];
+        tri.n[0][i] = &data->normal0[index.index[i]];
+        tri.n[1][i] = &data->normal1[index.index[i]];
+    }
+    // Only the meshes of an instance pay for a transform, the others are read in place
+    if (instance) {
+        for (int t = 0; t < 2; t++) {
+            for (int i = 0; i < 3; i++) {
+                tri.xformed[0][t][i] = XformPoint(instance->toWorld, *tri.p[t][i]);
+                tri.xformed[1][t][i] = XformNormal(instance->invToWorld, *tri.n[t][i]);
+                tri.p[t][i] = &tri.xformed[0][t][i];
+                tri.n[t][i] = &tri.xformed[1][t][i];
+            }
+        }
+    }
+}
+
 static inline bool TriangleIntersect(const RaySegment &raySeg,
                                      const Vector3 &p0,
                                      const Vector3 &e1,
@@ -104,62 +150,59 @@ void TriangleIntersect(const TRay<FloatType> &ray,
     isect.shadingNormal = Normalize(TVector3<FloatType>(w * n0 + uv[0] * n1 + uv[1] * n2));
 }
 
-ShapeID TriangleMesh::RtcRegister(const RTCScene &rtcScene, const RTCDevice &rtcDevice) const {
-    struct Vertex {
-        float x, y, z, a;
-    };
-    struct Index {
-        uint32_t v0, v1, v2;
-    };
-    
+RTCGeometry TriangleMesh::RtcNewGeometry(const RTCDevice &rtcDevice) const {
+    if (instance) {
+        Error("The meshes of an instance are traced through the scene of their group");
+    }
     RTCGeometry geom_0 = rtcNewGeometry(rtcDevice, RTC_GEOMETRY_TYPE_TRIANGLE); // EMBREE_FIXME: check if geometry gets properly committed
      rtcSetGeometryBuildQuality(geom_0,RTC_BUILD_QUALITY_MEDIUM);
      rtcSetGeometryTimeStepCount(geom_0,data->isMoving ? 2 : 1);
-    ShapeID geomID = rtcAttachGeometry(rtcScene,geom_0);
-     rtcReleaseGeometry(geom_0);
 
-    if (!data->isMoving) {
-        Vertex *vertices = (Vertex *)rtcSetNewGeometryBuffer(geom_0,RTC_BUFFER_TYPE_VERTEX,0,RTC_FORMAT_FLOAT3,4*sizeof(float),data->position0.size());
-        for (const auto &p : data->position0)
+    const int numTimeSteps = data->isMoving ? 2 : 1;
+    const VertexBuffer *positions[2] = {&data->position0, &data->position1};
+    static_assert(sizeof(TriIndex) == 3 * sizeof(uint32_t), "Embree UINT3 layout");
+#if defined(SINGLE_PRECISION)
+    // The buffers of data are used in place, data outlives the scene that holds the geometry
+    static_assert(sizeof(Vector3) == 3 * sizeof(float), "Embree FLOAT3 layout");
+    for (int t = 0; t < numTimeSteps; t++) {
+        rtcSetSharedGeometryBuffer(geom_0,RTC_BUFFER_TYPE_VERTEX,t,RTC_FORMAT_FLOAT3,positions[t]->data(),0,sizeof(Vector3),positions[t]->size());
+    }
+#else
+    // Embree only takes float positions
+    struct Vertex {
+        float x, y, z, a;
+    };
+    for (int t = 0; t < numTimeSteps; t++) {
+        Vertex *vertices = (Vertex *)rtcSetNewGeometryBuffer(geom_0,RTC_BUFFER_TYPE_VERTEX,t,RTC_FORMAT_FLOAT3,4*sizeof(float),positions[t]->size());
+        for (const auto &p : *positions[t])
             *vertices++ = Vertex{float(p[0]), float(p[1]), float(p[2]), 0.0f};
-        
-    } else {
-        Vertex *vertices0 = (Vertex *)rtcSetNewGeometryBuffer(geom_0,RTC_BUFFER_TYPE_VERTEX,0,RTC_FORMAT_FLOAT3,4*sizeof(float),data->position0.size());
-        for (const auto &p : data->position0)
-            *vertices0++ = Vertex{float(p[0]), float(p[1]), float(p[2]), 0.0f};
-        
-        Vertex *vertices1 = (Vertex *)rtcSetNewGeometryBuffer(geom_0,RTC_BUFFER_TYPE_VERTEX,1,RTC_FORMAT_FLOAT3,4*sizeof(float),data->position0.size());
-        for (const auto &p : data->position1)
-            *vertices1++ = Vertex{float(p[0]), float(p[1]), float(p[2]), 0.0f};
-        
     }
+#endif
+    rtcSetSharedGeometryBuffer(geom_0,RTC_BUFFER_TYPE_INDEX,0,RTC_FORMAT_UINT3,data->indices.data(),0,sizeof(TriIndex),data->indices.size());
 
-    Index *indices = (Index *)rtcSetNewGeometryBuffer(geom_0,RTC_BUFFER_TYPE_INDEX,0,RTC_FORMAT_UINT3,3*sizeof(int),data->indices.size());
-    for (const auto &i : data->indices)
-        *indices++ = Index{i.index[0], i.index[1], i.index[2]};
-    
     rtcCommitGeometry(geom_0);
-    return geomID;
+    return geom_0;
 }
 
 void TriangleMesh::Serialize(const PrimID primID, Float *buffer) const {
     buffer = ::Serialize((Float)ShapeType::TriangleMesh, buffer);
 
     buffer = ::Serialize((Float)data->isMoving, buffer);
-    assert(primID < int(data->indices.size()));
     const TriIndex &index = data->indices[primID];
-    const Vector3 &p0_0 = data->position0[index.index[0]];
-    const Vector3 &p1_0 = data->position0[index.index[1]];
-    const Vector3 &p2_0 = data->position0[index.index[2]];
-    const Vector3 &n0_0 = data->normal0[index.index[0]];
-    const Vector3 &n1_0 = data->normal0[index.index[1]];
-    const Vector3 &n2_0 = data->normal0[index.index[2]];
-    const Vector3 &p0_1 = data->position1[index.index[0]];
-    const Vector3 &p1_1 = data->position1[index.index[1]];
-    const Vector3 &p2_1 = data->position1[index.index[2]];
-    const Vector3 &n0_1 = data->normal1[index.index[0]];
-    const Vector3 &n1_1 = data->normal1[index.index[1]];
-    const Vector3 &n2_1 = data->normal1[index.index[2]];
+    Triangle tri;
+    GetTriangle(primID, tri);
+    const Vector3 &p0_0 = *tri.p[0][0];
+    const Vector3 &p1_0 = *tri.p[0][1];
+    const Vector3 &p2_0 = *tri.p[0][2];
+    const Vector3 &n0_0 = *tri.n[0][0];
+    const Vector3 &n1_0 = *tri.n[0][1];
+    const Vector3 &n2_0 = *tri.n[0][2];
+    const Vector3 &p0_1 = *tri.p[1][0];
+    const Vector3 &p1_1 = *tri.p[1][1];
+    const Vector3 &p2_1 = *tri.p[1][2];
+    const Vector3 &n0_1 = *tri.n[1][0];
+    const Vector3 &n1_1 = *tri.n[1][1];
+    const Vector3 &n2_1 = *tri.n[1][2];
     buffer = ::Serialize(p0_0, buffer);
     buffer = ::Serialize(Vector3(p1_0 - p0_0), buffer);
     buffer = ::Serialize(Vector3(p2_0 - p0_0), buffer);
@@ -192,18 +235,20 @@ bool TriangleMesh::Intersect(const PrimID &primID,
                              Intersection &isect,
                              Vector2 &st) const {
     const TriIndex &index = data->indices[primID];
-    const Vector3 &p0_0 = data->position0[index.index[0]];
-    const Vector3 &p1_0 = data->position0[index.index[1]];
-    const Vector3 &p2_0 = data->position0[index.index[2]];
-    const Vector3 &n0_0 = data->normal0[index.index[0]];
-    const Vector3 &n1_0 = data->normal0[index.index[1]];
-    const Vector3 &n2_0 = data->normal0[index.index[2]];
-    const Vector3 &p0_1 = data->position1[index.index[0]];
-    const Vector3 &p1_1 = data->position1[index.index[1]];
-    const Vector3 &p2_1 = data->position1[index.index[2]];
-    const Vector3 &n0_1 = data->normal1[index.index[0]];
-    const Vector3 &n1_1 = data->normal1[index.index[1]];
-    const Vector3 &n2_1 = data->normal1[index.index[2]];
+    Triangle tri;
+    GetTriangle(primID, tri);
+    const Vector3 &p0_0 = *tri.p[0][0];
+    const Vector3 &p1_0 = *tri.p[0][1];
+    const Vector3 &p2_0 = *tri.p[0][2];
+    const Vector3 &n0_0 = *tri.n[0][0];
+    const Vector3 &n1_0 = *tri.n[0][1];
+    const Vector3 &n2_0 = *tri.n[0][2];
+    const Vector3 &p0_1 = *tri.p[1][0];
+    const Vector3 &p1_1 = *tri.p[1][1];
+    const Vector3 &p2_1 = *tri.p[1][2];
+    const Vector3 &n0_1 = *tri.n[1][0];
+    const Vector3 &n1_1 = *tri.n[1][1];
+    const Vector3 &n2_1 = *tri.n[1][2];
     Vector2 uv;
     if (!data->isMoving) {
         if (!TriangleIntersect(
@@ -255,13 +300,14 @@ Vector2 Barycentric(const Vector3 &position,
 Vector2 TriangleMesh::GetSampleParam(const PrimID &primID,
                                      const Vector3 &position,
                                      const Float time) const {
-    const TriIndex &index = data->indices[primID];
-    const Vector3 &p0_0 = data->position0[index.index[0]];
-    const Vector3 &p1_0 = data->position0[index.index[1]];
-    const Vector3 &p2_0 = data->position0[index.index[2]];
-    const Vector3 &p0_1 = data->position1[index.index[0]];
-    const Vector3 &p1_1 = data->position1[index.index[1]];
-    const Vector3 &p2_1 = data->position1[index.index[2]];
+    Triangle tri;
+    GetTriangle(primID, tri);
+    const Vector3 &p0_0 = *tri.p[0][0];
+    const Vector3 &p1_0 = *tri.p[0][1];
+    const Vector3 &p2_0 = *tri.p[0][2];
+    const Vector3 &p0_1 = *tri.p[1][0];
+    const Vector3 &p1_1 = *tri.p[1][1];
+    const Vector3 &p2_1 = *tri.p[1][2];
 
     Vector2 b;
     if (!data->isMoving) {
@@ -289,20 +335,49 @@ Vector2 TriangleMesh::GetSampleParam(const PrimID &primID,
 }
 
 void TriangleMesh::SetAreaLight(const AreaLight *areaLight) {
+    if (instance) {
+        Error("Instanced shapes cannot be area lights");
+    }
     Shape::SetAreaLight(areaLight);
-    std::vector<Float> area(data->indices.size());
-    totalArea = Float(0.0);
+    const int count = int(data->indices.size());
+    if (data->areaCdf.size() == size_t(count) + 1) {
+        // Computed by the loader or taken from the scene cache
+        totalArea = data->totalArea;
+        areaDist = std::unique_ptr<PiecewiseConstant1D>(new PiecewiseConstant1D(
+            data->areaFunc.data(), data->areaCdf.data(), data->areaFuncInt, count));
+        return;
+    }
+    // A mesh that was not loaded by the scene parser, the distribution is computed from views of
+    // its arrays
+    TriMeshData areas;
+    areas.position0 = VertexBuffer(data->position0.data(), data->position0.size());
+    areas.indices = TriIndexBuffer(data->indices.data(), data->indices.size());
+    ComputeAreaDistribution(areas);
+    totalArea = areas.totalArea;
+    areaDist = std::unique_ptr<PiecewiseConstant1D>(new PiecewiseConstant1D(
+        areas.areaFunc.data(), count));
+}
+
+void ComputeAreaDistribution(TriMeshData &data) {
+    // Read through const references, which leaves views as they are
+    const VertexBuffer &positions = data.position0;
+    const TriIndexBuffer &indices = data.indices;
+    std::vector<Float> area(indices.size());
+    data.totalArea = Float(0.0);
     // Currently we do not allow light sources that has varying area over time
     for (size_t i = 0; i < area.size(); i++) {
-        const Vector3 &p0 = data->position0[data->indices[i].index[0]];
-        const Vector3 &p1 = data->position0[data->indices[i].index[1]];
-        const Vector3 &p2 = data->position0[data->indices[i].index[2]];
+        const Vector3 &p0 = positions[indices[i].index[0]];
+        const Vector3 &p1 = positions[indices[i].index[1]];
+        const Vector3 &p2 = positions[indices[i].index[2]];
         const Vector3 e1 = p1 - p0;
         const Vector3 e2 = p2 - p0;
         area[i] = Float(0.5) * Length(Cross(e1, e2));
-        totalArea += area[i];
+        data.totalArea += area[i];
     }
-    areaDist = std::unique_ptr<PiecewiseConstant1D>(new PiecewiseConstant1D(&area[0], area.size()));
+    const PiecewiseConstant1D dist(&area[0], area.size());
+    data.areaFunc.assign(dist.func, dist.func + area.size());
+    data.areaCdf.assign(dist.cdf, dist.cdf + area.size() + 1);
+    data.areaFuncInt = dist.funcInt;
 }
 
 PrimID TriangleMesh::Sample(const Float u) const {
@@ -332,19 +407,20 @@ void TriangleMesh::Sample(const Vector2 rndParam,
                           Vector3 &position,
                           Vector3 &normal,
                           Float *pdf) const {
-    const TriIndex &index = data->indices[primID];
-    const Vector3 &p0_0 = data->position0[index.index[0]];
-    const Vector3 &p1_0 = data->position0[index.index[1]];
-    const Vector3 &p2_0 = data->position0[index.index[2]];
-    const Vector3 &n0_0 = data->normal0[index.index[0]];
-    const Vector3 &n1_0 = data->normal0[index.index[1]];
-    const Vector3 &n2_0 = data->normal0[index.index[2]];
-    const Vector3 &p0_1 = data->position1[index.index[0]];
-    const Vector3 &p1_1 = data->position1[index.index[1]];
-    const Vector3 &p2_1 = data->position1[index.index[2]];
-    const Vector3 &n0_1 = data->normal1[index.index[0]];
-    const Vector3 &n1_1 = data->normal1[index.index[1]];
-    const Vector3 &n2_1 = data->normal1[index.index[2]];
+    Triangle tri;
+    GetTriangle(primID, tri);
+    const Vector3 &p0_0 = *tri.p[0][0];
+    const Vector3 &p1_0 = *tri.p[0][1];
+    const Vector3 &p2_0 = *tri.p[0][2];
+    const Vector3 &n0_0 = *tri.n[0][0];
+    const Vector3 &n1_0 = *tri.n[0][1];
+    const Vector3 &n2_0 = *tri.n[0][2];
+    const Vector3 &p0_1 = *tri.p[1][0];
+    const Vector3 &p1_1 = *tri.p[1][1];
+    const Vector3 &p2_1 = *tri.p[1][2];
+    const Vector3 &n0_1 = *tri.n[1][0];
+    const Vector3 &n1_1 = *tri.n[1][1];
+    const Vector3 &n2_1 = *tri.n[1][2];
     if (!data->isMoving) {
         const Vector3 e1_0 = p1_0 - p0_0;
         const Vector3 e2_0 = p2_0 - p0_0;
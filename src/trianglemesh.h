@@ -8,10 +8,17 @@ int GetTriangleMeshSerializedSize();
 
 struct TriangleMesh : public Shape {
     TriangleMesh(const std::shared_ptr<const BSDF> bsdf, const std::shared_ptr<TriMeshData> data);
+    // A mesh of _instance_ with the data and material of _prototype_ from its group
+    TriangleMesh(const TriangleMesh &prototype, const std::shared_ptr<const GroupInstance> &instance);
     ShapeType GetType() const override {
         return ShapeType::TriangleMesh;
     }
-    ShapeID RtcRegister(const RTCScene &scene, const RTCDevice &device) const override;
+    RTCGeometry RtcNewGeometry(const RTCDevice &device) const override;
+    std::shared_ptr<const Shape> Instantiate(
+        const std::shared_ptr<const GroupInstance> &instance) const override;
+    const GroupInstance *GetGroupInstance() const override {
+        return instance.get();
+    }
     void Serialize(const PrimID primID, Float *buffer) const override;
     bool Intersect(const PrimID &primID,
                    const Float time,
@@ -39,7 +46,19 @@ struct TriangleMesh : public Shape {
         return data->isMoving;
     }
 
+    // The corners and vertex normals of a triangle in world space, at the start (0) and the end
+    // (1) of the shutter interval. They point into data, or into xformed for the meshes of an
+    // instance.
+    struct Triangle {
+        const Vector3 *p[2][3];
+        const Vector3 *n[2][3];
+        Vector3 xformed[2][2][3];
+    };
+    void GetTriangle(const PrimID primID, Triangle &tri) const;
+
     const std::shared_ptr<const TriMeshData> data;
+    // Set for the meshes of an instance, data is then in the space of the group
+    const std::shared_ptr<const GroupInstance> instance;
     const BBox bbox;
     // Only used when the mesh is associated with an area light
     Float totalArea;
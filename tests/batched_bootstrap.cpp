@@ -0,0 +1,119 @@
+#include "parsescene.h"
+#include "mlt.h"
+#include "texturesystem.h"
+#include "parallel.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+using namespace std;
+
+// Embree's stream kernels are not guaranteed to pick the same primitive as rtcIntersect1 when
+// two hits are within rounding of each other, a path that takes such a hit differently goes on
+// as another path. Up to this fraction of the paths may differ when their rays are streamed.
+static const double c_StreamTolerance = 1e-2;
+
+template <typename T>
+static bool SameBits(const T &a, const T &b) {
+    return std::memcmp(&a, &b, sizeof(T)) == 0;
+}
+
+static bool SameContrib(const SubpathContrib &a, const SubpathContrib &b) {
+    return a.camDepth == b.camDepth && a.lightDepth == b.lightDepth &&
+           SameBits(a.screenPos[0], b.screenPos[0]) && SameBits(a.screenPos[1], b.screenPos[1]) &&
+           SameBits(a.contrib[0], b.contrib[0]) && SameBits(a.contrib[1], b.contrib[1]) &&
+           SameBits(a.contrib[2], b.contrib[2]) && SameBits(a.lsScore, b.lsScore) &&
+           SameBits(a.ssScore, b.ssScore) && SameBits(a.lensScore, b.lensScore) &&
+           SameBits(a.misWeight, b.misWeight);
+}
+
+static bool SameContribs(const std::vector<SubpathContrib> &a,
+                         const std::vector<SubpathContrib> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (!SameContrib(a[i], b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Generates _numBatches_ batches of paths with GeneratePathBidirBatch, seeded like the MLT
+// bootstrap seeds them, and returns the number of paths whose contributions or random number
+// use differ from GeneratePathBidir with the same generator
+static int DifferentPaths(const Scene *scene,
+                          const int batch,
+                          const int numBatches,
+                          const bool streamQueries) {
+    const int minDepth = std::max(scene->options->minDepth, 3);
+    const int maxDepth = scene->options->maxDepth;
+    RNG rng(scene->options->seedOffset);
+    std::vector<RNG> rngs;
+    std::vector<Path> paths;
+    std::vector<std::vector<SubpathContrib>> contribs;
+    Path path;
+    std::vector<SubpathContrib> scalarContribs;
+    int different = 0;
+    for (int b = 0; b < numBatches; b++) {
+        rngs.clear();
+        for (int i = 0; i < batch; i++) {
+            rngs.push_back(PathRNG(rng));
+        }
+        const std::vector<RNG> seeds = rngs;
+        paths.resize(batch);
+        for (Path &batchPath : paths) {
+            Clear(batchPath);
+        }
+        GeneratePathBidirBatch(
+            scene, Vector2i(-1, -1), minDepth, maxDepth, paths, contribs, rngs, streamQueries);
+        for (int i = 0; i < batch; i++) {
+            RNG scalarRng = seeds[i];
+            Clear(path);
+            scalarContribs.clear();
+            GeneratePathBidir(
+                scene, Vector2i(-1, -1), minDepth, maxDepth, path, scalarContribs, scalarRng);
+            if (!SameContribs(scalarContribs, contribs[i]) || !(scalarRng == rngs[i])) {
+                different++;
+            }
+        }
+    }
+    return different;
+}
+
+// Generates bootstrap paths one by one and in batches, and checks that the batches give
+// bit-identical contributions when their rays are traced one by one, and nearly the same when
+// they are streamed:
+//   batched_bootstrap scene.xml batch
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        cerr << "usage: batched_bootstrap scene.xml batch" << endl;
+        return 1;
+    }
+    string filename = argv[1];
+    const int batch = stoi(string(argv[2]));
+    const int numBatches = 64;
+    TextureSystem::Init();
+    if (filename.rfind('/') != string::npos) {
+        if (chdir(filename.substr(0, filename.rfind('/')).c_str()) != 0) {
+            Error("chdir failed");
+        }
+        filename = filename.substr(filename.rfind('/') + 1);
+    }
+    std::unique_ptr<Scene> scene = ParseScene(filename);
+
+    const int numPaths = batch * numBatches;
+    const int differentScalar = DifferentPaths(scene.get(), batch, numBatches, false);
+    const int differentStream = DifferentPaths(scene.get(), batch, numBatches, true);
+    const int allowed = int(c_StreamTolerance * numPaths);
+    cout << numPaths << " paths in batches of " << batch << ": " << differentScalar
+         << " differ with scalar queries, " << differentStream << " with stream queries ("
+         << allowed << " allowed)" << endl;
+
+    TextureSystem::Destroy();
+    TerminateWorkerThreads();
+    return differentScalar == 0 && differentStream <= allowed ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+#include "commondef.h"
+#include "utils.h"
+#include "timer.h"
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+using namespace chad;
+
+using dervsig = void (*)(const float *, const float, const float *, float *, float *);
+using batchsig = void (*)(const int, const float *, const float *, const float *, float *, float *);
+
+static const int c_Dim = 9;
+static const int c_SceneSize = 4;
+
+// A chain of three vertices with scene-dependent attenuation, shaped like the path throughput
+// functions: the vertices and the scale differ between paths, the scene parameters are shared
+static std::shared_ptr<Function> BuildBenchFunc(const std::string &name,
+                                                ADFloat &logThroughput,
+                                                ExpressionCPtrVec &xParams) {
+    Argument x("x", c_Dim);
+    Argument scale("scale");
+    Argument scene("scene", c_SceneSize);
+    auto func = BeginFunction(name, {x, scale, scene});
+    xParams = x.GetExprVec();
+    ExpressionCPtrVec sceneParams = scene.GetExprVec();
+    ADFloat throughput = ADFloat(scale.GetExpr());
+    for (int i = 0; i + 1 < c_Dim / 3; i++) {
+        const ADFloat dx = xParams[3 * i + 3] - xParams[3 * i];
+        const ADFloat dy = xParams[3 * i + 4] - xParams[3 * i + 1];
+        const ADFloat dz = xParams[3 * i + 5] - xParams[3 * i + 2] + ADFloat(sceneParams[0]);
+        const ADFloat dist = length3d(dx, dy, dz);
+        const ADFloat cosTheta = fabs(dz / dist);
+        std::vector<CondExprCPtr> ret = CreateCondExprVec(1);
+        BeginIf(Gt(xParams[3 * i], 0.f), ret);
+        { SetCondOutput({cosTheta * ADFloat(sceneParams[1])}); }
+        BeginElse();
+        { SetCondOutput({cosTheta * cosTheta + ADFloat(sceneParams[2])}); }
+        EndIf();
+        throughput = throughput * fmax(ADFloat(ret[0]), Const<ADFloat>(1e-2f)) *
+                     exp(-ADFloat(sceneParams[3]) * dist) / square(dist);
+    }
+    logThroughput = log(throughput);
+    EndFunction({{"y", {logThroughput}}});
+    return func;
+}
+
+static float RelativeError(const float a, const float b) {
+    // std::max drops NaNs, so a NaN in only one of the entries counts as the largest error
+    if (std::isnan(a) != std::isnan(b)) {
+        return std::numeric_limits<float>::infinity();
+    }
+    return std::isnan(a) ? 0.f : std::fabs(a - b) / std::max(std::fabs(a), 1.f);
+}
+
+template <typename Eval>
+static Float TimePerPath(const Eval &eval, const int count) {
+    // Warm up the caches and the vector math library before timing
+    eval();
+    Timer timer;
+    Tick(timer);
+    eval();
+    return Tick(timer) / Float(count);
+}
+
+int main(int argc, char *argv[]) {
+    const char *libpath = getenv("DPT_LIBPATH");
+    const int count = argc > 1 ? std::stoi(argv[1]) : 4096;
+
+    // The batched entries are C, so the kernels are emitted as C as well to run without ISPC
+    Library library(libpath != nullptr ? libpath : "/tmp", "batchbench", Library::Backend::Cached);
+    const BatchSignature batch{{"scene"}};
+    {
+        ADFloat y;
+        ExpressionCPtrVec xParams;
+        auto func = BuildBenchFunc("batchbench", y, xParams);
+        library.RegisterFuncDerv(func, xParams, y, false, &batch);
+    }
+    {
+        ADFloat y;
+        ExpressionCPtrVec xParams;
+        auto func = BuildBenchFunc("batchbench2", y, xParams);
+        library.RegisterFuncDerv2(func, xParams, y, false, &batch);
+    }
+    library.Link();
+    dervsig derv = (dervsig)library.GetFuncDerv("batchbench");
+    batchsig dervBatch = (batchsig)library.GetFuncDervBatch("batchbench");
+    dervsig derv2 = (dervsig)library.GetFuncDerv("batchbench2");
+    batchsig derv2Batch = (batchsig)library.GetFuncDervBatch("batchbench2");
+    if (derv == nullptr || dervBatch == nullptr || derv2 == nullptr || derv2Batch == nullptr) {
+        cerr << "missing function" << endl;
+        return 1;
+    }
+
+    RNG rng(7);
+    std::uniform_real_distribution<float> uniDist(-1.f, 1.f);
+    const std::vector<float> scene = {1.f, 0.8f, 0.1f, 0.1f};
+    std::vector<float> inputs(count * c_Dim), inputsSoA(count * c_Dim), scales(count);
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < c_Dim; j++) {
+            inputs[i * c_Dim + j] = inputsSoA[j * count + i] = uniDist(rng);
+        }
+        scales[i] = 1.5f + uniDist(rng);
+    }
+
+    std::vector<float> grad(count * c_Dim), hess(count * c_Dim * c_Dim);
+    std::vector<float> batchGrad(count * c_Dim), batchHess(count * c_Dim * c_Dim);
+    const Float singleTime = TimePerPath([&]() {
+        for (int i = 0; i < count; i++) {
+            derv(&inputs[i * c_Dim],
+                 scales[i],
+                 &scene[0],
+                 &grad[i * c_Dim],
+                 &hess[i * c_Dim * c_Dim]);
+        }
+    }, count);
+    const Float batchTime = TimePerPath([&]() {
+        dervBatch(count, &inputsSoA[0], &scales[0], &scene[0], &batchGrad[0], &batchHess[0]);
+    }, count);
+    std::vector<float> grad2(count * c_Dim), batchGrad2(count * c_Dim);
+    const Float singleTime2 = TimePerPath([&]() {
+        for (int i = 0; i < count; i++) {
+            derv2(&inputs[i * c_Dim], scales[i], &scene[0], &grad2[i * c_Dim], nullptr);
+        }
+    }, count);
+    const Float batchTime2 = TimePerPath([&]() {
+        derv2Batch(count, &inputsSoA[0], &scales[0], &scene[0], &batchGrad2[0], nullptr);
+    }, count);
+
+    // The batched entries return structures of arrays
+    float maxError = 0.f;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < c_Dim; j++) {
+            maxError = std::max(maxError, RelativeError(grad[i * c_Dim + j], batchGrad[j * count + i]));
+            maxError =
+                std::max(maxError, RelativeError(grad2[i * c_Dim + j], batchGrad2[j * count + i]));
+        }
+        for (int j = 0; j < c_Dim * c_Dim; j++) {
+            maxError = std::max(
+                maxError, RelativeError(hess[i * c_Dim * c_Dim + j], batchHess[j * count + i]));
+        }
+    }
+
+    cout << "gradient and Hessian: single " << singleTime * Float(1e9) << " ns, batched "
+         << batchTime * Float(1e9) << " ns per path, speedup " << singleTime / batchTime << endl;
+    cout << "gradient: single " << singleTime2 * Float(1e9) << " ns, batched "
+         << batchTime2 * Float(1e9) << " ns per path, speedup " << singleTime2 / batchTime2
+         << endl;
+    cout << "max relative difference: " << maxError << endl;
+
+    return maxError < 1e-3f ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+#include "commondef.h"
+#include "utils.h"
+#include "timer.h"
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+using namespace chad;
+
+using dervsig = void (*)(const float *, float *, float *);
+
+static const int c_Dim = 12;
+
+// A chain of vertices whose geometry terms and branch-dependent factors share subexpressions,
+// like the path throughput functions do
+static std::shared_ptr<Function> BuildBenchFunc(const std::string &name,
+                                                ADFloat &logThroughput,
+                                                ExpressionCPtrVec &xParams) {
+    Argument x("x", c_Dim);
+    auto func = BeginFunction(name, {x});
+    xParams = x.GetExprVec();
+    ADFloat throughput = Const<ADFloat>(1.f);
+    for (int i = 0; i + 1 < c_Dim / 3; i++) {
+        const ADFloat dx = xParams[3 * i + 3] - xParams[3 * i];
+        const ADFloat dy = xParams[3 * i + 4] - xParams[3 * i + 1];
+        const ADFloat dz = xParams[3 * i + 5] - xParams[3 * i + 2] + 1.f;
+        const ADFloat dist = length3d(dx, dy, dz);
+        const ADFloat cosTheta = fabs(dz / dist);
+        std::vector<CondExprCPtr> ret = CreateCondExprVec(2);
+        BeginIf(Gt(xParams[3 * i], 0.f), ret);
+        {
+            const ADFloat rough = fabs(dx * dist) + cosTheta * dist;
+            SetCondOutput({rough * dist, sqrt(square(dx) + 1.f)});
+        }
+        BeginElseIf(Gt(xParams[3 * i + 1], 0.2f));
+        { SetCondOutput({cosTheta * dist * 0.5f, sqrt(square(dx) + 1.f) + dist}); }
+        BeginElse();
+        { SetCondOutput({cosTheta, Const<ADFloat>(2.f)}); }
+        EndIf();
+        throughput = throughput * fmax(ADFloat(ret[0]), Const<ADFloat>(1e-2f)) *
+                     exp(-0.1f * dist) / square(dist) * ADFloat(ret[1]);
+    }
+    logThroughput = log(throughput);
+    EndFunction({{"y", {logThroughput}}});
+    return func;
+}
+
+struct Result {
+    SimplifyStats stats;
+    size_t sourceSize;
+    Float compileTime;
+    Float runTime;
+    std::shared_ptr<Library> library;
+    dervsig derv;
+};
+
+static Result Measure(const std::string &libpath,
+                      const bool simplify,
+                      const std::vector<float> &inputs) {
+    const std::string name = simplify ? "simplified" : "unsimplified";
+    SetSimplifyExprs(simplify);
+    Result result;
+    ADFloat y;
+    ExpressionCPtrVec xParams;
+    {
+        std::stringstream ss;
+        auto func = BuildBenchFunc(name, y, xParams);
+        const SimplifyStats start = GetSimplifyStats();
+        EmitGradHessian(func, xParams, y, ss, false);
+        result.stats.nodesBefore = GetSimplifyStats().nodesBefore - start.nodesBefore;
+        result.stats.nodesAfter = GetSimplifyStats().nodesAfter - start.nodesAfter;
+        result.sourceSize = ss.str().size();
+    }
+
+    // A library left over from an earlier run would be loaded instead of the new one
+    std::remove((libpath + "/" + name + ".so").c_str());
+    result.library = std::make_shared<Library>(libpath, name);
+    auto func = BuildBenchFunc(name, y, xParams);
+    Timer timer;
+    Tick(timer);
+    result.library->RegisterFuncDerv(func, xParams, y, false);
+    result.library->Link();
+    result.compileTime = Tick(timer);
+    result.derv = (dervsig)result.library->GetFuncDerv(name);
+    if (result.derv == nullptr) {
+        return result;
+    }
+
+    float grad[c_Dim], hess[c_Dim * c_Dim];
+    const int count = int(inputs.size()) / c_Dim;
+    Tick(timer);
+    for (int i = 0; i < count; i++) {
+        result.derv(&inputs[i * c_Dim], grad, hess);
+    }
+    result.runTime = Tick(timer) / Float(count);
+    return result;
+}
+
+static float RelativeError(const float a, const float b) {
+    return std::fabs(a - b) / std::max(std::fabs(a), 1.f);
+}
+
+int main(int argc, char *argv[]) {
+    const char *libpath = getenv("DPT_LIBPATH");
+    const int count = argc > 1 ? std::stoi(argv[1]) : 20000;
+
+    RNG rng(7);
+    std::uniform_real_distribution<float> uniDist(-1.f, 1.f);
+    std::vector<float> inputs(count * c_Dim);
+    for (auto &input : inputs) {
+        input = uniDist(rng);
+    }
+
+    const std::string path = libpath != nullptr ? libpath : "/tmp";
+    Result plain = Measure(path, false, inputs);
+    Result simplified = Measure(path, true, inputs);
+    if (plain.derv == nullptr || simplified.derv == nullptr) {
+        cerr << "missing function" << endl;
+        return 1;
+    }
+
+    // The simplification must not change the derivatives beyond rounding
+    float maxError = 0.f;
+    for (int i = 0; i < std::min(count, 1000); i++) {
+        float g0[c_Dim], g1[c_Dim], h0[c_Dim * c_Dim], h1[c_Dim * c_Dim];
+        plain.derv(&inputs[i * c_Dim], g0, h0);
+        simplified.derv(&inputs[i * c_Dim], g1, h1);
+        for (int j = 0; j < c_Dim; j++) {
+            maxError = std::max(maxError, RelativeError(g0[j], g1[j]));
+        }
+        for (int j = 0; j < c_Dim * c_Dim; j++) {
+            maxError = std::max(maxError, RelativeError(h0[j], h1[j]));
+        }
+    }
+
+    // Without the pass every visited node is emitted
+    cout << "nodes: " << simplified.stats.nodesBefore << " -> " << simplified.stats.nodesAfter
+         << endl;
+    cout << "source: " << plain.sourceSize << " -> " << simplified.sourceSize << " bytes" << endl;
+    cout << "compile: " << plain.compileTime << " -> " << simplified.compileTime << " s" << endl;
+    cout << "derivatives: " << plain.runTime * Float(1e9) << " -> "
+         << simplified.runTime * Float(1e9) << " ns" << endl;
+    cout << "max relative difference: " << maxError << endl;
+
+    return maxError < 1e-3f ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+#include "commondef.h"
+#include "utils.h"
+#include "timer.h"
+
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <cstdlib>
+
+using namespace std;
+using namespace chad;
+
+using funcsig = void (*)(const float *, float *);
+using dervsig = void (*)(const float *, float *, float *);
+
+static const int c_Dim = 9;
+
+// A chain of three vertices with geometry terms, attenuation and clamped cosines, shaped like
+// the path throughput functions that the renderer differentiates
+static std::shared_ptr<Function> BuildBenchFunc(ADFloat &logThroughput,
+                                                ExpressionCPtrVec &xParams) {
+    Argument x("x", c_Dim);
+    auto func = BeginFunction("tapebench", {x});
+    xParams = x.GetExprVec();
+    ADFloat throughput = Const<ADFloat>(1.f);
+    for (int i = 0; i + 1 < c_Dim / 3; i++) {
+        const ADFloat dx = xParams[3 * i + 3] - xParams[3 * i];
+        const ADFloat dy = xParams[3 * i + 4] - xParams[3 * i + 1];
+        const ADFloat dz = xParams[3 * i + 5] - xParams[3 * i + 2] + 1.f;
+        const ADFloat dist = length3d(dx, dy, dz);
+        const ADFloat cosTheta = fabs(dot3d({dx, dy, dz}, {Const<ADFloat>(0.f),
+                                                           Const<ADFloat>(0.f),
+                                                           Const<ADFloat>(1.f)}) / dist);
+        const ADFloat falloff = exp(-0.1f * dist) * (1.f + 0.5f * sin(xParams[3 * i]));
+        throughput = throughput * fmax(cosTheta, Const<ADFloat>(1e-2f)) * falloff / square(dist);
+    }
+    logThroughput = log(throughput);
+    EndFunction({{"y", {logThroughput}}});
+    return func;
+}
+
+static void Register(Library &lib) {
+    ADFloat y;
+    ExpressionCPtrVec xParams;
+    // The function is registered before its derivatives add their variables to it
+    auto func = BuildBenchFunc(y, xParams);
+    lib.RegisterFunc(func);
+    lib.RegisterFuncDerv(func, xParams, y, false);
+    lib.Link();
+}
+
+template <typename Eval>
+static Float TimePerCall(const Eval &eval, const int count) {
+    Timer timer;
+    Tick(timer);
+    for (int i = 0; i < count; i++) {
+        eval(i);
+    }
+    return Tick(timer) / Float(count);
+}
+
+int main(int argc, char *argv[]) {
+    const char *libpath = getenv("DPT_LIBPATH");
+    const int count = argc > 1 ? std::stoi(argv[1]) : 20000;
+
+    Timer timer;
+    Tick(timer);
+    Library compiled(libpath != nullptr ? libpath : "/tmp", "tapebench");
+    Register(compiled);
+    const Float compileTime = Tick(timer);
+    Library interpreted("", "tapebench", Library::Backend::Interpreted);
+    Register(interpreted);
+    const Float recordTime = Tick(timer);
+    cout << "compile: " << compileTime << " s, record: " << recordTime << " s" << endl;
+
+    funcsig compiledFunc = (funcsig)compiled.GetFunc("tapebench");
+    dervsig compiledDerv = (dervsig)compiled.GetFuncDerv("tapebench");
+    funcsig interpretedFunc = (funcsig)interpreted.GetFunc("tapebench");
+    dervsig interpretedDerv = (dervsig)interpreted.GetFuncDerv("tapebench");
+    if (compiledFunc == nullptr || compiledDerv == nullptr || interpretedFunc == nullptr ||
+        interpretedDerv == nullptr) {
+        cerr << "missing function" << endl;
+        return 1;
+    }
+
+    RNG rng(7);
+    std::uniform_real_distribution<float> uniDist(-1.f, 1.f);
+    std::vector<float> inputs(count * c_Dim);
+    for (auto &input : inputs) {
+        input = uniDist(rng);
+    }
+
+    // Both backends have to agree up to the differences of float math libraries
+    float maxError = 0.f;
+    auto compare = [&](const float a, const float b) {
+        maxError = std::max(maxError, std::fabs(a - b) / std::max(std::fabs(a), 1.f));
+    };
+    for (int i = 0; i < std::min(count, 1000); i++) {
+        float y0, y1, g0[c_Dim], g1[c_Dim], h0[c_Dim * c_Dim], h1[c_Dim * c_Dim];
+        compiledFunc(&inputs[i * c_Dim], &y0);
+        interpretedFunc(&inputs[i * c_Dim], &y1);
+        compare(y0, y1);
+        compiledDerv(&inputs[i * c_Dim], g0, h0);
+        interpretedDerv(&inputs[i * c_Dim], g1, h1);
+        for (int j = 0; j < c_Dim; j++) {
+            compare(g0[j], g1[j]);
+        }
+        for (int j = 0; j < c_Dim * c_Dim; j++) {
+            compare(h0[j], h1[j]);
+        }
+    }
+    cout << "max relative difference: " << maxError << endl;
+
+    float y, grad[c_Dim], hess[c_Dim * c_Dim];
+    const Float compiledFuncTime =
+        TimePerCall([&](const int i) { compiledFunc(&inputs[i * c_Dim], &y); }, count);
+    const Float interpretedFuncTime =
+        TimePerCall([&](const int i) { interpretedFunc(&inputs[i * c_Dim], &y); }, count);
+    const Float compiledDervTime =
+        TimePerCall([&](const int i) { compiledDerv(&inputs[i * c_Dim], grad, hess); }, count);
+    const Float interpretedDervTime =
+        TimePerCall([&](const int i) { interpretedDerv(&inputs[i * c_Dim], grad, hess); }, count);
+    cout << "function: compiled " << compiledFuncTime * Float(1e9) << " ns, interpreted "
+         << interpretedFuncTime * Float(1e9) << " ns, slowdown "
+         << interpretedFuncTime / compiledFuncTime << endl;
+    cout << "derivatives: compiled " << compiledDervTime * Float(1e9) << " ns, interpreted "
+         << interpretedDervTime * Float(1e9) << " ns, slowdown "
+         << interpretedDervTime / compiledDervTime << endl;
+
+    // Once the entry points of the Interpreted backend run out, registering fails instead of
+    // leaving the function out, and a library hands its entry points back when it goes away
+    const int freeSlots = Library::FreeTapeSlots(2);
+    bool full = false;
+    {
+        std::vector<std::unique_ptr<Library>> libraries;
+        try {
+            for (int i = 0; i <= freeSlots; i++) {
+                libraries.emplace_back(new Library("", "tapebench", Library::Backend::Interpreted));
+                Register(*libraries.back());
+            }
+        } catch (const std::runtime_error &e) {
+            full = libraries.size() == size_t(freeSlots) + 1;
+            cout << e.what() << endl;
+        }
+    }
+    const bool released = Library::FreeTapeSlots(2) == freeSlots;
+    cout << "tape slots: " << (full ? "full after " + std::to_string(freeSlots) : "never full")
+         << ", " << (released ? "released" : "not released") << endl;
+
+    return maxError < 1e-3f && full && released ? 0 : 1;
+}
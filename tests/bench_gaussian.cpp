@@ -0,0 +1,112 @@
+#include "gaussian.h"
+#include "h2mc.h"
+#include "timer.h"
+
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+// The dynamically sized Gaussian kernels from before the fixed-size dispatch, kept here as the
+// baseline for the comparison
+namespace legacy {
+
+Float GaussianLogPdf(const int dim, const Vector &offset, const Gaussian &gaussian) {
+    const Eigen::Map<const Vector> mean(gaussian.mean.data(), dim);
+    const Eigen::Map<const Matrix> invCov(gaussian.invCov.data(), dim, dim);
+    auto d = offset - mean;
+    Float logPdf = mean.size() * (-Float(0.9189385332046727));
+    logPdf += Float(0.5) * gaussian.logDet;
+    logPdf -= Float(0.5) * (d.transpose() * (invCov * d))[0];
+    return logPdf;
+}
+
+void GenerateSample(const int dim, Gaussian &gaussian, Vector &x, RNG &rng) {
+    const Eigen::Map<const Vector> mean(gaussian.mean.data(), dim);
+    const Eigen::Map<const Matrix> covL(gaussian.covL.data(), dim, dim);
+    std::normal_distribution<Float> normDist(Float(0.0), Float(1.0));
+    for (int i = 0; i < x.size(); i++) {
+        x[i] = normDist(rng);
+    }
+    x = covL * x + mean;
+}
+
+}  // namespace legacy
+
+// A proposal of the H2MC small step: draw an offset, then evaluate the densities of the move
+// and of the move back
+template <typename Sample, typename LogPdf>
+static Float TimeProposal(const Sample &sample,
+                          const LogPdf &logPdf,
+                          Gaussian &gaussian,
+                          const int count,
+                          Float &checksum) {
+    RNG rng(13);
+    Vector offset(GetDimension(gaussian));
+    Vector reverseOffset(GetDimension(gaussian));
+    checksum = Float(0.0);
+    Timer timer;
+    Tick(timer);
+    for (int i = 0; i < count; i++) {
+        sample(GetDimension(gaussian), gaussian, offset, rng);
+        reverseOffset = -offset;
+        checksum += logPdf(GetDimension(gaussian), offset, gaussian) -
+                    logPdf(GetDimension(gaussian), reverseOffset, gaussian);
+    }
+    return Tick(timer) / Float(count);
+}
+
+int main(int argc, char *argv[]) {
+    const int count = argc > 1 ? std::stoi(argv[1]) : 100000;
+    const H2MCParam param(Float(0.01));
+    RNG rng(7);
+    std::uniform_real_distribution<Float> uniDist(Float(-1.0), Float(1.0));
+
+    bool ok = true;
+    for (int dim = 2; dim <= c_MaxFixedDim; dim += 2) {
+        // A Hessian that is far from isotropic, so that the eigendecomposition is used
+        AlignedStdVector vGrad(dim), vHess(dim * dim);
+        for (int i = 0; i < dim; i++) {
+            vGrad[i] = uniDist(rng);
+            for (int j = 0; j <= i; j++) {
+                vHess[i * dim + j] = vHess[j * dim + i] = Float(1e4) * uniDist(rng);
+            }
+        }
+        Gaussian gaussian;
+        Timer timer;
+        Tick(timer);
+        const int gaussianCount = std::max(count / 10, 1);
+        for (int i = 0; i < gaussianCount; i++) {
+            ComputeGaussian(param, Float(1.0), vGrad, vHess, gaussian);
+        }
+        const Float gaussianTime = Tick(timer) / Float(gaussianCount);
+        // The normalization of the proposal densities, above c_MaxFixedEigenDim it comes from
+        // the dynamically sized solver
+        const Eigen::Map<const Matrix> invCov(gaussian.invCov.data(), dim, dim);
+        const Matrix invCovL = invCov.llt().matrixL();
+        const Float logDet = Float(2.0) * invCovL.diagonal().array().log().sum();
+        const Float logDetError =
+            std::fabs(gaussian.logDet - logDet) / std::max(std::fabs(logDet), Float(1.0));
+        ok = ok && logDetError < Float(1e-3);
+
+        Float fixedChecksum, legacyChecksum;
+        const Float fixedTime =
+            TimeProposal(GenerateSample, GaussianLogPdf, gaussian, count, fixedChecksum);
+        const Float legacyTime = TimeProposal(legacy::GenerateSample,
+                                              legacy::GaussianLogPdf,
+                                              gaussian,
+                                              count,
+                                              legacyChecksum);
+        // Only the order of the sums differs
+        const Float error =
+            std::fabs(fixedChecksum - legacyChecksum) / std::max(std::fabs(legacyChecksum), Float(1.0));
+        ok = ok && error < Float(1e-3);
+        cout << "dim " << dim << ": ComputeGaussian " << gaussianTime * Float(1e9)
+             << " ns, proposal dynamic " << legacyTime * Float(1e9) << " ns, fixed "
+             << fixedTime * Float(1e9) << " ns, speedup " << legacyTime / fixedTime
+             << ", relative difference " << error << ", logDet difference " << logDetError
+             << endl;
+    }
+
+    return ok ? 0 : 1;
+}
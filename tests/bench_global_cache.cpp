@@ -0,0 +1,283 @@
+#include "global_cache.h"
+#include "allocation.h"
+#include "timer.h"
+
+#include <iostream>
+#include <limits>
+#include <vector>
+
+using namespace std;
+
+static const int c_NumTags = 3;
+static const int c_MaxDepth = 8;
+
+// Times the preconditioner lookups of the MALA small steps, at points within the query
+// distance of a record, with the exact kd-tree and with random projection forests. The
+// recall is the fraction of the lookups that find a neighbour with the kd-tree that also
+// find one with the forest.
+template <int dim>
+static void MeasureLookups(const std::vector<cache_record_t<dim>> &records,
+                           const int count,
+                           RNG &rng) {
+    std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
+    std::normal_distribution<Float> queryDist(Float(0.0), PSS_QUERY_DIST);
+    std::vector<std::vector<Float>> queries(count, std::vector<Float>(dim));
+    for (auto &query : queries) {
+        const auto &record =
+            records[std::min(int(uniDist(rng) * records.size()), int(records.size()) - 1)];
+        for (int j = 0; j < dim; j++) {
+            query[j] = record.pss[j] + queryDist(rng);
+        }
+    }
+
+    std::vector<bool> exactHits;
+    Float exactTime = 0;
+    const int treeCounts[] = {0, 1, 2, 4, 8, 16};
+    for (const int numTrees : treeCounts) {
+        cache_index_config_t config;
+        config.type = numTrees == 0 ? CacheIndex::KDTree : CacheIndex::RPForest;
+        config.numTrees = numTrees;
+        cache_snapshot_t<dim> cache;
+        for (const auto &record : records) {
+            cache.add(record);
+        }
+        cache.build(config);
+
+        std::vector<Float> v1(dim), v2(dim);
+        std::vector<bool> hits(count);
+        Timer timer;
+        Tick(timer);
+        for (int i = 0; i < count; i++) {
+            hits[i] = cache.query(queries[i], v1, v2);
+        }
+        const Float time = Tick(timer) / Float(count);
+        int numHits = 0, numExactHits = 0, numFound = 0;
+        if (numTrees == 0) {
+            exactHits = hits;
+            exactTime = time;
+        }
+        for (int i = 0; i < count; i++) {
+            numHits += hits[i];
+            numExactHits += exactHits[i];
+            numFound += hits[i] && exactHits[i];
+        }
+        cout << "  lookup " << (numTrees == 0 ? std::string("kd-tree") 
+                                              : std::to_string(numTrees) + " trees")
+             << ": " << time * Float(1e9) << " ns, speedup " << exactTime / time << ", hits "
+             << Float(numHits) / Float(count) << ", recall "
+             << Float(numFound) / Float(std::max(numExactHits, 1)) << endl;
+    }
+}
+
+// Fills a cache with records that gather around a few points, the way the paths of a scene
+// gather around its bright regions, then times the density of queries drawn like the large
+// step draws them: a record moved by the kernel, or a uniform point
+template <int dim>
+static bool Measure(const int count, RNG &rng) {
+    std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
+    std::normal_distribution<Float> clusterDist(Float(0.0), Float(0.05));
+    std::normal_distribution<Float> kernelDist(Float(0.0), CACHE_SIG);
+
+    std::vector<std::vector<Float>> centers(8, std::vector<Float>(dim));
+    for (auto &center : centers) {
+        for (auto &x : center) {
+            x = uniDist(rng);
+        }
+    }
+    std::vector<cache_record_t<dim>> records(PSS_MAX_SIZE);
+    for (int i = 0; i < PSS_MAX_SIZE; i++) {
+        cache_record_t<dim> &record = records[i];
+        const std::vector<Float> &center = centers[i % centers.size()];
+        for (int j = 0; j < dim; j++) {
+            record.pss[j] = Modulo(center[j] + clusterDist(rng), Float(1.0));
+            record.v1[j] = uniDist(rng);
+            record.v2[j] = uniDist(rng);
+        }
+        record.tag = path_tag_t{i % c_NumTags + 1, 1};
+        record.pathWeight = Float(0.1) + uniDist(rng);
+    }
+    cache_snapshot_t<dim> cache;
+    for (const auto &record : records) {
+        cache.add(record);
+    }
+    cache.build(cache_index_config_t());
+
+    std::vector<typename cache_snapshot_t<dim>::row_t> queries(count);
+    std::vector<path_tag_t> tags(count);
+    for (int i = 0; i < count; i++) {
+        const auto &pss = cache.data_pts.data_pss[std::min(
+            int(uniDist(rng) * PSS_MAX_SIZE), PSS_MAX_SIZE - 1)];
+        const bool uniform = i % 2 == 1;
+        for (int j = 0; j < dim; j++) {
+            queries[i][j] =
+                uniform ? uniDist(rng) : Modulo(pss[j] + kernelDist(rng), Float(1.0));
+        }
+        tags[i] = path_tag_t{i % c_NumTags + 1, 1};
+    }
+
+    std::vector<Float> bruteForce(count), blocked(count);
+    Timer timer;
+    Tick(timer);
+    for (int i = 0; i < count; i++) {
+        bruteForce[i] = cache.evalPdfCacheBruteForce(queries[i], tags[i]);
+    }
+    const Float bruteForceTime = Tick(timer) / Float(count);
+    for (int i = 0; i < count; i++) {
+        blocked[i] = cache.evalPdfCache(queries[i], tags[i]);
+    }
+    const Float blockedTime = Tick(timer) / Float(count);
+
+    // The records of the tag that a truncation at sqrt(dim) + 3 sigmas would skip, an index
+    // could not skip more than these
+    const Float radius = square((std::sqrt(Float(dim)) + Float(3.0)) * CACHE_SIG);
+    int64_t skipped[2] = {0, 0}, total[2] = {0, 0};
+    for (int i = 0; i < count; i++) {
+        for (size_t k = 0; k < cache.data_pts.data_pss.size(); k++) {
+            if (cache.data_pts.data_tag[k].camDepth != tags[i].camDepth)    continue;
+            Float distSqr = 0;
+            for (int j = 0; j < dim; j++) {
+                const Float d = std::fabs(queries[i][j] - cache.data_pts.data_pss[k][j]);
+                distSqr += square(std::min(d, Float(1.0) - d));
+            }
+            skipped[i % 2] += distSqr > radius;
+            total[i % 2]++;
+        }
+    }
+
+    // vfastexp is accurate to a few 1e-5, and stops at the smallest normal float where the
+    // exponentials of the reference underflow
+    const Float bound = std::numeric_limits<Float>::min() * cache.factor;
+    Float maxError = 0;
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        const Float diff = std::fabs(blocked[i] - bruteForce[i]);
+        ok = ok && diff <= Float(1e-3) * bruteForce[i] + bound;
+        if (i % 2 == 0) {
+            maxError = std::max(maxError, diff / std::max(bruteForce[i], Float(1e-6)));
+        }
+    }
+    cout << "dim " << dim << ": brute force " << bruteForceTime * Float(1e9) << " ns, blocked "
+         << blockedTime * Float(1e9) << " ns, speedup " << bruteForceTime / blockedTime
+         << ", max relative difference near records " << maxError << endl;
+    cout << "dim " << dim << ": beyond sqrt(dim) + 3 sigmas near records "
+         << Float(100) * Float(skipped[0]) / Float(total[0]) << "%, at uniform points "
+         << Float(100) * Float(skipped[1]) / Float(total[1]) << "%" << endl;
+
+    MeasureLookups(records, count, rng);
+    return ok;
+}
+
+// Pushes paths of random lengths through a cache and updates it every chunk, like the chains
+// and the rebuild thread do. Once the window is full every chunk a push starts is one the
+// window dropped, so with DPT_COUNT_ALLOCATIONS the pushes after that must not allocate.
+template <int dim>
+static bool MeasurePushAllocations(RNG &rng) {
+    std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
+    global_cache_t<dim> cache(cache_setup_t{1, c_MaxDepth, cache_index_config_t()});
+    std::vector<Float> pss(dim), v1(dim), v2(dim);
+    Path path;
+    SubpathContrib spContrib = {};
+    const int warmup = 2 * PSS_MAX_SIZE;
+    uint64_t allocations = 0;
+    for (int i = 0; i < 8 * PSS_MAX_SIZE; i++) {
+        for (int j = 0; j < dim; j++) {
+            pss[j] = uniDist(rng);
+            v1[j] = uniDist(rng);
+            v2[j] = uniDist(rng);
+        }
+        spContrib.camDepth = 1 + std::min(int(uniDist(rng) * c_MaxDepth), c_MaxDepth - 1);
+        spContrib.lightDepth = c_MaxDepth + 1 - spContrib.camDepth;
+        path.camSurfaceVertex.resize(spContrib.camDepth);
+        path.lgtSurfaceVertex.resize(spContrib.lightDepth);
+        const uint64_t before = ThreadAllocationCount();
+        cache.push(0, pss, v1, v2, path, spContrib, uniDist(rng));
+        if (i >= warmup) {
+            allocations += ThreadAllocationCount() - before;
+        }
+        if ((i + 1) % PSS_CHUNK_SIZE == 0) {
+            delete cache.update();
+        }
+    }
+    if (!CountingAllocations()) {
+        return true;
+    }
+    cout << "dim " << dim << ": allocations of the pushes after warm-up " << allocations << endl;
+    return allocations == 0;
+}
+
+// Fills a snapshot with subpaths of _dim_ that carry the vertex caches of
+// DptOptions::incrementalPerturb, and compares the bytes of their paths with what copies of
+// the paths take up. Every path has to come back from the snapshot as it went in.
+template <int dim>
+static bool MeasurePathFootprint(RNG &rng) {
+    std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
+    const int numVertices = dim / 2 - 1;
+    cache_snapshot_t<dim> cache;
+    std::vector<Path> paths(PSS_MAX_SIZE);
+    size_t copyBytes = paths.capacity() * sizeof(Path);
+    for (int i = 0; i < PSS_MAX_SIZE; i++) {
+        cache_record_t<dim> record = {};
+        Path &path = paths[i];
+        const int lgtDepth = std::min(int(uniDist(rng) * (numVertices + 2)), numVertices + 1);
+        path.camDepth = numVertices + 2 - lgtDepth;
+        path.lgtDepth = lgtDepth;
+        path.isSubpath = true;
+        path.camSurfaceVertex.resize(path.camDepth - 1);
+        path.lgtSurfaceVertex.resize(std::max(lgtDepth - 1, 0));
+        path.time = uniDist(rng);
+        path.camVertex.screenPos = Vector2(uniDist(rng), uniDist(rng));
+        for (auto *vertices : {&path.camSurfaceVertex, &path.lgtSurfaceVertex}) {
+            for (SurfaceVertex &vertex : *vertices) {
+                vertex.bsdfRndParam = Vector2(uniDist(rng), uniDist(rng));
+                vertex.bsdfDiscrete = uniDist(rng);
+            }
+        }
+        path.camVertexCache.resize(path.camSurfaceVertex.size());
+        path.lgtVertexCache.resize(path.lgtSurfaceVertex.size());
+        copyBytes += path.camSurfaceVertex.capacity() * sizeof(SurfaceVertex) +
+                     path.lgtSurfaceVertex.capacity() * sizeof(SurfaceVertex) +
+                     path.camVertexCache.capacity() * sizeof(VertexCache) +
+                     path.lgtVertexCache.capacity() * sizeof(VertexCache);
+        record.tag = path_tag_t{path.camDepth, path.lgtDepth};
+        record.pathWeight = Float(0.1) + uniDist(rng);
+        record.path = path;
+        cache.add(record);
+    }
+    cache.build(cache_index_config_t());
+
+    bool ok = true;
+    Path path;
+    for (int i = 0; i < PSS_MAX_SIZE; i++) {
+        cache.getPath(i, path);
+        const Path &expected = paths[i];
+        ok = ok && path.time == expected.time && path.camDepth == expected.camDepth &&
+             path.lgtDepth == expected.lgtDepth &&
+             path.camSurfaceVertex.size() == expected.camSurfaceVertex.size() &&
+             path.lgtSurfaceVertex.size() == expected.lgtSurfaceVertex.size();
+        for (size_t k = 0; ok && k < path.camSurfaceVertex.size(); k++) {
+            ok = path.camSurfaceVertex[k].bsdfRndParam == expected.camSurfaceVertex[k].bsdfRndParam;
+        }
+        for (size_t k = 0; ok && k < path.lgtSurfaceVertex.size(); k++) {
+            ok = path.lgtSurfaceVertex[k].bsdfRndParam == expected.lgtSurfaceVertex[k].bsdfRndParam;
+        }
+    }
+    cout << "dim " << dim << ": path bytes per record " << cache.pathBytes() / PSS_MAX_SIZE
+         << ", as copies " << copyBytes / PSS_MAX_SIZE << " without the heap overhead" << endl;
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    const int count = argc > 1 ? std::stoi(argv[1]) : 20000;
+    RNG rng(7);
+    bool ok = true;
+    ok = Measure<2>(count, rng) && ok;
+    ok = Measure<4>(count, rng) && ok;
+    ok = Measure<8>(count, rng) && ok;
+    ok = Measure<12>(count, rng) && ok;
+    ok = Measure<16>(count, rng) && ok;
+    ok = MeasurePathFootprint<4>(rng) && ok;
+    ok = MeasurePathFootprint<12>(rng) && ok;
+    ok = MeasurePushAllocations<4>(rng) && ok;
+    ok = MeasurePushAllocations<12>(rng) && ok;
+    return ok ? 0 : 1;
+}
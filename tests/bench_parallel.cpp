@@ -0,0 +1,263 @@
+#include "parallel.h"
+#include "timer.h"
+
+#include <iostream>
+#include <list>
+#include <thread>
+#include <condition_variable>
+#include <cmath>
+
+using namespace std;
+
+// The global-mutex pool that ParallelFor used before the work-stealing scheduler, kept here
+// as the baseline for the comparison.
+namespace legacy {
+
+static std::vector<std::thread> threads;
+static bool shutdownThreads = false;
+struct ParallelForLoop;
+static ParallelForLoop *workList = nullptr;
+static std::mutex workListMutex;
+static std::condition_variable workListCondition;
+
+struct ParallelForLoop {
+    ParallelForLoop(std::function<void(int64_t)> func1D, int64_t maxIndex, int chunkSize)
+        : func1D(std::move(func1D)), maxIndex(maxIndex), chunkSize(chunkSize) {
+    }
+    ParallelForLoop(const std::function<void(Vector2i)> &f, const Vector2i count)
+        : func2D(f), maxIndex(count[0] * count[1]), chunkSize(1) {
+        nX = count[0];
+    }
+
+    std::function<void(int64_t)> func1D;
+    std::function<void(Vector2i)> func2D;
+    const int64_t maxIndex;
+    const int chunkSize;
+    int64_t nextIndex = 0;
+    int activeWorkers = 0;
+    ParallelForLoop *next = nullptr;
+    int nX = -1;
+
+    bool Finished() const {
+        return nextIndex >= maxIndex && activeWorkers == 0;
+    }
+};
+
+// Runs one chunk of _loop_, called and returns with _lock_ held
+static void RunChunk(ParallelForLoop &loop, std::unique_lock<std::mutex> &lock) {
+    int64_t indexStart = loop.nextIndex;
+    int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
+    loop.nextIndex = indexEnd;
+    if (loop.nextIndex == loop.maxIndex) {
+        workList = loop.next;
+    }
+    loop.activeWorkers++;
+    lock.unlock();
+    for (int64_t index = indexStart; index < indexEnd; ++index) {
+        if (loop.func1D) {
+            loop.func1D(index);
+        } else {
+            loop.func2D(Vector2i(index % loop.nX, index / loop.nX));
+        }
+    }
+    lock.lock();
+    loop.activeWorkers--;
+}
+
+static void workerThreadFunc() {
+    std::unique_lock<std::mutex> lock(workListMutex);
+    while (!shutdownThreads) {
+        if (!workList) {
+            workListCondition.wait(lock);
+        } else {
+            ParallelForLoop &loop = *workList;
+            RunChunk(loop, lock);
+            if (loop.Finished()) {
+                workListCondition.notify_all();
+            }
+        }
+    }
+}
+
+static void Run(ParallelForLoop &loop) {
+    if (threads.size() == 0) {
+        for (int i = 0; i < NumSystemCores() - 1; ++i) {
+            threads.push_back(std::thread(workerThreadFunc));
+        }
+    }
+    std::unique_lock<std::mutex> lock(workListMutex);
+    loop.next = workList;
+    workList = &loop;
+    workListCondition.notify_all();
+    while (!loop.Finished()) {
+        if (loop.nextIndex < loop.maxIndex) {
+            RunChunk(loop, lock);
+        } else {
+            workListCondition.wait(lock);
+        }
+    }
+}
+
+void ParallelFor(const std::function<void(int64_t)> &func, int64_t count, int chunkSize = 1) {
+    ParallelForLoop loop(func, count, chunkSize);
+    Run(loop);
+}
+
+void ParallelFor(std::function<void(Vector2i)> func, const Vector2i count) {
+    ParallelForLoop loop(std::move(func), count);
+    Run(loop);
+}
+
+void TerminateWorkerThreads() {
+    {
+        std::lock_guard<std::mutex> lock(workListMutex);
+        shutdownThreads = true;
+        workListCondition.notify_all();
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+    shutdownThreads = false;
+}
+
+}  // namespace legacy
+
+// Stands in for a chunk of rendering work, the cost varies with the index like MLT chains
+// or image tiles do
+static Float Work(const int64_t index, const int iterations) {
+    RNG rng(index);
+    std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
+    Float sum = Float(0.0);
+    const int n = iterations * (1 + int(index % 7));
+    for (int i = 0; i < n; i++) {
+        sum += std::exp(-uniDist(rng)) * std::sin(uniDist(rng));
+    }
+    return sum;
+}
+
+template <typename ParallelFor1D>
+static Float Time1D(const ParallelFor1D &parallelFor,
+                    const int64_t count,
+                    const int chunkSize,
+                    const int iterations,
+                    const int repeats) {
+    std::vector<Float> results(count);
+    Timer timer;
+    Tick(timer);
+    for (int r = 0; r < repeats; r++) {
+        parallelFor([&](const int64_t i) { results[i] = iterations > 0 ? Work(i, iterations) : Float(i); },
+                    count,
+                    chunkSize);
+    }
+    return Tick(timer) / Float(repeats);
+}
+
+template <typename ParallelFor2D>
+static Float Time2D(const ParallelFor2D &parallelFor,
+                    const Vector2i count,
+                    const int iterations,
+                    const int repeats) {
+    std::vector<Float> results(count[0] * count[1]);
+    Timer timer;
+    Tick(timer);
+    for (int r = 0; r < repeats; r++) {
+        parallelFor([&](const Vector2i tile) {
+            const int64_t i = tile[1] * count[0] + tile[0];
+            results[i] = Work(i, iterations);
+        }, count);
+    }
+    return Tick(timer) / Float(repeats);
+}
+
+// Nested loops and loops started from threads outside the pool run concurrently, the bodies
+// that run at the same time have to see distinct thread indices
+static bool CheckConcurrentLoops() {
+    const int numIndices = MaxThreadIndex();
+    std::unique_ptr<std::atomic<int>[]> inUse(new std::atomic<int>[numIndices]);
+    for (int i = 0; i < numIndices; i++) {
+        inUse[i] = 0;
+    }
+    std::atomic<bool> ok(true);
+    std::atomic<int64_t> sum(0);
+    // Marks the thread index of a running body, a thread gives it back before it starts a
+    // nested loop
+    auto enter = [&]() {
+        const int tIndex = threadIndex;
+        if (tIndex < 0 || tIndex >= numIndices || inUse[tIndex].exchange(1) != 0) {
+            ok = false;
+            return false;
+        }
+        return true;
+    };
+    auto inner = [&](const int64_t i) {
+        if (enter()) {
+            Work(i, 10);
+            sum += i;
+            inUse[threadIndex] = 0;
+        }
+    };
+    auto middle = [&](const int64_t j) {
+        if (enter()) {
+            sum += j;
+            inUse[threadIndex] = 0;
+        }
+        ParallelFor(inner, 64);
+    };
+    auto outer = [&](const int64_t) { ParallelFor(middle, 16); };
+    std::vector<std::thread> callers;
+    for (int t = 0; t < 3; t++) {
+        callers.push_back(std::thread([&]() { ParallelFor(outer, 4); }));
+    }
+    ParallelFor(outer, 4);
+    for (std::thread &caller : callers) {
+        caller.join();
+    }
+    const int64_t expected = 4 * 4 * 16 * (64 * 63 / 2) + 4 * 4 * (16 * 15 / 2);
+    return ok && sum == expected;
+}
+
+static void Report(const std::string &name, const Float legacyTime, const Float stealTime) {
+    cout << name << ": global mutex " << legacyTime * Float(1000.0) << " ms, work stealing "
+         << stealTime * Float(1000.0) << " ms, speedup " << legacyTime / stealTime << endl;
+}
+
+int main(int argc, char *argv[]) {
+    cout << "Running with " << NumSystemCores() << " threads." << endl;
+    auto legacy1D = [](const std::function<void(int64_t)> &func, int64_t count, int chunkSize) {
+        legacy::ParallelFor(func, count, chunkSize);
+    };
+    auto steal1D = [](const std::function<void(int64_t)> &func, int64_t count, int chunkSize) {
+        ParallelFor(func, count, chunkSize);
+    };
+    auto legacy2D = [](std::function<void(Vector2i)> func, const Vector2i count) {
+        legacy::ParallelFor(func, count);
+    };
+    auto steal2D = [](std::function<void(Vector2i)> func, const Vector2i count) {
+        ParallelFor(func, count);
+    };
+
+    // Warm up both pools so that thread creation is not measured
+    Time1D(legacy1D, 1024, 1, 0, 1);
+    Time1D(steal1D, 1024, 1, 0, 1);
+
+    Report("empty body, 1M indices, chunk 1",
+           Time1D(legacy1D, 1 << 20, 1, 0, 5),
+           Time1D(steal1D, 1 << 20, 1, 0, 5));
+    Report("empty body, 1M indices, chunk 64",
+           Time1D(legacy1D, 1 << 20, 64, 0, 5),
+           Time1D(steal1D, 1 << 20, 64, 0, 5));
+    Report("chain loop, 4096 chains, chunk 1",
+           Time1D(legacy1D, 4096, 1, 2000, 3),
+           Time1D(steal1D, 4096, 1, 2000, 3));
+    Report("tiled loop, 64x64 tiles",
+           Time2D(legacy2D, Vector2i(64, 64), 1000, 3),
+           Time2D(steal2D, Vector2i(64, 64), 1000, 3));
+
+    const bool concurrentOk = CheckConcurrentLoops();
+    cout << "nested and concurrent loops: " << (concurrentOk ? "ok" : "FAILED") << endl;
+
+    legacy::TerminateWorkerThreads();
+    TerminateWorkerThreads();
+    return concurrentOk ? 0 : 1;
+}
@@ -0,0 +1,95 @@
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Compares two MLT checkpoints part by part. The settings, the global cache and the groups
+// (the chain states and the splats they did not flush) have to match byte by byte. The image
+// sums the splats of the threads in whatever order they flushed, so its pixels only have to
+// match up to rounding. checkpoint_resume.cmake uses it to compare a run that went straight
+// through with one that stopped halfway and was resumed.
+
+static const char c_Magic[8] = {'D', 'P', 'T', 'C', 'K', 'P', 'T', '7'};
+static const char *c_PartNames[] = {"settings", "image", "cache", "groups"};
+static const int c_NumParts = 4;
+static const int c_ImagePart = 1;
+
+static bool ReadParts(const string &filename, vector<vector<char>> &parts) {
+    ifstream ifs(filename, ios::binary);
+    vector<char> data((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+    if (data.size() < sizeof(c_Magic) || memcmp(data.data(), c_Magic, sizeof(c_Magic)) != 0) {
+        cerr << filename << " is not a checkpoint" << endl;
+        return false;
+    }
+    size_t pos = sizeof(c_Magic);
+    for (int i = 0; i < c_NumParts; i++) {
+        uint64_t size;
+        if (data.size() - pos < sizeof(size)) {
+            cerr << filename << " is truncated" << endl;
+            return false;
+        }
+        memcpy(&size, &data[pos], sizeof(size));
+        pos += sizeof(size);
+        if (data.size() - pos < size) {
+            cerr << filename << " is truncated" << endl;
+            return false;
+        }
+        parts.emplace_back(data.begin() + pos, data.begin() + pos + size);
+        pos += size;
+    }
+    if (pos != data.size()) {
+        cerr << filename << " has trailing data" << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        cerr << "usage: checkpoint_compare <checkpoint> <checkpoint>" << endl;
+        return 1;
+    }
+    vector<vector<char>> a, b;
+    if (!ReadParts(argv[1], a) || !ReadParts(argv[2], b)) {
+        return 1;
+    }
+    bool passed = true;
+    for (int i = 0; i < c_NumParts; i++) {
+        if (i == c_ImagePart) {
+            continue;
+        }
+        const bool same = a[i] == b[i];
+        cout << c_PartNames[i] << ": " << (same ? "identical" : "differ") << endl;
+        passed = passed && same;
+    }
+
+    const vector<char> &imageA = a[c_ImagePart];
+    const vector<char> &imageB = b[c_ImagePart];
+    if (imageA.size() != imageB.size() || imageA.size() % sizeof(double) != 0) {
+        cout << "image: sizes differ" << endl;
+        return 1;
+    }
+    double maxError = 0.0;
+    size_t mismatches = 0;
+    for (size_t offset = 0; offset < imageA.size(); offset += sizeof(double)) {
+        double valueA, valueB;
+        memcpy(&valueA, &imageA[offset], sizeof(double));
+        memcpy(&valueB, &imageB[offset], sizeof(double));
+        const double error = fabs(valueA - valueB) / max(fabs(valueA), 1e-8);
+        // Written so that a NaN on either side counts as a mismatch
+        if (!(error < 1e-9)) {
+            mismatches++;
+        }
+        maxError = max(maxError, error);
+    }
+    cout << "image: max relative difference " << maxError << ", " << mismatches
+         << " channels differ" << endl;
+    passed = passed && mismatches == 0;
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,29 @@
+# Renders SCENE for 2 * STEPS chain steps straight through, and again stopping after STEPS
+# and resuming, then compares the two checkpoints that MLT wrote to CHECKPOINT with COMPARE:
+#   cmake -DDPT=... -DCOMPARE=... -DSCENE=... -DCHECKPOINT=... -DSTEPS=... -P checkpoint_resume.cmake
+get_filename_component(sceneName ${SCENE} NAME_WE)
+set(checkpoint ${CHECKPOINT})
+math(EXPR endStep "2 * ${STEPS}")
+
+function(run_dpt)
+    execute_process(COMMAND ${DPT} ${ARGN} ${SCENE} RESULT_VARIABLE result)
+    if (NOT result EQUAL 0 OR NOT EXISTS ${checkpoint})
+        message(FATAL_ERROR "dpt ${ARGN} did not write ${checkpoint}")
+    endif()
+endfunction()
+
+file(REMOVE ${checkpoint})
+run_dpt(--checkpoint-at ${endStep})
+file(RENAME ${checkpoint} ${CMAKE_CURRENT_BINARY_DIR}/${sceneName}_straight.checkpoint)
+
+run_dpt(--checkpoint-at ${STEPS})
+run_dpt(--resume --checkpoint-at ${endStep})
+file(RENAME ${checkpoint} ${CMAKE_CURRENT_BINARY_DIR}/${sceneName}_resumed.checkpoint)
+
+execute_process(COMMAND ${COMPARE}
+                        ${CMAKE_CURRENT_BINARY_DIR}/${sceneName}_straight.checkpoint
+                        ${CMAKE_CURRENT_BINARY_DIR}/${sceneName}_resumed.checkpoint
+                RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "the resumed run does not continue where it stopped")
+endif()
@@ -0,0 +1,82 @@
+#include "image.h"
+#include "allocation.h"
+
+#include <iostream>
+#include <cmath>
+
+using namespace std;
+
+// Splats a fixed contribution stream into a small film at increasing sample counts and
+// compares the pixel sums against an exact reference:
+//  - float:  FloatSampleBuffer, the AtomicFloat accumulation SampleBuffer used before
+//  - double: SampleBuffer, splatted through the per-thread SplatBuffer tiles like MLT does
+// With DPT_COUNT_ALLOCATIONS it also checks that splatting and flushing never allocate once
+// the first sample count took the tiles from the pool
+int main() {
+    const int width = 4;
+    const int height = 4;
+    const int numPixels = width * height;
+    const int flushInterval = 1000;
+    const int maxLog2Spp = 24;
+
+    FloatSampleBuffer floatBuffer(width, height);
+    SampleBuffer buffer(width, height);
+    SplatBuffer splatBuffer(buffer, MaxThreadIndex());
+    std::vector<long double> reference(numPixels * 3, 0.0L);
+
+    RNG rng(1);
+    std::uniform_real_distribution<Float> uniDist(Float(0.0), Float(1.0));
+    int64_t numSplats = 0;
+    uint64_t splatAllocations = 0;
+    bool passed = true;
+    for (int log2Spp = 16; log2Spp <= maxLog2Spp; log2Spp += 2) {
+        const int64_t targetSplats = (int64_t(1) << log2Spp) * numPixels;
+        const uint64_t allocationsBefore = ThreadAllocationCount();
+        for (; numSplats < targetSplats; numSplats++) {
+            const Vector2 screenPos(uniDist(rng), uniDist(rng));
+            // Mostly dim contributions with rare fireflies, like MLT splats
+            const Float scale = uniDist(rng) < Float(1e-4) ? Float(100.0) : Float(1e-2);
+            const Vector3 contrib = scale * Vector3(uniDist(rng), uniDist(rng), uniDist(rng));
+            const int ix = Clamp(int(screenPos[0] * width), 0, width - 1);
+            const int iy = Clamp(int(screenPos[1] * height), 0, height - 1);
+            for (int c = 0; c < 3; c++) {
+                reference[3 * (iy * width + ix) + c] += contrib[c];
+            }
+            Splat(floatBuffer, screenPos, contrib);
+            Splat(splatBuffer, screenPos, contrib);
+            if (numSplats % flushInterval == 0) {
+                FlushSplats(splatBuffer, threadIndex);
+            }
+        }
+        FlushSplats(splatBuffer, threadIndex);
+        if (log2Spp > 16) {
+            splatAllocations += ThreadAllocationCount() - allocationsBefore;
+        }
+
+        double floatError = 0.0;
+        double doubleError = 0.0;
+        for (int i = 0; i < numPixels; i++) {
+            for (int c = 0; c < 3; c++) {
+                const long double ref = reference[3 * i + c];
+                floatError = std::max(
+                    floatError, double(std::fabs((long double)Float(floatBuffer.pixels[i][c]) - ref) / ref));
+                doubleError = std::max(
+                    doubleError, double(std::fabs((long double)double(buffer.pixels[i][c]) - ref) / ref));
+            }
+        }
+        cout << "spp 2^" << log2Spp << ": max relative bias float " << floatError << ", double "
+             << doubleError << endl;
+        if (doubleError > 1e-5) {
+            passed = false;
+        }
+    }
+    if (CountingAllocations()) {
+        cout << "allocations while splatting after warm-up: " << splatAllocations << endl;
+        if (splatAllocations > 0) {
+            passed = false;
+        }
+    }
+    TerminateWorkerThreads();
+    cout << (passed ? "PASSED" : "FAILED") << endl;
+    return passed ? 0 : 1;
+}
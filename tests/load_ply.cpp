@@ -1,42 +1,274 @@
 #include "parseply.h"
+#include "parallel.h"
+#include "scenecache.h"
+#include "envlight.h"
+#include "transform.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
 
 using namespace std;
-int main() {
-    string meshFn = "../data/unit_plane.ply";
-
-    bool isMoving = false, 
-        flipNormals = false, 
-        faceNormals = false;
-
-    Matrix4x4 toWorld0 = Matrix4x4::Identity(),
-        toWorld1 = Matrix4x4::Identity();
-    std::shared_ptr<TriMeshData> mesh = ParsePly(
-            meshFn,
-            toWorld0,
-            toWorld1,
-            isMoving, 
-            flipNormals,
-            faceNormals
-    );
-
-    // print info
-    cout << "Mesh contains " << mesh->position0.size() << " vertices "
-        << mesh->indices.size() << " faces" << endl;
-    cout << "Vertices Info " << endl;
-    for (size_t i = 0; i < mesh->position0.size(); ++i)
+
+// The reading loop of the parser from before the mapped loader, kept here as the baseline for
+// the comparison: one stream read per value, and the normal transforms inverted per vertex
+namespace legacy {
+
+void ReadBody(const string &filename,
+              const size_t bodyOffset,
+              const Matrix4x4 &toWorld,
+              TriMeshData &data) {
+    ifstream ifs(filename.c_str(), ifstream::in | ifstream::binary);
+    ifs.seekg(bodyOffset);
+    for (size_t i = 0; i < data.position0.size(); i++) {
+        float x, y, z, nx, ny, nz;
+        ifs.read(reinterpret_cast<char *>(&x), sizeof(float));
+        ifs.read(reinterpret_cast<char *>(&y), sizeof(float));
+        ifs.read(reinterpret_cast<char *>(&z), sizeof(float));
+        ifs.read(reinterpret_cast<char *>(&nx), sizeof(float));
+        ifs.read(reinterpret_cast<char *>(&ny), sizeof(float));
+        ifs.read(reinterpret_cast<char *>(&nz), sizeof(float));
+        data.position0[i] = XformPoint(toWorld, Vector3(x, y, z));
+        data.position1[i] = XformPoint(toWorld, Vector3(x, y, z));
+        data.normal0[i] = XformNormal(Matrix4x4(toWorld.inverse()), Vector3(nx, ny, nz));
+        data.normal1[i] = XformNormal(Matrix4x4(toWorld.inverse()), Vector3(nx, ny, nz));
+    }
+    for (size_t i = 0; i < data.indices.size(); i++) {
+        unsigned char numVertPerFace;
+        int si0, si1, si2;
+        ifs.read(reinterpret_cast<char *>(&numVertPerFace), sizeof(numVertPerFace));
+        ifs.read(reinterpret_cast<char *>(&si0), sizeof(si0));
+        ifs.read(reinterpret_cast<char *>(&si1), sizeof(si1));
+        ifs.read(reinterpret_cast<char *>(&si2), sizeof(si2));
+        data.indices[i] = TriIndex(si0, si1, si2);
+    }
+}
+
+}  // namespace legacy
+
+template <typename T>
+static void Put(string &out, T value, const bool bigEndian) {
+    char bytes[sizeof(T)];
+    memcpy(bytes, &value, sizeof(T));
+    if (bigEndian) {
+        reverse(bytes, bytes + sizeof(T));
+    }
+    out.append(bytes, sizeof(T));
+}
+
+// A grid of n x n vertices with normals, two triangles per cell. Returns the size of the header.
+static size_t WriteGrid(const string &filename, const int n, const string &format) {
+    const int numVerts = n * n;
+    const int numFaces = 2 * (n - 1) * (n - 1);
+    string out = "ply\nformat " + format + " 1.0\ncomment grid\nelement vertex " +
+                 to_string(numVerts) +
+                 "\nproperty float x\nproperty float y\nproperty float z\n"
+                 "property float nx\nproperty float ny\nproperty float nz\n"
+                 "element face " + to_string(numFaces) +
+                 "\nproperty list uchar int vertex_indices\nend_header\n";
+    const size_t headerSize = out.size();
+    const bool ascii = format == "ascii";
+    const bool bigEndian = format == "binary_big_endian";
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            const float v[6] = {float(x) / n, float(y) / n, float((x * 7 + y * 3) % 11) / 11, 0, 0, 1};
+            for (const float f : v) {
+                if (ascii) {
+                    out += to_string(f) + " ";
+                } else {
+                    Put(out, f, bigEndian);
+                }
+            }
+            if (ascii) {
+                out += "\n";
+            }
+        }
+    }
+    for (int y = 0; y + 1 < n; y++) {
+        for (int x = 0; x + 1 < n; x++) {
+            const int i = y * n + x;
+            const int tris[2][3] = {{i, i + 1, i + n + 1}, {i, i + n + 1, i + n}};
+            for (const auto &tri : tris) {
+                if (ascii) {
+                    out += "3 " + to_string(tri[0]) + " " + to_string(tri[1]) + " " +
+                           to_string(tri[2]) + "\n";
+                } else {
+                    Put(out, uint8_t(3), bigEndian);
+                    for (const int index : tri) {
+                        Put(out, int32_t(index), bigEndian);
+                    }
+                }
+            }
+        }
+    }
+    ofstream ofs(filename, ios::binary);
+    ofs.write(out.data(), out.size());
+    return headerSize;
+}
+
+static bool SameMesh(const TriMeshData &a, const TriMeshData &b, const Float tolerance) {
+    if (a.position0.size() != b.position0.size() || a.indices.size() != b.indices.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.position0.size(); i++) {
+        if ((a.position0[i] - b.position0[i]).cwiseAbs().maxCoeff() > tolerance ||
+            (a.normal0[i] - b.normal0[i]).cwiseAbs().maxCoeff() > tolerance) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < a.indices.size(); i++) {
+        for (int j = 0; j < 3; j++) {
+            if (a.indices[i].index[j] != b.indices[i].index[j]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    const int n = argc > 1 ? stoi(argv[1]) : 2000;
+    Matrix4x4 toWorld = Matrix4x4::Identity();
+    toWorld(0, 3) = Float(1.0);
+    toWorld(1, 1) = Float(2.0);
+
+    const string binaryFile = "/tmp/dpt_load_ply_le.ply";
+    const size_t headerSize = WriteGrid(binaryFile, n, "binary_little_endian");
+    Timer timer;
+    Tick(timer);
+    std::shared_ptr<TriMeshData> mesh = ParsePly(binaryFile, toWorld, toWorld, false, false, false);
+    const Float mappedTime = Tick(timer);
+
+    TriMeshData legacyMesh;
+    legacyMesh.position0.resize(mesh->position0.size());
+    legacyMesh.position1.resize(mesh->position0.size());
+    legacyMesh.normal0.resize(mesh->position0.size());
+    legacyMesh.normal1.resize(mesh->position0.size());
+    legacyMesh.indices.resize(mesh->indices.size());
+    Tick(timer);
+    legacy::ReadBody(binaryFile, headerSize, toWorld, legacyMesh);
+    const Float legacyTime = Tick(timer);
+
+    const double megabytes = double(ifstream(binaryFile, ios::ate | ios::binary).tellg()) / 1e6;
+    cout << mesh->position0.size() << " vertices, " << mesh->indices.size() << " faces, "
+         << megabytes << " MB" << endl;
+    cout << "binary_little_endian: legacy " << legacyTime << " s, mapped " << mappedTime
+         << " s (" << megabytes / mappedTime << " MB/s), speedup " << legacyTime / mappedTime
+         << endl;
+    bool ok = SameMesh(*mesh, legacyMesh, Float(0.0));
+
+    // Loaded from the body of a loop like the scene loader does, the decoding loop is nested
+    std::shared_ptr<TriMeshData> nested[2];
+    Tick(timer);
+    ParallelFor([&](const int64_t i) {
+        nested[i] = ParsePly(binaryFile, toWorld, toWorld, false, false, false);
+    }, 2);
+    const Float nestedTime = Tick(timer);
+    const bool nestedSame =
+        SameMesh(*nested[0], *mesh, Float(0.0)) && SameMesh(*nested[1], *mesh, Float(0.0));
+    cout << "two meshes from a loop: " << nestedTime << " s, "
+         << (nestedSame ? "same mesh" : "different mesh") << endl;
+    ok = ok && nestedSame;
+
+    // The other formats of a smaller grid decode to the same mesh
+    const int m = std::min(n, 200);
+    std::shared_ptr<TriMeshData> reference;
+    for (const string format : {"binary_little_endian", "binary_big_endian", "ascii"}) {
+        const string filename = "/tmp/dpt_load_ply_" + format + ".ply";
+        WriteGrid(filename, m, format);
+        std::shared_ptr<TriMeshData> decoded =
+            ParsePly(filename, toWorld, toWorld, false, false, false);
+        if (!reference) {
+            reference = decoded;
+        }
+        const bool same = SameMesh(*decoded, *reference, Float(1e-5));
+        cout << format << ": " << (same ? "same mesh" : "different mesh") << endl;
+        ok = ok && same;
+        remove(filename.c_str());
+    }
+
+    // Written to a scene cache and mapped again, the mesh comes back as views into the mapping
+    // that stay valid after the cache is gone, with the arrays aligned for Embree
+    const string cacheFile = "/tmp/dpt_load_ply.cache";
+    remove(cacheFile.c_str());
+    // Stand-ins for the area distribution of an emitter and the distribution of an envmap
+    const Float values[3] = {Float(1.0), Float(2.0), Float(3.0)};
+    mesh->areaFunc.assign(values, values + 3);
+    std::shared_ptr<EnvmapSampleInfo> envmap = std::make_shared<EnvmapSampleInfo>();
+    envmap->cdfRows.assign(values, values + 2);
+    envmap->normalization = Float(0.5);
+    const string key = MeshCacheKey("ply", binaryFile, 0, toWorld, toWorld, false, false, false, true);
+    const string envmapKey = EnvmapCacheKey(binaryFile);
     {
-        Vector3 &vert = mesh->position0.at(i);
-        cout << i << " " << vert[0] << " " << vert[1] << " " << vert[2] << endl;
+        SceneCache cache(cacheFile);
+        cache.Get(key, [&]() { return mesh; });
+        cache.GetEnvmap(envmapKey, [&]() { return envmap; });
+        cache.Write();
     }
-    cout << "-------------" << endl;
+    std::shared_ptr<TriMeshData> cached;
+    std::shared_ptr<const EnvmapSampleInfo> cachedEnvmap;
+    {
+        SceneCache cache(cacheFile);
+        cached = cache.Get(key, [&]() -> std::shared_ptr<TriMeshData> {
+            Error("mesh not found in the scene cache");
+            return nullptr;
+        });
+        cachedEnvmap = cache.GetEnvmap(envmapKey, [&]() -> std::shared_ptr<EnvmapSampleInfo> {
+            Error("envmap not found in the scene cache");
+            return nullptr;
+        });
+    }
+    const bool aligned = cached->position0.IsView() && cached->indices.IsView() &&
+                         reinterpret_cast<uintptr_t>(cached->position0.data()) % 16 == 0 &&
+                         reinterpret_cast<uintptr_t>(cached->indices.data()) % 16 == 0;
+    const bool cachedSame = SameMesh(*cached, *mesh, Float(0.0)) &&
+                            cached->areaFunc.size() == 3 && cached->areaFunc[2] == values[2] &&
+                            cachedEnvmap->cdfRows.size() == 2 &&
+                            cachedEnvmap->cdfRows[1] == values[1] &&
+                            cachedEnvmap->normalization == envmap->normalization;
+    cout << "scene cache: " << (cachedSame ? "same mesh" : "different mesh") << ", "
+         << (aligned ? "mapped in place" : "not mapped in place") << endl;
+    ok = ok && cachedSame && aligned;
 
-    cout << "Faces Info " << endl;
-    for (size_t i = 0; i < mesh->indices.size(); ++i)
+    // A corrupted entry is loaded again and rewritten instead of failing the scene. The envmap
+    // sorts first, its record type follows the file header, its key and size, aligned to 16 bytes.
+    {
+        fstream fs(cacheFile, ios::in | ios::out | ios::binary);
+        const size_t recordOffset = (32 + 8 + envmapKey.size() + 8 + 15) / 16 * 16;
+        fs.seekp(recordOffset);
+        fs.put(char(0xff));
+    }
+    bool reloaded = false;
     {
-        TriIndex &idx = mesh->indices.at(i);
-        cout << i << " " << idx.index[0] << " " << idx.index[1] << " " << idx.index[2] << endl;
+        SceneCache cache(cacheFile);
+        cache.Get(key, [&]() -> std::shared_ptr<TriMeshData> {
+            Error("mesh not found in the scene cache");
+            return nullptr;
+        });
+        cache.GetEnvmap(envmapKey, [&]() {
+            reloaded = true;
+            return envmap;
+        });
+        cache.Write();
     }
-    cout << "-------------" << endl;
-    
-    return 0;
-}
\ No newline at end of file
+    bool rewritten = true;
+    {
+        SceneCache cache(cacheFile);
+        cache.GetEnvmap(envmapKey, [&]() {
+            rewritten = false;
+            return envmap;
+        });
+    }
+    cout << "corrupted scene cache: " << (reloaded ? "reloaded" : "not reloaded") << ", "
+         << (rewritten ? "rewritten" : "not rewritten") << endl;
+    ok = ok && reloaded && rewritten;
+    remove(cacheFile.c_str());
+
+    remove(binaryFile.c_str());
+    TerminateWorkerThreads();
+    return ok ? 0 : 1;
+}